@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <QPair>
 #include <QHash>
+#include <QSet>
 #include <QTime>
 #include <QTimer>
 #include "qzmqsocket.h"
@@ -32,6 +33,11 @@
 #include "m2responsepacket.h"
 #include "zhttprequestpacket.h"
 #include "zhttpresponsepacket.h"
+#include "zhttppacketwriter.h"
+#include "zrpcmanager.h"
+#include "zrpcrequest.h"
+#include "tracer.h"
+#include "objectcounter.h"
 #include "bufferlist.h"
 #include "log.h"
 #include "layertracker.h"
@@ -45,6 +51,9 @@
 #define SESSION_EXPIRE 60000
 #define CONTROL_REQUEST_EXPIRE 30000
 
+// max number of ids per keep-alive packet
+#define KEEPALIVE_BATCH_MAX 1000
+
 // make sure this is not larger than Mongrel2's DELIVER_OUTSTANDING_MSGS
 #define M2_PENDING_MAX 16
 
@@ -97,6 +106,42 @@ static bool isErrorPacket(const ZhttpResponsePacket &packet)
 	return (packet.type == ZhttpResponsePacket::Error || packet.type == ZhttpResponsePacket::Cancel);
 }
 
+static bool isKeepAliveBatch(const QVariant &data)
+{
+	return (data.type() == QVariant::Hash && data.toHash().contains("ids"));
+}
+
+static bool parseKeepAliveBatch(const QVariant &data, QByteArray *from, QList<QPair<QByteArray, int> > *ids)
+{
+	QVariantHash obj = data.toHash();
+
+	if(!obj.contains("from") || obj["from"].type() != QVariant::ByteArray)
+		return false;
+
+	if(obj["ids"].type() != QVariant::List)
+		return false;
+
+	*from = obj["from"].toByteArray();
+
+	foreach(const QVariant &vi, obj["ids"].toList())
+	{
+		if(vi.type() != QVariant::Hash)
+			return false;
+
+		QVariantHash i = vi.toHash();
+
+		if(!i.contains("id") || i["id"].type() != QVariant::ByteArray)
+			return false;
+
+		if(!i.contains("seq") || !i["seq"].canConvert(QVariant::Int))
+			return false;
+
+		*ids += QPair<QByteArray, int>(i["id"].toByteArray(), i["seq"].toInt());
+	}
+
+	return true;
+}
+
 static void writeBigEndian(char *dest, quint64 value, int bytes)
 {
 	for(int n = 0; n < bytes; ++n)
@@ -135,6 +180,9 @@ static QByteArray makeWsHeader(bool fin, int opcode, quint64 size)
 	}
 }
 
+static ObjectCounter g_m2ConnectionCounter("M2Connection");
+static ObjectCounter g_sessionCounter("Session");
+
 class App::Private : public QObject
 {
 	Q_OBJECT
@@ -213,6 +261,12 @@ public:
 			flowControl(false),
 			waitForAllWritten(false)
 		{
+			g_m2ConnectionCounter.ref();
+		}
+
+		~M2Connection()
+		{
+			g_m2ConnectionCounter.deref();
 		}
 
 		bool canWrite() const
@@ -252,6 +306,8 @@ public:
 		int pendingInCredits;
 		bool inHandoff;
 
+		Trace trace;
+
 		Session() :
 			lastActive(-1),
 			downClosed(false),
@@ -269,6 +325,12 @@ public:
 			pendingInCredits(0),
 			inHandoff(false)
 		{
+			g_sessionCounter.ref();
+		}
+
+		~Session()
+		{
+			g_sessionCounter.deref();
 		}
 	};
 
@@ -291,11 +353,13 @@ public:
 	QHash<Rid, Session*> sessionsByM2Rid;
 	QHash<Rid, Session*> sessionsByZhttpRid;
 	QHash<Rid, Session*> sessionsByZwsRid;
+	QSet<QByteArray> multiPeers;
 	int m2_client_buffer;
 	int zhttpConnectPort;
 	int zwsConnectPort;
 	bool ignorePolicies;
 	QList<ControlPort> controlPorts;
+	ZrpcManager *command;
 	QTime time;
 	QTimer *expireTimer;
 	QTimer *statusTimer;
@@ -315,7 +379,8 @@ public:
 		zws_out_stream_sock(0),
 		m2_in_valve(0),
 		zhttp_in_valve(0),
-		zws_in_valve(0)
+		zws_in_valve(0),
+		command(0)
 	{
 		connect(ProcessQuit::instance(), SIGNAL(quit()), SLOT(doQuit()));
 		connect(ProcessQuit::instance(), SIGNAL(hup()), SLOT(reload()));
@@ -475,6 +540,9 @@ public:
 		m2_client_buffer = settings.value("m2_client_buffer").toInt();
 		if(m2_client_buffer <= 0)
 			m2_client_buffer = 200000;
+		QString command_spec = settings.value("command_spec").toString();
+		int traceSampleRate = settings.value("trace_sample_rate", 0).toInt();
+		int traceSlowTime = settings.value("trace_slow_time", 0).toInt();
 
 		m2_send_idents.clear();
 		foreach(const QString &s, str_m2_send_idents)
@@ -510,6 +578,8 @@ public:
 			return false;
 		}
 
+		Tracer::setup(traceSampleRate, traceSlowTime);
+
 		QByteArray pidStr = QByteArray::number(QCoreApplication::applicationPid());
 		zhttpInstanceId = "m2zhttp_" + pidStr;
 		zwsInstanceId = "m2zws_" + pidStr;
@@ -690,6 +760,20 @@ public:
 			}
 		}
 
+		if(!command_spec.isEmpty())
+		{
+			command = new ZrpcManager(this);
+			command->setBind(true);
+			connect(command, SIGNAL(requestReady()), SLOT(command_requestReady()));
+
+			log_info("command bind %s", qPrintable(command_spec));
+			if(!command->setServerSpecs(QStringList() << command_spec))
+			{
+				// zrpcmanager logs error
+				return false;
+			}
+		}
+
 		return true;
 	}
 
@@ -707,6 +791,7 @@ public:
 
 	void destroySession(Session *s)
 	{
+		s->trace.finish();
 		unlinkConnection(s);
 		if(s->mode == Http)
 			sessionsByZhttpRid.remove(Rid(zhttpInstanceId, s->id));
@@ -799,6 +884,9 @@ public:
 		}
 		else
 		{
+			if(conn->session && conn->pendingOutItems.isEmpty())
+				conn->session->trace.mark("m2-queued");
+
 			M2PendingOutItem *item = 0;
 			if(!conn->pendingOutItems.isEmpty())
 			{
@@ -862,7 +950,8 @@ public:
 	{
 		const char *logprefix = (mode == Http ? "zhttp" : "zws");
 
-		QByteArray buf = QByteArray("T") + TnetString::fromVariant(packet.toVariant());
+		bool multi = (packet.seq == 0 || packet.type == ZhttpRequestPacket::KeepAlive);
+		QByteArray buf = ZhttpPacketWriter::writeRequest(packet, QByteArray(), multi);
 
 		log_debug("%s: OUT %s", logprefix, buf.mid(0, 1000).data());
 
@@ -874,9 +963,19 @@ public:
 
 	void zhttp_out_write(Mode mode, const ZhttpRequestPacket &packet, const QByteArray &instanceAddress)
 	{
-		const char *logprefix = (mode == Http ? "zhttp" : "zws");
+		bool multi = (packet.type == ZhttpRequestPacket::KeepAlive);
+		zhttp_out_writeStream(mode, ZhttpPacketWriter::writeRequest(packet, QByteArray(), multi), instanceAddress);
+	}
+
+	void zhttp_out_writeStream(Mode mode, const QVariant &vpacket, const QByteArray &instanceAddress)
+	{
+		zhttp_out_writeStream(mode, QByteArray("T") + TnetString::fromVariant(vpacket), instanceAddress);
+	}
 
-		QByteArray buf = QByteArray("T") + TnetString::fromVariant(packet.toVariant());
+	// buf is an encoded packet including the "T" prefix
+	void zhttp_out_writeStream(Mode mode, const QByteArray &buf, const QByteArray &instanceAddress)
+	{
+		const char *logprefix = (mode == Http ? "zhttp" : "zws");
 
 		log_debug("%s: OUT instance=%s %s", logprefix, instanceAddress.data(), buf.mid(0, 1000).data());
 
@@ -898,6 +997,8 @@ public:
 		out.id = s->id;
 		out.seq = (s->outSeq)++;
 		zhttp_out_write(s->mode, out);
+
+		s->trace.mark("zhttp-request");
 	}
 
 	void zhttp_out_write(Session *s, const ZhttpRequestPacket &packet)
@@ -911,6 +1012,53 @@ public:
 		zhttp_out_write(s->mode, out, s->zhttpAddress);
 	}
 
+	void keepAliveSessions(Mode mode, const QHash<Rid, Session*> &sessions)
+	{
+		// sessions whose handlers accept batches are collected per
+		//   handler, everyone else gets a keep-alive packet of their own
+		QHash<QByteArray, QVariantList> batches;
+
+		QHashIterator<Rid, Session*> it(sessions);
+		while(it.hasNext())
+		{
+			it.next();
+			Session *s = it.value();
+
+			if(!s->inHandoff && !s->zhttpAddress.isEmpty())
+			{
+				if(multiPeers.contains(s->zhttpAddress))
+				{
+					QVariantHash i;
+					i["id"] = s->id;
+					i["seq"] = (s->outSeq)++;
+					batches[s->zhttpAddress] += i;
+				}
+				else
+				{
+					ZhttpRequestPacket zreq;
+					zreq.type = ZhttpRequestPacket::KeepAlive;
+					zhttp_out_write(s, zreq);
+				}
+			}
+		}
+
+		QHashIterator<QByteArray, QVariantList> bit(batches);
+		while(bit.hasNext())
+		{
+			bit.next();
+			const QVariantList &ids = bit.value();
+
+			for(int n = 0; n < ids.count(); n += KEEPALIVE_BATCH_MAX)
+			{
+				QVariantHash vpacket;
+				vpacket["from"] = (mode == Http ? zhttpInstanceId : zwsInstanceId);
+				vpacket["type"] = QByteArray("keep-alive");
+				vpacket["ids"] = ids.mid(n, KEEPALIVE_BATCH_MAX);
+				zhttp_out_writeStream(mode, vpacket, bit.key());
+			}
+		}
+	}
+
 	void handleControlResponse(int index, const QVariant &data)
 	{
 #ifdef CONTROL_PORT_DEBUG
@@ -1091,6 +1239,32 @@ public:
 
 		log_debug("%s: IN %s", logprefix, dataRaw.data());
 
+		if(isKeepAliveBatch(data))
+		{
+			QByteArray from;
+			QList<QPair<QByteArray, int> > ids;
+			if(!parseKeepAliveBatch(data, &from, &ids))
+			{
+				log_warning("%s: received keep-alive batch with invalid format, skipping", logprefix);
+				return;
+			}
+
+			// sending batches implies accepting them
+			multiPeers += from;
+
+			for(int n = 0; n < ids.count(); ++n)
+			{
+				ZhttpResponsePacket zresp;
+				zresp.from = from;
+				zresp.id = ids[n].first;
+				zresp.type = ZhttpResponsePacket::KeepAlive;
+				zresp.seq = ids[n].second;
+				handleZhttpIn(mode, zresp);
+			}
+
+			return;
+		}
+
 		ZhttpResponsePacket zresp;
 		if(!zresp.fromVariant(data))
 		{
@@ -1098,6 +1272,22 @@ public:
 			return;
 		}
 
+		// the flag is only expected in first packets and keep-alives
+		if(!zresp.from.isEmpty() && (zresp.seq == 0 || zresp.type == ZhttpResponsePacket::KeepAlive))
+		{
+			if(data.toHash().value("multi").toBool())
+				multiPeers += zresp.from;
+			else
+				multiPeers.remove(zresp.from);
+		}
+
+		handleZhttpIn(mode, zresp);
+	}
+
+	void handleZhttpIn(Mode mode, const ZhttpResponsePacket &zresp)
+	{
+		const char *logprefix = (mode == Http ? "zhttp" : "zws");
+
 		Session *s;
 		if(mode == Http)
 			s = sessionsByZhttpRid.value(Rid(zhttpInstanceId, zresp.id));
@@ -1126,6 +1316,8 @@ public:
 
 		if(s->inSeq == 0)
 		{
+			s->trace.mark("zhttp-response");
+
 			// are we expecting a sequence of packets after the first?
 			if((!isErrorPacket(zresp) && zresp.type != ZhttpResponsePacket::Data) || (zresp.type == ZhttpResponsePacket::Data && zresp.more))
 			{
@@ -1221,6 +1413,7 @@ public:
 		{
 			// receiving any message means handoff is complete
 			s->inHandoff = false;
+			s->trace.mark("handoff-done");
 
 			// in order to have been in a handoff state, we would have
 			//   had to receive a from address sometime earlier, so it
@@ -1308,6 +1501,7 @@ public:
 							s->conn->flowControl = false;
 
 						s->sentResponseHeader = true;
+						s->trace.mark("m2-response");
 
 						if(zresp.more && !zresp.headers.contains("Content-Length"))
 						{
@@ -1411,6 +1605,7 @@ public:
 				if(!s->sentResponseHeader)
 				{
 					s->sentResponseHeader = true;
+					s->trace.mark("m2-response");
 					s->conn->flowControl = controlPorts[s->conn->identIndex].active;
 
 					HttpHeaders headers = zresp.headers;
@@ -1519,6 +1714,7 @@ public:
 		else if(zresp.type == ZhttpResponsePacket::HandoffStart)
 		{
 			s->inHandoff = true;
+			s->trace.mark("handoff");
 
 			ZhttpRequestPacket zreq;
 			zreq.type = ZhttpRequestPacket::HandoffProceed;
@@ -1745,6 +1941,10 @@ private slots:
 			{
 				s->mode = Http;
 
+				// the proxy sees the same id, so traces can be matched up.
+				//   websockets are long-lived and aren't traced
+				s->trace.start(s->id);
+
 				if(mreq.version == "HTTP/1.0")
 				{
 					if(mreq.headers.getAll("Connection").contains("Keep-Alive"))
@@ -1978,6 +2178,47 @@ private slots:
 		handleZhttpIn(WebSocket, message);
 	}
 
+	void command_requestReady()
+	{
+		ZrpcRequest *req = command->takeNext();
+		if(req->method() == "traces")
+		{
+			if(!Tracer::isEnabled())
+			{
+				req->respondError("service-unavailable");
+				delete req;
+				return;
+			}
+
+			int max = -1;
+
+			QVariantHash args = req->args();
+			if(args.contains("max"))
+			{
+				if(!args["max"].canConvert(QVariant::Int))
+				{
+					req->respondError("bad-format");
+					delete req;
+					return;
+				}
+
+				max = args["max"].toInt();
+			}
+
+			req->respond(Tracer::recent(max));
+		}
+		else if(req->method() == "objects")
+		{
+			req->respond(ObjectCounter::report());
+		}
+		else
+		{
+			req->respondError("method-not-found");
+		}
+
+		delete req;
+	}
+
 	void expire_timeout()
 	{
 		int now = time.elapsed();
@@ -2023,37 +2264,8 @@ private slots:
 
 	void keepAlive_timeout()
 	{
-		{
-			QHashIterator<Rid, Session*> it(sessionsByZhttpRid);
-			while(it.hasNext())
-			{
-				it.next();
-				Session *s = it.value();
-
-				if(!s->inHandoff && !s->zhttpAddress.isEmpty())
-				{
-					ZhttpRequestPacket zreq;
-					zreq.type = ZhttpRequestPacket::KeepAlive;
-					zhttp_out_write(s, zreq);
-				}
-			}
-		}
-
-		{
-			QHashIterator<Rid, Session*> it(sessionsByZwsRid);
-			while(it.hasNext())
-			{
-				it.next();
-				Session *s = it.value();
-
-				if(!s->inHandoff && !s->zhttpAddress.isEmpty())
-				{
-					ZhttpRequestPacket zreq;
-					zreq.type = ZhttpRequestPacket::KeepAlive;
-					zhttp_out_write(s, zreq);
-				}
-			}
-		}
+		keepAliveSessions(Http, sessionsByZhttpRid);
+		keepAliveSessions(WebSocket, sessionsByZwsRid);
 	}
 
 	void m2KeepAlive_timeout()
@@ -1,5 +1,6 @@
 QZMQ_DIR = $$PWD/../../qzmq
 COMMON_DIR = $$PWD/../../common
+PROXY_SRC_DIR = $$PWD/../../proxy/src
 
 INCLUDEPATH += $$QZMQ_DIR/src
 include($$QZMQ_DIR/src/src.pri)
@@ -27,6 +28,30 @@ SOURCES += \
 	$$COMMON_DIR/log.cpp \
 	$$COMMON_DIR/layertracker.cpp
 
+# shared zhttp encoder, request tracing, object counts, and zrpc for the
+#   command socket
+INCLUDEPATH += $$PROXY_SRC_DIR
+
+HEADERS += \
+	$$PROXY_SRC_DIR/zhttppacketwriter.h \
+	$$PROXY_SRC_DIR/tracer.h \
+	$$PROXY_SRC_DIR/objectcounter.h \
+	$$PROXY_SRC_DIR/uuidutil.h \
+	$$PROXY_SRC_DIR/packet/zrpcrequestpacket.h \
+	$$PROXY_SRC_DIR/packet/zrpcresponsepacket.h \
+	$$PROXY_SRC_DIR/zrpcmanager.h \
+	$$PROXY_SRC_DIR/zrpcrequest.h
+
+SOURCES += \
+	$$PROXY_SRC_DIR/zhttppacketwriter.cpp \
+	$$PROXY_SRC_DIR/tracer.cpp \
+	$$PROXY_SRC_DIR/objectcounter.cpp \
+	$$PROXY_SRC_DIR/uuidutil.cpp \
+	$$PROXY_SRC_DIR/packet/zrpcrequestpacket.cpp \
+	$$PROXY_SRC_DIR/packet/zrpcresponsepacket.cpp \
+	$$PROXY_SRC_DIR/zrpcmanager.cpp \
+	$$PROXY_SRC_DIR/zrpcrequest.cpp
+
 HEADERS += \
 	$$PWD/m2requestpacket.h \
 	$$PWD/m2responsepacket.h \
@@ -30,6 +30,7 @@
 #include "log.h"
 #include "xffrule.h"
 #include "engine.h"
+#include "tracer.h"
 
 #define VERSION "1.0.0"
 
@@ -229,8 +230,14 @@ public:
 		QString handler_ws_control_out_spec = settings.value("proxy/handler_ws_control_out_spec").toString();
 		QString stats_spec = settings.value("proxy/stats_spec").toString();
 		QString command_spec = settings.value("proxy/command_spec").toString();
+		int workers = settings.value("proxy/workers", 1).toInt();
 		int maxWorkers = settings.value("proxy/max_open_requests", -1).toInt();
+		int intakeHighWatermark = settings.value("proxy/intake_high_watermark", 0).toInt();
+		int intakeLowWatermark = settings.value("proxy/intake_low_watermark", 0).toInt();
 		QString routesFile = settings.value("proxy/routesfile").toString();
+		int inspectCacheSize = settings.value("proxy/inspect_cache_size", 10000).toInt();
+		QStringList inspectCacheHeadersStr = settings.value("proxy/inspect_cache_headers").toStringList();
+		trimlist(&inspectCacheHeadersStr);
 		bool autoCrossOrigin = settings.value("proxy/auto_cross_origin").toBool();
 		bool useXForwardedProtocol = settings.value("proxy/set_x_forwarded_protocol").toBool();
 		XffRule xffRule = parse_xffRule(settings.value("proxy/x_forwarded_for").toStringList());
@@ -239,11 +246,17 @@ public:
 		trimlist(&origHeadersNeedMarkStr);
 		QByteArray sigKey = parse_key(settings.value("proxy/sig_key").toString());
 		QByteArray upstreamKey = parse_key(settings.value("proxy/upstream_key").toString());
+		int traceSampleRate = settings.value("proxy/trace_sample_rate", 0).toInt();
+		int traceSlowTime = settings.value("proxy/trace_slow_time", 0).toInt();
 
 		QList<QByteArray> origHeadersNeedMark;
 		foreach(const QString &s, origHeadersNeedMarkStr)
 			origHeadersNeedMark += s.toUtf8();
 
+		QList<QByteArray> inspectCacheHeaders;
+		foreach(const QString &s, inspectCacheHeadersStr)
+			inspectCacheHeaders += s.toUtf8();
+
 		// if routesfile is a relative path, then use it relative to the config file location
 		QFileInfo fi(routesFile);
 		if(fi.isRelative())
@@ -271,7 +284,12 @@ public:
 		config.wsControlOutSpec = handler_ws_control_out_spec;
 		config.statsSpec = stats_spec;
 		config.commandSpec = command_spec;
+		config.workers = qMax(workers, 1);
 		config.maxWorkers = maxWorkers;
+		config.intakeHighWatermark = intakeHighWatermark;
+		config.intakeLowWatermark = intakeLowWatermark;
+		config.inspectCacheSize = inspectCacheSize;
+		config.inspectCacheHeaders = inspectCacheHeaders;
 		config.routesFile = routesFile;
 		config.autoCrossOrigin = autoCrossOrigin;
 		config.useXForwardedProtocol = useXForwardedProtocol;
@@ -282,6 +300,9 @@ public:
 		config.sigKey = sigKey;
 		config.upstreamKey = upstreamKey;
 
+		// before the engine starts any worker threads
+		Tracer::setup(traceSampleRate, traceSlowTime);
+
 		engine = new Engine(this);
 		if(!engine->start(config))
 		{
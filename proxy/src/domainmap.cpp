@@ -20,8 +20,10 @@
 #include "domainmap.h"
 
 #include <assert.h>
+#include <string.h>
 #include <QStringList>
 #include <QHash>
+#include <QVector>
 #include <QTimer>
 #include <QThread>
 #include <QMutex>
@@ -30,6 +32,7 @@
 #include <QTextStream>
 #include <QFileSystemWatcher>
 #include "log.h"
+#include "rcupointer.h"
 
 static QByteArray parse_key(const QString &in)
 {
@@ -128,6 +131,10 @@ public:
 		bool autoCrossOrigin;
 		JsonpConfig jsonpConfig;
 		bool session;
+		bool speculative;
+		LoadBalance lb;
+		int maxConns;
+		int maxPending;
 		QList<Target> targets;
 
 		Rule() :
@@ -136,76 +143,356 @@ public:
 			origHeaders(false),
 			pathRemove(0),
 			autoCrossOrigin(false),
-			session(false)
+			session(false),
+			speculative(false),
+			lb(Ordered),
+			maxConns(0),
+			maxPending(0)
 		{
 		}
 
-		// checks only the condition, not sig/targets
-		bool compare(const Rule &other) const
+		Entry toEntry() const
 		{
-			return (proto == other.proto && ssl == other.ssl && pathBeg == other.pathBeg);
+			Entry e;
+			e.id = id;
+			e.sigIss = sigIss;
+			e.sigKey = sigKey;
+			e.prefix = prefix;
+			e.origHeaders = origHeaders;
+			e.asHost = asHost;
+			e.pathRemove = pathRemove;
+			e.autoCrossOrigin = autoCrossOrigin;
+			e.jsonpConfig = jsonpConfig;
+			e.session = session;
+			e.speculative = speculative;
+			e.lb = lb;
+			e.maxConns = maxConns;
+			e.maxPending = maxPending;
+			e.targets = targets;
+			return e;
 		}
+	};
+
+	// compiled, immutable form of the routes file. each domain has a radix
+	//   tree keyed on path_beg, and each tree node holds its rules in slots
+	//   by proto/ssl condition. a lookup walks the request path once and
+	//   picks the most specific match without examining unrelated rules.
+	//   entries are built once at load time and shared with callers.
+	//   published to readers as an rcu snapshot
+	class Index : public QSharedData
+	{
+	public:
+		class PathNode
+		{
+		public:
+			QByteArray label; // bytes leading to this node from its parent
+			QByteArray childKeys; // first label byte of each child, sorted
+			QVector<int> children;
+			int ruleSlots[3][3]; // entry indexes by proto + 1 and ssl + 1
+
+			PathNode()
+			{
+				for(int n = 0; n < 3; ++n)
+				{
+					for(int i = 0; i < 3; ++i)
+						ruleSlots[n][i] = -1;
+				}
+			}
+
+			int findChild(char c) const
+			{
+				const char *keys = childKeys.constData();
+				int low = 0;
+				int high = childKeys.size() - 1;
+				while(low <= high)
+				{
+					int mid = (low + high) / 2;
+					if(keys[mid] == c)
+						return children[mid];
+					else if(keys[mid] < c)
+						low = mid + 1;
+					else
+						high = mid - 1;
+				}
+
+				return -1;
+			}
+
+			// returns the entry index of the most specific rule at this
+			//   node that matches, along with its proto/ssl rank
+			int match(int proto, int ssl, int *rank) const
+			{
+				if(ruleSlots[proto + 1][ssl + 1] != -1)
+				{
+					*rank = 3;
+					return ruleSlots[proto + 1][ssl + 1];
+				}
+				else if(ruleSlots[proto + 1][0] != -1)
+				{
+					*rank = 2;
+					return ruleSlots[proto + 1][0];
+				}
+				else if(ruleSlots[0][ssl + 1] != -1)
+				{
+					*rank = 1;
+					return ruleSlots[0][ssl + 1];
+				}
+				else if(ruleSlots[0][0] != -1)
+				{
+					*rank = 0;
+					return ruleSlots[0][0];
+				}
+
+				return -1;
+			}
+		};
+
+		class Domain
+		{
+		public:
+			QString name;
+			bool wildcard;
+			QVector<PathNode> nodes; // first node is the root
+			QList<int> entries; // in file order
+
+			Domain() :
+				wildcard(false)
+			{
+				nodes += PathNode();
+			}
+
+			// returns the node for path, creating it if needed
+			int addPath(const QByteArray &path)
+			{
+				int at = 0;
+				int pos = 0;
+				while(pos < path.size())
+				{
+					char c = path[pos];
+					int child = nodes[at].findChild(c);
+					if(child == -1)
+					{
+						PathNode n;
+						n.label = path.mid(pos);
+						nodes += n;
+						addChild(at, nodes.count() - 1);
+						return nodes.count() - 1;
+					}
+
+					const QByteArray &label = nodes[child].label;
+					int common = 0;
+					while(common < label.size() && pos + common < path.size() && label[common] == path[pos + common])
+						++common;
+
+					if(common < label.size())
+					{
+						// split the edge
+						PathNode n;
+						n.label = label.mid(0, common);
+						n.childKeys += label[common];
+						n.children += child;
+						nodes += n;
+						int split = nodes.count() - 1;
+
+						nodes[child].label = nodes[child].label.mid(common);
+
+						PathNode &parent = nodes[at];
+						parent.children[parent.childKeys.indexOf(c)] = split;
+						child = split;
+					}
+
+					pos += common;
+					at = child;
+				}
+
+				return at;
+			}
+
+			void addChild(int parent, int child)
+			{
+				PathNode &p = nodes[parent];
+				char c = nodes[child].label[0];
+
+				int n = 0;
+				while(n < p.childKeys.size() && p.childKeys[n] < c)
+					++n;
+
+				p.childKeys.insert(n, c);
+				p.children.insert(n, child);
+			}
+
+			int find(int proto, int ssl, const QByteArray &path) const
+			{
+				int best = -1;
+				int bestRank = -1;
+
+				const char *p = path.constData();
+				int left = path.size();
+				int at = 0;
+				while(true)
+				{
+					const PathNode &n = nodes[at];
+
+					// deeper nodes have longer prefixes, so they win ties
+					int rank;
+					int e = n.match(proto, ssl, &rank);
+					if(e != -1 && rank >= bestRank)
+					{
+						best = e;
+						bestRank = rank;
+					}
+
+					if(left == 0)
+						break;
+
+					int child = n.findChild(*p);
+					if(child == -1)
+						break;
+
+					const QByteArray &label = nodes[child].label;
+					if(label.size() > left || memcmp(label.constData(), p, label.size()) != 0)
+						break;
+
+					p += label.size();
+					left -= label.size();
+					at = child;
+				}
+
+				return best;
+			}
+		};
+
+		// wildcard domains are indexed by their labels in reverse, e.g.
+		//   *.api.example.com is stored under com -> example -> api
+		class SuffixNode
+		{
+		public:
+			QHash<QString, int> children;
+			int domain; // index of the wildcard domain ending here, or -1
+
+			SuffixNode() :
+				domain(-1)
+			{
+			}
+		};
+
+		QHash<QString, int> domainIndexes;
+		QVector<Domain> domains;
+		QVector<SuffixNode> suffixNodes; // first node is the root
+		QVector<Entry> entries;
 
-		inline bool matchProto(Protocol reqProto) const
+		Index()
 		{
-			return ((proto == 0 && reqProto == Http) || (proto == 1 && reqProto == WebSocket));
+			suffixNodes += SuffixNode();
 		}
 
-		inline bool matchSsl(bool reqSsl) const
+		// returns false if the domain already has a rule with the same
+		//   condition
+		bool addRule(const QString &domain, const Rule &r)
 		{
-			return ((ssl == 0 && !reqSsl) || (ssl == 1 && reqSsl));
+			int di = domainIndexes.value(domain, -1);
+			if(di == -1)
+			{
+				Domain d;
+				d.name = domain;
+				domains += d;
+				di = domains.count() - 1;
+				domainIndexes.insert(domain, di);
+
+				if(domain.startsWith("*."))
+				{
+					domains[di].wildcard = true;
+					addSuffix(domain.mid(2), di);
+				}
+			}
+
+			Domain &d = domains[di];
+			int node = d.addPath(r.pathBeg);
+			int &slot = d.nodes[node].ruleSlots[r.proto + 1][r.ssl + 1];
+			if(slot != -1)
+				return false;
+
+			entries += r.toEntry();
+			slot = entries.count() - 1;
+			d.entries += slot;
+			return true;
 		}
 
-		bool isMatch(Protocol reqProto, bool reqSsl, const QByteArray &reqPath) const
+		void addSuffix(const QString &suffix, int di)
 		{
-			return ((proto == -1 || matchProto(reqProto)) && (ssl == -1 || matchSsl(reqSsl)) && (pathBeg.isEmpty() || reqPath.startsWith(pathBeg)));
+			QStringList labels = suffix.split('.');
+
+			int node = 0;
+			for(int n = labels.count() - 1; n >= 0; --n)
+			{
+				int child = suffixNodes[node].children.value(labels[n], -1);
+				if(child == -1)
+				{
+					suffixNodes += SuffixNode();
+					child = suffixNodes.count() - 1;
+					suffixNodes[node].children.insert(labels[n], child);
+				}
+
+				node = child;
+			}
+
+			suffixNodes[node].domain = di;
 		}
 
-		bool isMoreSpecificMatch(const Rule &other, Protocol reqProto, bool reqSsl, const QByteArray &reqPath) const
+		// exact match, then the longest wildcard suffix, then the default
+		int findDomain(const QString &domain) const
 		{
-			// have to at least be a match
-			if(!isMatch(reqProto, reqSsl, reqPath))
-				return false;
+			int di = domainIndexes.value(domain, -1);
+			if(di != -1 && !domains[di].wildcard)
+				return di;
 
-			// now let's see if we're a better match
+			di = -1;
+			if(suffixNodes.count() > 1)
+			{
+				int node = 0;
+				int end = domain.size();
+				while(end > 0)
+				{
+					int dot = domain.lastIndexOf('.', end - 1);
+					int child = suffixNodes[node].children.value(domain.mid(dot + 1, end - dot - 1), -1);
+					if(child == -1)
+						break;
 
-			if(other.proto == -1 && proto != -1)
-				return true;
-			else if(other.proto != -1 && proto == -1)
-				return false;
+					node = child;
 
-			if(other.ssl == -1 && ssl != -1)
-				return true;
-			else if(other.ssl != -1 && ssl == -1)
-				return false;
+					// the wildcard has to cover at least one label
+					if(dot == -1)
+						break;
 
-			if(pathBeg.size() > other.pathBeg.size() && reqPath.startsWith(pathBeg))
-				return true;
+					if(suffixNodes[node].domain != -1)
+						di = suffixNodes[node].domain;
 
-			return false;
+					end = dot;
+				}
+			}
+
+			if(di == -1)
+				di = domainIndexes.value(QString(""), -1);
+
+			return di;
 		}
 
-		Entry toEntry() const
+		const Entry *find(Protocol proto, bool ssl, const QString &domain, const QByteArray &path) const
 		{
-			Entry e;
-			e.id = id;
-			e.sigIss = sigIss;
-			e.sigKey = sigKey;
-			e.prefix = prefix;
-			e.origHeaders = origHeaders;
-			e.asHost = asHost;
-			e.pathRemove = pathRemove;
-			e.autoCrossOrigin = autoCrossOrigin;
-			e.jsonpConfig = jsonpConfig;
-			e.session = session;
-			e.targets = targets;
-			return e;
+			int di = findDomain(domain);
+			if(di == -1)
+				return 0;
+
+			int e = domains[di].find(proto == Http ? 0 : 1, ssl ? 1 : 0, path);
+			if(e == -1)
+				return 0;
+
+			return &entries[e];
 		}
 	};
 
-	QMutex m;
 	QString fileName;
-	QHash< QString, QList<Rule> > map;
+	RcuPointer<Index> index;
 	QTimer t;
 
 	Worker() :
@@ -224,7 +511,7 @@ public:
 			return;
 		}
 
-		QHash< QString, QList<Rule> > newmap;
+		Index *newIndex = new Index;
 
 		QTextStream ts(&file);
 		for(int lineNum = 0; !ts.atEnd(); ++lineNum)
@@ -259,6 +546,13 @@ public:
 			if(val == "*")
 				val = QString();
 
+			// wildcards are only allowed as a leading label
+			if(val.contains('*') && (!val.startsWith("*.") || val.size() < 3 || val.indexOf('*', 1) != -1))
+			{
+				log_warning("%s:%d: wildcard domain must be of the form *.example.com", qPrintable(fileName), lineNum);
+				continue;
+			}
+
 			QString domain = val;
 
 			Rule r;
@@ -375,23 +669,42 @@ public:
 			if(props.contains("session"))
 				r.session = true;
 
-			QList<Rule> *rules = 0;
-			if(newmap.contains(domain))
+			if(props.contains("speculative"))
+				r.speculative = true;
+
+			if(props.contains("lb"))
 			{
-				rules = &newmap[domain];
-				bool found = false;
-				foreach(const Rule &b, *rules)
+				val = props.value("lb");
+				if(val == "least_conn")
+					r.lb = LeastConn;
+				else if(val == "ewma")
+					r.lb = Ewma;
+				else
 				{
-					if(b.compare(r))
-					{
-						found = true;
-						break;
-					}
+					log_warning("%s:%d: lb must be set to 'least_conn' or 'ewma'", qPrintable(fileName), lineNum);
+					continue;
+				}
+			}
+
+			if(props.contains("max_conns"))
+			{
+				// limits are tracked by route id
+				bool ok;
+				r.maxConns = props.value("max_conns").toInt(&ok);
+				if(!ok || r.maxConns < 1 || r.id.isEmpty())
+				{
+					log_warning("%s:%d: max_conns must be a positive number and requires id", qPrintable(fileName), lineNum);
+					continue;
 				}
+			}
 
-				if(found)
+			if(props.contains("max_pending"))
+			{
+				bool ok;
+				r.maxPending = props.value("max_pending").toInt(&ok);
+				if(!ok || r.maxPending < 0)
 				{
-					log_warning("%s:%d skipping duplicate condition", qPrintable(fileName), lineNum);
+					log_warning("%s:%d: max_pending must be a number", qPrintable(fileName), lineNum);
 					continue;
 				}
 			}
@@ -466,6 +779,19 @@ public:
 				if(props.contains("over_http"))
 					target.overHttp = true;
 
+				if(props.contains("weight"))
+				{
+					int x = props.value("weight").toInt(&ok);
+					if(!ok || x < 1)
+					{
+						log_warning("%s:%d: target invalid weight", qPrintable(fileName), lineNum);
+						ok = false;
+						break;
+					}
+
+					target.weight = x;
+				}
+
 				if(props.contains("ipc_file_mode"))
 				{
 					bool ok;
@@ -480,47 +806,42 @@ public:
 			if(!ok)
 				continue;
 
-			if(!rules)
+			if(!newIndex->addRule(domain, r))
 			{
-				newmap.insert(domain, QList<Rule>());
-				rules = &newmap[domain];
+				log_warning("%s:%d skipping duplicate condition", qPrintable(fileName), lineNum);
+				continue;
 			}
-
-			*rules += r;
 		}
 
-		log_debug("routes map:");
-		QHashIterator< QString, QList<Rule> > it(newmap);
-		while(it.hasNext())
+		if(log_outputLevel() >= LOG_LEVEL_DEBUG)
 		{
-			it.next();
-
-			const QString &domain = it.key();
-			const QList<Rule> &rules = it.value();
-			foreach(const Rule &r, rules)
+			log_debug("routes map:");
+			foreach(const Index::Domain &d, newIndex->domains)
 			{
-				QStringList tstr;
-				foreach(const Target &t, r.targets)
+				foreach(int e, d.entries)
 				{
-					if(!t.zhttpRoute.isNull())
-						tstr += t.zhttpRoute.baseSpec;
+					QStringList tstr;
+					foreach(const Target &t, newIndex->entries[e].targets)
+					{
+						if(!t.zhttpRoute.isNull())
+							tstr += t.zhttpRoute.baseSpec;
+						else
+							tstr += t.connectHost + ';' + QString::number(t.connectPort);
+					}
+
+					if(!d.name.isEmpty())
+						log_debug("  %s: %s", qPrintable(d.name), qPrintable(tstr.join(" ")));
 					else
-						tstr += t.connectHost + ';' + QString::number(t.connectPort);
+						log_debug("  (default): %s", qPrintable(tstr.join(" ")));
 				}
-
-				if(!domain.isEmpty())
-					log_debug("  %s: %s", qPrintable(domain), qPrintable(tstr.join(" ")));
-				else
-					log_debug("  (default): %s", qPrintable(tstr.join(" ")));
 			}
 		}
 
-		// atomically replace the map
-		m.lock();
-		map = newmap;
-		m.unlock();
+		log_info("routes map loaded with %d entries", newIndex->domains.count());
 
-		log_info("routes map loaded with %d entries", newmap.count());
+		// publish the new generation. readers still holding the old one
+		//   keep it alive until they are done
+		index.store(newIndex);
 
 		QMetaObject::invokeMethod(this, "changed", Qt::QueuedConnection);
 	}
@@ -655,52 +976,38 @@ void DomainMap::reload()
 
 DomainMap::Entry DomainMap::entry(Protocol proto, bool ssl, const QString &domain, const QByteArray &path) const
 {
-	QMutexLocker locker(&d->thread->worker->m);
-
-	const QList<Worker::Rule> *rules;
-	QString empty("");
-	if(d->thread->worker->map.contains(domain))
-		rules = &d->thread->worker->map[domain];
-	else if(d->thread->worker->map.contains(empty))
-		rules = &d->thread->worker->map[empty];
-	else
-		return Entry();
+	// pin the current snapshot. it stays valid even if a reload
+	//   publishes a new one while we use it
+	QExplicitlySharedDataPointer<Worker::Index> index = d->thread->worker->index.load();
 
-	const Worker::Rule *best = 0;
-	foreach(const Worker::Rule &r, *rules)
-	{
-		if((!best && r.isMatch(proto, ssl, path)) || (best && r.isMoreSpecificMatch(*best, proto, ssl, path)))
-		{
-			best = &r;
-		}
-	}
+	if(!index)
+		return Entry();
 
-	if(!best)
+	const Entry *e = index->find(proto, ssl, domain, path);
+	if(!e)
 		return Entry();
 
-	assert(!best->targets.isEmpty());
+	assert(!e->targets.isEmpty());
 
-	return best->toEntry();
+	// members are implicitly shared, so this doesn't copy any data
+	return *e;
 }
 
 QList<DomainMap::ZhttpRoute> DomainMap::zhttpRoutes() const
 {
-	QMutexLocker locker(&d->thread->worker->m);
+	QExplicitlySharedDataPointer<Worker::Index> index = d->thread->worker->index.load();
 
 	QList<ZhttpRoute> out;
 
-	QHashIterator< QString, QList<Worker::Rule> > it(d->thread->worker->map);
-	while(it.hasNext())
+	if(!index)
+		return out;
+
+	foreach(const Entry &e, index->entries)
 	{
-		it.next();
-		const QList<Worker::Rule> &rules = it.value();
-		foreach(const Worker::Rule &r, rules)
+		foreach(const Target &t, e.targets)
 		{
-			foreach(const Target &t, r.targets)
-			{
-				if(!t.zhttpRoute.isNull() && !out.contains(t.zhttpRoute))
-					out += t.zhttpRoute;
-			}
+			if(!t.zhttpRoute.isNull() && !out.contains(t.zhttpRoute))
+				out += t.zhttpRoute;
 		}
 	}
 
@@ -58,6 +58,13 @@ public:
 		WebSocket
 	};
 
+	enum LoadBalance
+	{
+		Ordered, // first target, others only for failover
+		LeastConn,
+		Ewma
+	};
+
 	class ZhttpRoute
 	{
 	public:
@@ -102,6 +109,7 @@ public:
 		QString host; // override input host
 		QString subChannel; // force subscription for websocket test
 		bool overHttp; // use websocket-over-http protocol
+		int weight; // share of load when balancing
 
 		Target() :
 			type(Default),
@@ -109,7 +117,8 @@ public:
 			ssl(false),
 			trusted(false),
 			insecure(false),
-			overHttp(false)
+			overHttp(false),
+			weight(1)
 		{
 		}
 	};
@@ -127,6 +136,10 @@ public:
 		bool autoCrossOrigin;
 		JsonpConfig jsonpConfig;
 		bool session;
+		bool speculative; // start upstream request while inspecting
+		LoadBalance lb;
+		int maxConns; // 0 for no limit
+		int maxPending; // requests that may wait for a free slot
 		QList<Target> targets;
 
 		bool isNull() const
@@ -138,7 +151,11 @@ public:
 			origHeaders(false),
 			pathRemove(0),
 			autoCrossOrigin(false),
-			session(false)
+			session(false),
+			speculative(false),
+			lb(Ordered),
+			maxConns(0),
+			maxPending(0)
 		{
 		}
 	};
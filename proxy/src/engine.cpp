@@ -20,10 +20,16 @@
 #include "engine.h"
 
 #include <assert.h>
+#include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QWaitCondition>
 #include "qzmqsocket.h"
 #include "qzmqvalve.h"
 #include "tnetstring.h"
 #include "packet/retryrequestpacket.h"
+#include "packet/wscontrolpacket.h"
 #include "log.h"
 #include "inspectdata.h"
 #include "acceptdata.h"
@@ -31,24 +37,81 @@
 #include "zhttprequest.h"
 #include "zwebsocket.h"
 #include "domainmap.h"
+#include "headerrewrite.h"
 #include "zroutes.h"
 #include "zrpcmanager.h"
 #include "zrpcrequest.h"
 #include "zrpcchecker.h"
+#include "inspectcache.h"
 #include "wscontrolmanager.h"
 #include "requestsession.h"
 #include "proxysession.h"
 #include "wsproxysession.h"
 #include "statsmanager.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "objectcounter.h"
 #include "connectionmanager.h"
 
 #define DEFAULT_HWM 1000
 
+#define STATS_INTERVAL 10000
+
+// pause zhttp intake when this many sessions are waiting to be taken,
+//   and resume once down to the low mark with room to take more. unless
+//   configured, the high mark is a tenth of the worker limit but no less
+//   than the minimum, and the low mark is a tenth of the high mark
+#define INTAKE_HIGH_WATERMARK_MIN 100
+
 static QByteArray ridToString(const QPair<QByteArray, QByteArray> &rid)
 {
 	return rid.first + ':' + rid.second;
 }
 
+// internal endpoint bound by a worker for relaying a handler socket
+static QString shardSpec(const QByteArray &clientId, const char *name, int index)
+{
+	return QString("inproc://") + QString::fromUtf8(clientId) + '-' + name + '-' + QString::number(index);
+}
+
+// in sharded mode, each worker thread runs its own engine with its own
+//   zhttp sockets, routes and sessions. the routes table and stats are
+//   shared, and the handler sockets are relayed by the main engine.
+
+class Engine::Shard : public QThread
+{
+public:
+	Configuration config;
+	DomainMap *domainMap;
+	StatsManager *stats;
+	QMutex m;
+	QWaitCondition w;
+	bool started;
+
+	Shard() :
+		domainMap(0),
+		stats(0),
+		started(false)
+	{
+	}
+
+	~Shard()
+	{
+		quit();
+		wait();
+	}
+
+	bool start()
+	{
+		QMutexLocker locker(&m);
+		QThread::start();
+		w.wait(&m);
+		return started;
+	}
+
+	virtual void run();
+};
+
 class Engine::Private : public QObject
 {
 	Q_OBJECT
@@ -68,6 +131,23 @@ public:
 		}
 	};
 
+	// requests admitted to and waiting for a route with max_conns
+	class RouteQueue
+	{
+	public:
+		int maxConns;
+		int maxPending;
+		int active;
+		QList<ZhttpRequest*> pending;
+
+		RouteQueue() :
+			maxConns(0),
+			maxPending(0),
+			active(0)
+		{
+		}
+	};
+
 	class WsProxyItem
 	{
 	public:
@@ -82,13 +162,22 @@ public:
 	Engine *q;
 	bool destroying;
 	Configuration config;
+	HeaderRewrite headerRewrite;
 	ZhttpManager *zhttpIn;
 	ZRoutes *zroutes;
 	ZrpcManager *inspect;
 	WsControlManager *wsControl;
 	DomainMap *domainMap;
 	ZrpcChecker *inspectChecker;
+	InspectCache *inspectCache;
+	QTimer *statsTimer;
+	QElapsedTimer intakePauseTime;
+	qint64 intakePausedTotal;
+	int intakePendingMax;
+	int intakeHighWatermark;
+	int intakeLowWatermark;
 	StatsManager *stats;
+	Metrics *metrics;
 	ZrpcManager *command;
 	ZrpcManager *accept;
 	QZmq::Socket *handler_retry_in_sock;
@@ -96,8 +185,22 @@ public:
 	QSet<RequestSession*> requestSessions;
 	QHash<QByteArray, ProxyItem*> proxyItemsByKey;
 	QHash<ProxySession*, ProxyItem*> proxyItemsBySession;
+	QHash<RequestSession*, ProxySession*> speculativeSessions;
+	QHash<QByteArray, RouteQueue*> routeQueues;
+	QHash<RequestSession*, QByteArray> routeLimitedSessions;
+	QHash<ZhttpRequest*, QByteArray> queuedRequests;
+	QList<QByteArray> waitingRoutes; // served in turn
 	QHash<WsProxySession*, WsProxyItem*> wsProxyItemsBySession;
 	ConnectionManager connectionManager;
+	QList<Shard*> shards;
+	QHash<QZmq::Socket*, QZmq::Socket*> relayPeers;
+	QList<QZmq::Socket*> shardRetryOutSocks;
+	QZmq::Socket *handler_ws_control_in_sock;
+	QZmq::Valve *handler_ws_control_in_valve;
+	QZmq::Socket *handler_ws_control_out_sock;
+	QList<QZmq::Socket*> shardWsControlInSocks;
+	QList<QZmq::Socket*> shardWsControlOutSocks;
+	QHash<QByteArray, int> shardsByCid;
 
 	Private(Engine *_q) :
 		QObject(_q),
@@ -109,11 +212,21 @@ public:
 		wsControl(0),
 		domainMap(0),
 		inspectChecker(0),
+		inspectCache(0),
+		statsTimer(0),
+		intakePausedTotal(0),
+		intakePendingMax(0),
+		intakeHighWatermark(0),
+		intakeLowWatermark(0),
 		stats(0),
+		metrics(0),
 		command(0),
 		accept(0),
 		handler_retry_in_sock(0),
-		handler_retry_in_valve(0)
+		handler_retry_in_valve(0),
+		handler_ws_control_in_sock(0),
+		handler_ws_control_in_valve(0),
+		handler_ws_control_out_sock(0)
 	{
 	}
 
@@ -121,6 +234,10 @@ public:
 	{
 		destroying = true;
 
+		// stop workers before anything they share goes away
+		qDeleteAll(shards);
+		shards.clear();
+
 		QHashIterator<ProxySession*, ProxyItem*> it(proxyItemsBySession);
 		while(it.hasNext())
 		{
@@ -131,6 +248,7 @@ public:
 
 		proxyItemsBySession.clear();
 		proxyItemsByKey.clear();
+		speculativeSessions.clear();
 
 		QHashIterator<WsProxySession*, WsProxyItem*> wit(wsProxyItemsBySession);
 		while(wit.hasNext())
@@ -146,16 +264,45 @@ public:
 			delete rs;
 		requestSessions.clear();
 
+		foreach(ZhttpRequest *req, queuedRequests.keys())
+			delete req;
+		queuedRequests.clear();
+		qDeleteAll(routeQueues);
+		routeQueues.clear();
+
 		// need to make sure this is deleted before inspect manager
 		delete inspectChecker;
 		inspectChecker = 0;
+
+		// sessions record into this, so it goes after them
+		delete metrics;
+		metrics = 0;
 	}
 
-	bool start(const Configuration &_config)
+	bool start(const Configuration &_config, DomainMap *sharedDomainMap = 0, StatsManager *sharedStats = 0)
 	{
 		config = _config;
+		headerRewrite = HeaderRewrite(config.origHeadersNeedMark, config.useXForwardedProtocol);
 
-		domainMap = new DomainMap(config.routesFile);
+		intakeHighWatermark = config.intakeHighWatermark;
+		if(intakeHighWatermark <= 0)
+		{
+			intakeHighWatermark = INTAKE_HIGH_WATERMARK_MIN;
+			if(config.maxWorkers != -1)
+				intakeHighWatermark = qMax(config.maxWorkers / 10, INTAKE_HIGH_WATERMARK_MIN);
+		}
+
+		intakeLowWatermark = config.intakeLowWatermark;
+		if(intakeLowWatermark <= 0 || intakeLowWatermark >= intakeHighWatermark)
+			intakeLowWatermark = intakeHighWatermark / 10;
+
+		if(config.workers > 1)
+			return startShards();
+
+		if(sharedDomainMap)
+			domainMap = sharedDomainMap;
+		else
+			domainMap = new DomainMap(config.routesFile);
 		connect(domainMap, SIGNAL(changed()), SLOT(domainMap_changed()));
 
 		zhttpIn = new ZhttpManager(this);
@@ -186,6 +333,13 @@ public:
 			inspect->setTimeout(config.inspectTimeout);
 
 			inspectChecker = new ZrpcChecker(this);
+
+			if(config.inspectCacheSize > 0)
+			{
+				inspectCache = new InspectCache(this);
+				inspectCache->setMaxItems(config.inspectCacheSize);
+				inspectCache->setVaryHeaders(config.inspectCacheHeaders);
+			}
 		}
 
 		if(!config.acceptSpec.isEmpty())
@@ -238,43 +392,311 @@ public:
 			}
 		}
 
+		if(sharedStats)
+		{
+			stats = sharedStats;
+		}
+		else if(!config.statsSpec.isEmpty())
+		{
+			if(!setupStats())
+				return false;
+		}
+
+		if(stats)
+		{
+			metrics = new Metrics;
+
+			statsTimer = new QTimer(this);
+			connect(statsTimer, SIGNAL(timeout()), SLOT(stats_timeout()));
+			statsTimer->start(STATS_INTERVAL);
+		}
+
+		if(!config.commandSpec.isEmpty())
+		{
+			if(!setupCommand())
+				return false;
+		}
+
+		// init zroutes
+		domainMap_changed();
+
+		return true;
+	}
+
+	bool setupStats()
+	{
+		stats = new StatsManager(this);
+
+		stats->setInstanceId(config.clientId);
+
+		if(!stats->setSpec(config.statsSpec))
+		{
+			log_error("unable to bind to stats_spec: %s", qPrintable(config.statsSpec));
+			return false;
+		}
+
+		return true;
+	}
+
+	bool setupCommand()
+	{
+		command = new ZrpcManager(this);
+		command->setBind(true);
+		connect(command, SIGNAL(requestReady()), SLOT(command_requestReady()));
+
+		if(!command->setServerSpecs(QStringList() << config.commandSpec))
+		{
+			// zrpcmanager logs error
+			return false;
+		}
+
+		return true;
+	}
+
+	Configuration shardConfig(int index) const
+	{
+		Configuration c = config;
+		c.workers = 1;
+
+		// each worker needs its own zhttp identity
+		c.clientId = config.clientId + '_' + QByteArray::number(index);
+
+		if(config.maxWorkers != -1)
+			c.maxWorkers = qMax((config.maxWorkers + config.workers - 1) / config.workers, 1);
+
+		// configured intake marks are for the whole engine, like the
+		//   worker limit
+		if(config.intakeHighWatermark > 0)
+			c.intakeHighWatermark = qMax((config.intakeHighWatermark + config.workers - 1) / config.workers, 1);
+		if(config.intakeLowWatermark > 0)
+			c.intakeLowWatermark = qMax((config.intakeLowWatermark + config.workers - 1) / config.workers, 1);
+
+		if(!config.inspectSpec.isEmpty())
+			c.inspectSpec = shardSpec(config.clientId, "inspect", index);
+		if(!config.acceptSpec.isEmpty())
+			c.acceptSpec = shardSpec(config.clientId, "accept", index);
+		if(!config.retryInSpec.isEmpty())
+			c.retryInSpec = shardSpec(config.clientId, "retry", index);
+		if(!config.wsControlInSpec.isEmpty() && !config.wsControlOutSpec.isEmpty())
+		{
+			c.wsControlInSpec = shardSpec(config.clientId, "ws-control-in", index);
+			c.wsControlOutSpec = shardSpec(config.clientId, "ws-control-out", index);
+		}
+
+		// stats and command are served by the main engine
+		c.statsSpec.clear();
+		c.commandSpec.clear();
+
+		return c;
+	}
+
+	bool startShards()
+	{
+		log_info("starting %d workers", config.workers);
+
+		domainMap = new DomainMap(config.routesFile);
+
 		if(!config.statsSpec.isEmpty())
 		{
-			stats = new StatsManager(this);
+			if(!setupStats())
+				return false;
+		}
 
-			stats->setInstanceId(config.clientId);
+		for(int n = 0; n < config.workers; ++n)
+		{
+			Shard *s = new Shard;
+			s->config = shardConfig(n);
+			s->domainMap = domainMap;
+			s->stats = stats;
+			shards += s;
 
-			if(!stats->setSpec(config.statsSpec))
+			if(!s->start())
 			{
-				log_error("unable to bind to stats_spec: %s", qPrintable(config.statsSpec));
+				log_error("failed to start worker %d", n);
 				return false;
 			}
 		}
 
-		if(!config.commandSpec.isEmpty())
+		// workers have bound their internal endpoints, so connect the relays
+
+		if(!config.inspectSpec.isEmpty())
+		{
+			if(!setupRpcRelay(config.inspectSpec, "inspect"))
+				return false;
+		}
+
+		if(!config.acceptSpec.isEmpty())
 		{
-			command = new ZrpcManager(this);
-			command->setBind(true);
-			connect(command, SIGNAL(requestReady()), SLOT(command_requestReady()));
+			if(!setupRpcRelay(config.acceptSpec, "accept"))
+				return false;
+		}
+
+		if(!config.retryInSpec.isEmpty())
+		{
+			handler_retry_in_sock = new QZmq::Socket(QZmq::Socket::Pull, this);
 
-			if(!command->setServerSpecs(QStringList() << config.commandSpec))
+			handler_retry_in_sock->setHwm(DEFAULT_HWM);
+
+			if(!handler_retry_in_sock->bind(config.retryInSpec))
 			{
-				// zrpcmanager logs error
+				log_error("unable to bind to handler_retry_in_spec: %s", qPrintable(config.retryInSpec));
 				return false;
 			}
+
+			for(int n = 0; n < shards.count(); ++n)
+			{
+				QZmq::Socket *sock = new QZmq::Socket(QZmq::Socket::Push, this);
+				sock->setHwm(DEFAULT_HWM);
+				sock->setShutdownWaitTime(0);
+				sock->connectToAddress(shardSpec(config.clientId, "retry", n));
+				shardRetryOutSocks += sock;
+			}
+
+			handler_retry_in_valve = new QZmq::Valve(handler_retry_in_sock, this);
+			connect(handler_retry_in_valve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(relay_retry_in_readyRead(const QList<QByteArray> &)));
+
+			handler_retry_in_valve->open();
 		}
 
-		// init zroutes
-		domainMap_changed();
+		if(!config.wsControlInSpec.isEmpty() && !config.wsControlOutSpec.isEmpty())
+		{
+			handler_ws_control_in_sock = new QZmq::Socket(QZmq::Socket::Pull, this);
+
+			handler_ws_control_in_sock->setHwm(DEFAULT_HWM);
+
+			if(!handler_ws_control_in_sock->bind(config.wsControlInSpec))
+			{
+				log_error("unable to bind to handler_ws_control_in_spec: %s", qPrintable(config.wsControlInSpec));
+				return false;
+			}
+
+			handler_ws_control_out_sock = new QZmq::Socket(QZmq::Socket::Push, this);
+
+			handler_ws_control_out_sock->setHwm(DEFAULT_HWM);
+			handler_ws_control_out_sock->setShutdownWaitTime(0);
+
+			if(!handler_ws_control_out_sock->bind(config.wsControlOutSpec))
+			{
+				log_error("unable to bind to handler_ws_control_out_spec: %s", qPrintable(config.wsControlOutSpec));
+				return false;
+			}
+
+			for(int n = 0; n < shards.count(); ++n)
+			{
+				QZmq::Socket *sock = new QZmq::Socket(QZmq::Socket::Push, this);
+				sock->setHwm(DEFAULT_HWM);
+				sock->setShutdownWaitTime(0);
+				sock->connectToAddress(shardSpec(config.clientId, "ws-control-in", n));
+				shardWsControlInSocks += sock;
+
+				sock = new QZmq::Socket(QZmq::Socket::Pull, this);
+				sock->setHwm(DEFAULT_HWM);
+				connect(sock, SIGNAL(readyRead()), SLOT(relay_ws_control_out_readyRead()));
+				sock->connectToAddress(shardSpec(config.clientId, "ws-control-out", n));
+				shardWsControlOutSocks += sock;
+			}
+
+			handler_ws_control_in_valve = new QZmq::Valve(handler_ws_control_in_sock, this);
+			connect(handler_ws_control_in_valve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(relay_ws_control_in_readyRead(const QList<QByteArray> &)));
+
+			handler_ws_control_in_valve->open();
+		}
+
+		if(!config.commandSpec.isEmpty())
+		{
+			if(!setupCommand())
+				return false;
+		}
 
 		return true;
 	}
 
+	// pass zrpc requests from the workers to the handler and responses
+	//   back. the router envelope finds the originating worker again
+	bool setupRpcRelay(const QString &spec, const char *name)
+	{
+		QZmq::Socket *outSock = new QZmq::Socket(QZmq::Socket::Dealer, this);
+
+		outSock->setHwm(DEFAULT_HWM);
+		outSock->setShutdownWaitTime(0);
+
+		if(!outSock->bind(spec))
+		{
+			log_error("unable to bind to handler_%s_spec: %s", name, qPrintable(spec));
+			return false;
+		}
+
+		QZmq::Socket *inSock = new QZmq::Socket(QZmq::Socket::Router, this);
+
+		inSock->setHwm(DEFAULT_HWM);
+		inSock->setShutdownWaitTime(0);
+
+		for(int n = 0; n < shards.count(); ++n)
+			inSock->connectToAddress(shardSpec(config.clientId, name, n));
+
+		connect(inSock, SIGNAL(readyRead()), SLOT(relay_readyRead()));
+		connect(outSock, SIGNAL(readyRead()), SLOT(relay_readyRead()));
+
+		relayPeers.insert(inSock, outSock);
+		relayPeers.insert(outSock, inSock);
+
+		return true;
+	}
+
+	int shardForRid(const QPair<QByteArray, QByteArray> &rid) const
+	{
+		return (int)(qHash(rid) % (uint)shards.count());
+	}
+
 	void reload()
 	{
 		domainMap->reload();
 	}
 
+	ProxySession *createProxySession(const DomainMap::Entry &route)
+	{
+		ProxySession *ps = new ProxySession(zroutes, accept, this);
+		connect(ps, SIGNAL(addNotAllowed()), SLOT(ps_addNotAllowed()));
+		connect(ps, SIGNAL(finished()), SLOT(ps_finished()));
+		connect(ps, SIGNAL(requestSessionDestroyed(RequestSession *, bool)), SLOT(ps_requestSessionDestroyed(RequestSession *, bool)));
+
+		ps->setRoute(route);
+		ps->setDefaultSigKey(config.sigIss, config.sigKey);
+		ps->setDefaultUpstreamKey(config.upstreamKey);
+		ps->setXffRules(config.xffUntrustedRule, config.xffTrustedRule);
+		ps->setHeaderRewrite(headerRewrite);
+		ps->setMetrics(metrics);
+
+		ProxyItem *i = new ProxyItem;
+		i->ps = ps;
+		proxyItemsBySession.insert(i->ps, i);
+
+		return ps;
+	}
+
+	void removeProxySession(ProxySession *ps)
+	{
+		ProxyItem *i = proxyItemsBySession.value(ps);
+		assert(i);
+
+		if(i->shared)
+			proxyItemsByKey.remove(i->key);
+		proxyItemsBySession.remove(i->ps);
+		delete i;
+		delete ps;
+	}
+
+	// drop an unused speculative upstream request, if any
+	void cancelSpeculation(RequestSession *rs)
+	{
+		ProxySession *ps = speculativeSessions.take(rs);
+		if(ps)
+		{
+			log_debug("cancelling speculative proxysession for id=%s", rs->rid().second.data());
+			removeProxySession(ps);
+		}
+	}
+
 	void doProxy(RequestSession *rs, const InspectData *idata = 0, bool isRetry = false)
 	{
 		DomainMap::Entry route = rs->route();
@@ -294,31 +716,35 @@ public:
 				ps = i->ps;
 		}
 
-		if(!ps)
+		// the speculative request went out without the session headers
+		//   and can't serve a request that joins an existing share
+		ProxySession *sps = speculativeSessions.take(rs);
+		if(sps && (ps || !sps->canAttachSpeculative() || (idata && (!idata->sid.isEmpty() || !idata->lastIds.isEmpty()))))
 		{
-			log_debug("creating proxysession for id=%s", rs->rid().second.data());
-
-			ps = new ProxySession(zroutes, accept, this);
-			connect(ps, SIGNAL(addNotAllowed()), SLOT(ps_addNotAllowed()));
-			connect(ps, SIGNAL(finished()), SLOT(ps_finished()));
-			connect(ps, SIGNAL(requestSessionDestroyed(RequestSession *, bool)), SLOT(ps_requestSessionDestroyed(RequestSession *, bool)));
+			log_debug("discarding speculative proxysession for id=%s", rs->rid().second.data());
+			removeProxySession(sps);
+			sps = 0;
+		}
 
-			ps->setRoute(route);
-			ps->setDefaultSigKey(config.sigIss, config.sigKey);
-			ps->setDefaultUpstreamKey(config.upstreamKey);
-			ps->setUseXForwardedProtocol(config.useXForwardedProtocol);
-			ps->setXffRules(config.xffUntrustedRule, config.xffTrustedRule);
-			ps->setOrigHeadersNeedMark(config.origHeadersNeedMark);
+		if(!ps)
+		{
+			if(sps)
+			{
+				log_debug("using speculative proxysession for id=%s", rs->rid().second.data());
+				ps = sps;
+			}
+			else
+			{
+				log_debug("creating proxysession for id=%s", rs->rid().second.data());
+				ps = createProxySession(route);
+			}
 
 			if(idata)
 				ps->setInspectData(*idata);
 
-			ProxyItem *i = new ProxyItem;
-			i->ps = ps;
-			proxyItemsBySession.insert(i->ps, i);
-
 			if(sharable)
 			{
+				ProxyItem *i = proxyItemsBySession.value(ps);
 				i->shared = true;
 				i->key = idata->sharingKey;
 				proxyItemsByKey.insert(i->key, i);
@@ -353,6 +779,80 @@ public:
 		return true;
 	}
 
+	RequestSession *createRequestSession()
+	{
+		RequestSession *rs = new RequestSession(domainMap, inspect, inspectChecker, accept, this);
+		connect(rs, SIGNAL(inspected(const InspectData &)), SLOT(rs_inspected(const InspectData &)));
+		connect(rs, SIGNAL(inspectError()), SLOT(rs_inspectError()));
+		connect(rs, SIGNAL(speculate()), SLOT(rs_speculate()));
+		connect(rs, SIGNAL(finished()), SLOT(rs_finished()));
+		connect(rs, SIGNAL(finishedByAccept()), SLOT(rs_finishedByAccept()));
+
+		rs->setAutoCrossOrigin(config.autoCrossOrigin);
+		rs->setInspectCache(inspectCache);
+		rs->setMetrics(metrics);
+
+		requestSessions += rs;
+
+		return rs;
+	}
+
+	void startLimitedRequest(ZhttpRequest *req, const QByteArray &routeId)
+	{
+		RouteQueue *rq = routeQueues.value(routeId);
+		++(rq->active);
+
+		RequestSession *rs = createRequestSession();
+		routeLimitedSessions.insert(rs, routeId);
+		rs->start(req);
+	}
+
+	void releaseRouteSlot(RequestSession *rs)
+	{
+		if(!routeLimitedSessions.contains(rs))
+			return;
+
+		QByteArray routeId = routeLimitedSessions.take(rs);
+		RouteQueue *rq = routeQueues.value(routeId);
+		assert(rq && rq->active > 0);
+		--(rq->active);
+
+		if(rq->active == 0 && rq->pending.isEmpty())
+		{
+			routeQueues.remove(routeId);
+			delete rq;
+		}
+	}
+
+	// admit waiting requests, taking turns between routes
+	void tryTakeQueued()
+	{
+		int skipped = 0;
+		while(skipped < waitingRoutes.count() && canTake())
+		{
+			QByteArray routeId = waitingRoutes.takeFirst();
+			RouteQueue *rq = routeQueues.value(routeId);
+
+			if(rq->active < rq->maxConns)
+			{
+				ZhttpRequest *req = rq->pending.takeFirst();
+				req->disconnect(this);
+				queuedRequests.remove(req);
+
+				if(stats)
+					stats->addRouteQueueCounts(routeId, -1, 0);
+
+				startLimitedRequest(req, routeId);
+				skipped = 0;
+			}
+			else
+				++skipped;
+
+			if(!rq->pending.isEmpty())
+				waitingRoutes += routeId;
+		}
+	}
+
 	void tryTakeRequest()
 	{
 		if(!canTake())
@@ -362,16 +862,55 @@ public:
 		if(!req)
 			return;
 
-		RequestSession *rs = new RequestSession(domainMap, inspect, inspectChecker, accept, this);
-		connect(rs, SIGNAL(inspected(const InspectData &)), SLOT(rs_inspected(const InspectData &)));
-		connect(rs, SIGNAL(inspectError()), SLOT(rs_inspectError()));
-		connect(rs, SIGNAL(finished()), SLOT(rs_finished()));
-		connect(rs, SIGNAL(finishedByAccept()), SLOT(rs_finishedByAccept()));
+		QUrl uri = req->requestUri();
+		DomainMap::Entry route = domainMap->entry(DomainMap::Http, uri.scheme() == "https", uri.host(), uri.encodedPath());
+		if(route.maxConns > 0)
+		{
+			RouteQueue *rq = routeQueues.value(route.id);
+			if(!rq)
+			{
+				rq = new RouteQueue;
+				routeQueues.insert(route.id, rq);
+			}
 
-		rs->setAutoCrossOrigin(config.autoCrossOrigin);
+			// limits follow the routes file as requests arrive
+			rq->maxConns = route.maxConns;
+			rq->maxPending = route.maxPending;
 
-		requestSessions += rs;
+			if(rq->active >= rq->maxConns || !rq->pending.isEmpty())
+			{
+				if(rq->pending.count() < rq->maxPending)
+				{
+					log_debug("queueing request for route %s", route.id.data());
 
+					connect(req, SIGNAL(error()), SLOT(queuedRequest_error()));
+					rq->pending += req;
+					queuedRequests.insert(req, route.id);
+					if(rq->pending.count() == 1)
+						waitingRoutes += route.id;
+
+					if(stats)
+						stats->addRouteQueueCounts(route.id, 1, 0);
+				}
+				else
+				{
+					log_debug("rejecting request for route %s, too many pending", route.id.data());
+
+					RequestSession *rs = createRequestSession();
+					rs->startError(req, 503, "Service Unavailable", "Too many requests for this route.");
+
+					if(stats)
+						stats->addRouteQueueCounts(route.id, 0, 1);
+				}
+
+				return;
+			}
+
+			startLimitedRequest(req, route.id);
+			return;
+		}
+
+		RequestSession *rs = createRequestSession();
 		rs->start(req);
 	}
 
@@ -393,9 +932,9 @@ public:
 
 		ps->setDefaultSigKey(config.sigIss, config.sigKey);
 		ps->setDefaultUpstreamKey(config.upstreamKey);
-		ps->setUseXForwardedProtocol(config.useXForwardedProtocol);
 		ps->setXffRules(config.xffUntrustedRule, config.xffTrustedRule);
-		ps->setOrigHeadersNeedMark(config.origHeadersNeedMark);
+		ps->setHeaderRewrite(headerRewrite);
+		ps->setMetrics(metrics);
 
 		WsProxyItem *i = new WsProxyItem;
 		i->ps = ps;
@@ -410,10 +949,37 @@ public:
 		}
 	}
 
+	// backpressure. while intake is paused, new sessions stay queued in
+	//   the zmq socket, where other instances can pick them up
+	void updateIntake()
+	{
+		int pending = zhttpIn->serverPendingCount();
+		if(pending > intakePendingMax)
+			intakePendingMax = pending;
+
+		if(!zhttpIn->isServerInPaused())
+		{
+			if(pending >= intakeHighWatermark)
+			{
+				log_debug("pausing intake, %d pending", pending);
+				zhttpIn->setServerInPaused(true);
+				intakePauseTime.start();
+			}
+		}
+		else if(pending <= intakeLowWatermark && canTake())
+		{
+			log_debug("resuming intake, %d pending", pending);
+			zhttpIn->setServerInPaused(false);
+			intakePausedTotal += intakePauseTime.elapsed();
+		}
+	}
+
 	void tryTakeNext()
 	{
+		tryTakeQueued();
 		tryTakeRequest();
 		tryTakeSocket();
+		updateIntake();
 	}
 
 private slots:
@@ -446,10 +1012,24 @@ private slots:
 		doProxy(rs);
 	}
 
+	void rs_speculate()
+	{
+		RequestSession *rs = (RequestSession *)sender();
+
+		log_debug("creating speculative proxysession for id=%s", rs->rid().second.data());
+
+		ProxySession *ps = createProxySession(rs->route());
+		speculativeSessions.insert(rs, ps);
+		ps->startSpeculative(rs);
+	}
+
 	void rs_finished()
 	{
 		RequestSession *rs = (RequestSession *)sender();
 
+		cancelSpeculation(rs);
+		releaseRouteSlot(rs);
+
 		if(stats)
 			stats->removeConnection(ridToString(rs->rid()), false);
 
@@ -463,6 +1043,9 @@ private slots:
 	{
 		RequestSession *rs = (RequestSession *)sender();
 
+		cancelSpeculation(rs);
+		releaseRouteSlot(rs);
+
 		if(stats)
 		{
 			// add connection so that it becomes lingerable
@@ -498,14 +1081,7 @@ private slots:
 	{
 		ProxySession *ps = (ProxySession *)sender();
 
-		ProxyItem *i = proxyItemsBySession.value(ps);
-		assert(i);
-
-		if(i->shared)
-			proxyItemsByKey.remove(i->key);
-		proxyItemsBySession.remove(i->ps);
-		delete i;
-		delete ps;
+		removeProxySession(ps);
 
 		tryTakeNext();
 	}
@@ -513,6 +1089,7 @@ private slots:
 	void ps_requestSessionDestroyed(RequestSession *rs, bool accept)
 	{
 		requestSessions.remove(rs);
+		releaseRouteSlot(rs);
 
 		if(stats)
 			stats->removeConnection(ridToString(rs->rid()), accept);
@@ -520,6 +1097,32 @@ private slots:
 		tryTakeNext();
 	}
 
+	void queuedRequest_error()
+	{
+		ZhttpRequest *req = (ZhttpRequest *)sender();
+
+		QByteArray routeId = queuedRequests.take(req);
+		RouteQueue *rq = routeQueues.value(routeId);
+		assert(rq);
+
+		rq->pending.removeAll(req);
+		if(rq->pending.isEmpty())
+		{
+			waitingRoutes.removeAll(routeId);
+
+			if(rq->active == 0)
+			{
+				routeQueues.remove(routeId);
+				delete rq;
+			}
+		}
+
+		if(stats)
+			stats->addRouteQueueCounts(routeId, -1, 0);
+
+		delete req;
+	}
+
 	void wsps_finishedByPassthrough()
 	{
 		WsProxySession *ps = (WsProxySession *)sender();
@@ -591,14 +1194,31 @@ private slots:
 
 			ZhttpRequest *zhttpRequest = zhttpIn->createRequestFromState(ss);
 
-			RequestSession *rs = new RequestSession(domainMap, inspect, inspectChecker, accept, this);
-			requestSessions += rs;
+			RequestSession *rs = createRequestSession();
 
 			// note: if the routing table was changed, there's a chance the request
 			//   might get a different route id this time around. this could confuse
 			//   stats processors tracking route+connection mappings.
 			rs->startRetry(zhttpRequest, req.autoCrossOrigin, req.jsonpCallback, req.jsonpExtendedResponse);
 
+			// retries were admitted once already, so they take a route slot
+			//   without queueing, even if that briefly exceeds the limit
+			DomainMap::Entry route = rs->route();
+			if(route.maxConns > 0)
+			{
+				RouteQueue *rq = routeQueues.value(route.id);
+				if(!rq)
+				{
+					rq = new RouteQueue;
+					rq->maxConns = route.maxConns;
+					rq->maxPending = route.maxPending;
+					routeQueues.insert(route.id, rq);
+				}
+
+				++(rq->active);
+				routeLimitedSessions.insert(rs, route.id);
+			}
+
 			doProxy(rs, p.haveInspectInfo ? &idata : 0, true);
 		}
 	}
@@ -653,6 +1273,53 @@ private slots:
 
 			req->respond(out);
 		}
+		else if(req->method() == "metrics")
+		{
+			if(!stats)
+			{
+				req->respondError("service-unavailable");
+				delete req;
+				return;
+			}
+
+			// workers hand over their counts every STATS_INTERVAL, so
+			//   theirs may lag. ours can be included right away
+			flushMetrics();
+
+			req->respond(stats->metrics());
+		}
+		else if(req->method() == "traces")
+		{
+			if(!Tracer::isEnabled())
+			{
+				req->respondError("service-unavailable");
+				delete req;
+				return;
+			}
+
+			int max = -1;
+
+			QVariantHash args = req->args();
+			if(args.contains("max"))
+			{
+				if(!args["max"].canConvert(QVariant::Int))
+				{
+					req->respondError("bad-format");
+					delete req;
+					return;
+				}
+
+				max = args["max"].toInt();
+			}
+
+			// traces from all workers share the same buffer
+			req->respond(Tracer::recent(max));
+		}
+		else if(req->method() == "objects")
+		{
+			// counts are process-wide, so they include all workers
+			req->respond(ObjectCounter::report());
+		}
 		else
 		{
 			req->respondError("method-not-found");
@@ -665,9 +1332,168 @@ private slots:
 	{
 		// connect to new zhttp targets, disconnect from old
 		zroutes->setup(domainMap->zhttpRoutes());
+
+		// cached results may no longer apply to the new routes
+		if(inspectCache)
+			inspectCache->clear();
+	}
+
+	void stats_timeout()
+	{
+		if(inspectCache)
+		{
+			int hits, misses;
+			inspectCache->takeCounts(&hits, &misses);
+
+			if(hits > 0 || misses > 0)
+				stats->addInspectCacheCounts(hits, misses);
+		}
+
+		qint64 pausedTime = intakePausedTotal;
+		if(zhttpIn->isServerInPaused())
+			pausedTime += intakePauseTime.restart();
+		intakePausedTotal = 0;
+
+		if(intakePendingMax > 0 || pausedTime > 0)
+			stats->addIntakeCounts(intakePendingMax, (int)pausedTime);
+
+		intakePendingMax = zhttpIn->serverPendingCount();
+
+		flushMetrics();
+	}
+
+	void flushMetrics()
+	{
+		if(metrics && !metrics->isEmpty())
+		{
+			stats->addMetrics(metrics->toVariant());
+			metrics->clear();
+		}
+	}
+
+	void relay_readyRead()
+	{
+		QZmq::Socket *sock = (QZmq::Socket *)sender();
+		QZmq::Socket *peer = relayPeers.value(sock);
+		assert(peer);
+
+		while(sock->canRead())
+			peer->write(sock->read());
+	}
+
+	void relay_retry_in_readyRead(const QList<QByteArray> &message)
+	{
+		// all requests of a retry packet belong to the same session, so
+		//   pick the worker based on the first one. anything we can't
+		//   parse is passed to the first worker, which will log it
+		int index = 0;
+
+		if(message.count() == 1)
+		{
+			bool ok;
+			QVariant data = TnetString::toVariant(message[0], 0, &ok);
+
+			RetryRequestPacket p;
+			if(ok && p.fromVariant(data) && !p.requests.isEmpty())
+				index = shardForRid(p.requests.first().rid);
+		}
+
+		shardRetryOutSocks[index]->write(message);
+	}
+
+	void relay_ws_control_in_readyRead(const QList<QByteArray> &message)
+	{
+		if(message.count() != 1)
+		{
+			log_warning("wscontrol: received message with parts != 1, skipping");
+			return;
+		}
+
+		QVariant data = TnetString::toVariant(message[0]);
+		if(data.isNull())
+		{
+			log_warning("wscontrol: received message with invalid format (tnetstring parse failed), skipping");
+			return;
+		}
+
+		WsControlPacket p;
+		if(!p.fromVariant(data))
+		{
+			log_warning("wscontrol: received message with invalid format (parse failed), skipping");
+			return;
+		}
+
+		// items for unknown connections go to the first worker, which
+		//   will respond with cancel
+		QHash<int, WsControlPacket> packetsByShard;
+		foreach(const WsControlPacket::Item &i, p.items)
+			packetsByShard[shardsByCid.value(i.cid)].items += i;
+
+		if(packetsByShard.count() == 1)
+		{
+			// common case, send as-is
+			shardWsControlInSocks[packetsByShard.keys().first()]->write(message);
+			return;
+		}
+
+		QHashIterator<int, WsControlPacket> it(packetsByShard);
+		while(it.hasNext())
+		{
+			it.next();
+			shardWsControlInSocks[it.key()]->write(QList<QByteArray>() << TnetString::fromVariant(it.value().toVariant()));
+		}
+	}
+
+	void relay_ws_control_out_readyRead()
+	{
+		QZmq::Socket *sock = (QZmq::Socket *)sender();
+		int index = shardWsControlOutSocks.indexOf(sock);
+		assert(index != -1);
+
+		while(sock->canRead())
+		{
+			QList<QByteArray> message = sock->read();
+
+			// learn which worker owns each connection id
+			if(message.count() == 1)
+			{
+				QVariant data = TnetString::toVariant(message[0]);
+
+				WsControlPacket p;
+				if(!data.isNull() && p.fromVariant(data))
+				{
+					foreach(const WsControlPacket::Item &i, p.items)
+					{
+						if(i.type == WsControlPacket::Item::Here)
+							shardsByCid[i.cid] = index;
+						else if(i.type == WsControlPacket::Item::Gone)
+							shardsByCid.remove(i.cid);
+					}
+				}
+			}
+
+			handler_ws_control_out_sock->write(message);
+		}
 	}
 };
 
+void Engine::Shard::run()
+{
+	Engine *engine = new Engine;
+	bool ok = engine->d->start(config, domainMap, stats);
+
+	{
+		QMutexLocker locker(&m);
+		started = ok;
+		w.wakeOne();
+	}
+
+	if(ok)
+		exec();
+
+	delete engine;
+}
+
 Engine::Engine(QObject *parent) :
 	QObject(parent)
 {
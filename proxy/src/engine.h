@@ -46,8 +46,13 @@ public:
 		QString wsControlOutSpec;
 		QString statsSpec;
 		QString commandSpec;
+		int workers;
 		int maxWorkers;
+		int intakeHighWatermark;
+		int intakeLowWatermark;
 		int inspectTimeout;
+		int inspectCacheSize;
+		QList<QByteArray> inspectCacheHeaders;
 		QString routesFile;
 		bool autoCrossOrigin;
 		bool useXForwardedProtocol;
@@ -59,8 +64,12 @@ public:
 		QByteArray upstreamKey;
 
 		Configuration() :
+			workers(1),
 			maxWorkers(-1),
+			intakeHighWatermark(0),
+			intakeLowWatermark(0),
 			inspectTimeout(8000),
+			inspectCacheSize(0),
 			autoCrossOrigin(false),
 			useXForwardedProtocol(false)
 		{
@@ -75,7 +84,11 @@ public:
 
 private:
 	class Private;
+	friend class Private;
 	Private *d;
+
+	class Shard;
+	friend class Shard;
 };
 
 #endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "headerrewrite.h"
+
+#define ORIG_PREFIX "eb9bf0f5-"
+#define ORIG_PREFIX_SIZE 9
+
+HeaderRewrite::HeaderRewrite() :
+	useXfp(false)
+{
+	compile(QList<QByteArray>());
+}
+
+HeaderRewrite::HeaderRewrite(const QList<QByteArray> &origHeadersNeedMark, bool useXForwardedProtocol) :
+	useXfp(useXForwardedProtocol)
+{
+	compile(origHeadersNeedMark);
+}
+
+void HeaderRewrite::compile(const QList<QByteArray> &origHeadersNeedMark)
+{
+	// don't relay these headers. their meaning is handled by
+	//   mongrel2 and they only apply to the incoming hop.
+	addRule("Connection", Drop);
+	addRule("Keep-Alive", Drop);
+	addRule("Accept-Encoding", Drop);
+	addRule("Content-Encoding", Drop);
+	addRule("Transfer-Encoding", Drop);
+	addRule("Expect", Drop);
+
+	// the caller sets these
+	addRule("Host", Drop);
+	if(useXfp)
+		addRule("X-Forwarded-Protocol", Drop);
+
+	addRule("X-Forwarded-For", ForwardedFor);
+
+	foreach(const QByteArray &name, origHeadersNeedMark)
+		addRule(name, NoMark);
+}
+
+void HeaderRewrite::addRule(const QByteArray &name, int flags)
+{
+	if(name.size() >= rulesByLength.size())
+		rulesByLength.resize(name.size() + 1);
+
+	QList<Rule> &rules = rulesByLength[name.size()];
+	for(int n = 0; n < rules.count(); ++n)
+	{
+		if(qstricmp(rules[n].name.data(), name.data()) == 0)
+		{
+			rules[n].flags |= flags;
+			return;
+		}
+	}
+
+	Rule r;
+	r.name = name;
+	r.flags = flags;
+	rules += r;
+}
+
+int HeaderRewrite::flagsFor(const QByteArray &name) const
+{
+	if(name.size() >= rulesByLength.size())
+		return 0;
+
+	const QList<Rule> &rules = rulesByLength[name.size()];
+	for(int n = 0; n < rules.count(); ++n)
+	{
+		if(qstricmp(rules[n].name.data(), name.data()) == 0)
+			return rules[n].flags;
+	}
+
+	return 0;
+}
+
+void HeaderRewrite::apply(const HttpHeaders &in, bool origHeaders, bool trustedClient, HttpHeaders *out, HttpHeaders *xff) const
+{
+	// copy headers to include magic prefix, so that the original
+	//   headers may be recovered later. if the client is trusted,
+	//   then we assume this has been done already.
+	bool mark = (origHeaders && !trustedClient);
+
+	HttpHeaders marked;
+	if(mark)
+		marked.reserve(in.count());
+
+	// room for the headers the caller appends
+	out->reserve(in.count() * (mark ? 2 : 1) + 8);
+
+	for(int n = 0; n < in.count(); ++n)
+	{
+		const HttpHeader &h = in[n];
+
+		if(qstrnicmp(h.first.data(), ORIG_PREFIX, ORIG_PREFIX_SIZE) == 0)
+		{
+			// if it's already marked, take it and put it with the others
+			//   at the end. if we don't want original headers, then
+			//   filter them out before proxying
+			if(mark)
+				marked += h;
+			else if(origHeaders)
+				*out += h;
+
+			continue;
+		}
+
+		int flags = flagsFor(h.first);
+
+		if(mark && !(flags & NoMark))
+			marked += HttpHeader(ORIG_PREFIX + h.first, h.second);
+
+		if(flags & Drop)
+			continue;
+
+		if(flags & ForwardedFor)
+		{
+			*xff += h;
+			continue;
+		}
+
+		if(!trustedClient && qstrnicmp(h.first.data(), "Grip-", 5) == 0)
+			continue;
+
+		*out += h;
+	}
+
+	if(mark)
+		*out += marked;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HEADERREWRITE_H
+#define HEADERREWRITE_H
+
+#include <QList>
+#include <QVector>
+#include "httpheaders.h"
+
+// request header rules compiled from the proxy config. a program is built
+//   once and shared by all sessions, and applying it makes one pass over
+//   the incoming headers, without removing anything in place
+
+class HeaderRewrite
+{
+public:
+	HeaderRewrite();
+	HeaderRewrite(const QList<QByteArray> &origHeadersNeedMark, bool useXForwardedProtocol);
+
+	bool useXForwardedProtocol() const { return useXfp; }
+
+	// copies in to out, leaving out hop-by-hop headers and Host. Grip-
+	//   headers are left out unless the client is trusted. X-Forwarded-For
+	//   headers are moved to xff. if origHeaders is set and the client is
+	//   not trusted, marked copies of the original headers are appended.
+	//   if origHeaders is not set, marked headers are left out
+	void apply(const HttpHeaders &in, bool origHeaders, bool trustedClient, HttpHeaders *out, HttpHeaders *xff) const;
+
+private:
+	enum Flag
+	{
+		Drop = 0x01,
+		ForwardedFor = 0x02,
+		NoMark = 0x04
+	};
+
+	class Rule
+	{
+	public:
+		QByteArray name;
+		int flags;
+
+		Rule() :
+			flags(0)
+		{
+		}
+	};
+
+	// rules bucketed by name length, so lookups compare against only
+	//   a few names and never allocate
+	QVector<QList<Rule> > rulesByLength;
+	bool useXfp;
+
+	void compile(const QList<QByteArray> &origHeadersNeedMark);
+	void addRule(const QByteArray &name, int flags);
+	int flagsFor(const QByteArray &name) const;
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "histogram.h"
+
+#include <string.h>
+
+Histogram::Histogram()
+{
+	clear();
+}
+
+void Histogram::add(const Histogram &other)
+{
+	if(other.total == 0)
+		return;
+
+	for(int n = 0; n < BucketCount; ++n)
+		counts[n] += other.counts[n];
+
+	if(total == 0 || other.valueMin < valueMin)
+		valueMin = other.valueMin;
+	if(other.valueMax > valueMax)
+		valueMax = other.valueMax;
+
+	total += other.total;
+	valueSum += other.valueSum;
+}
+
+void Histogram::clear()
+{
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+	valueSum = 0;
+	valueMin = 0;
+	valueMax = 0;
+}
+
+qint64 Histogram::percentile(double p) const
+{
+	if(total == 0)
+		return 0;
+
+	qint64 rank = (qint64)((p / 100.0) * total + 0.5);
+	if(rank < 1)
+		rank = 1;
+
+	qint64 seen = 0;
+	for(int n = 0; n < BucketCount; ++n)
+	{
+		seen += counts[n];
+		if(seen >= rank)
+			return qBound(valueMin, bucketLowerBound(n), valueMax);
+	}
+
+	return valueMax;
+}
+
+qint64 Histogram::bucketLowerBound(int index)
+{
+	if(index < SubBuckets)
+		return index;
+
+	int bits = (index / SubBuckets) + SubBucketBits - 1;
+	int sub = index % SubBuckets;
+	return ((qint64)(SubBuckets + sub)) << (bits - SubBucketBits);
+}
+
+QVariant Histogram::toVariant() const
+{
+	QVariantHash obj;
+	obj["count"] = total;
+	obj["sum"] = valueSum;
+	obj["min"] = valueMin;
+	obj["max"] = valueMax;
+	obj["p50"] = percentile(50);
+	obj["p90"] = percentile(90);
+	obj["p99"] = percentile(99);
+
+	// sparse list of [lower bound, count] pairs
+	QVariantList vbuckets;
+	for(int n = 0; n < BucketCount; ++n)
+	{
+		if(counts[n] == 0)
+			continue;
+
+		QVariantList b;
+		b += bucketLowerBound(n);
+		b += (qint64)counts[n];
+		vbuckets += QVariant(b);
+	}
+
+	obj["buckets"] = vbuckets;
+
+	return obj;
+}
+
+bool Histogram::fromVariant(const QVariant &in)
+{
+	if(in.type() != QVariant::Hash)
+		return false;
+
+	QVariantHash obj = in.toHash();
+
+	if(!obj.contains("count") || !obj["count"].canConvert(QVariant::LongLong))
+		return false;
+
+	if(!obj.contains("buckets") || obj["buckets"].type() != QVariant::List)
+		return false;
+
+	clear();
+
+	foreach(const QVariant &vb, obj["buckets"].toList())
+	{
+		if(vb.type() != QVariant::List)
+			return false;
+
+		QVariantList b = vb.toList();
+		if(b.count() != 2)
+			return false;
+
+		qint64 lowerBound = b[0].toLongLong();
+		qint64 count = b[1].toLongLong();
+		if(lowerBound < 0 || count < 0)
+			return false;
+
+		counts[bucketIndex(lowerBound)] += (quint64)count;
+	}
+
+	total = obj["count"].toLongLong();
+	valueSum = obj.value("sum").toLongLong();
+	valueMin = obj.value("min").toLongLong();
+	valueMax = obj.value("max").toLongLong();
+
+	return true;
+}
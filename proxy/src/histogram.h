@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <QtGlobal>
+#include <QVariant>
+
+// log-linear histogram of non-negative values. each power of two is split
+//   into SubBuckets linear buckets, so values are kept to within about 12%.
+//   the bucket layout is fixed, which makes histograms mergeable by adding
+//   counts. counts are 64-bit so that long-lived totals can't wrap.
+//   recording is a handful of instructions and never allocates. not
+//   thread-safe
+
+class Histogram
+{
+public:
+	enum
+	{
+		SubBucketBits = 3,
+		SubBuckets = 1 << SubBucketBits,
+		MaxBits = 40, // larger values are counted in the last bucket
+		BucketCount = (MaxBits - SubBucketBits + 1) * SubBuckets
+	};
+
+	Histogram();
+
+	bool isEmpty() const { return total == 0; }
+	qint64 count() const { return total; }
+	qint64 sum() const { return valueSum; }
+	qint64 min() const { return valueMin; }
+	qint64 max() const { return valueMax; }
+
+	inline void record(qint64 value)
+	{
+		if(value < 0)
+			value = 0;
+
+		++counts[bucketIndex(value)];
+		++total;
+		valueSum += value;
+		if(value < valueMin || total == 1)
+			valueMin = value;
+		if(value > valueMax)
+			valueMax = value;
+	}
+
+	void add(const Histogram &other);
+	void clear();
+
+	// lower bound of the bucket holding the value at percentile p (0-100)
+	qint64 percentile(double p) const;
+
+	QVariant toVariant() const;
+	bool fromVariant(const QVariant &in);
+
+	static inline int bucketIndex(qint64 value)
+	{
+		if(value < SubBuckets)
+			return (int)value;
+
+		int bits = highestBit(value);
+		if(bits >= MaxBits)
+			return BucketCount - 1;
+
+		int sub = (int)(value >> (bits - SubBucketBits)) - SubBuckets;
+		return (bits - SubBucketBits + 1) * SubBuckets + sub;
+	}
+
+	static qint64 bucketLowerBound(int index);
+
+private:
+	quint64 counts[BucketCount];
+	qint64 total;
+	qint64 valueSum;
+	qint64 valueMin;
+	qint64 valueMax;
+
+	static inline int highestBit(qint64 value)
+	{
+#if defined(__GNUC__)
+		return 63 - __builtin_clzll((unsigned long long)value);
+#else
+		int n = 0;
+		while(value >>= 1)
+			++n;
+		return n;
+#endif
+	}
+};
+
+#endif
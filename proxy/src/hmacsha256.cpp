@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "hmacsha256.h"
+
+#include <string.h>
+
+static const quint32 round_constants[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline quint32 rotr(quint32 x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256()
+{
+	reset();
+}
+
+void Sha256::reset()
+{
+	h[0] = 0x6a09e667;
+	h[1] = 0xbb67ae85;
+	h[2] = 0x3c6ef372;
+	h[3] = 0xa54ff53a;
+	h[4] = 0x510e527f;
+	h[5] = 0x9b05688c;
+	h[6] = 0x1f83d9ab;
+	h[7] = 0x5be0cd19;
+	length = 0;
+	bufSize = 0;
+}
+
+void Sha256::compress(const unsigned char *block)
+{
+	quint32 w[64];
+	for(int n = 0; n < 16; ++n)
+	{
+		const unsigned char *p = block + (n * 4);
+		w[n] = ((quint32)p[0] << 24) | ((quint32)p[1] << 16) | ((quint32)p[2] << 8) | (quint32)p[3];
+	}
+
+	for(int n = 16; n < 64; ++n)
+	{
+		quint32 s0 = rotr(w[n - 15], 7) ^ rotr(w[n - 15], 18) ^ (w[n - 15] >> 3);
+		quint32 s1 = rotr(w[n - 2], 17) ^ rotr(w[n - 2], 19) ^ (w[n - 2] >> 10);
+		w[n] = w[n - 16] + s0 + w[n - 7] + s1;
+	}
+
+	quint32 a = h[0];
+	quint32 b = h[1];
+	quint32 c = h[2];
+	quint32 d = h[3];
+	quint32 e = h[4];
+	quint32 f = h[5];
+	quint32 g = h[6];
+	quint32 hh = h[7];
+
+	for(int n = 0; n < 64; ++n)
+	{
+		quint32 s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+		quint32 ch = (e & f) ^ (~e & g);
+		quint32 t1 = hh + s1 + ch + round_constants[n] + w[n];
+		quint32 s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+		quint32 maj = (a & b) ^ (a & c) ^ (b & c);
+		quint32 t2 = s0 + maj;
+
+		hh = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += hh;
+}
+
+void Sha256::update(const char *data, int size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	length += size;
+
+	if(bufSize > 0)
+	{
+		int take = qMin(size, (int)BlockSize - bufSize);
+		memcpy(buf + bufSize, p, take);
+		bufSize += take;
+		p += take;
+		size -= take;
+
+		if(bufSize < BlockSize)
+			return;
+
+		compress(buf);
+		bufSize = 0;
+	}
+
+	// whole blocks are hashed straight from the input
+	while(size >= BlockSize)
+	{
+		compress(p);
+		p += BlockSize;
+		size -= BlockSize;
+	}
+
+	if(size > 0)
+	{
+		memcpy(buf, p, size);
+		bufSize = size;
+	}
+}
+
+void Sha256::result(unsigned char *out)
+{
+	quint64 bits = length * 8;
+
+	buf[bufSize++] = 0x80;
+	if(bufSize > BlockSize - 8)
+	{
+		memset(buf + bufSize, 0, BlockSize - bufSize);
+		compress(buf);
+		bufSize = 0;
+	}
+
+	memset(buf + bufSize, 0, BlockSize - 8 - bufSize);
+	for(int n = 0; n < 8; ++n)
+		buf[BlockSize - 1 - n] = (unsigned char)(bits >> (n * 8));
+	compress(buf);
+	bufSize = 0;
+
+	for(int n = 0; n < 8; ++n)
+	{
+		out[n * 4] = (unsigned char)(h[n] >> 24);
+		out[n * 4 + 1] = (unsigned char)(h[n] >> 16);
+		out[n * 4 + 2] = (unsigned char)(h[n] >> 8);
+		out[n * 4 + 3] = (unsigned char)h[n];
+	}
+}
+
+QByteArray Sha256::result()
+{
+	QByteArray out(DigestSize, 0);
+	result((unsigned char *)out.data());
+	return out;
+}
+
+HmacSha256::HmacSha256()
+{
+	setKey(QByteArray());
+}
+
+HmacSha256::HmacSha256(const QByteArray &key)
+{
+	setKey(key);
+}
+
+void HmacSha256::setKey(const QByteArray &key)
+{
+	unsigned char k0[Sha256::BlockSize];
+	memset(k0, 0, sizeof(k0));
+
+	if(key.size() > Sha256::BlockSize)
+	{
+		Sha256 hash;
+		hash.update(key);
+		hash.result(k0);
+	}
+	else
+		memcpy(k0, key.constData(), key.size());
+
+	char pad[Sha256::BlockSize];
+
+	for(int n = 0; n < Sha256::BlockSize; ++n)
+		pad[n] = (char)(k0[n] ^ 0x36);
+	inner.reset();
+	inner.update(pad, Sha256::BlockSize);
+
+	for(int n = 0; n < Sha256::BlockSize; ++n)
+		pad[n] = (char)(k0[n] ^ 0x5c);
+	outer.reset();
+	outer.update(pad, Sha256::BlockSize);
+}
+
+void HmacSha256::sign(const char *data, int size, unsigned char *out) const
+{
+	unsigned char innerDigest[Sha256::DigestSize];
+
+	Sha256 hash = inner;
+	hash.update(data, size);
+	hash.result(innerDigest);
+
+	hash = outer;
+	hash.update((const char *)innerDigest, Sha256::DigestSize);
+	hash.result(out);
+}
+
+QByteArray HmacSha256::sign(const QByteArray &data) const
+{
+	QByteArray out(Sha256::DigestSize, 0);
+	sign(data.constData(), data.size(), (unsigned char *)out.data());
+	return out;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HMACSHA256_H
+#define HMACSHA256_H
+
+#include <QByteArray>
+
+// self-contained sha256 and hmac-sha256, so that token signing does not
+//   need to go through qca and its provider lookup
+
+class Sha256
+{
+public:
+	enum
+	{
+		BlockSize = 64,
+		DigestSize = 32
+	};
+
+	Sha256();
+
+	void reset();
+	void update(const char *data, int size);
+	void update(const QByteArray &data) { update(data.constData(), data.size()); }
+
+	// writes DigestSize bytes to out. the object must be reset before reuse
+	void result(unsigned char *out);
+	QByteArray result();
+
+private:
+	quint32 h[8];
+	quint64 length;
+	unsigned char buf[BlockSize];
+	int bufSize;
+
+	void compress(const unsigned char *block);
+};
+
+// the key is absorbed into the inner and outer hash states once, so each
+//   signature costs only the hashing of the message plus one block
+class HmacSha256
+{
+public:
+	HmacSha256();
+	explicit HmacSha256(const QByteArray &key);
+
+	void setKey(const QByteArray &key);
+
+	void sign(const char *data, int size, unsigned char *out) const;
+	QByteArray sign(const QByteArray &data) const;
+
+private:
+	Sha256 inner;
+	Sha256 outer;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "httpextension.h"
+
+static int findNext(const QByteArray &in, const char *charList, int start = 0)
+{
+	int len = qstrlen(charList);
+	for(int n = start; n < in.size(); ++n)
+	{
+		char c = in[n];
+		for(int i = 0; i < len; ++i)
+		{
+			if(c == charList[i])
+				return n;
+		}
+	}
+
+	return -1;
+}
+
+QHash<QByteArray, QByteArray> parseParams(const QByteArray &in, bool *ok)
+{
+	QHash<QByteArray, QByteArray> out;
+
+	int start = 0;
+	while(start < in.size())
+	{
+		QByteArray var;
+		QByteArray val;
+
+		int at = findNext(in, "=;", start);
+		if(at != -1)
+		{
+			var = in.mid(start, at - start).trimmed();
+			if(in[at] == '=')
+			{
+				if(at + 1 >= in.size())
+				{
+					if(ok)
+						*ok = false;
+					return QHash<QByteArray, QByteArray>();
+				}
+
+				++at;
+
+				if(in[at] == '\"')
+				{
+					++at;
+
+					bool complete = false;
+					for(int n = at; n < in.size(); ++n)
+					{
+						if(in[n] == '\\')
+						{
+							if(n + 1 >= in.size())
+							{
+								if(ok)
+									*ok = false;
+								return QHash<QByteArray, QByteArray>();
+							}
+
+							++n;
+							val += in[n];
+						}
+						else if(in[n] == '\"')
+						{
+							complete = true;
+							at = n + 1;
+							break;
+						}
+						else
+							val += in[n];
+					}
+
+					if(!complete)
+					{
+						if(ok)
+							*ok = false;
+						return QHash<QByteArray, QByteArray>();
+					}
+
+					at = in.indexOf(';', at);
+					if(at != -1)
+						start = at + 1;
+					else
+						start = in.size();
+				}
+				else
+				{
+					int vstart = at;
+					at = in.indexOf(';', vstart);
+					if(at != -1)
+					{
+						val = in.mid(vstart, at - vstart).trimmed();
+						start = at + 1;
+					}
+					else
+					{
+						val = in.mid(vstart).trimmed();
+						start = in.size();
+					}
+				}
+			}
+			else
+				start = at + 1;
+		}
+		else
+		{
+			var = in.mid(start).trimmed();
+			start = in.size();
+		}
+
+		out[var] = val;
+	}
+
+	if(ok)
+		*ok = true;
+
+	return out;
+}
+
+HttpExtension getExtension(const QList<QByteArray> &extStrings, const QByteArray &name)
+{
+	foreach(const QByteArray &ext, extStrings)
+	{
+		bool found = false;
+		int at = ext.indexOf(';');
+		if(at != -1)
+		{
+			if(ext.mid(0, at).trimmed() == name)
+				found = true;
+		}
+		else
+		{
+			if(ext == name)
+				found = true;
+		}
+
+		if(found)
+		{
+			HttpExtension e;
+			e.name = name;
+
+			if(at != -1)
+			{
+				bool ok;
+				e.params = parseParams(ext.mid(at + 1), &ok);
+				if(!ok)
+					return HttpExtension();
+			}
+
+			return e;
+		}
+	}
+
+	return HttpExtension();
+}
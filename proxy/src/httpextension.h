@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HTTPEXTENSION_H
+#define HTTPEXTENSION_H
+
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+
+class HttpExtension
+{
+public:
+	bool isNull() const { return name.isEmpty(); }
+
+	QByteArray name;
+	QHash<QByteArray, QByteArray> params;
+};
+
+// parses "a=1; b=\"x\"" style parameters. sets ok to false on bad quoting
+QHash<QByteArray, QByteArray> parseParams(const QByteArray &in, bool *ok = 0);
+
+// finds the named extension in a list of extension header values, or
+//   returns a null extension
+HttpExtension getExtension(const QList<QByteArray> &extStrings, const QByteArray &name);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "inspectcache.h"
+
+#include <QHash>
+#include <QElapsedTimer>
+#include "packet/httprequestdata.h"
+#include "inspectdata.h"
+
+#define DEFAULT_MAX_ITEMS 10000
+
+class InspectCache::Private
+{
+public:
+	class Item
+	{
+	public:
+		QByteArray key;
+		InspectData idata;
+		qint64 expires;
+		Item *prev; // toward most recently used
+		Item *next;
+
+		Item() :
+			expires(0),
+			prev(0),
+			next(0)
+		{
+		}
+	};
+
+	int maxItems;
+	QList<QByteArray> varyHeaders;
+	QHash<QByteArray, Item*> items;
+	Item *first; // most recently used
+	Item *last;
+	QElapsedTimer clock;
+	int hits;
+	int misses;
+
+	Private() :
+		maxItems(DEFAULT_MAX_ITEMS),
+		first(0),
+		last(0),
+		hits(0),
+		misses(0)
+	{
+		clock.start();
+	}
+
+	~Private()
+	{
+		qDeleteAll(items);
+	}
+
+	void unlink(Item *i)
+	{
+		if(i->prev)
+			i->prev->next = i->next;
+		else
+			first = i->next;
+
+		if(i->next)
+			i->next->prev = i->prev;
+		else
+			last = i->prev;
+
+		i->prev = 0;
+		i->next = 0;
+	}
+
+	void pushFront(Item *i)
+	{
+		i->prev = 0;
+		i->next = first;
+		if(first)
+			first->prev = i;
+		else
+			last = i;
+		first = i;
+	}
+
+	void remove(Item *i)
+	{
+		unlink(i);
+		items.remove(i->key);
+		delete i;
+	}
+
+	void trim()
+	{
+		while(items.count() > maxItems && last)
+			remove(last);
+	}
+};
+
+InspectCache::InspectCache(QObject *parent) :
+	QObject(parent)
+{
+	d = new Private;
+}
+
+InspectCache::~InspectCache()
+{
+	delete d;
+}
+
+int InspectCache::count() const
+{
+	return d->items.count();
+}
+
+void InspectCache::setMaxItems(int max)
+{
+	d->maxItems = qMax(max, 0);
+	d->trim();
+}
+
+void InspectCache::setVaryHeaders(const QList<QByteArray> &headers)
+{
+	d->varyHeaders = headers;
+}
+
+void InspectCache::clear()
+{
+	qDeleteAll(d->items);
+	d->items.clear();
+	d->first = 0;
+	d->last = 0;
+}
+
+QByteArray InspectCache::key(const QByteArray &routeId, const HttpRequestData &hdata) const
+{
+	QByteArray out;
+	out += routeId;
+	out += '\n';
+	out += hdata.method.toLatin1();
+	out += '\n';
+
+	// the whole uri, since inspect results can depend on scheme and port
+	out += hdata.uri.toEncoded();
+
+	foreach(const QByteArray &name, d->varyHeaders)
+	{
+		out += '\n';
+		foreach(const HttpHeader &h, hdata.headers)
+		{
+			if(qstricmp(h.first.data(), name.data()) == 0)
+			{
+				out += h.second;
+				out += '\0';
+			}
+		}
+	}
+
+	return out;
+}
+
+bool InspectCache::get(const QByteArray &key, InspectData *idata)
+{
+	Private::Item *i = d->items.value(key);
+	if(i && i->expires <= d->clock.elapsed())
+	{
+		d->remove(i);
+		i = 0;
+	}
+
+	if(!i)
+	{
+		++(d->misses);
+		return false;
+	}
+
+	d->unlink(i);
+	d->pushFront(i);
+
+	*idata = i->idata;
+	++(d->hits);
+	return true;
+}
+
+void InspectCache::insert(const QByteArray &key, const InspectData &idata, int ttl)
+{
+	if(ttl <= 0 || d->maxItems <= 0)
+		return;
+
+	Private::Item *i = d->items.value(key);
+	if(i)
+	{
+		d->unlink(i);
+	}
+	else
+	{
+		i = new Private::Item;
+		i->key = key;
+		d->items.insert(key, i);
+	}
+
+	i->idata = idata;
+	i->expires = d->clock.elapsed() + ((qint64)ttl * 1000);
+	d->pushFront(i);
+
+	d->trim();
+}
+
+void InspectCache::takeCounts(int *hits, int *misses)
+{
+	*hits = d->hits;
+	*misses = d->misses;
+	d->hits = 0;
+	d->misses = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INSPECTCACHE_H
+#define INSPECTCACHE_H
+
+#include <QObject>
+
+class HttpRequestData;
+class InspectData;
+
+// LRU cache of inspect results. results are only stored if the handler
+//   indicated a ttl. entries are keyed by route, method, full uri and a
+//   configurable set of request headers
+
+class InspectCache : public QObject
+{
+	Q_OBJECT
+
+public:
+	InspectCache(QObject *parent = 0);
+	~InspectCache();
+
+	int count() const;
+
+	void setMaxItems(int max);
+	void setVaryHeaders(const QList<QByteArray> &headers);
+
+	void clear();
+
+	QByteArray key(const QByteArray &routeId, const HttpRequestData &hdata) const;
+
+	// counts a hit or a miss
+	bool get(const QByteArray &key, InspectData *idata);
+
+	// ttl is in seconds
+	void insert(const QByteArray &key, const InspectData &idata, int ttl);
+
+	// returns the counts accumulated since the last call
+	void takeCounts(int *hits, int *misses);
+
+private:
+	class Private;
+	Private *d;
+};
+
+#endif
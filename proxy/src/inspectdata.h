@@ -31,9 +31,11 @@ public:
 	QByteArray sid;
 	QHash<QByteArray, QByteArray> lastIds;
 	QVariant userData;
+	int cacheTtl; // seconds the result may be reused, or 0
 
 	InspectData() :
-		doProxy(false)
+		doProxy(false),
+		cacheTtl(0)
 	{
 	}
 };
@@ -94,6 +94,18 @@ static InspectData resultToData(const QVariant &in, bool *ok)
 
 	out.userData = obj["user-data"];
 
+	out.cacheTtl = 0;
+	if(obj.contains("cache-ttl"))
+	{
+		if(obj["cache-ttl"].type() != QVariant::Int)
+		{
+			*ok = false;
+			return InspectData();
+		}
+
+		out.cacheTtl = qMax(obj["cache-ttl"].toInt(), 0);
+	}
+
 	*ok = true;
 	return out;
 }
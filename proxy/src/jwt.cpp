@@ -19,97 +19,202 @@
 
 #include "jwt.h"
 
-#include <QtCrypto>
+#include <string.h>
+#include <QHash>
+#include <QThreadStorage>
 #include <qjson/serializer.h>
 #include <qjson/parser.h>
 #include "log.h"
+#include "hmacsha256.h"
 
-static QByteArray base64url(const QByteArray &in)
-{
-	QByteArray b64 = in.toBase64();
+#define KEYS_MAX 32
+
+// base64url of {"alg":"HS256","typ":"JWT"}. tokens we make always use
+//   this header, so it is neither serialized nor parsed
+static const char HEADER_PART[] = "eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9";
+
+static const char base64url_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-	// trim trailing padding
-	int at = b64.indexOf('=');
-	if(at != -1)
-		b64 = b64.mid(0, at);
+// maps characters to 6-bit values, or -1 if not part of the alphabet
+static const signed char base64url_values[256] =
+{
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+// appends the unpadded encoding of in to out
+static void base64url_append(const unsigned char *in, int size, QByteArray *out)
+{
+	int start = out->size();
+	out->resize(start + ((size * 4) + 2) / 3);
+	char *p = out->data() + start;
 
-	// character substitution
-	for(int n = 0; n < b64.size(); ++n)
+	int n = 0;
+	for(; n + 3 <= size; n += 3)
 	{
-		if(b64[n] == '+')
-			b64[n] = '-';
-		else if(b64[n] == '/')
-			b64[n] = '_';
+		quint32 v = ((quint32)in[n] << 16) | ((quint32)in[n + 1] << 8) | (quint32)in[n + 2];
+		*(p++) = base64url_chars[(v >> 18) & 0x3f];
+		*(p++) = base64url_chars[(v >> 12) & 0x3f];
+		*(p++) = base64url_chars[(v >> 6) & 0x3f];
+		*(p++) = base64url_chars[v & 0x3f];
 	}
 
-	return b64;
+	if(size - n == 2)
+	{
+		quint32 v = ((quint32)in[n] << 16) | ((quint32)in[n + 1] << 8);
+		*(p++) = base64url_chars[(v >> 18) & 0x3f];
+		*(p++) = base64url_chars[(v >> 12) & 0x3f];
+		*(p++) = base64url_chars[(v >> 6) & 0x3f];
+	}
+	else if(size - n == 1)
+	{
+		quint32 v = (quint32)in[n] << 16;
+		*(p++) = base64url_chars[(v >> 18) & 0x3f];
+		*(p++) = base64url_chars[(v >> 12) & 0x3f];
+	}
 }
 
-static QByteArray unbase64url(const QByteArray &in)
+// padding is not accepted. returns false on any character outside of the
+//   alphabet or on an impossible length
+static bool unbase64url(const char *in, int size, QByteArray *out)
 {
-	QByteArray b64 = in;
+	if(size % 4 == 1)
+		return false;
 
-	// add padding
-	int need = b64.size() % 4;
-	for(int n = 0; n < need; ++n)
-		b64 += '=';
+	out->resize((size * 3) / 4);
+	unsigned char *p = (unsigned char *)out->data();
+	const unsigned char *s = (const unsigned char *)in;
 
-	// character substitution
-	for(int n = 0; n < b64.size(); ++n)
+	int n = 0;
+	for(; n + 4 <= size; n += 4)
 	{
-		if(b64[n] == '-')
-			b64[n] = '+';
-		else if(b64[n] == '_')
-			b64[n] = '/';
+		int a = base64url_values[s[n]];
+		int b = base64url_values[s[n + 1]];
+		int c = base64url_values[s[n + 2]];
+		int d = base64url_values[s[n + 3]];
+		if((a | b | c | d) < 0)
+			return false;
+
+		quint32 v = ((quint32)a << 18) | ((quint32)b << 12) | ((quint32)c << 6) | (quint32)d;
+		*(p++) = (unsigned char)(v >> 16);
+		*(p++) = (unsigned char)(v >> 8);
+		*(p++) = (unsigned char)v;
 	}
 
-	return QByteArray::fromBase64(b64);
+	int left = size - n;
+	if(left > 0)
+	{
+		int a = base64url_values[s[n]];
+		int b = base64url_values[s[n + 1]];
+		int c = (left == 3 ? base64url_values[s[n + 2]] : 0);
+		if((a | b | c) < 0)
+			return false;
+
+		quint32 v = ((quint32)a << 18) | ((quint32)b << 12) | ((quint32)c << 6);
+		*(p++) = (unsigned char)(v >> 16);
+		if(left == 3)
+			*(p++) = (unsigned char)(v >> 8);
+	}
+
+	return true;
+}
+
+class KeyCache
+{
+public:
+	QHash<QByteArray, HmacSha256> keys;
+};
+
+static QThreadStorage<KeyCache*> keyCaches;
+
+// the same few keys are used over and over, so keep their hmac state
+//   around rather than deriving the pads on every call
+static const HmacSha256 &hmacForKey(const QByteArray &key)
+{
+	if(!keyCaches.hasLocalData())
+		keyCaches.setLocalData(new KeyCache);
+
+	KeyCache *c = keyCaches.localData();
+
+	QHash<QByteArray, HmacSha256>::const_iterator it = c->keys.constFind(key);
+	if(it != c->keys.constEnd())
+		return it.value();
+
+	if(c->keys.count() >= KEYS_MAX)
+		c->keys.clear();
+
+	return c->keys.insert(key, HmacSha256(key)).value();
+}
+
+// signingInput is header.claim. returns the encoded signature
+static QByteArray jws_sign(const char *signingInput, int size, const QByteArray &key)
+{
+	unsigned char mac[Sha256::DigestSize];
+	hmacForKey(key).sign(signingInput, size, mac);
+
+	QByteArray out;
+	base64url_append(mac, Sha256::DigestSize, &out);
+	return out;
 }
 
-static QByteArray jws_sign(const QByteArray &header, const QByteArray &claim, const QByteArray &key)
+static bool constant_time_equal(const char *a, const char *b, int size)
 {
-	QByteArray si = header + '.' + claim;
-	return base64url(QCA::MessageAuthenticationCode("hmac(sha256)", key).process(si).toByteArray());
+	unsigned char diff = 0;
+	for(int n = 0; n < size; ++n)
+		diff |= (unsigned char)(a[n] ^ b[n]);
+
+	return (diff == 0);
 }
 
 namespace Jwt {
 
 QByteArray encode(const QVariant &claim, const QByteArray &key)
 {
-	if(!QCA::isSupported("hmac(sha256)"))
-		return QByteArray();
-
 	QJson::Serializer serializer;
 
-	QVariantMap header;
-	header["typ"] = "JWT";
-	header["alg"] = "HS256";
-	QByteArray headerJson = serializer.serialize(header);
-	if(headerJson.isNull())
-		return QByteArray();
-
 	QByteArray claimJson = serializer.serialize(claim);
 	if(claimJson.isNull())
 		return QByteArray();
 
-	QByteArray headerPart = base64url(headerJson);
-	QByteArray claimPart = base64url(claimJson);
+	int headerSize = sizeof(HEADER_PART) - 1;
+
+	// header, claim and the 43 characters of an encoded sha256 mac
+	QByteArray out;
+	out.reserve(headerSize + 1 + ((claimJson.size() * 4) + 2) / 3 + 1 + 43);
+	out.append(HEADER_PART, headerSize);
+	out += '.';
+	base64url_append((const unsigned char *)claimJson.constData(), claimJson.size(), &out);
 
-	QByteArray sig = jws_sign(headerPart, claimPart, key);
+	QByteArray sig = jws_sign(out.constData(), out.size(), key);
 
-	return headerPart + '.' + claimPart + '.' + sig;
+	out += '.';
+	out += sig;
+	return out;
 }
 
 QVariant decode(const QByteArray &token, const QByteArray &key)
 {
-	if(!QCA::isSupported("hmac(sha256)"))
-		return QVariant();
+	const char *p = token.constData();
 
 	int at = token.indexOf('.');
 	if(at == -1)
 		return QVariant();
 
-	QByteArray headerPart = token.mid(0, at);
+	int headerSize = at;
 
 	++at;
 	int start = at;
@@ -117,35 +222,43 @@ QVariant decode(const QByteArray &token, const QByteArray &key)
 	if(at == -1)
 		return QVariant();
 
-	QByteArray claimPart = token.mid(start, at - start);
-	QByteArray sig = token.mid(at + 1);
+	int claimStart = start;
+	int claimSize = at - start;
+	int sigStart = at + 1;
+	int sigSize = token.size() - sigStart;
+
+	// check the signature first, so that forged tokens are rejected
+	//   without any json parsing
+	QByteArray expectedSig = jws_sign(p, at, key);
+	if(sigSize != expectedSig.size() || !constant_time_equal(p + sigStart, expectedSig.constData(), sigSize))
+		return QVariant();
 
 	bool ok;
 	QJson::Parser parser;
 
-	QByteArray headerJson = unbase64url(headerPart);
-	if(headerJson.isEmpty())
-		return QVariant();
+	if(headerSize != (int)sizeof(HEADER_PART) - 1 || memcmp(p, HEADER_PART, headerSize) != 0)
+	{
+		QByteArray headerJson;
+		if(!unbase64url(p, headerSize, &headerJson) || headerJson.isEmpty())
+			return QVariant();
 
-	QVariant headerObj = parser.parse(headerJson, &ok);
-	if(!ok || headerObj.type() != QVariant::Map)
-		return QVariant();
+		QVariant headerObj = parser.parse(headerJson, &ok);
+		if(!ok || headerObj.type() != QVariant::Map)
+			return QVariant();
 
-	QVariantMap header = headerObj.toMap();
-	if(header.value("typ").toString() != "JWT" || header.value("alg").toString() != "HS256")
-		return QVariant();
+		QVariantMap header = headerObj.toMap();
+		if(header.value("typ").toString() != "JWT" || header.value("alg").toString() != "HS256")
+			return QVariant();
+	}
 
-	QByteArray claimJson = unbase64url(claimPart);
-	if(claimJson.isEmpty())
+	QByteArray claimJson;
+	if(!unbase64url(p + claimStart, claimSize, &claimJson) || claimJson.isEmpty())
 		return QVariant();
 
 	QVariant claim = parser.parse(claimJson, &ok);
 	if(!ok)
 		return QVariant();
 
-	if(jws_sign(headerPart, claimPart, key) != sig)
-		return QVariant();
-
 	return claim;
 }
 
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "metrics.h"
+
+static const char *type_names[Metrics::TypeCount] =
+{
+	"time-to-route",
+	"inspect-time",
+	"first-byte-time",
+	"response-time",
+	"bytes-in",
+	"bytes-out"
+};
+
+bool Metrics::Route::isEmpty() const
+{
+	for(int n = 0; n < TypeCount; ++n)
+	{
+		if(!histograms[n].isEmpty())
+			return false;
+	}
+
+	return true;
+}
+
+Metrics::Metrics()
+{
+}
+
+Metrics::~Metrics()
+{
+	qDeleteAll(routes);
+}
+
+Metrics::Route *Metrics::route(const QByteArray &routeId)
+{
+	Route *r = routes.value(routeId);
+	if(!r)
+	{
+		r = new Route;
+		routes.insert(routeId, r);
+	}
+
+	return r;
+}
+
+bool Metrics::isEmpty() const
+{
+	foreach(const Route *r, routes)
+	{
+		if(!r->isEmpty())
+			return false;
+	}
+
+	return true;
+}
+
+void Metrics::clear()
+{
+	foreach(Route *r, routes)
+	{
+		for(int n = 0; n < TypeCount; ++n)
+			r->histograms[n].clear();
+	}
+}
+
+QVariant Metrics::toVariant() const
+{
+	QVariantHash out;
+
+	QHashIterator<QByteArray, Route*> it(routes);
+	while(it.hasNext())
+	{
+		it.next();
+		const Route *r = it.value();
+
+		QVariantHash vroute;
+		for(int n = 0; n < TypeCount; ++n)
+		{
+			if(!r->histograms[n].isEmpty())
+				vroute[type_names[n]] = r->histograms[n].toVariant();
+		}
+
+		if(!vroute.isEmpty())
+			out[QString::fromUtf8(it.key())] = vroute;
+	}
+
+	return out;
+}
+
+bool Metrics::addVariant(const QVariant &in)
+{
+	if(in.type() != QVariant::Hash)
+		return false;
+
+	QHashIterator<QString, QVariant> it(in.toHash());
+	while(it.hasNext())
+	{
+		it.next();
+
+		if(it.value().type() != QVariant::Hash)
+			return false;
+
+		QVariantHash vroute = it.value().toHash();
+		Route *r = route(it.key().toUtf8());
+
+		for(int n = 0; n < TypeCount; ++n)
+		{
+			if(!vroute.contains(type_names[n]))
+				continue;
+
+			Histogram h;
+			if(!h.fromVariant(vroute[type_names[n]]))
+				return false;
+
+			r->histograms[n].add(h);
+		}
+	}
+
+	return true;
+}
+
+const char *Metrics::typeName(Type type)
+{
+	return type_names[type];
+}
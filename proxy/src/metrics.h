@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QHash>
+#include "histogram.h"
+
+// per-route histograms. each engine thread keeps its own instance, which
+//   sessions record into directly, and hands the contents to the
+//   StatsManager periodically. times are in microseconds
+
+class Metrics
+{
+public:
+	enum Type
+	{
+		TimeToRoute, // request start until the handler decided what to do
+		InspectTime, // inspect request round trip
+		FirstByteTime, // upstream request start until response (or connect)
+		ResponseTime, // request start until the response was written
+		BytesIn, // request body, or websocket messages from the client
+		BytesOut, // response body, or websocket messages to the client
+		TypeCount
+	};
+
+	class Route
+	{
+	public:
+		Histogram histograms[TypeCount];
+
+		inline void record(Type type, qint64 value)
+		{
+			histograms[type].record(value);
+		}
+
+		bool isEmpty() const;
+	};
+
+	Metrics();
+	~Metrics();
+
+	// the returned object remains valid for the life of the Metrics
+	//   object, so sessions may keep it rather than look up per record
+	Route *route(const QByteArray &routeId);
+
+	bool isEmpty() const;
+
+	// resets all counts, keeping the route objects
+	void clear();
+
+	// { route id: { type name: histogram } }, without empty histograms
+	QVariant toVariant() const;
+
+	// merges the counts from the output of toVariant()
+	bool addVariant(const QVariant &in);
+
+	static const char *typeName(Type type);
+
+private:
+	Q_DISABLE_COPY(Metrics)
+
+	QHash<QByteArray, Route*> routes;
+};
+
+#endif
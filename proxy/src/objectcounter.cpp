@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "objectcounter.h"
+
+#include <stdlib.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// constant-initialized, so it is set before any counter registers
+static ObjectCounter *g_head = 0;
+
+ObjectCounter::ObjectCounter(const char *_name) :
+	name(_name),
+	count(0),
+	next(g_head)
+{
+	g_head = this;
+}
+
+QVariantHash ObjectCounter::counts()
+{
+	QVariantHash out;
+	for(ObjectCounter *c = g_head; c; c = c->next)
+		out[c->name] = (int)c->count;
+
+	return out;
+}
+
+QVariantHash ObjectCounter::heapStats()
+{
+	QVariantHash out;
+
+#if defined(__GLIBC__)
+# if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+# else
+	// fields are ints here, so they wrap past 2GB
+	struct mallinfo mi = mallinfo();
+# endif
+
+	// glibc doesn't track the number of live allocations, only bytes and
+	//   free chunks. in-use covers both arena and directly mmapped chunks
+	out["in-use"] = (qint64)mi.uordblks + (qint64)mi.hblkhd;
+	out["free"] = (qint64)mi.fordblks;
+	out["free-chunks"] = (qint64)mi.ordblks;
+	out["mmapped-chunks"] = (qint64)mi.hblks;
+#endif
+
+	return out;
+}
+
+QVariantHash ObjectCounter::report()
+{
+	QVariantHash out;
+	out["types"] = counts();
+	out["heap"] = heapStats();
+	return out;
+}
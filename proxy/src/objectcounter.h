@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OBJECTCOUNTER_H
+#define OBJECTCOUNTER_H
+
+#include <QAtomicInt>
+#include <QVariant>
+
+// process-wide live instance counts for long-lived, per-connection
+//   objects, so that memory held per connection can be broken down by
+//   type. each counted type has one static counter, declared at file scope
+//   next to the type's implementation, which registers itself during
+//   static initialization. counting is one atomic operation.
+
+class ObjectCounter
+{
+public:
+	ObjectCounter(const char *name);
+
+	void ref() { count.ref(); }
+	void deref() { count.deref(); }
+
+	// name -> live count, for all registered counters
+	static QVariantHash counts();
+
+	// allocator state, so that memory outside the counted types shows up
+	//   too. empty if the allocator doesn't report it
+	static QVariantHash heapStats();
+
+	// reply for the "objects" command: counts and heap stats
+	static QVariantHash report();
+
+private:
+	const char *name;
+	QAtomicInt count;
+	ObjectCounter *next;
+};
+
+#endif
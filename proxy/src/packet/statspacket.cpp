@@ -20,6 +20,7 @@
 #include "statspacket.h"
 
 #include <assert.h>
+#include <QHash>
 
 QVariant StatsPacket::toVariant() const
 {
@@ -27,9 +28,76 @@ QVariant StatsPacket::toVariant() const
 
 	obj["from"] = from;
 
+	if(type == RouteMetrics)
+	{
+		obj["routes"] = metrics;
+		return obj;
+	}
+
+	if(type == Connections)
+	{
+		// route and peer address strings are sent once per batch, and
+		//   items refer to them by index
+		QVariantList strings;
+		QHash<QByteArray, int> stringIndexes;
+		QVariantList items;
+
+		foreach(const StatsPacket &p, connections)
+		{
+			QVariantHash item = p.toVariant().toHash();
+			item.remove("from");
+
+			const char *refKeys[] = { "route", "peer-address" };
+			for(int n = 0; n < 2; ++n)
+			{
+				QString key = refKeys[n];
+				if(!item.contains(key))
+					continue;
+
+				QByteArray str = item[key].toByteArray();
+				int index = stringIndexes.value(str, -1);
+				if(index == -1)
+				{
+					index = strings.count();
+					strings += str;
+					stringIndexes.insert(str, index);
+				}
+
+				item[key] = index;
+			}
+
+			items += item;
+		}
+
+		obj["strings"] = strings;
+		obj["items"] = items;
+		return obj;
+	}
+
+	if(type == InspectCache)
+	{
+		obj["hits"] = qMax(hits, 0);
+		obj["misses"] = qMax(misses, 0);
+		return obj;
+	}
+
+	if(type == Intake)
+	{
+		obj["pending"] = qMax(pending, 0);
+		obj["paused-time"] = qMax(pausedTime, 0);
+		return obj;
+	}
+
 	if(!route.isEmpty())
 		obj["route"] = route;
 
+	if(type == RouteQueue)
+	{
+		obj["depth"] = qMax(depth, 0);
+		obj["rejected"] = qMax(rejected, 0);
+		return obj;
+	}
+
 	if(type == Activity)
 	{
 		obj["type"] = QByteArray("activity");
@@ -21,6 +21,7 @@
 #define STATSPACKET_H
 
 #include <QByteArray>
+#include <QList>
 #include <QVariant>
 #include <QHostAddress>
 
@@ -31,7 +32,12 @@ public:
 	{
 		Activity,
 		Connected,
-		Disconnected
+		Disconnected,
+		InspectCache,
+		RouteQueue,
+		Intake,
+		Connections,
+		RouteMetrics
 	};
 
 	enum ConnectionType
@@ -49,11 +55,25 @@ public:
 	QHostAddress peerAddress; // connected
 	bool ssl; // connected
 	int ttl; // connected
+	int hits; // inspect cache
+	int misses; // inspect cache
+	int depth; // route queue
+	int rejected; // route queue
+	int pending; // intake
+	int pausedTime; // intake, msecs
+	QList<StatsPacket> connections; // connected and disconnected packets, batched
+	QVariant metrics; // per-route histograms, see Metrics::toVariant()
 
 	StatsPacket() :
 		type((Type)-1),
 		count(-1),
-		ttl(-1)
+		ttl(-1),
+		hits(-1),
+		misses(-1),
+		depth(-1),
+		rejected(-1),
+		pending(-1),
+		pausedTime(-1)
 	{
 	}
 
@@ -48,43 +48,62 @@ SOURCES += \
 
 HEADERS += \
 	$$SRC_DIR/uuidutil.h \
+	$$SRC_DIR/hmacsha256.h \
 	$$SRC_DIR/jwt.h \
 	$$SRC_DIR/websocket.h \
+	$$SRC_DIR/timerwheel.h \
+	$$SRC_DIR/zhttppacketreader.h \
+	$$SRC_DIR/zhttppacketwriter.h \
 	$$SRC_DIR/zhttpmanager.h \
 	$$SRC_DIR/zhttprequest.h \
 	$$SRC_DIR/zwebsocket.h \
+	$$SRC_DIR/wsevent.h \
 	$$SRC_DIR/websocketoverhttp.h \
 	$$SRC_DIR/zrpcmanager.h \
 	$$SRC_DIR/zrpcrequest.h \
 	$$SRC_DIR/zrpcchecker.h \
 	$$SRC_DIR/inspectdata.h \
 	$$SRC_DIR/inspectrequest.h \
+	$$SRC_DIR/inspectcache.h \
 	$$SRC_DIR/acceptrequest.h \
 	$$SRC_DIR/connectionmanager.h \
 	$$SRC_DIR/wscontrolmanager.h \
 	$$SRC_DIR/wscontrolsession.h \
 	$$SRC_DIR/acceptdata.h \
+	$$SRC_DIR/rcupointer.h \
 	$$SRC_DIR/domainmap.h \
 	$$SRC_DIR/zroutes.h \
 	$$SRC_DIR/xffrule.h \
 	$$SRC_DIR/requestsession.h \
+	$$SRC_DIR/headerrewrite.h \
 	$$SRC_DIR/proxyutil.h \
 	$$SRC_DIR/proxysession.h \
+	$$SRC_DIR/httpextension.h \
 	$$SRC_DIR/wsproxysession.h \
+	$$SRC_DIR/histogram.h \
+	$$SRC_DIR/metrics.h \
+	$$SRC_DIR/tracer.h \
+	$$SRC_DIR/objectcounter.h \
 	$$SRC_DIR/statsmanager.h \
 	$$SRC_DIR/engine.h
 
 SOURCES += \
 	$$SRC_DIR/uuidutil.cpp \
+	$$SRC_DIR/hmacsha256.cpp \
 	$$SRC_DIR/jwt.cpp \
+	$$SRC_DIR/timerwheel.cpp \
+	$$SRC_DIR/zhttppacketreader.cpp \
+	$$SRC_DIR/zhttppacketwriter.cpp \
 	$$SRC_DIR/zhttpmanager.cpp \
 	$$SRC_DIR/zhttprequest.cpp \
 	$$SRC_DIR/zwebsocket.cpp \
+	$$SRC_DIR/wsevent.cpp \
 	$$SRC_DIR/websocketoverhttp.cpp \
 	$$SRC_DIR/zrpcmanager.cpp \
 	$$SRC_DIR/zrpcrequest.cpp \
 	$$SRC_DIR/zrpcchecker.cpp \
 	$$SRC_DIR/inspectrequest.cpp \
+	$$SRC_DIR/inspectcache.cpp \
 	$$SRC_DIR/acceptrequest.cpp \
 	$$SRC_DIR/connectionmanager.cpp \
 	$$SRC_DIR/wscontrolmanager.cpp \
@@ -92,8 +111,14 @@ SOURCES += \
 	$$SRC_DIR/domainmap.cpp \
 	$$SRC_DIR/zroutes.cpp \
 	$$SRC_DIR/requestsession.cpp \
+	$$SRC_DIR/headerrewrite.cpp \
 	$$SRC_DIR/proxyutil.cpp \
 	$$SRC_DIR/proxysession.cpp \
+	$$SRC_DIR/httpextension.cpp \
 	$$SRC_DIR/wsproxysession.cpp \
+	$$SRC_DIR/histogram.cpp \
+	$$SRC_DIR/metrics.cpp \
+	$$SRC_DIR/tracer.cpp \
+	$$SRC_DIR/objectcounter.cpp \
 	$$SRC_DIR/statsmanager.cpp \
 	$$SRC_DIR/engine.cpp
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <QSet>
 #include <QPointer>
+#include <QElapsedTimer>
 #include <QUrl>
 #include <QHostAddress>
 #include "packet/httprequestdata.h"
@@ -34,9 +35,13 @@
 #include "zhttprequest.h"
 #include "zroutes.h"
 #include "xffrule.h"
+#include "headerrewrite.h"
 #include "requestsession.h"
 #include "proxyutil.h"
 #include "acceptrequest.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "objectcounter.h"
 
 #define MAX_ACCEPT_REQUEST_BODY 100000
 #define MAX_ACCEPT_RESPONSE_BODY 100000
@@ -44,6 +49,8 @@
 #define MAX_INITIAL_BUFFER 100000
 #define MAX_STREAM_BUFFER 100000
 
+static ObjectCounter g_counter("ProxySession");
+
 class ProxySession::Private : public QObject
 {
 	Q_OBJECT
@@ -91,8 +98,13 @@ public:
 	bool isHttps;
 	DomainMap::Entry route;
 	QList<DomainMap::Target> targets;
+	DomainMap::Target target;
+	bool targetActive;
+	QElapsedTimer targetTime;
 	ZhttpRequest *zhttpRequest;
 	bool addAllowed;
+	bool held;
+	bool heldFailed;
 	bool haveInspectData;
 	InspectData idata;
 	QSet<QByteArray> acceptHeaderPrefixes;
@@ -105,17 +117,19 @@ public:
 	QHash<RequestSession*, SessionItem*> sessionItemsBySession;
 	QByteArray initialRequestBody;
 	int requestBytesToWrite;
+	int requestTotal;
 	int total;
 	bool buffering;
 	QByteArray defaultSigIss;
 	QByteArray defaultSigKey;
 	QByteArray defaultUpstreamKey;
 	bool passToUpstream;
-	bool useXForwardedProtocol;
 	XffRule xffRule;
 	XffRule xffTrustedRule;
-	QList<QByteArray> origHeadersNeedMark;
+	HeaderRewrite headerRewrite;
 	AcceptRequest *acceptRequest;
+	Metrics *metrics;
+	Metrics::Route *routeMetrics;
 
 	Private(ProxySession *_q, ZRoutes *_zroutes, ZrpcManager *_acceptManager) :
 		QObject(_q),
@@ -126,14 +140,19 @@ public:
 		inRequest(0),
 		acceptManager(_acceptManager),
 		isHttps(false),
+		targetActive(false),
 		zhttpRequest(0),
 		addAllowed(true),
+		held(false),
+		heldFailed(false),
 		haveInspectData(false),
 		requestBytesToWrite(0),
+		requestTotal(0),
 		total(0),
 		passToUpstream(false),
-		useXForwardedProtocol(false),
-		acceptRequest(0)
+		acceptRequest(0),
+		metrics(0),
+		routeMetrics(0)
 	{
 		acceptHeaderPrefixes += "Grip-";
 		acceptContentTypes += "application/grip-instruct";
@@ -157,6 +176,8 @@ public:
 		sessionItems.clear();
 		sessionItemsBySession.clear();
 
+		releaseTarget();
+
 		if(zhttpManager)
 		{
 			zroutes->removeRef(zhttpManager);
@@ -164,81 +185,103 @@ public:
 		}
 	}
 
-	void add(RequestSession *rs)
+	void start(RequestSession *rs, bool readInput)
 	{
-		assert(addAllowed);
-		assert(!route.isNull());
+		QString host = rs->requestData().uri.host();
+		isHttps = rs->isHttps();
 
-		SessionItem *si = new SessionItem;
-		si->rs = rs;
-		si->rs->setParent(this);
-		sessionItems += si;
-		sessionItemsBySession.insert(rs, si);
-		connect(rs, SIGNAL(bytesWritten(int)), SLOT(rs_bytesWritten(int)));
-		connect(rs, SIGNAL(errorResponding()), SLOT(rs_errorResponding()));
-		connect(rs, SIGNAL(finished()), SLOT(rs_finished()));
-		connect(rs, SIGNAL(paused()), SLOT(rs_paused()));
+		requestData = rs->requestData();
+		requestBody += requestData.body;
+		requestData.body.clear();
 
-		if(state == Stopped)
+		if(!route.asHost.isEmpty())
+			requestData.uri.setHost(route.asHost);
+
+		if(route.pathRemove > 0)
 		{
-			QString host = rs->requestData().uri.host();
-			isHttps = rs->isHttps();
+			QByteArray path = requestData.uri.encodedPath();
+			path = path.mid(route.pathRemove);
+			requestData.uri.setEncodedPath(path);
+		}
 
-			requestData = rs->requestData();
-			requestBody += requestData.body;
-			requestData.body.clear();
+		QByteArray sigIss;
+		QByteArray sigKey;
+		if(!route.sigIss.isEmpty() && !route.sigKey.isEmpty())
+		{
+			sigIss = route.sigIss;
+			sigKey = route.sigKey;
+		}
+		else
+		{
+			sigIss = defaultSigIss;
+			sigKey = defaultSigKey;
+		}
 
-			if(!route.asHost.isEmpty())
-				requestData.uri.setHost(route.asHost);
+		targets = zroutes->targetsForRoute(route);
 
-			if(route.pathRemove > 0)
-			{
-				QByteArray path = requestData.uri.encodedPath();
-				path = path.mid(route.pathRemove);
-				requestData.uri.setEncodedPath(path);
-			}
+		if(metrics)
+			routeMetrics = metrics->route(route.id);
 
-			QByteArray sigIss;
-			QByteArray sigKey;
-			if(!route.sigIss.isEmpty() && !route.sigKey.isEmpty())
-			{
-				sigIss = route.sigIss;
-				sigKey = route.sigKey;
-			}
-			else
-			{
-				sigIss = defaultSigIss;
-				sigKey = defaultSigKey;
-			}
+		bool trustedClient = ProxyUtil::manipulateRequestHeaders("wsproxysession", q, &requestData, defaultUpstreamKey, route, sigIss, sigKey, headerRewrite, xffTrustedRule, xffRule, rs->peerAddress(), idata);
+
+		if(trustedClient)
+			passToUpstream = true;
 
-			targets = route.targets;
+		state = Requesting;
+		buffering = true;
 
-			bool trustedClient = ProxyUtil::manipulateRequestHeaders("wsproxysession", q, &requestData, defaultUpstreamKey, route, sigIss, sigKey, useXForwardedProtocol, xffTrustedRule, xffRule, origHeadersNeedMark, rs->peerAddress(), idata);
+		if(readInput)
+		{
+			inRequest = rs->request();
+			connect(inRequest, SIGNAL(readyRead()), SLOT(inRequest_readyRead()));
+			connect(inRequest, SIGNAL(error()), SLOT(inRequest_error()));
 
-			if(trustedClient)
-				passToUpstream = true;
+			requestBody += inRequest->readBody();
+		}
 
-			state = Requesting;
-			buffering = true;
+		initialRequestBody = requestBody.toByteArray();
 
-			if(!rs->isRetry())
-			{
-				inRequest = rs->request();
-				connect(inRequest, SIGNAL(readyRead()), SLOT(inRequest_readyRead()));
-				connect(inRequest, SIGNAL(error()), SLOT(inRequest_error()));
+		if(requestBody.size() > MAX_ACCEPT_REQUEST_BODY)
+		{
+			requestBody.clear();
+			buffering = false;
+		}
 
-				requestBody += inRequest->readBody();
-			}
+		tryNextTarget();
+	}
 
-			initialRequestBody = requestBody.toByteArray();
+	void startHeld(RequestSession *rs)
+	{
+		assert(state == Stopped);
 
-			if(requestBody.size() > MAX_ACCEPT_REQUEST_BODY)
-			{
-				requestBody.clear();
-				buffering = false;
-			}
+		// the request is complete, so there's no input to follow
+		held = true;
+		rs->trace()->mark("speculate");
+		start(rs, false);
+	}
+
+	void add(RequestSession *rs)
+	{
+		assert(addAllowed);
+		assert(!route.isNull());
 
-			tryNextTarget();
+		SessionItem *si = new SessionItem;
+		si->rs = rs;
+		si->rs->setParent(this);
+		sessionItems += si;
+		sessionItemsBySession.insert(rs, si);
+		connect(rs, SIGNAL(bytesWritten(int)), SLOT(rs_bytesWritten(int)));
+		connect(rs, SIGNAL(errorResponding()), SLOT(rs_errorResponding()));
+		connect(rs, SIGNAL(finished()), SLOT(rs_finished()));
+		connect(rs, SIGNAL(paused()), SLOT(rs_paused()));
+
+		// joining a request that is already in progress
+		if(state != Stopped)
+			rs->trace()->mark("shared");
+
+		if(state == Stopped)
+		{
+			start(rs, !rs->isRetry());
 		}
 		else if(state == Requesting)
 		{
@@ -257,6 +300,16 @@ public:
 				rs->writeResponseBody(responseBody.toByteArray());
 			}
 		}
+
+		if(held)
+		{
+			held = false;
+
+			// the response may have completed while it was held, so
+			//   pick up reading where we left off
+			if(zhttpRequest && (state == Accepting || state == Responding))
+				QMetaObject::invokeMethod(this, "doResume", Qt::QueuedConnection);
+		}
 	}
 
 	bool pendingWrites()
@@ -270,15 +323,42 @@ public:
 		return false;
 	}
 
+	void markAll(const char *stage)
+	{
+		if(!Tracer::isEnabled())
+			return;
+
+		foreach(SessionItem *si, sessionItems)
+			si->rs->trace()->mark(stage);
+	}
+
+	void releaseTarget()
+	{
+		if(targetActive)
+		{
+			targetActive = false;
+			zroutes->targetFinished(target);
+		}
+	}
+
 	void tryNextTarget()
 	{
+		releaseTarget();
+
+		// skip targets that are cooling down after failures
+		while(!targets.isEmpty() && !zroutes->targetAvailable(targets.first()))
+		{
+			log_debug("proxysession: %p skipping unavailable target", q);
+			targets.removeFirst();
+		}
+
 		if(targets.isEmpty())
 		{
 			rejectAll(502, "Bad Gateway", "Error while proxying to origin.");
 			return;
 		}
 
-		DomainMap::Target target = targets.takeFirst();
+		target = targets.takeFirst();
 
 		QUrl uri = requestData.uri;
 		if(target.ssl)
@@ -323,8 +403,15 @@ public:
 			zhttpRequest->setConnectPort(target.connectPort);
 		}
 
+		zroutes->targetStarted(target);
+		targetActive = true;
+		targetTime.start();
+		markAll("upstream-start");
+
 		zhttpRequest->start(requestData.method, uri, requestData.headers);
 
+		requestTotal = initialRequestBody.size();
+
 		if(!initialRequestBody.isEmpty())
 		{
 			requestBytesToWrite += initialRequestBody.size();
@@ -355,6 +442,7 @@ public:
 		}
 
 		requestBytesToWrite += buf.size();
+		requestTotal += buf.size();
 		zhttpRequest->writeBody(buf);
 	}
 
@@ -375,6 +463,9 @@ public:
 
 	void rejectAll(int code, const QString &reason, const QString &errorMessage)
 	{
+		if(held)
+			heldFailed = true;
+
 		foreach(SessionItem *si, sessionItems)
 		{
 			if(si->state != SessionItem::Errored)
@@ -408,6 +499,9 @@ public:
 		// this method is only to be called when we are in Responding state
 		assert(state == Responding);
 
+		if(held)
+			heldFailed = true;
+
 		foreach(SessionItem *si, sessionItems)
 		{
 			assert(si->state != SessionItem::WaitingForResponse);
@@ -431,7 +525,17 @@ public:
 
 		QPointer<QObject> self = this;
 
-		QByteArray buf = zhttpRequest->readBody(MAX_STREAM_BUFFER);
+		int max = MAX_STREAM_BUFFER;
+		if(held && state == Responding)
+		{
+			// nobody to stream to yet, so keep no more than a new
+			//   session could be caught up with
+			max = qMin(max, MAX_INITIAL_BUFFER - responseBody.size());
+			if(max <= 0)
+				return;
+		}
+
+		QByteArray buf = zhttpRequest->readBody(max);
 		if(!buf.isEmpty())
 		{
 			total += buf.size();
@@ -503,9 +607,24 @@ public:
 				return;
 			}
 
+			if(held)
+			{
+				log_debug("proxysession: %p holding response until inspected", q);
+				return;
+			}
+
 			delete zhttpRequest;
 			zhttpRequest = 0;
 
+			releaseTarget();
+			markAll("upstream-done");
+
+			if(routeMetrics)
+			{
+				routeMetrics->record(Metrics::BytesIn, requestTotal);
+				routeMetrics->record(Metrics::BytesOut, total);
+			}
+
 			// once the entire response has been received, cut off any new adds
 			if(addAllowed)
 			{
@@ -546,6 +665,12 @@ public:
 	}
 
 public slots:
+	void doResume()
+	{
+		if(zhttpRequest)
+			tryResponseRead();
+	}
+
 	void inRequest_readyRead()
 	{
 		tryRequestRead();
@@ -567,7 +692,18 @@ public slots:
 
 		if(state == Requesting)
 		{
+			zroutes->targetResponded(target, targetTime.elapsed());
+			markAll("upstream-response");
+
+			if(routeMetrics)
+				routeMetrics->record(Metrics::FirstByteTime, targetTime.nsecsElapsed() / 1000);
+
 			responseData.code = zhttpRequest->responseCode();
+
+			if(responseData.code >= 500)
+				zroutes->targetFailed(target);
+			else
+				zroutes->targetSucceeded(target);
 			responseData.reason = zhttpRequest->responseReason();
 			responseData.headers = zhttpRequest->responseHeaders();
 			responseBody += zhttpRequest->readBody(MAX_INITIAL_BUFFER);
@@ -615,6 +751,7 @@ public slots:
 				}
 
 				state = Accepting;
+				markAll("instruct");
 			}
 			else
 			{
@@ -666,6 +803,12 @@ public slots:
 	{
 		ZhttpRequest::ErrorCondition e = zhttpRequest->errorCondition();
 		log_debug("proxysession: %p target error state=%d, condition=%d", q, (int)state, (int)e);
+		markAll("upstream-error");
+
+		if(e == ZhttpRequest::ErrorConnect || e == ZhttpRequest::ErrorConnectTimeout || e == ZhttpRequest::ErrorTimeout)
+			zroutes->targetFailed(target);
+
+		releaseTarget();
 
 		if(state == Requesting || state == Accepting)
 		{
@@ -902,11 +1045,13 @@ ProxySession::ProxySession(ZRoutes *zroutes, ZrpcManager *acceptManager, QObject
 	QObject(parent)
 {
 	d = new Private(this, zroutes, acceptManager);
+	g_counter.ref();
 }
 
 ProxySession::~ProxySession()
 {
 	delete d;
+	g_counter.deref();
 }
 
 void ProxySession::setRoute(const DomainMap::Entry &route)
@@ -925,20 +1070,20 @@ void ProxySession::setDefaultUpstreamKey(const QByteArray &key)
 	d->defaultUpstreamKey = key;
 }
 
-void ProxySession::setUseXForwardedProtocol(bool enabled)
-{
-	d->useXForwardedProtocol = enabled;
-}
-
 void ProxySession::setXffRules(const XffRule &untrusted, const XffRule &trusted)
 {
 	d->xffRule = untrusted;
 	d->xffTrustedRule = trusted;
 }
 
-void ProxySession::setOrigHeadersNeedMark(const QList<QByteArray> &names)
+void ProxySession::setHeaderRewrite(const HeaderRewrite &rewrite)
+{
+	d->headerRewrite = rewrite;
+}
+
+void ProxySession::setMetrics(Metrics *metrics)
 {
-	d->origHeadersNeedMark = names;
+	d->metrics = metrics;
 }
 
 void ProxySession::setInspectData(const InspectData &idata)
@@ -947,6 +1092,16 @@ void ProxySession::setInspectData(const InspectData &idata)
 	d->idata = idata;
 }
 
+void ProxySession::startSpeculative(RequestSession *rs)
+{
+	d->startHeld(rs);
+}
+
+bool ProxySession::canAttachSpeculative() const
+{
+	return !d->heldFailed;
+}
+
 void ProxySession::add(RequestSession *rs)
 {
 	d->add(rs);
@@ -28,6 +28,8 @@ class AcceptData;
 class ZrpcManager;
 class ZRoutes;
 class XffRule;
+class HeaderRewrite;
+class Metrics;
 class RequestSession;
 
 class ProxySession : public QObject
@@ -41,12 +43,20 @@ public:
 	void setRoute(const DomainMap::Entry &route);
 	void setDefaultSigKey(const QByteArray &iss, const QByteArray &key);
 	void setDefaultUpstreamKey(const QByteArray &key);
-	void setUseXForwardedProtocol(bool enabled);
 	void setXffRules(const XffRule &untrusted, const XffRule &trusted);
-	void setOrigHeadersNeedMark(const QList<QByteArray> &names);
+	void setHeaderRewrite(const HeaderRewrite &rewrite);
+	void setMetrics(Metrics *metrics);
 
 	void setInspectData(const InspectData &idata);
 
+	// sends the request of rs upstream without taking ownership. the
+	//   response is held until rs is passed to add(). only for requests
+	//   with a complete, empty body
+	void startSpeculative(RequestSession *rs);
+
+	// false if the held response failed and add() would not complete it
+	bool canAttachSpeculative() const;
+
 	// takes ownership
 	void add(RequestSession *rs);
 
@@ -20,20 +20,111 @@
 #include "proxyutil.h"
 
 #include <QDateTime>
+#include <QCache>
+#include <QThreadStorage>
 #include "log.h"
 #include "jwt.h"
 #include "inspectdata.h"
 
-static QByteArray make_token(const QByteArray &iss, const QByteArray &key)
+#define SIG_TOKEN_LIFETIME 3600
+
+// a cached token is replaced once it has this many seconds left
+#define SIG_TOKEN_REFRESH 3000
+
+#define SIGNED_TOKENS_MAX 100
+#define VALIDATED_TOKENS_MAX 1000
+
+// the signature token only carries iss and exp, so the same one can be
+//   sent with every request for a while. tokens received from upstream
+//   proxies are also remembered once validated. kept per thread so
+//   engine workers don't contend
+class TokenCache
+{
+public:
+	class SignedToken
+	{
+	public:
+		QByteArray token;
+		int exp;
+
+		SignedToken() :
+			exp(0)
+		{
+		}
+	};
+
+	class ValidatedToken
+	{
+	public:
+		QByteArray key;
+		int exp;
+	};
+
+	QHash<QPair<QByteArray, QByteArray>, SignedToken> signedTokens;
+	QCache<QByteArray, ValidatedToken> validatedTokens;
+
+	TokenCache() :
+		validatedTokens(VALIDATED_TOKENS_MAX)
+	{
+	}
+};
+
+static QThreadStorage<TokenCache*> tokenCaches;
+
+static TokenCache *tokenCache()
+{
+	if(!tokenCaches.hasLocalData())
+		tokenCaches.setLocalData(new TokenCache);
+
+	return tokenCaches.localData();
+}
+
+static QByteArray make_token(const QByteArray &iss, const QByteArray &key, int exp)
 {
 	QVariantMap claim;
 	claim["iss"] = QString::fromUtf8(iss);
-	claim["exp"] = QDateTime::currentDateTimeUtc().toTime_t() + 3600;
+	claim["exp"] = exp;
 	return Jwt::encode(claim, key);
 }
 
-static bool validate_token(const QByteArray &token, const QByteArray &key)
+namespace ProxyUtil {
+
+QByteArray getSignatureToken(const QByteArray &iss, const QByteArray &key, int now)
 {
+	TokenCache *c = tokenCache();
+
+	QPair<QByteArray, QByteArray> id(iss, key);
+	QHash<QPair<QByteArray, QByteArray>, TokenCache::SignedToken>::const_iterator it = c->signedTokens.constFind(id);
+	if(it != c->signedTokens.constEnd() && it->exp - now > SIG_TOKEN_REFRESH)
+		return it->token;
+
+	TokenCache::SignedToken st;
+	st.exp = now + SIG_TOKEN_LIFETIME;
+	st.token = make_token(iss, key, st.exp);
+	if(st.token.isEmpty())
+		return QByteArray();
+
+	if(it == c->signedTokens.constEnd() && c->signedTokens.count() >= SIGNED_TOKENS_MAX)
+		c->signedTokens.clear();
+
+	c->signedTokens.insert(id, st);
+	return st.token;
+}
+
+bool validateSignatureToken(const QByteArray &token, const QByteArray &key, int now)
+{
+	TokenCache *c = tokenCache();
+
+	TokenCache::ValidatedToken *vt = c->validatedTokens.object(token);
+	if(vt && vt->key == key)
+	{
+		if(now < vt->exp)
+			return true;
+
+		c->validatedTokens.remove(token);
+		return false;
+	}
+
 	QVariant claimObj = Jwt::decode(token, key);
 	if(!claimObj.isValid() || claimObj.type() != QVariant::Map)
 		return false;
@@ -41,24 +132,28 @@ static bool validate_token(const QByteArray &token, const QByteArray &key)
 	QVariantMap claim = claimObj.toMap();
 
 	int exp = claim.value("exp").toInt();
-	if(exp <= 0 || (int)QDateTime::currentDateTimeUtc().toTime_t() >= exp)
+	if(exp <= 0 || now >= exp)
 		return false;
 
+	vt = new TokenCache::ValidatedToken;
+	vt->key = key;
+	vt->exp = exp;
+	c->validatedTokens.insert(token, vt);
+
 	return true;
 }
 
-namespace ProxyUtil {
-
-bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestData *requestData, const QByteArray &defaultUpstreamKey, const DomainMap::Entry &entry, const QByteArray &sigIss, const QByteArray &sigKey, bool useXForwardedProtocol, const XffRule &xffTrustedRule, const XffRule &xffRule, const QList<QByteArray> &origHeadersNeedMark, const QHostAddress &peerAddress, const InspectData &idata)
+bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestData *requestData, const QByteArray &defaultUpstreamKey, const DomainMap::Entry &entry, const QByteArray &sigIss, const QByteArray &sigKey, const HeaderRewrite &rewrite, const XffRule &xffTrustedRule, const XffRule &xffRule, const QHostAddress &peerAddress, const InspectData &idata)
 {
 	// check if the request is coming from a grip proxy already
 	bool trustedClient = false;
+	int now = (int)QDateTime::currentDateTimeUtc().toTime_t();
 	if(!defaultUpstreamKey.isEmpty())
 	{
 		QByteArray token = requestData->headers.get("Grip-Sig");
 		if(!token.isEmpty())
 		{
-			if(validate_token(token, defaultUpstreamKey))
+			if(validateSignatureToken(token, defaultUpstreamKey, now))
 			{
 				log_debug("%s: %p passing to upstream", logprefix, object);
 				trustedClient = true;
@@ -68,101 +163,24 @@ bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestDa
 		}
 	}
 
-	if(!trustedClient && entry.origHeaders)
-	{
-		// copy headers to include magic prefix, so that the original
-		//   headers may be recovered later. if the client is trusted,
-		//   then we assume this has been done already.
-
-		HttpHeaders origHeaders;
-		for(int n = 0; n < requestData->headers.count(); ++n)
-		{
-			const HttpHeader &h = requestData->headers[n];
-
-			if(qstrnicmp(h.first.data(), "eb9bf0f5-", 9) == 0)
-			{
-				// if it's already marked, take it
-				origHeaders += h;
-
-				// remove where it lives now. we'll put it back later
-				requestData->headers.removeAt(n);
-				--n; // adjust position
-			}
-			else
-			{
-				// see if we require it to be marked already
-				bool found = false;
-				foreach(const QByteArray &i, origHeadersNeedMark)
-				{
-					if(qstricmp(h.first.data(), i.data()) == 0)
-					{
-						found = true;
-						break;
-					}
-				}
-
-				// if not, then add as marked
-				if(!found)
-					origHeaders += HttpHeader("eb9bf0f5-" + h.first, h.second);
-			}
-		}
-
-		// now append all the orig headers to the end
-		foreach(const HttpHeader &h, origHeaders)
-			requestData->headers += h;
-	}
-	else if(!entry.origHeaders)
-	{
-		// if we don't want original headers, then filter them out
-		//   before proxying
-		for(int n = 0; n < requestData->headers.count(); ++n)
-		{
-			const HttpHeader &h = requestData->headers[n];
-
-			if(qstrnicmp(h.first.data(), "eb9bf0f5-", 9) == 0)
-			{
-				requestData->headers.removeAt(n);
-				--n; // adjust position
-			}
-		}
-	}
-
-	// don't relay these headers. their meaning is handled by
-	//   mongrel2 and they only apply to the incoming hop.
-	requestData->headers.removeAll("Connection");
-	requestData->headers.removeAll("Keep-Alive");
-	requestData->headers.removeAll("Accept-Encoding");
-	requestData->headers.removeAll("Content-Encoding");
-	requestData->headers.removeAll("Transfer-Encoding");
-	requestData->headers.removeAll("Expect");
+	HttpHeaders headers;
+	HttpHeaders xffHeaders;
+	rewrite.apply(requestData->headers, entry.origHeaders, trustedClient, &headers, &xffHeaders);
+	requestData->headers = headers;
 
 	// rewrite the Host header to match the hostname of the destination URL.
 	//   in practice, the only time the value should ever be different is
 	//   if the original Host header had a port specified
-	requestData->headers.removeAll("Host");
 	requestData->headers += HttpHeader("Host", requestData->uri.host().toUtf8());
 
-	if(!trustedClient)
+	// set Grip-Sig
+	if(!trustedClient && !sigIss.isEmpty() && !sigKey.isEmpty())
 	{
-		// remove all Grip- headers
-		for(int n = 0; n < requestData->headers.count(); ++n)
-		{
-			if(qstrnicmp(requestData->headers[n].first.data(), "Grip-", 5) == 0)
-			{
-				requestData->headers.removeAt(n);
-				--n; // adjust position
-			}
-		}
-
-		// set Grip-Sig
-		if(!sigIss.isEmpty() && !sigKey.isEmpty())
-		{
-			QByteArray token = make_token(sigIss, sigKey);
-			if(!token.isEmpty())
-				requestData->headers += HttpHeader("Grip-Sig", token);
-			else
-				log_warning("%s: %p failed to sign request", logprefix, object);
-		}
+		QByteArray token = getSignatureToken(sigIss, sigKey, now);
+		if(!token.isEmpty())
+			requestData->headers += HttpHeader("Grip-Sig", token);
+		else
+			log_warning("%s: %p failed to sign request", logprefix, object);
 	}
 
 	if(!idata.sid.isEmpty())
@@ -176,10 +194,8 @@ bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestDa
 		}
 	}
 
-	if(useXForwardedProtocol)
+	if(rewrite.useXForwardedProtocol())
 	{
-		requestData->headers.removeAll("X-Forwarded-Protocol");
-
 		QString scheme = requestData->uri.scheme();
 		if(scheme == "https" || scheme == "wss")
 			requestData->headers += HttpHeader("X-Forwarded-Protocol", scheme.toUtf8());
@@ -191,7 +207,7 @@ bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestDa
 	else
 		xr = &xffRule;
 
-	QList<QByteArray> xffValues = requestData->headers.takeAll("X-Forwarded-For");
+	QList<QByteArray> xffValues = xffHeaders.takeAll("X-Forwarded-For");
 	if(xr->truncate >= 0)
 		xffValues = xffValues.mid(qMax(xffValues.count() - xr->truncate, 0));
 	if(xr->append)
@@ -26,12 +26,17 @@
 #include "packet/httprequestdata.h"
 #include "domainmap.h"
 #include "xffrule.h"
+#include "headerrewrite.h"
 
 class InspectData;
 
 namespace ProxyUtil {
 
-bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestData *requestData, const QByteArray &defaultUpstreamKey, const DomainMap::Entry &entry, const QByteArray &sigIss, const QByteArray &sigKey, bool useXForwardedProtocol, const XffRule &xffTrustedRule, const XffRule &xffRule, const QList<QByteArray> &origHeadersNeedMark, const QHostAddress &peerAddress, const InspectData &idata);
+// tokens are cached per thread. now is in seconds since the epoch
+QByteArray getSignatureToken(const QByteArray &iss, const QByteArray &key, int now);
+bool validateSignatureToken(const QByteArray &token, const QByteArray &key, int now);
+
+bool manipulateRequestHeaders(const char *logprefix, void *object, HttpRequestData *requestData, const QByteArray &defaultUpstreamKey, const DomainMap::Entry &entry, const QByteArray &sigIss, const QByteArray &sigKey, const HeaderRewrite &rewrite, const XffRule &xffTrustedRule, const XffRule &xffRule, const QHostAddress &peerAddress, const InspectData &idata);
 
 }
 
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RCUPOINTER_H
+#define RCUPOINTER_H
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QSharedData>
+#include <QThread>
+
+// publishes immutable objects from a single writer thread to any number of
+//   reader threads. readers pin the current object without taking a lock.
+//   the writer swaps in a new object and then waits only for readers that
+//   were in the middle of pinning, before dropping its reference to the
+//   old one. T must derive from QSharedData and must not be modified once
+//   stored
+
+template <typename T>
+class RcuPointer
+{
+public:
+	RcuPointer() :
+		epoch(0),
+		cur(0)
+	{
+	}
+
+	// may be null if nothing has been stored yet
+	QExplicitlySharedDataPointer<T> load() const
+	{
+		while(true)
+		{
+			int e = epoch;
+			QAtomicInt &count = readers[e & 1];
+			count.ref();
+
+			// if the writer moved on before we registered, it may not
+			//   wait for us. try again
+			if((int)epoch != e)
+			{
+				count.deref();
+				continue;
+			}
+
+			QExplicitlySharedDataPointer<T> p((T *)cur);
+			count.deref();
+			return p;
+		}
+	}
+
+	// takes ownership of p. writer thread only
+	void store(T *p)
+	{
+		QExplicitlySharedDataPointer<T> old = owned;
+		owned = QExplicitlySharedDataPointer<T>(p);
+		cur.fetchAndStoreOrdered(p);
+
+		// readers arriving from here on see the new object. wait for
+		//   the ones that may have fetched the old one to take a ref
+		int e = epoch.fetchAndAddOrdered(1);
+		while((int)readers[e & 1] != 0)
+			QThread::yieldCurrentThread();
+
+		// old is released here, or by the last reader holding it
+	}
+
+private:
+	mutable QAtomicInt readers[2];
+	QAtomicInt epoch;
+	QAtomicPointer<T> cur;
+	QExplicitlySharedDataPointer<T> owned;
+
+	Q_DISABLE_COPY(RcuPointer)
+};
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <assert.h>
 #include <QPointer>
+#include <QElapsedTimer>
 #include <QUrl>
 #include <QHostAddress>
 #include <qjson/parser.h>
@@ -35,7 +36,11 @@
 #include "zrpcmanager.h"
 #include "zrpcchecker.h"
 #include "inspectrequest.h"
+#include "inspectcache.h"
 #include "acceptrequest.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "objectcounter.h"
 
 #define MAX_PREFETCH_REQUEST_BODY 10000
 #define MAX_SHARED_REQUEST_BODY 100000
@@ -180,6 +185,8 @@ static void applyCorsHeaders(const HttpHeaders &requestHeaders, HttpHeaders *res
 	}
 }
 
+static ObjectCounter g_counter("RequestSession");
+
 class RequestSession::Private : public QObject
 {
 	Q_OBJECT
@@ -211,6 +218,8 @@ public:
 	DomainMap::Entry route;
 	bool autoCrossOrigin;
 	InspectRequest *inspectRequest;
+	InspectCache *inspectCache;
+	QByteArray inspectCacheKey;
 	InspectData idata;
 	AcceptRequest *acceptRequest;
 	BufferList in;
@@ -223,6 +232,11 @@ public:
 	LayerTracker jsonpTracker;
 	bool isRetry;
 	QList<QByteArray> jsonpExtractableHeaders;
+	Metrics *metrics;
+	Metrics::Route *routeMetrics;
+	QElapsedTimer startTime;
+	QElapsedTimer inspectTime;
+	Trace trace;
 
 	Private(RequestSession *_q, DomainMap *_domainMap, ZrpcManager *_inspectManager, ZrpcChecker *_inspectChecker, ZrpcManager *_acceptManager) :
 		QObject(_q),
@@ -235,11 +249,14 @@ public:
 		zhttpRequest(0),
 		autoCrossOrigin(false),
 		inspectRequest(0),
+		inspectCache(0),
 		acceptRequest(0),
 		jsonpExtendedResponse(false),
 		responseBodyFinished(false),
 		pendingResponseUpdate(false),
-		isRetry(false)
+		isRetry(false),
+		metrics(0),
+		routeMetrics(0)
 	{
 		jsonpExtractableHeaders += "Cache-Control";
 	}
@@ -247,6 +264,7 @@ public:
 	~Private()
 	{
 		cleanup();
+		trace.finish();
 	}
 
 	void cleanup()
@@ -269,9 +287,14 @@ public:
 
 	void start(ZhttpRequest *req)
 	{
+		startTime.start();
+
 		zhttpRequest = req;
 		rid = req->rid();
 
+		trace.start(rid.second);
+		zhttpRequest->setTrace(&trace);
+
 		requestData.method = req->requestMethod();
 		requestData.uri = req->requestUri();
 		requestData.headers = req->requestHeaders();
@@ -340,14 +363,44 @@ public:
 
 		log_debug("requestsession: %p %s has %d routes", q, qPrintable(host), route.targets.count());
 
+		trace.setRoute(route.id);
+		trace.mark("routed");
+
+		if(metrics)
+			routeMetrics = metrics->route(route.id);
+
 		state = Prefetching;
 
 		connect(zhttpRequest, SIGNAL(readyRead()), SLOT(zhttpRequest_readyRead()));
 		processIncomingRequest();
 	}
 
+	void startError(ZhttpRequest *req, int code, const QString &reason, const QString &errorString)
+	{
+		zhttpRequest = req;
+		rid = req->rid();
+
+		requestData.method = req->requestMethod();
+		requestData.uri = req->requestUri();
+		requestData.headers = req->requestHeaders();
+
+		connect(zhttpRequest, SIGNAL(error()), SLOT(zhttpRequest_error()));
+		connect(zhttpRequest, SIGNAL(paused()), SLOT(zhttpRequest_paused()));
+
+		state = WaitingForResponse;
+		respondError(code, reason, errorString);
+	}
+
 	void startRetry()
 	{
+		// timings for retries start over, since the original start time
+		//   isn't known
+		startTime.start();
+
+		trace.start(rid.second);
+		trace.mark("retry");
+		zhttpRequest->setTrace(&trace);
+
 		connect(zhttpRequest, SIGNAL(error()), SLOT(zhttpRequest_error()));
 		connect(zhttpRequest, SIGNAL(paused()), SLOT(zhttpRequest_paused()));
 
@@ -368,6 +421,11 @@ public:
 		}
 
 		log_debug("proxysession: %p %s has %d routes", q, qPrintable(host), route.targets.count());
+
+		trace.setRoute(route.id);
+
+		if(metrics)
+			routeMetrics = metrics->route(route.id);
 	}
 
 	void processIncomingRequest()
@@ -388,8 +446,30 @@ public:
 
 				assert(!inspectRequest);
 
+				// a cached result can only be used if the handler wouldn't
+				//   have seen anything beyond the request line and headers
+				if(inspectCache && requestData.body.isEmpty() && !truncated && !route.session)
+				{
+					inspectCacheKey = inspectCache->key(route.id, requestData);
+
+					if(inspectCache->get(inspectCacheKey, &idata))
+					{
+						log_debug("requestsession: %p inspect cache hit", q);
+						trace.mark("inspect-cached");
+						QMetaObject::invokeMethod(this, "doInspectCached", Qt::QueuedConnection);
+						return;
+					}
+				}
+
+				// safe requests on speculative routes may be sent upstream
+				//   while the handler is still deciding what to do
+				if(route.speculative && (requestData.method == "GET" || requestData.method == "HEAD") && requestData.body.isEmpty() && !truncated)
+					emit q->speculate();
+
 				if(inspectManager)
 				{
+					inspectTime.start();
+					trace.mark("inspect-start");
 					inspectRequest = new InspectRequest(inspectManager, this);
 
 					if(inspectChecker->isInterfaceAvailable())
@@ -725,6 +805,46 @@ public:
 		return true;
 	}
 
+	void recordTimeToRoute()
+	{
+		if(routeMetrics)
+			routeMetrics->record(Metrics::TimeToRoute, startTime.nsecsElapsed() / 1000);
+	}
+
+	void handleInspected()
+	{
+		trace.mark(idata.doProxy ? "proxy" : "accept");
+		recordTimeToRoute();
+
+		if(!idata.doProxy)
+		{
+			state = ReceivingForAccept;
+
+			// successful inspect indicated we should not proxy. in that case,
+			//   collect the body and accept
+			connect(zhttpRequest, SIGNAL(readyRead()), SLOT(zhttpRequest_readyRead()));
+			processIncomingRequest();
+		}
+		else
+		{
+			if(!idata.sharingKey.isEmpty())
+			{
+				// a request can only be shared if we've read the entire
+				//   request body, so let's try to read it now
+				state = Receiving;
+
+				connect(zhttpRequest, SIGNAL(readyRead()), SLOT(zhttpRequest_readyRead()));
+				processIncomingRequest();
+			}
+			else
+			{
+				state = WaitingForResponse;
+				requestData.body = in.take();
+				emit q->inspected(idata);
+			}
+		}
+	}
+
 public slots:
 	void zhttpRequest_readyRead()
 	{
@@ -749,7 +869,12 @@ public slots:
 
 		if(zhttpRequest->isFinished())
 		{
+			if(routeMetrics)
+				routeMetrics->record(Metrics::ResponseTime, startTime.nsecsElapsed() / 1000);
+
 			cleanup();
+			trace.mark("done");
+			trace.finish();
 			emit q->finished();
 		}
 	}
@@ -786,6 +911,7 @@ public slots:
 			adata.route = route.id;
 			adata.channelPrefix = route.prefix;
 
+			trace.mark("handoff");
 			acceptRequest = new AcceptRequest(acceptManager, this);
 			connect(acceptRequest, SIGNAL(finished()), SLOT(acceptRequest_finished()));
 			acceptRequest->start(adata);
@@ -800,6 +926,8 @@ public slots:
 	{
 		log_warning("requestsession: request error id=%s", rid.second.data());
 		cleanup();
+		trace.mark("error");
+		trace.finish();
 		emit q->finished();
 	}
 
@@ -817,37 +945,24 @@ public slots:
 
 		idata = inspectRequest->result();
 
+		trace.mark("inspect-done");
+
+		if(routeMetrics)
+			routeMetrics->record(Metrics::InspectTime, inspectTime.nsecsElapsed() / 1000);
+
 		inspectRequest->disconnect(this);
 		inspectChecker->give(inspectRequest);
 		inspectRequest = 0;
 
-		if(!idata.doProxy)
-		{
-			state = ReceivingForAccept;
+		if(!inspectCacheKey.isEmpty() && idata.cacheTtl > 0)
+			inspectCache->insert(inspectCacheKey, idata, idata.cacheTtl);
 
-			// successful inspect indicated we should not proxy. in that case,
-			//   collect the body and accept
-			connect(zhttpRequest, SIGNAL(readyRead()), SLOT(zhttpRequest_readyRead()));
-			processIncomingRequest();
-		}
-		else
-		{
-			if(!idata.sharingKey.isEmpty())
-			{
-				// a request can only be shared if we've read the entire
-				//   request body, so let's try to read it now
-				state = Receiving;
+		handleInspected();
+	}
 
-				connect(zhttpRequest, SIGNAL(readyRead()), SLOT(zhttpRequest_readyRead()));
-				processIncomingRequest();
-			}
-			else
-			{
-				state = WaitingForResponse;
-				requestData.body = in.take();
-				emit q->inspected(idata);
-			}
-		}
+	void doInspectCached()
+	{
+		handleInspected();
 	}
 
 	void acceptRequest_finished()
@@ -867,6 +982,8 @@ public slots:
 
 				state = Stopped;
 
+				trace.mark("accepted");
+				trace.finish();
 				emit q->finishedByAccept();
 			}
 			else
@@ -1044,6 +1161,9 @@ public slots:
 
 	void doInspectError()
 	{
+		trace.mark("inspect-error");
+		recordTimeToRoute();
+
 		state = WaitingForResponse;
 		emit q->inspectError();
 	}
@@ -1053,11 +1173,13 @@ RequestSession::RequestSession(DomainMap *domainMap, ZrpcManager *inspectManager
 	QObject(parent)
 {
 	d = new Private(this, domainMap, inspectManager, inspectChecker, acceptManager);
+	g_counter.ref();
 }
 
 RequestSession::~RequestSession()
 {
 	delete d;
+	g_counter.deref();
 }
 
 bool RequestSession::isRetry() const
@@ -1115,6 +1237,21 @@ ZhttpRequest *RequestSession::request()
 	return d->zhttpRequest;
 }
 
+Trace *RequestSession::trace()
+{
+	return &d->trace;
+}
+
+void RequestSession::setInspectCache(InspectCache *cache)
+{
+	d->inspectCache = cache;
+}
+
+void RequestSession::setMetrics(Metrics *metrics)
+{
+	d->metrics = metrics;
+}
+
 void RequestSession::setAutoCrossOrigin(bool enabled)
 {
 	d->autoCrossOrigin = enabled;
@@ -1125,6 +1262,11 @@ void RequestSession::start(ZhttpRequest *req)
 	d->start(req);
 }
 
+void RequestSession::startError(ZhttpRequest *req, int code, const QString &reason, const QString &errorString)
+{
+	d->startError(req, code, reason, errorString);
+}
+
 void RequestSession::startRetry(ZhttpRequest *req, bool autoCrossOrigin, const QByteArray &jsonpCallback, bool jsonpExtendedResponse)
 {
 	d->isRetry = true;
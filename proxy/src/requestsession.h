@@ -31,6 +31,9 @@ class InspectData;
 class AcceptData;
 class ZrpcManager;
 class ZrpcChecker;
+class InspectCache;
+class Metrics;
+class Trace;
 
 class RequestSession : public QObject
 {
@@ -53,12 +56,20 @@ public:
 
 	ZhttpRequest *request();
 
+	// for marking stages of the request from the session handling it
+	Trace *trace();
+
 	void setAutoCrossOrigin(bool enabled);
+	void setInspectCache(InspectCache *cache);
+	void setMetrics(Metrics *metrics);
 
 	// takes ownership
 	void start(ZhttpRequest *req);
 	void startRetry(ZhttpRequest *req, bool autoCrossOrigin, const QByteArray &jsonpCallback, bool jsonpExtendedResponse);
 
+	// respond with an error without looking at the request
+	void startError(ZhttpRequest *req, int code, const QString &reason, const QString &errorString);
+
 	void pause();
 	void resume();
 
@@ -73,6 +84,9 @@ public:
 signals:
 	void inspected(const InspectData &idata);
 	void inspectError();
+
+	// the upstream request may be started before inspection completes
+	void speculate();
 	void finished();
 	void finishedByAccept();
 	void bytesWritten(int count);
@@ -21,42 +21,68 @@
 
 #include <assert.h>
 #include <QTimer>
-#include <QDateTime>
 #include <QPointer>
+#include <QThread>
 #include "qzmqsocket.h"
 #include "log.h"
 #include "tnetstring.h"
+#include "timerwheel.h"
+#include "metrics.h"
 #include "packet/statspacket.h"
 
 // make this somewhat big since PUB is lossy
 #define OUT_HWM 200000
 
 #define ACTIVITY_TIMEOUT 100
+
+// connection events are batched, and sent at least every ACTIVITY_TIMEOUT
+#define CONNECTIONS_BATCH_MAX 500
+
+#define METRICS_INTERVAL (10 * 1000)
 #define CONNECTION_TTL 600
 #define CONNECTION_REFRESH (CONNECTION_TTL * 9 / 10)
 #define CONNECTION_LINGER 60
-#define REFRESH_TIMEOUT (30 * 1000)
 
-// FIXME: trickle connection refreshes rather than all at once on an interval
+// the first refresh of a connection comes up to this much early, so that
+//   connections arriving in a burst don't stay in step afterwards
+#define CONNECTION_REFRESH_SPREAD (CONNECTION_REFRESH / 3)
 
 class StatsManager::Private : public QObject
 {
 	Q_OBJECT
 
 public:
+	class RouteQueueInfo
+	{
+	public:
+		int depth;
+		int rejected;
+		bool changed;
+
+		RouteQueueInfo() :
+			depth(0),
+			rejected(0),
+			changed(false)
+		{
+		}
+	};
+
 	class ConnectionInfo
 	{
 	public:
+		Private *owner;
 		QByteArray id;
 		QByteArray routeId;
 		ConnectionType type;
 		QHostAddress peerAddress;
 		bool ssl;
-		QDateTime nextRefresh;
+		int timer;
 		bool linger;
 
 		ConnectionInfo() :
+			owner(0),
 			ssl(false),
+			timer(-1),
 			linger(false)
 		{
 		}
@@ -68,21 +94,38 @@ public:
 	QZmq::Socket *sock;
 	QHash<QByteArray, int> routeActivity;
 	QHash<QByteArray, ConnectionInfo*> connectionInfoById;
+	int inspectCacheHits;
+	int inspectCacheMisses;
+	QHash<QByteArray, RouteQueueInfo> routeQueues;
+	int intakePending;
+	int intakePausedTime;
+	QList<StatsPacket> pendingConnections;
+	Metrics totalMetrics;
+	Metrics intervalMetrics;
 	QTimer *activityTimer;
-	QTimer *refreshTimer;
+	QTimer *metricsTimer;
+	TimerWheel *timerWheel;
 
 	Private(StatsManager *_q) :
 		QObject(_q),
 		q(_q),
-		sock(0)
+		sock(0),
+		inspectCacheHits(0),
+		inspectCacheMisses(0),
+		intakePending(0),
+		intakePausedTime(0)
 	{
 		activityTimer = new QTimer(this);
 		connect(activityTimer, SIGNAL(timeout()), SLOT(activity_timeout()));
 		activityTimer->setSingleShot(true);
 
-		refreshTimer = new QTimer(this);
-		connect(refreshTimer, SIGNAL(timeout()), SLOT(refresh_timeout()));
-		refreshTimer->start(REFRESH_TIMEOUT);
+		// refreshes are scheduled per connection, so each tick only
+		//   handles the connections that are due
+		timerWheel = new TimerWheel(this);
+
+		metricsTimer = new QTimer(this);
+		connect(metricsTimer, SIGNAL(timeout()), SLOT(metrics_timeout()));
+		metricsTimer->start(METRICS_INTERVAL);
 	}
 
 	~Private()
@@ -95,12 +138,12 @@ public:
 			activityTimer = 0;
 		}
 
-		if(refreshTimer)
+		if(metricsTimer)
 		{
-			refreshTimer->setParent(0);
-			refreshTimer->disconnect(this);
-			refreshTimer->deleteLater();
-			refreshTimer = 0;
+			metricsTimer->setParent(0);
+			metricsTimer->disconnect(this);
+			metricsTimer->deleteLater();
+			metricsTimer = 0;
 		}
 
 		qDeleteAll(connectionInfoById);
@@ -128,6 +171,16 @@ public:
 		QByteArray prefix;
 		if(packet.type == StatsPacket::Activity)
 			prefix = "activity ";
+		else if(packet.type == StatsPacket::InspectCache)
+			prefix = "inspect-cache ";
+		else if(packet.type == StatsPacket::RouteQueue)
+			prefix = "route-queue ";
+		else if(packet.type == StatsPacket::Intake)
+			prefix = "intake ";
+		else if(packet.type == StatsPacket::Connections)
+			prefix = "conns ";
+		else if(packet.type == StatsPacket::RouteMetrics)
+			prefix = "metrics ";
 		else
 			prefix = "conn ";
 
@@ -164,7 +217,7 @@ public:
 		p.peerAddress = c->peerAddress;
 		p.ssl = c->ssl;
 		p.ttl = CONNECTION_TTL;
-		write(p);
+		addConnectionPacket(p);
 	}
 
 	void sendDisconnected(ConnectionInfo *c)
@@ -174,9 +227,224 @@ public:
 		p.from = instanceId;
 		p.route = c->routeId;
 		p.connectionId = c->id;
+		addConnectionPacket(p);
+	}
+
+	void addConnectionPacket(const StatsPacket &p)
+	{
+		pendingConnections += p;
+
+		if(pendingConnections.count() >= CONNECTIONS_BATCH_MAX)
+			flushConnections();
+		else if(!activityTimer->isActive())
+			activityTimer->start(ACTIVITY_TIMEOUT);
+	}
+
+	void flushConnections()
+	{
+		if(pendingConnections.isEmpty())
+			return;
+
+		StatsPacket p;
+		p.type = StatsPacket::Connections;
+		p.from = instanceId;
+		p.connections = pendingConnections;
+		pendingConnections.clear();
 		write(p);
 	}
 
+	void addActivity(const QByteArray &routeId)
+	{
+		if(routeActivity.contains(routeId))
+			++(routeActivity[routeId]);
+		else
+			routeActivity[routeId] = 1;
+
+		if(!activityTimer->isActive())
+			activityTimer->start(ACTIVITY_TIMEOUT);
+	}
+
+	void sendInspectCache(int hits, int misses)
+	{
+		StatsPacket p;
+		p.type = StatsPacket::InspectCache;
+		p.from = instanceId;
+		p.hits = hits;
+		p.misses = misses;
+		write(p);
+	}
+
+	void addInspectCacheCounts(int hits, int misses)
+	{
+		inspectCacheHits += hits;
+		inspectCacheMisses += misses;
+
+		if(!activityTimer->isActive())
+			activityTimer->start(ACTIVITY_TIMEOUT);
+	}
+
+	void sendRouteQueue(const QByteArray &routeId, int depth, int rejected)
+	{
+		StatsPacket p;
+		p.type = StatsPacket::RouteQueue;
+		p.from = instanceId;
+		p.route = routeId;
+		p.depth = depth;
+		p.rejected = rejected;
+		write(p);
+	}
+
+	void addRouteQueueCounts(const QByteArray &routeId, int depthChange, int rejected)
+	{
+		RouteQueueInfo &i = routeQueues[routeId];
+		i.depth += depthChange;
+		i.rejected += rejected;
+		i.changed = true;
+
+		if(!activityTimer->isActive())
+			activityTimer->start(ACTIVITY_TIMEOUT);
+	}
+
+	void sendIntake(int pending, int pausedTime)
+	{
+		StatsPacket p;
+		p.type = StatsPacket::Intake;
+		p.from = instanceId;
+		p.pending = pending;
+		p.pausedTime = pausedTime;
+		write(p);
+	}
+
+	void addIntakeCounts(int pending, int pausedTime)
+	{
+		intakePending = qMax(intakePending, pending);
+		intakePausedTime += pausedTime;
+
+		if(!activityTimer->isActive())
+			activityTimer->start(ACTIVITY_TIMEOUT);
+	}
+
+	void addMetrics(const QVariant &metrics)
+	{
+		if(!totalMetrics.addVariant(metrics) || !intervalMetrics.addVariant(metrics))
+			log_warning("stats: invalid metrics");
+	}
+
+	void addConnection(const QByteArray &id, const QByteArray &routeId, ConnectionType type, const QHostAddress &peerAddress, bool ssl, bool quiet)
+	{
+		// if we already had an entry, silently overwrite it. this can
+		//   happen if we sent an accepted connection off to the handler,
+		//   kept it lingering in our table, and then the handler passed
+		//   it back to us for retrying
+		ConnectionInfo *c = connectionInfoById.value(id);
+		if(c)
+			removeConnectionInfo(c);
+
+		c = new ConnectionInfo;
+		c->owner = this;
+		c->id = id;
+		c->routeId = routeId;
+		c->type = type;
+		c->peerAddress = peerAddress;
+		c->ssl = ssl;
+		connectionInfoById[c->id] = c;
+
+		c->timer = timerWheel->add(refresh_cb, c);
+		int spread = (int)(qHash(id) % (CONNECTION_REFRESH_SPREAD * 1000));
+		timerWheel->start(c->timer, (CONNECTION_REFRESH * 1000) - spread);
+
+		if(!quiet)
+			sendConnected(c);
+	}
+
+	void removeConnection(const QByteArray &id, bool linger)
+	{
+		ConnectionInfo *c = connectionInfoById.value(id);
+		if(!c)
+			return;
+
+		if(linger)
+		{
+			if(!c->linger)
+			{
+				c->linger = true;
+				timerWheel->start(c->timer, CONNECTION_LINGER * 1000);
+			}
+		}
+		else
+		{
+			sendDisconnected(c);
+			removeConnectionInfo(c);
+		}
+	}
+
+	void removeConnectionInfo(ConnectionInfo *c)
+	{
+		timerWheel->remove(c->timer);
+		connectionInfoById.remove(c->id);
+		delete c;
+	}
+
+	static void refresh_cb(void *data)
+	{
+		ConnectionInfo *c = (ConnectionInfo *)data;
+		c->owner->refresh(c);
+	}
+
+	void refresh(ConnectionInfo *c)
+	{
+		if(c->linger)
+		{
+			// note: we don't send a disconnect message when the
+			//   linger expires. the assumption is that the handler
+			//   owns the connection now
+			removeConnectionInfo(c);
+		}
+		else
+		{
+			sendConnected(c);
+			timerWheel->start(c->timer, CONNECTION_REFRESH * 1000);
+		}
+	}
+
+public slots:
+	// entry points for calls made from engine worker threads
+
+	void queuedAddActivity(const QByteArray &routeId)
+	{
+		addActivity(routeId);
+	}
+
+	void queuedAddConnection(const QByteArray &id, const QByteArray &routeId, int type, const QString &peerAddress, bool ssl, bool quiet)
+	{
+		addConnection(id, routeId, (ConnectionType)type, QHostAddress(peerAddress), ssl, quiet);
+	}
+
+	void queuedRemoveConnection(const QByteArray &id, bool linger)
+	{
+		removeConnection(id, linger);
+	}
+
+	void queuedAddInspectCacheCounts(int hits, int misses)
+	{
+		addInspectCacheCounts(hits, misses);
+	}
+
+	void queuedAddRouteQueueCounts(const QByteArray &routeId, int depthChange, int rejected)
+	{
+		addRouteQueueCounts(routeId, depthChange, rejected);
+	}
+
+	void queuedAddIntakeCounts(int pending, int pausedTime)
+	{
+		addIntakeCounts(pending, pausedTime);
+	}
+
+	void queuedAddMetrics(const QVariant &metrics)
+	{
+		addMetrics(metrics);
+	}
+
 private slots:
 	void activity_timeout()
 	{
@@ -188,41 +456,54 @@ private slots:
 		}
 
 		routeActivity.clear();
-	}
 
-	void refresh_timeout()
-	{
-		QDateTime now = QDateTime::currentDateTime();
+		flushConnections();
 
-		QList<ConnectionInfo*> toDelete;
-		QHashIterator<QByteArray, ConnectionInfo*> it(connectionInfoById);
-		while(it.hasNext())
+		if(inspectCacheHits > 0 || inspectCacheMisses > 0)
 		{
-			it.next();
-			ConnectionInfo *c = it.value();
-			if(now >= c->nextRefresh)
-			{
-				if(c->linger)
-				{
-					toDelete += c;
-
-					// note: we don't send a disconnect message when the
-					//   linger expires. the assumption is that the handler
-					//   owns the connection now
-				}
-				else
-				{
-					sendConnected(c);
-					c->nextRefresh = now.addSecs(CONNECTION_REFRESH);
-				}
-			}
+			sendInspectCache(inspectCacheHits, inspectCacheMisses);
+			inspectCacheHits = 0;
+			inspectCacheMisses = 0;
 		}
 
-		foreach(ConnectionInfo *c, toDelete)
+		if(intakePending > 0 || intakePausedTime > 0)
 		{
-			connectionInfoById.remove(c->id);
-			delete c;
+			sendIntake(intakePending, intakePausedTime);
+			intakePending = 0;
+			intakePausedTime = 0;
 		}
+
+		// depth is reported as it changes, and dropped once back to zero
+		QMutableHashIterator<QByteArray, RouteQueueInfo> qit(routeQueues);
+		while(qit.hasNext())
+		{
+			qit.next();
+			RouteQueueInfo &i = qit.value();
+
+			if(i.changed)
+			{
+				sendRouteQueue(qit.key(), i.depth, i.rejected);
+				i.rejected = 0;
+				i.changed = false;
+			}
+
+			if(i.depth == 0)
+				qit.remove();
+		}
+	}
+
+	void metrics_timeout()
+	{
+		if(intervalMetrics.isEmpty())
+			return;
+
+		StatsPacket p;
+		p.type = StatsPacket::RouteMetrics;
+		p.from = instanceId;
+		p.metrics = intervalMetrics.toVariant();
+		write(p);
+
+		intervalMetrics.clear();
 	}
 };
 
@@ -250,62 +531,79 @@ bool StatsManager::setSpec(const QString &spec)
 
 void StatsManager::addActivity(const QByteArray &routeId)
 {
-	if(d->routeActivity.contains(routeId))
-		++(d->routeActivity[routeId]);
-	else
-		d->routeActivity[routeId] = 1;
+	if(QThread::currentThread() != thread())
+	{
+		QMetaObject::invokeMethod(d, "queuedAddActivity", Qt::QueuedConnection, Q_ARG(QByteArray, routeId));
+		return;
+	}
 
-	if(!d->activityTimer->isActive())
-		d->activityTimer->start(ACTIVITY_TIMEOUT);
+	d->addActivity(routeId);
 }
 
 void StatsManager::addConnection(const QByteArray &id, const QByteArray &routeId, ConnectionType type, const QHostAddress &peerAddress, bool ssl, bool quiet)
 {
-	// if we already had an entry, silently overwrite it. this can
-	//   happen if we sent an accepted connection off to the handler,
-	//   kept it lingering in our table, and then the handler passed
-	//   it back to us for retrying
-	Private::ConnectionInfo *c = d->connectionInfoById.value(id);
-	if(c)
-	{
-		d->connectionInfoById.remove(id);
-		delete c;
+	if(QThread::currentThread() != thread())
+	{
+		QMetaObject::invokeMethod(d, "queuedAddConnection", Qt::QueuedConnection, Q_ARG(QByteArray, id), Q_ARG(QByteArray, routeId), Q_ARG(int, (int)type), Q_ARG(QString, peerAddress.toString()), Q_ARG(bool, ssl), Q_ARG(bool, quiet));
+		return;
 	}
 
-	c = new Private::ConnectionInfo;
-	c->id = id;
-	c->routeId = routeId;
-	c->type = type;
-	c->peerAddress = peerAddress;
-	c->ssl = ssl;
-	d->connectionInfoById[c->id] = c;
+	d->addConnection(id, routeId, type, peerAddress, ssl, quiet);
+}
 
-	c->nextRefresh = QDateTime::currentDateTime().addSecs(CONNECTION_REFRESH);
+void StatsManager::removeConnection(const QByteArray &id, bool linger)
+{
+	if(QThread::currentThread() != thread())
+	{
+		QMetaObject::invokeMethod(d, "queuedRemoveConnection", Qt::QueuedConnection, Q_ARG(QByteArray, id), Q_ARG(bool, linger));
+		return;
+	}
 
-	if(!quiet)
-		d->sendConnected(c);
+	d->removeConnection(id, linger);
 }
 
-void StatsManager::removeConnection(const QByteArray &id, bool linger)
+void StatsManager::addInspectCacheCounts(int hits, int misses)
+{
+	if(QThread::currentThread() != thread())
+	{
+		QMetaObject::invokeMethod(d, "queuedAddInspectCacheCounts", Qt::QueuedConnection, Q_ARG(int, hits), Q_ARG(int, misses));
+		return;
+	}
+
+	d->addInspectCacheCounts(hits, misses);
+}
+
+void StatsManager::addRouteQueueCounts(const QByteArray &routeId, int depthChange, int rejected)
 {
-	Private::ConnectionInfo *c = d->connectionInfoById.value(id);
-	if(!c)
+	if(QThread::currentThread() != thread())
+	{
+		QMetaObject::invokeMethod(d, "queuedAddRouteQueueCounts", Qt::QueuedConnection, Q_ARG(QByteArray, routeId), Q_ARG(int, depthChange), Q_ARG(int, rejected));
 		return;
+	}
 
-	if(linger)
+	d->addRouteQueueCounts(routeId, depthChange, rejected);
+}
+
+void StatsManager::addIntakeCounts(int pending, int pausedTime)
+{
+	if(QThread::currentThread() != thread())
 	{
-		if(!c->linger)
-		{
-			c->linger = true;
-			c->nextRefresh = QDateTime::currentDateTime().addSecs(CONNECTION_LINGER);
-		}
+		QMetaObject::invokeMethod(d, "queuedAddIntakeCounts", Qt::QueuedConnection, Q_ARG(int, pending), Q_ARG(int, pausedTime));
+		return;
 	}
-	else
+
+	d->addIntakeCounts(pending, pausedTime);
+}
+
+void StatsManager::addMetrics(const QVariant &metrics)
+{
+	if(QThread::currentThread() != thread())
 	{
-		d->sendDisconnected(c);
-		d->connectionInfoById.remove(id);
-		delete c;
+		QMetaObject::invokeMethod(d, "queuedAddMetrics", Qt::QueuedConnection, Q_ARG(QVariant, metrics));
+		return;
 	}
+
+	d->addMetrics(metrics);
 }
 
 bool StatsManager::checkConnection(const QByteArray &id)
@@ -313,4 +611,9 @@ bool StatsManager::checkConnection(const QByteArray &id)
 	return d->connectionInfoById.contains(id);
 }
 
+QVariant StatsManager::metrics() const
+{
+	return d->totalMetrics.toVariant();
+}
+
 #include "statsmanager.moc"
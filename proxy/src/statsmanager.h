@@ -21,6 +21,7 @@
 #define STATSMANAGER_H
 
 #include <QObject>
+#include <QVariant>
 
 class QHostAddress;
 
@@ -41,15 +42,35 @@ public:
 	void setInstanceId(const QByteArray &instanceId);
 	bool setSpec(const QString &spec);
 
-	// routeId may be empty for non-identified route
+	// routeId may be empty for non-identified route. the following
+	//   methods may be called from other threads, in which case the call is
+	//   queued to the thread that owns the manager
 
 	void addActivity(const QByteArray &routeId);
 
 	void addConnection(const QByteArray &id, const QByteArray &routeId, ConnectionType type, const QHostAddress &peerAddress, bool ssl, bool quiet);
 	void removeConnection(const QByteArray &id, bool linger);
 
+	void addInspectCacheCounts(int hits, int misses);
+
+	// change in the number of requests waiting for a route, and requests
+	//   turned away because its queue was full
+	void addRouteQueueCounts(const QByteArray &routeId, int depthChange, int rejected);
+
+	// peak number of sessions waiting to be taken, and msecs spent with
+	//   intake paused
+	void addIntakeCounts(int pending, int pausedTime);
+
+	// per-route histograms as produced by Metrics::toVariant(). they are
+	//   merged into running totals and published periodically
+	void addMetrics(const QVariant &metrics);
+
+	// must be called from the owning thread
 	bool checkConnection(const QByteArray &id);
 
+	// running totals of everything passed to addMetrics()
+	QVariant metrics() const;
+
 private:
 	class Private;
 	Private *d;
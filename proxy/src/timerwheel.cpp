@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timerwheel.h"
+
+#include <assert.h>
+#include <QVector>
+#include <QPointer>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#define TICK_INTERVAL 100
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS 4
+#define BUCKETS (LEVELS * LEVEL_SIZE)
+
+// extra list holding timers that are due in the current tick
+#define EXPIRING_LIST BUCKETS
+
+// furthest a timer can be scheduled, in ticks
+#define MAX_DELTA ((Q_INT64_C(1) << (LEVELS * LEVEL_BITS)) - 1)
+
+class TimerWheel::Private : public QObject
+{
+	Q_OBJECT
+
+public:
+	class Timer
+	{
+	public:
+		bool used;
+		TimeoutFunc func;
+		void *data;
+		qint64 expires;
+		int list; // -1 when inactive
+		int prev;
+		int next;
+
+		Timer() :
+			used(false),
+			func(0),
+			data(0),
+			expires(0),
+			list(-1),
+			prev(-1),
+			next(-1)
+		{
+		}
+	};
+
+	TimerWheel *q;
+	QVector<Timer> timers;
+	QList<int> freeHandles;
+	int count;
+	int active;
+	int heads[BUCKETS + 1];
+	qint64 curTick;
+	QElapsedTimer clock;
+	QTimer *tickTimer;
+
+	Private(TimerWheel *_q) :
+		QObject(_q),
+		q(_q),
+		count(0),
+		active(0),
+		curTick(0)
+	{
+		for(int n = 0; n < BUCKETS + 1; ++n)
+			heads[n] = -1;
+
+		clock.start();
+
+		tickTimer = new QTimer(this);
+		connect(tickTimer, SIGNAL(timeout()), SLOT(tickTimer_timeout()));
+		tickTimer->setInterval(TICK_INTERVAL);
+	}
+
+	~Private()
+	{
+		tickTimer->disconnect(this);
+		tickTimer->setParent(0);
+		tickTimer->deleteLater();
+	}
+
+	qint64 nowTick() const
+	{
+		return clock.elapsed() / TICK_INTERVAL;
+	}
+
+	void link(int handle, int list)
+	{
+		Timer &t = timers[handle];
+		t.list = list;
+		t.prev = -1;
+		t.next = heads[list];
+		if(t.next != -1)
+			timers[t.next].prev = handle;
+		heads[list] = handle;
+	}
+
+	void unlink(int handle)
+	{
+		Timer &t = timers[handle];
+		if(t.prev != -1)
+			timers[t.prev].next = t.next;
+		else
+			heads[t.list] = t.next;
+		if(t.next != -1)
+			timers[t.next].prev = t.prev;
+		t.list = -1;
+		t.prev = -1;
+		t.next = -1;
+	}
+
+	void schedule(int handle)
+	{
+		qint64 expires = timers[handle].expires;
+		qint64 delta = expires - curTick;
+
+		int list;
+		if(delta < 0)
+		{
+			// overdue. process on the next tick
+			list = (int)(curTick & LEVEL_MASK);
+		}
+		else
+		{
+			if(delta > MAX_DELTA)
+			{
+				expires = curTick + MAX_DELTA;
+				timers[handle].expires = expires;
+				delta = MAX_DELTA;
+			}
+
+			int level = 0;
+			while(level < LEVELS - 1 && delta >= (Q_INT64_C(1) << ((level + 1) * LEVEL_BITS)))
+				++level;
+
+			list = level * LEVEL_SIZE + (int)((expires >> (level * LEVEL_BITS)) & LEVEL_MASK);
+		}
+
+		link(handle, list);
+	}
+
+	// move the timers of a higher level bucket down to lower levels.
+	//   returns the index of the bucket within its level
+	int cascade(int level)
+	{
+		int index = (int)((curTick >> (level * LEVEL_BITS)) & LEVEL_MASK);
+		int list = level * LEVEL_SIZE + index;
+
+		int handle = heads[list];
+		while(handle != -1)
+		{
+			int next = timers[handle].next;
+			unlink(handle);
+			schedule(handle);
+			handle = next;
+		}
+
+		return index;
+	}
+
+	void start(int handle, int msecs)
+	{
+		assert(handle >= 0 && handle < timers.count() && timers[handle].used);
+
+		if(active == 0)
+		{
+			// wheel is empty, so we can jump straight to the present
+			curTick = nowTick();
+			tickTimer->start();
+		}
+
+		Timer &t = timers[handle];
+		if(t.list != -1)
+			unlink(handle);
+		else
+			++active;
+
+		t.expires = (clock.elapsed() + qMax(msecs, 0) + TICK_INTERVAL - 1) / TICK_INTERVAL;
+		schedule(handle);
+	}
+
+	void stop(int handle)
+	{
+		assert(handle >= 0 && handle < timers.count() && timers[handle].used);
+
+		if(timers[handle].list == -1)
+			return;
+
+		unlink(handle);
+		--active;
+
+		if(active == 0)
+			tickTimer->stop();
+	}
+
+private slots:
+	void tickTimer_timeout()
+	{
+		QPointer<QObject> self = this;
+
+		qint64 now = nowTick();
+		while(curTick <= now && active > 0)
+		{
+			int index = (int)(curTick & LEVEL_MASK);
+			if(index == 0)
+			{
+				for(int level = 1; level < LEVELS; ++level)
+				{
+					if(cascade(level) != 0)
+						break;
+				}
+			}
+
+			++curTick;
+
+			// move the whole bucket to the expiring list at once. callbacks
+			//   may stop or remove other expiring timers, which unlinks
+			//   them from here
+			heads[EXPIRING_LIST] = heads[index];
+			heads[index] = -1;
+			for(int h = heads[EXPIRING_LIST]; h != -1; h = timers[h].next)
+				timers[h].list = EXPIRING_LIST;
+
+			while(heads[EXPIRING_LIST] != -1)
+			{
+				int handle = heads[EXPIRING_LIST];
+				unlink(handle);
+				--active;
+
+				TimeoutFunc func = timers[handle].func;
+				void *data = timers[handle].data;
+
+				if(func)
+				{
+					func(data);
+					if(!self)
+						return;
+				}
+			}
+		}
+
+		if(active == 0)
+			tickTimer->stop();
+	}
+};
+
+TimerWheel::TimerWheel(QObject *parent) :
+	QObject(parent)
+{
+	d = new Private(this);
+}
+
+TimerWheel::~TimerWheel()
+{
+	delete d;
+}
+
+int TimerWheel::timerCount() const
+{
+	return d->count;
+}
+
+int TimerWheel::activeCount() const
+{
+	return d->active;
+}
+
+int TimerWheel::add(TimeoutFunc func, void *data)
+{
+	int handle;
+	if(!d->freeHandles.isEmpty())
+	{
+		handle = d->freeHandles.takeLast();
+	}
+	else
+	{
+		handle = d->timers.count();
+		d->timers += Private::Timer();
+	}
+
+	Private::Timer &t = d->timers[handle];
+	t.used = true;
+	t.func = func;
+	t.data = data;
+	++(d->count);
+
+	return handle;
+}
+
+void TimerWheel::remove(int handle)
+{
+	d->stop(handle);
+
+	d->timers[handle] = Private::Timer();
+	d->freeHandles += handle;
+	--(d->count);
+}
+
+void TimerWheel::start(int handle, int msecs)
+{
+	d->start(handle, msecs);
+}
+
+void TimerWheel::stop(int handle)
+{
+	d->stop(handle);
+}
+
+bool TimerWheel::isActive(int handle) const
+{
+	assert(handle >= 0 && handle < d->timers.count() && d->timers[handle].used);
+
+	return (d->timers[handle].list != -1);
+}
+
+#include "timerwheel.moc"
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+
+// hierarchical timing wheel for large numbers of coarse, per-connection
+//   timeouts. timers are referred to by handle. starting, restarting and
+//   stopping a timer are constant time, and expired timers are processed
+//   a bucket at a time from a single qt timer. resolution is 100ms.
+
+class TimerWheel : public QObject
+{
+	Q_OBJECT
+
+public:
+	// func may be null for timers that are only checked with isActive()
+	typedef void (*TimeoutFunc)(void *data);
+
+	TimerWheel(QObject *parent = 0);
+	~TimerWheel();
+
+	int timerCount() const;
+	int activeCount() const;
+
+	// returns a handle that remains valid until removed
+	int add(TimeoutFunc func, void *data);
+	void remove(int handle);
+
+	// timers are single-shot. restarting an active timer reschedules it
+	void start(int handle, int msecs);
+	void stop(int handle);
+	bool isActive(int handle) const;
+
+private:
+	class Private;
+	Private *d;
+};
+
+#endif
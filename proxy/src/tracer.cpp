@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tracer.h"
+
+#include <assert.h>
+#include <string.h>
+#include <QAtomicInt>
+#include <QHash>
+
+#define ID_MAX 64
+#define ROUTE_MAX 64
+
+// slots are claimed round-robin. a writer makes the sequence odd while it
+//   fills the slot and even again when done. readers copy the slot and
+//   keep the copy only if the sequence was even and unchanged throughout.
+//   a writer that finds its slot still being written (only possible if the
+//   whole ring wrapped around during the write) drops its trace instead of
+//   waiting
+class TraceSlot
+{
+public:
+	QAtomicInt seq;
+	char id[ID_MAX];
+	int idSize;
+	char route[ROUTE_MAX];
+	int routeSize;
+	qint64 start;
+	qint64 total;
+	bool sampled;
+	int markCount;
+	const char *stages[Trace::MaxMarks];
+	qint64 offsets[Trace::MaxMarks];
+};
+
+static bool g_enabled = false;
+static int g_sampleRate = 0;
+static qint64 g_slowTime = 0; // usecs
+static int g_capacity = 0;
+static TraceSlot *g_slots = 0;
+static QAtomicInt g_head;
+
+static int copyTruncated(char *dest, int max, const QByteArray &src)
+{
+	int size = qMin(src.size(), max);
+	memcpy(dest, src.data(), size);
+	return size;
+}
+
+Trace::Trace() :
+	active(false),
+	sampled(false),
+	markCount(0)
+{
+}
+
+void Trace::start(const QByteArray &_id)
+{
+	if(!g_enabled)
+		return;
+
+	sampled = (g_sampleRate > 0 && qHash(_id) % (uint)g_sampleRate == 0);
+
+	// without a slow threshold, unsampled requests can never be written
+	if(!sampled && g_slowTime <= 0)
+		return;
+
+	active = true;
+	id = _id;
+	route.clear();
+	markCount = 0;
+	timer.start();
+}
+
+void Trace::setRoute(const QByteArray &_route)
+{
+	if(active)
+		route = _route;
+}
+
+void Trace::finish()
+{
+	if(!active)
+		return;
+
+	active = false;
+
+	qint64 total = timer.nsecsElapsed() / 1000;
+	if(sampled || (g_slowTime > 0 && total >= g_slowTime))
+		Tracer::write(*this, total);
+
+	id.clear();
+	route.clear();
+}
+
+void Tracer::setup(int sampleRate, int slowTime, int capacity)
+{
+	assert(!g_slots);
+
+	g_sampleRate = qMax(sampleRate, 0);
+	g_slowTime = (qint64)qMax(slowTime, 0) * 1000;
+
+	if((g_sampleRate <= 0 && g_slowTime <= 0) || capacity <= 0)
+		return;
+
+	g_capacity = capacity;
+	g_slots = new TraceSlot[g_capacity];
+	for(int n = 0; n < g_capacity; ++n)
+		g_slots[n].markCount = 0;
+
+	g_enabled = true;
+}
+
+bool Tracer::isEnabled()
+{
+	return g_enabled;
+}
+
+void Tracer::write(const Trace &trace, qint64 total)
+{
+	int pos = (int)((uint)g_head.fetchAndAddOrdered(1) % (uint)g_capacity);
+	TraceSlot &s = g_slots[pos];
+
+	int seq = s.seq;
+	if((seq & 1) || !s.seq.testAndSetAcquire(seq, seq + 1))
+		return;
+
+	s.idSize = copyTruncated(s.id, ID_MAX, trace.id);
+	s.routeSize = copyTruncated(s.route, ROUTE_MAX, trace.route);
+	s.start = trace.timer.msecsSinceReference();
+	s.total = total;
+	s.sampled = trace.sampled;
+	s.markCount = trace.markCount;
+	for(int n = 0; n < trace.markCount; ++n)
+	{
+		s.stages[n] = trace.stages[n];
+		s.offsets[n] = trace.offsets[n];
+	}
+
+	s.seq.fetchAndStoreRelease(seq + 2);
+}
+
+QVariantList Tracer::recent(int max)
+{
+	QVariantList out;
+
+	if(!g_enabled)
+		return out;
+
+	uint head = (uint)(int)g_head;
+
+	for(int n = 1; n <= g_capacity && (max < 0 || out.count() < max); ++n)
+	{
+		int pos = (int)((head - (uint)n) % (uint)g_capacity);
+		TraceSlot &s = g_slots[pos];
+
+		int seq = s.seq.fetchAndAddAcquire(0);
+		if(seq == 0 || (seq & 1))
+			continue;
+
+		TraceSlot c;
+		memcpy(c.id, s.id, ID_MAX);
+		c.idSize = s.idSize;
+		memcpy(c.route, s.route, ROUTE_MAX);
+		c.routeSize = s.routeSize;
+		c.start = s.start;
+		c.total = s.total;
+		c.sampled = s.sampled;
+		c.markCount = s.markCount;
+		memcpy(c.stages, s.stages, sizeof(c.stages));
+		memcpy(c.offsets, s.offsets, sizeof(c.offsets));
+
+		// torn by a writer that claimed the slot while we copied. acquire
+		//   alone would let the copy move after this check, so use a full
+		//   barrier to keep it ahead
+		if(s.seq.fetchAndAddOrdered(0) != seq)
+			continue;
+
+		QVariantHash t;
+		t["id"] = QByteArray(c.id, qBound(0, c.idSize, ID_MAX));
+		t["route"] = QByteArray(c.route, qBound(0, c.routeSize, ROUTE_MAX));
+		t["start"] = c.start;
+		t["total"] = c.total;
+		t["sampled"] = c.sampled;
+
+		QVariantList vstages;
+		for(int i = 0; i < qBound(0, c.markCount, (int)Trace::MaxMarks); ++i)
+		{
+			QVariantList m;
+			m += QByteArray(c.stages[i]);
+			m += c.offsets[i];
+			vstages += QVariant(m);
+		}
+		t["stages"] = vstages;
+
+		out += t;
+	}
+
+	return out;
+}
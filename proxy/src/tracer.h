@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QVariant>
+
+// per-request stage timing. each session keeps a Trace and marks stage
+//   transitions as it goes. marks are microsecond offsets from the start
+//   of the request, and cost only a branch when the trace is inactive.
+//   finished traces are written to a process-wide ring buffer if the
+//   request was sampled or turned out to be slow. sampling is decided by
+//   hashing the request id, so every process handling a request makes the
+//   same decision and the traces can be joined up by id
+
+class Trace
+{
+public:
+	enum { MaxMarks = 16 };
+
+	Trace();
+
+	bool isActive() const { return active; }
+
+	void start(const QByteArray &id);
+	void setRoute(const QByteArray &route);
+
+	// stage must be a string literal
+	inline void mark(const char *stage)
+	{
+		if(active && markCount < MaxMarks)
+		{
+			stages[markCount] = stage;
+			offsets[markCount] = timer.nsecsElapsed() / 1000;
+			++markCount;
+		}
+	}
+
+	// writes the trace out if wanted and deactivates it. does nothing if
+	//   the trace is not active
+	void finish();
+
+private:
+	friend class Tracer;
+
+	bool active;
+	bool sampled;
+	QByteArray id;
+	QByteArray route;
+	QElapsedTimer timer;
+	int markCount;
+	const char *stages[MaxMarks];
+	qint64 offsets[MaxMarks];
+};
+
+class Tracer
+{
+public:
+	// call once at startup, before any traces are started. with a
+	//   sampleRate of n, one in n requests is traced (0 for none).
+	//   requests taking at least slowTime msecs are traced regardless
+	//   (0 to disable). capacity is the number of traces kept
+	static void setup(int sampleRate, int slowTime, int capacity = 1024);
+
+	static bool isEnabled();
+
+	// most recent first. each item is a hash of id, route, start (msecs
+	//   on the system monotonic clock, comparable across processes),
+	//   total (usecs), sampled, and stages, a list of [name, usecs] pairs
+	static QVariantList recent(int max = -1);
+
+private:
+	friend class Trace;
+
+	static void write(const Trace &trace, qint64 total);
+};
+
+#endif
@@ -20,7 +20,6 @@
 #include "websocketoverhttp.h"
 
 #include <assert.h>
-#include <QTimer>
 #include <QPointer>
 #include "log.h"
 #include "bufferlist.h"
@@ -28,88 +27,14 @@
 #include "packet/httpresponsedata.h"
 #include "zhttprequest.h"
 #include "zhttpmanager.h"
+#include "timerwheel.h"
 #include "uuidutil.h"
+#include "wsevent.h"
+#include "objectcounter.h"
 
 #define BUFFER_SIZE 200000
 
-class WsEvent
-{
-public:
-	QByteArray type;
-	QByteArray content;
-
-	WsEvent()
-	{
-	}
-
-	WsEvent(const QByteArray &_type, const QByteArray &_content = QByteArray()) :
-		type(_type),
-		content(_content)
-	{
-	}
-};
-
-static QList<WsEvent> decodeEvents(const QByteArray &in, bool *ok = 0)
-{
-	QList<WsEvent> out;
-	if(ok)
-		*ok = false;
-
-	int start = 0;
-	while(start < in.size())
-	{
-		int at = in.indexOf("\r\n", start);
-		if(at == -1)
-			return QList<WsEvent>();
-
-		QByteArray typeLine = in.mid(start, at - start);
-		start = at + 2;
-
-		WsEvent e;
-		at = typeLine.indexOf(' ');
-		if(at != -1)
-		{
-			e.type = typeLine.mid(0, at);
-
-			bool check;
-			int clen = typeLine.mid(at + 1).toInt(&check, 16);
-			if(!check)
-				return QList<WsEvent>();
-
-			e.content = in.mid(start, clen);
-			start += clen + 2;
-		}
-		else
-		{
-			e.type = typeLine;
-		}
-
-		out += e;
-	}
-
-	if(ok)
-		*ok = true;
-	return out;
-}
-
-static QByteArray encodeEvents(const QList<WsEvent> &events)
-{
-	QByteArray out;
-
-	foreach(const WsEvent &e, events)
-	{
-		if(!e.content.isNull())
-		{
-			out += e.type + ' ' + QByteArray::number(e.content.size(), 16) + "\r\n" + e.content + "\r\n";
-		}
-		else
-		{
-			out += e.type + "\r\n";
-		}
-	}
-
-	return out;
-}
+static ObjectCounter g_counter("WebSocketOverHttp");
 
 class WebSocketOverHttp::Private : public QObject
 {
@@ -141,7 +66,8 @@ public:
 	bool closeSent;
 	bool peerClosing;
 	int peerCloseCode;
-	QTimer *keepAliveTimer;
+	QPointer<TimerWheel> timerWheel;
+	int keepAliveTimer;
 
 	Private(WebSocketOverHttp *_q) :
 		QObject(_q),
@@ -160,18 +86,27 @@ public:
 		closeCode(-1),
 		closeSent(false),
 		peerClosing(false),
-		peerCloseCode(-1)
+		peerCloseCode(-1),
+		keepAliveTimer(-1)
 	{
-		keepAliveTimer = new QTimer(this);
-		connect(keepAliveTimer, SIGNAL(timeout()), SLOT(keepAliveTimer_timeout()));
-		keepAliveTimer->setSingleShot(true);
 	}
 
 	~Private()
 	{
-		keepAliveTimer->disconnect(this);
-		keepAliveTimer->setParent(0);
-		keepAliveTimer->deleteLater();
+		// the manager, and its wheel, may be gone by now
+		if(timerWheel)
+			timerWheel->remove(keepAliveTimer);
+	}
+
+	void setupTimers()
+	{
+		timerWheel = zhttpManager->timerWheel();
+		keepAliveTimer = timerWheel->add(keepAlive_cb, this);
+	}
+
+	static void keepAlive_cb(void *data)
+	{
+		((Private *)data)->keepAliveTimer_timeout();
 	}
 
 	void start()
@@ -238,7 +173,7 @@ private:
 
 		updating = true;
 
-		keepAliveTimer->stop();
+		timerWheel->stop(keepAliveTimer);
 
 		req = zhttpManager->createRequest();
 		req->setParent(this);
@@ -533,7 +468,7 @@ private slots:
 		if(!outFrames.isEmpty() || (state == Closing && !closeSent))
 			update();
 		else if(keepAliveInterval != -1)
-			keepAliveTimer->start(keepAliveInterval * 1000);
+			timerWheel->start(keepAliveTimer, keepAliveInterval * 1000);
 	}
 
 	void req_bytesWritten(int count)
@@ -561,12 +496,15 @@ WebSocketOverHttp::WebSocketOverHttp(ZhttpManager *zhttpManager, QObject *parent
 	WebSocket(parent)
 {
 	d = new Private(this);
+	g_counter.ref();
 	d->zhttpManager = zhttpManager;
+	d->setupTimers();
 }
 
 WebSocketOverHttp::~WebSocketOverHttp()
 {
 	delete d;
+	g_counter.deref();
 }
 
 void WebSocketOverHttp::setConnectionId(const QByteArray &id)
@@ -26,6 +26,7 @@
 #include "log.h"
 #include "tnetstring.h"
 #include "wscontrolsession.h"
+#include "timerwheel.h"
 
 #define DEFAULT_HWM 5000
 
@@ -41,6 +42,7 @@ public:
 	QZmq::Socket *outSock;
 	QZmq::Valve *inValve;
 	QHash<QByteArray, WsControlSession*> sessionsByCid;
+	TimerWheel *timerWheel;
 
 	Private(WsControlManager *_q) :
 		QObject(_q),
@@ -49,6 +51,7 @@ public:
 		outSock(0),
 		inValve(0)
 	{
+		timerWheel = new TimerWheel(this);
 	}
 
 	~Private()
@@ -213,4 +216,9 @@ void WsControlManager::write(const WsControlPacket::Item &item)
 	d->write(item);
 }
 
+TimerWheel *WsControlManager::timerWheel() const
+{
+	return d->timerWheel;
+}
+
 #include "wscontrolmanager.moc"
@@ -24,6 +24,7 @@
 #include "packet/wscontrolpacket.h"
 
 class WsControlSession;
+class TimerWheel;
 
 class WsControlManager : public QObject
 {
@@ -47,6 +48,7 @@ private:
 	void unlink(const QByteArray &cid);
 	bool canWriteImmediately() const;
 	void write(const WsControlPacket::Item &item);
+	TimerWheel *timerWheel() const;
 };
 
 #endif
@@ -20,11 +20,14 @@
 #include "wscontrolsession.h"
 
 #include <assert.h>
-#include <QTimer>
 #include "wscontrolmanager.h"
+#include "timerwheel.h"
+#include "objectcounter.h"
 
 #define KEEPALIVE_TIMEOUT 30000
 
+static ObjectCounter g_counter("WsControlSession");
+
 class WsControlSession::Private : public QObject
 {
 	Q_OBJECT
@@ -33,16 +36,17 @@ public:
 	WsControlSession *q;
 	WsControlManager *manager;
 	QByteArray cid;
-	QTimer *keepAliveTimer;
+	TimerWheel *timerWheel;
+	int keepAliveTimer;
 	QByteArray channelPrefix;
 
 	Private(WsControlSession *_q) :
 		QObject(_q),
 		q(_q),
-		manager(0)
+		manager(0),
+		timerWheel(0),
+		keepAliveTimer(-1)
 	{
-		 keepAliveTimer = new QTimer(this);
-		 connect(keepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAlive_timeout()));
 	}
 
 	~Private()
@@ -52,12 +56,11 @@ public:
 
 	void cleanup()
 	{
-		if(keepAliveTimer)
+		if(timerWheel)
 		{
-			keepAliveTimer->disconnect(this);
-			keepAliveTimer->setParent(0);
-			keepAliveTimer->deleteLater();
-			keepAliveTimer = 0;
+			timerWheel->remove(keepAliveTimer);
+			keepAliveTimer = -1;
+			timerWheel = 0;
 		}
 
 		if(manager)
@@ -71,9 +74,20 @@ public:
 		}
 	}
 
+	void setupTimers()
+	{
+		timerWheel = manager->timerWheel();
+		keepAliveTimer = timerWheel->add(keepAlive_cb, this);
+	}
+
+	static void keepAlive_cb(void *data)
+	{
+		((Private *)data)->keepAlive_timeout();
+	}
+
 	void start()
 	{
-		keepAliveTimer->start(KEEPALIVE_TIMEOUT);
+		timerWheel->start(keepAliveTimer, KEEPALIVE_TIMEOUT);
 
 		WsControlPacket::Item i;
 		i.type = WsControlPacket::Item::Here;
@@ -117,6 +131,8 @@ public:
 private slots:
 	void keepAlive_timeout()
 	{
+		timerWheel->start(keepAliveTimer, KEEPALIVE_TIMEOUT);
+
 		WsControlPacket::Item i;
 		i.type = WsControlPacket::Item::Here;
 		write(i);
@@ -127,11 +143,13 @@ WsControlSession::WsControlSession(QObject *parent) :
 	QObject(parent)
 {
 	d = new Private(this);
+	g_counter.ref();
 }
 
 WsControlSession::~WsControlSession()
 {
 	delete d;
+	g_counter.deref();
 }
 
 void WsControlSession::start(const QByteArray &channelPrefix)
@@ -148,6 +166,7 @@ void WsControlSession::sendGripMessage(const QByteArray &message)
 void WsControlSession::setup(WsControlManager *manager, const QByteArray &cid)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->cid = cid;
 	d->manager->link(this, d->cid);
 }
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wsevent.h"
+
+QList<WsEvent> decodeEvents(const QByteArray &in, bool *ok)
+{
+	QList<WsEvent> out;
+	if(ok)
+		*ok = false;
+
+	int start = 0;
+	while(start < in.size())
+	{
+		int at = in.indexOf("\r\n", start);
+		if(at == -1)
+			return QList<WsEvent>();
+
+		QByteArray typeLine = in.mid(start, at - start);
+		start = at + 2;
+
+		WsEvent e;
+		at = typeLine.indexOf(' ');
+		if(at != -1)
+		{
+			e.type = typeLine.mid(0, at);
+
+			bool check;
+			int clen = typeLine.mid(at + 1).toInt(&check, 16);
+			if(!check)
+				return QList<WsEvent>();
+
+			e.content = in.mid(start, clen);
+			start += clen + 2;
+		}
+		else
+		{
+			e.type = typeLine;
+		}
+
+		out += e;
+	}
+
+	if(ok)
+		*ok = true;
+	return out;
+}
+
+QByteArray encodeEvents(const QList<WsEvent> &events)
+{
+	QByteArray out;
+
+	foreach(const WsEvent &e, events)
+	{
+		if(!e.content.isNull())
+		{
+			out += e.type + ' ' + QByteArray::number(e.content.size(), 16) + "\r\n" + e.content + "\r\n";
+		}
+		else
+		{
+			out += e.type + "\r\n";
+		}
+	}
+
+	return out;
+}
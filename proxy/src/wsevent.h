@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WSEVENT_H
+#define WSEVENT_H
+
+#include <QByteArray>
+#include <QList>
+
+// events of the websocket-over-http protocol, as carried in
+//   application/websocket-events bodies
+
+class WsEvent
+{
+public:
+	QByteArray type;
+	QByteArray content;
+
+	WsEvent()
+	{
+	}
+
+	WsEvent(const QByteArray &_type, const QByteArray &_content = QByteArray()) :
+		type(_type),
+		content(_content)
+	{
+	}
+};
+
+// returns an empty list and sets ok to false if the input is malformed
+QList<WsEvent> decodeEvents(const QByteArray &in, bool *ok = 0);
+QByteArray encodeEvents(const QList<WsEvent> &events);
+
+#endif
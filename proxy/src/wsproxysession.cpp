@@ -20,7 +20,7 @@
 #include "wsproxysession.h"
 
 #include <assert.h>
-#include <QTimer>
+#include <QElapsedTimer>
 #include <QUrl>
 #include <QHostAddress>
 #include <qjson/serializer.h>
@@ -34,181 +34,24 @@
 #include "wscontrolmanager.h"
 #include "wscontrolsession.h"
 #include "xffrule.h"
+#include "headerrewrite.h"
 #include "proxyutil.h"
+#include "httpextension.h"
 #include "statsmanager.h"
+#include "metrics.h"
 #include "inspectdata.h"
 #include "connectionmanager.h"
+#include "objectcounter.h"
 
 #define ACTIVITY_TIMEOUT 60000
 
-class HttpExtension
-{
-public:
-	bool isNull() const { return name.isEmpty(); }
-
-	QByteArray name;
-	QHash<QByteArray, QByteArray> params;
-};
-
-static int findNext(const QByteArray &in, const char *charList, int start = 0)
-{
-	int len = qstrlen(charList);
-	for(int n = start; n < in.size(); ++n)
-	{
-		char c = in[n];
-		for(int i = 0; i < len; ++i)
-		{
-			if(c == charList[i])
-				return n;
-		}
-	}
-
-	return -1;
-}
-
-static QHash<QByteArray, QByteArray> parseParams(const QByteArray &in, bool *ok = 0)
-{
-	QHash<QByteArray, QByteArray> out;
-
-	int start = 0;
-	while(start < in.size())
-	{
-		QByteArray var;
-		QByteArray val;
-
-		int at = findNext(in, "=;", start);
-		if(at != -1)
-		{
-			var = in.mid(start, at - start).trimmed();
-			if(in[at] == '=')
-			{
-				if(at + 1 >= in.size())
-				{
-					if(ok)
-						*ok = false;
-					return QHash<QByteArray, QByteArray>();
-				}
-
-				++at;
-
-				if(in[at] == '\"')
-				{
-					++at;
-
-					bool complete = false;
-					for(int n = at; n < in.size(); ++n)
-					{
-						if(in[n] == '\\')
-						{
-							if(n + 1 >= in.size())
-							{
-								if(ok)
-									*ok = false;
-								return QHash<QByteArray, QByteArray>();
-							}
-
-							++n;
-							val += in[n];
-						}
-						else if(in[n] == '\"')
-						{
-							complete = true;
-							at = n + 1;
-							break;
-						}
-						else
-							val += in[n];
-					}
-
-					if(!complete)
-					{
-						if(ok)
-							*ok = false;
-						return QHash<QByteArray, QByteArray>();
-					}
-
-					at = in.indexOf(';', at);
-					if(at != -1)
-						start = at + 1;
-					else
-						start = in.size();
-				}
-				else
-				{
-					int vstart = at;
-					at = in.indexOf(';', vstart);
-					if(at != -1)
-					{
-						val = in.mid(vstart, at - vstart).trimmed();
-						start = at + 1;
-					}
-					else
-					{
-						val = in.mid(vstart).trimmed();
-						start = in.size();
-					}
-				}
-			}
-			else
-				start = at + 1;
-		}
-		else
-		{
-			var = in.mid(start).trimmed();
-			start = in.size();
-		}
-
-		out[var] = val;
-	}
-
-	if(ok)
-		*ok = true;
-
-	return out;
-}
-
-static HttpExtension getExtension(const QList<QByteArray> &extStrings, const QByteArray &name)
-{
-	foreach(const QByteArray &ext, extStrings)
-	{
-		bool found = false;
-		int at = ext.indexOf(';');
-		if(at != -1)
-		{
-			if(ext.mid(0, at).trimmed() == name)
-				found = true;
-		}
-		else
-		{
-			if(ext == name)
-				found = true;
-		}
-
-		if(found)
-		{
-			HttpExtension e;
-			e.name = name;
-
-			if(at != -1)
-			{
-				bool ok;
-				e.params = parseParams(ext.mid(at + 1), &ok);
-				if(!ok)
-					return HttpExtension();
-			}
-
-			return e;
-		}
-	}
-
-	return HttpExtension();
-}
-
 static QByteArray ridToString(const QPair<QByteArray, QByteArray> &rid)
 {
 	return rid.first + ':' + rid.second;
 }
 
+static ObjectCounter g_counter("WsProxySession");
+
 class WsProxySession::Private : public QObject
 {
 	Q_OBJECT
@@ -235,25 +78,31 @@ public:
 	QByteArray defaultSigKey;
 	QByteArray defaultUpstreamKey;
 	bool passToUpstream;
-	bool useXForwardedProtocol;
 	XffRule xffRule;
 	XffRule xffTrustedRule;
-	QList<QByteArray> origHeadersNeedMark;
+	HeaderRewrite headerRewrite;
 	HttpRequestData requestData;
 	ZWebSocket::Rid rid;
 	ZWebSocket *inSock;
 	WebSocket *outSock;
 	int inPendingBytes;
 	int outPendingBytes;
+	qint64 bytesIn;
+	qint64 bytesOut;
+	Metrics *metrics;
+	Metrics::Route *routeMetrics;
 	int outReadInProgress; // frame type or -1
 	QByteArray routeId;
 	QByteArray channelPrefix;
 	QList<DomainMap::Target> targets;
+	DomainMap::Target target;
+	bool targetActive;
+	QElapsedTimer targetTime;
 	bool acceptGripMessages;
 	QByteArray messagePrefix;
 	bool detached;
 	QString subChannel;
-	QTimer *activityTimer;
+	QElapsedTimer activityTime;
 	QByteArray publicCid;
 
 	Private(WsProxySession *_q, ZRoutes *_zroutes, DomainMap *_domainMap, ConnectionManager *_connectionManager, StatsManager *_statsManager, WsControlManager *_wsControlManager) :
@@ -268,18 +117,19 @@ public:
 		wsControlManager(_wsControlManager),
 		wsControl(0),
 		passToUpstream(false),
-		useXForwardedProtocol(false),
 		inSock(0),
 		outSock(0),
 		inPendingBytes(0),
 		outPendingBytes(0),
+		bytesIn(0),
+		bytesOut(0),
+		metrics(0),
+		routeMetrics(0),
 		outReadInProgress(-1),
+		targetActive(false),
 		acceptGripMessages(false),
 		detached(false)
 	{
-		activityTimer = new QTimer(this);
-		connect(activityTimer, SIGNAL(timeout()), SLOT(activity_timeout()));
-		activityTimer->setSingleShot(true);
 	}
 
 	~Private()
@@ -296,20 +146,11 @@ public:
 			inSock = 0;
 		}
 
-		delete outSock;
-		outSock = 0;
+		destroyOutSock();
 
 		delete wsControl;
 		wsControl = 0;
 
-		if(activityTimer)
-		{
-			activityTimer->setParent(0);
-			activityTimer->disconnect(this);
-			activityTimer->deleteLater();
-			activityTimer = 0;
-		}
-
 		if(zhttpManager)
 		{
 			zroutes->removeRef(zhttpManager);
@@ -326,8 +167,10 @@ public:
 		rid = sock->rid();
 		publicCid = _publicCid;
 
+		// activity is rate limited. no need for a timer, just note when
+		//   it was last reported
 		if(statsManager)
-			activityTimer->start(ACTIVITY_TIMEOUT);
+			activityTime.start();
 
 		inSock = sock;
 		inSock->setParent(this);
@@ -369,11 +212,14 @@ public:
 
 		routeId = entry.id;
 		channelPrefix = entry.prefix;
-		targets = entry.targets;
+		targets = zroutes->targetsForRoute(entry);
+
+		if(metrics)
+			routeMetrics = metrics->route(routeId);
 
 		log_debug("wsproxysession: %p %s has %d routes", q, qPrintable(host), targets.count());
 
-		bool trustedClient = ProxyUtil::manipulateRequestHeaders("wsproxysession", q, &requestData, defaultUpstreamKey, entry, sigIss, sigKey, useXForwardedProtocol, xffTrustedRule, xffRule, origHeadersNeedMark, inSock->peerAddress(), InspectData());
+		bool trustedClient = ProxyUtil::manipulateRequestHeaders("wsproxysession", q, &requestData, defaultUpstreamKey, entry, sigIss, sigKey, headerRewrite, xffTrustedRule, xffRule, inSock->peerAddress(), InspectData());
 
 		// don't proxy extensions, as we may not know how to handle them
 		requestData.headers.removeAll("Sec-WebSocket-Extensions");
@@ -387,15 +233,34 @@ public:
 		tryNextTarget();
 	}
 
+	void destroyOutSock()
+	{
+		delete outSock;
+		outSock = 0;
+
+		if(targetActive)
+		{
+			targetActive = false;
+			zroutes->targetFinished(target);
+		}
+	}
+
 	void tryNextTarget()
 	{
+		// skip targets that are cooling down after failures
+		while(!targets.isEmpty() && !zroutes->targetAvailable(targets.first()))
+		{
+			log_debug("wsproxysession: %p skipping unavailable target", q);
+			targets.removeFirst();
+		}
+
 		if(targets.isEmpty())
 		{
 			reject(502, "Bad Gateway", "Error while proxying to origin.");
 			return;
 		}
 
-		DomainMap::Target target = targets.takeFirst();
+		target = targets.takeFirst();
 
 		QUrl uri = requestData.uri;
 		if(target.ssl)
@@ -462,6 +327,10 @@ public:
 			outSock->setConnectPort(target.connectPort);
 		}
 
+		zroutes->targetStarted(target);
+		targetActive = true;
+		targetTime.start();
+
 		outSock->start(uri, requestData.headers);
 	}
 
@@ -491,6 +360,7 @@ public:
 
 			outSock->writeFrame(f);
 			outPendingBytes += f.data.size();
+			bytesIn += f.data.size();
 		}
 	}
 
@@ -529,6 +399,7 @@ public:
 						f.data = f.data.mid(messagePrefix.size());
 						inSock->writeFrame(f);
 						inPendingBytes += f.data.size();
+						bytesOut += f.data.size();
 					}
 					else if(f.type == WebSocket::Frame::Continuation)
 					{
@@ -536,12 +407,14 @@ public:
 
 						inSock->writeFrame(f);
 						inPendingBytes += f.data.size();
+						bytesOut += f.data.size();
 					}
 				}
 				else
 				{
 					inSock->writeFrame(f);
 					inPendingBytes += f.data.size();
+					bytesOut += f.data.size();
 				}
 
 				if(!f.more)
@@ -552,6 +425,7 @@ public:
 				// always relay non-content frames
 				inSock->writeFrame(f);
 				inPendingBytes += f.data.size();
+				bytesOut += f.data.size();
 			}
 		}
 	}
@@ -560,6 +434,12 @@ public:
 	{
 		if(!inSock && !outSock)
 		{
+			if(routeMetrics)
+			{
+				routeMetrics->record(Metrics::BytesIn, bytesIn);
+				routeMetrics->record(Metrics::BytesOut, bytesOut);
+			}
+
 			cleanup();
 			emit q->finishedByPassthrough();
 		}
@@ -567,11 +447,11 @@ public:
 
 	void tryLogActivity()
 	{
-		if(statsManager && !activityTimer->isActive())
+		if(statsManager && (!activityTime.isValid() || activityTime.elapsed() >= ACTIVITY_TIMEOUT))
 		{
 			statsManager->addActivity(routeId);
 
-			activityTimer->start(ACTIVITY_TIMEOUT);
+			activityTime.start();
 		}
 	}
 
@@ -604,8 +484,7 @@ private slots:
 			{
 				if(outSock->state() == WebSocket::Connecting)
 				{
-					delete outSock;
-					outSock = 0;
+					destroyOutSock();
 
 					inSock->close();
 				}
@@ -637,8 +516,7 @@ private slots:
 
 		if(!detached)
 		{
-			delete outSock;
-			outSock = 0;
+			destroyOutSock();
 		}
 
 		tryFinish();
@@ -648,6 +526,12 @@ private slots:
 	{
 		log_debug("wsproxysession: %p connected", q);
 
+		zroutes->targetResponded(target, targetTime.elapsed());
+		zroutes->targetSucceeded(target);
+
+		if(routeMetrics)
+			routeMetrics->record(Metrics::FirstByteTime, targetTime.nsecsElapsed() / 1000);
+
 		state = Connected;
 
 		HttpHeaders headers = outSock->responseHeaders();
@@ -718,8 +602,7 @@ private slots:
 
 	void out_closed()
 	{
-		delete outSock;
-		outSock = 0;
+		destroyOutSock();
 
 		if(!detached && inSock && inSock->state() != WebSocket::Closing)
 			inSock->close();
@@ -732,10 +615,12 @@ private slots:
 		WebSocket::ErrorCondition e = outSock->errorCondition();
 		log_debug("wsproxysession: %p target error state=%d, condition=%d", q, (int)state, (int)e);
 
+		if(e == WebSocket::ErrorConnect || e == WebSocket::ErrorConnectTimeout || e == WebSocket::ErrorTimeout || (e == WebSocket::ErrorRejected && outSock->responseCode() >= 500))
+			zroutes->targetFailed(target);
+
 		if(detached)
 		{
-			delete outSock;
-			outSock = 0;
+			destroyOutSock();
 
 			tryFinish();
 			return;
@@ -760,8 +645,7 @@ private slots:
 					break;
 			}
 
-			delete outSock;
-			outSock = 0;
+			destroyOutSock();
 
 			if(tryAgain)
 				tryNextTarget();
@@ -771,8 +655,7 @@ private slots:
 			connectionManager->removeConnection(inSock->rid());
 			delete inSock;
 			inSock = 0;
-			delete outSock;
-			outSock = 0;
+			destroyOutSock();
 
 			tryFinish();
 		}
@@ -789,6 +672,7 @@ private slots:
 				inSock->writeFrame(WebSocket::Frame(WebSocket::Frame::Text, message, false));
 
 			inPendingBytes += message.size();
+			bytesOut += message.size();
 		}
 	}
 
@@ -803,22 +687,19 @@ private slots:
 		if(outSock && outSock->state() != WebSocket::Closing)
 			outSock->close();
 	}
-
-	void activity_timeout()
-	{
-		// nothing to do
-	}
 };
 
 WsProxySession::WsProxySession(ZRoutes *zroutes, DomainMap *domainMap, ConnectionManager *connectionManager, StatsManager *statsManager, WsControlManager *wsControlManager, QObject *parent) :
 	QObject(parent)
 {
 	d = new Private(this, zroutes, domainMap, connectionManager, statsManager, wsControlManager);
+	g_counter.ref();
 }
 
 WsProxySession::~WsProxySession()
 {
 	delete d;
+	g_counter.deref();
 }
 
 QByteArray WsProxySession::routeId() const
@@ -842,20 +723,20 @@ void WsProxySession::setDefaultUpstreamKey(const QByteArray &key)
 	d->defaultUpstreamKey = key;
 }
 
-void WsProxySession::setUseXForwardedProtocol(bool enabled)
-{
-	d->useXForwardedProtocol = enabled;
-}
-
 void WsProxySession::setXffRules(const XffRule &untrusted, const XffRule &trusted)
 {
 	d->xffRule = untrusted;
 	d->xffTrustedRule = trusted;
 }
 
-void WsProxySession::setOrigHeadersNeedMark(const QList<QByteArray> &names)
+void WsProxySession::setHeaderRewrite(const HeaderRewrite &rewrite)
+{
+	d->headerRewrite = rewrite;
+}
+
+void WsProxySession::setMetrics(Metrics *metrics)
 {
-	d->origHeadersNeedMark = names;
+	d->metrics = metrics;
 }
 
 void WsProxySession::start(ZWebSocket *sock, const QByteArray &publicCid)
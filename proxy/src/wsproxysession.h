@@ -29,6 +29,8 @@ class StatsManager;
 class DomainMap;
 class ConnectionManager;
 class XffRule;
+class HeaderRewrite;
+class Metrics;
 
 class WsProxySession : public QObject
 {
@@ -43,9 +45,9 @@ public:
 
 	void setDefaultSigKey(const QByteArray &iss, const QByteArray &key);
 	void setDefaultUpstreamKey(const QByteArray &key);
-	void setUseXForwardedProtocol(bool enabled);
 	void setXffRules(const XffRule &untrusted, const XffRule &trusted);
-	void setOrigHeadersNeedMark(const QList<QByteArray> &names);
+	void setHeaderRewrite(const HeaderRewrite &rewrite);
+	void setMetrics(Metrics *metrics);
 
 	// takes ownership
 	void start(ZWebSocket *sock, const QByteArray &publicCid);
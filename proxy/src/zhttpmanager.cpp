@@ -22,13 +22,18 @@
 #include <assert.h>
 #include <QStringList>
 #include <QHash>
+#include <QSet>
 #include <QPointer>
+#include <QTimer>
 #include <QFile>
 #include "qzmqsocket.h"
 #include "qzmqvalve.h"
 #include "tnetstring.h"
 #include "zhttprequestpacket.h"
 #include "zhttpresponsepacket.h"
+#include "zhttppacketreader.h"
+#include "zhttppacketwriter.h"
+#include "timerwheel.h"
 #include "log.h"
 
 #define OUT_HWM 100
@@ -36,6 +41,12 @@
 #define DEFAULT_HWM 1000
 #define SHUTDOWN_WAIT_TIME 1000
 
+// half of the session expiration of our peers
+#define KEEPALIVE_INTERVAL 30000
+
+// max number of ids per keep-alive packet
+#define KEEPALIVE_BATCH_MAX 1000
+
 class ZhttpManager::Private : public QObject
 {
 	Q_OBJECT
@@ -48,6 +59,8 @@ public:
 		WebSocketSession
 	};
 
+	typedef QList<ZhttpPacketWriter::KeepAliveId> KeepAliveIds;
+
 	ZhttpManager *q;
 	QStringList client_out_specs;
 	QStringList client_out_stream_specs;
@@ -64,6 +77,7 @@ public:
 	QZmq::Socket *server_in_stream_sock;
 	QZmq::Socket *server_out_sock;
 	QZmq::Valve *server_in_valve;
+	bool serverInPaused;
 	QByteArray instanceId;
 	int ipcFileMode;
 	bool doBind;
@@ -73,6 +87,11 @@ public:
 	QHash<ZWebSocket::Rid, ZWebSocket*> clientSocksByRid;
 	QHash<ZWebSocket::Rid, ZWebSocket*> serverSocksByRid;
 	QList<ZWebSocket*> serverPendingSocks;
+	TimerWheel *timerWheel;
+	QSet<ZhttpRequest*> keepAliveReqs;
+	QSet<ZWebSocket*> keepAliveSocks;
+	QSet<QByteArray> multiPeers;
+	QTimer *keepAliveTimer;
 
 	Private(ZhttpManager *_q) :
 		QObject(_q),
@@ -85,9 +104,23 @@ public:
 		server_in_stream_sock(0),
 		server_out_sock(0),
 		server_in_valve(0),
+		serverInPaused(false),
 		ipcFileMode(-1),
 		doBind(false)
 	{
+		timerWheel = new TimerWheel(this);
+
+		keepAliveTimer = new QTimer(this);
+		connect(keepAliveTimer, SIGNAL(timeout()), SLOT(keepAlive_timeout()));
+		keepAliveTimer->setInterval(KEEPALIVE_INTERVAL);
+		keepAliveTimer->start();
+	}
+
+	~Private()
+	{
+		keepAliveTimer->disconnect(this);
+		keepAliveTimer->setParent(0);
+		keepAliveTimer->deleteLater();
 	}
 
 	bool bindSpec(QZmq::Socket *sock, const QString &spec)
@@ -251,7 +284,8 @@ public:
 		server_in_valve = new QZmq::Valve(server_in_sock, this);
 		connect(server_in_valve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(server_in_readyRead(const QList<QByteArray> &)));
 
-		server_in_valve->open();
+		if(!serverInPaused)
+			server_in_valve->open();
 
 		return true;
 	}
@@ -326,13 +360,13 @@ public:
 		assert(client_out_sock || client_req_sock);
 		const char *logprefix = logPrefixForType(type);
 
-		QVariant vpacket = packet.toVariant();
-		QByteArray buf = QByteArray("T") + TnetString::fromVariant(vpacket);
+		bool multi = (packet.seq == 0 || packet.type == ZhttpRequestPacket::KeepAlive);
+		QByteArray buf = ZhttpPacketWriter::writeRequest(packet, QByteArray(), multi);
 
 		if(client_out_sock)
 		{
 			if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-				log_debug("%s client: OUT %s", logprefix, qPrintable(TnetString::variantToString(vpacket, -1)));
+				log_debug("%s client: OUT %s", logprefix, qPrintable(TnetString::variantToString(TnetString::toVariant(buf, 1), -1)));
 
 			client_out_sock->write(QList<QByteArray>() << buf);
 		}
@@ -343,15 +377,19 @@ public:
 	}
 
 	void write(SessionType type, const ZhttpRequestPacket &packet, const QByteArray &instanceAddress)
+	{
+		bool multi = (packet.type == ZhttpRequestPacket::KeepAlive);
+		writeClientStream(type, ZhttpPacketWriter::writeRequest(packet, QByteArray(), multi), instanceAddress);
+	}
+
+	// buf is an encoded packet including the "T" prefix
+	void writeClientStream(SessionType type, const QByteArray &buf, const QByteArray &instanceAddress)
 	{
 		assert(client_out_stream_sock);
 		const char *logprefix = logPrefixForType(type);
 
-		QVariant vpacket = packet.toVariant();
-		QByteArray buf = QByteArray("T") + TnetString::fromVariant(vpacket);
-
 		if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-			log_debug("%s client: OUT %s %s", logprefix, instanceAddress.data(), qPrintable(TnetString::variantToString(vpacket, -1)));
+			log_debug("%s client: OUT %s %s", logprefix, instanceAddress.data(), qPrintable(TnetString::variantToString(TnetString::toVariant(buf, 1), -1)));
 
 		QList<QByteArray> msg;
 		msg += instanceAddress;
@@ -361,19 +399,120 @@ public:
 	}
 
 	void write(SessionType type, const ZhttpResponsePacket &packet, const QByteArray &instanceAddress)
+	{
+		bool multi = (packet.seq == 0 || packet.type == ZhttpResponsePacket::KeepAlive);
+		writeServerOut(type, ZhttpPacketWriter::writeResponse(packet, instanceAddress, multi), instanceAddress);
+	}
+
+	// buf is an encoded packet including the address and "T" prefix
+	void writeServerOut(SessionType type, const QByteArray &buf, const QByteArray &instanceAddress)
 	{
 		assert(server_out_sock);
 		const char *logprefix = logPrefixForType(type);
 
-		QVariant vpacket = packet.toVariant();
-		QByteArray buf = instanceAddress + " T" + TnetString::fromVariant(vpacket);
-
 		if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-			log_debug("%s server: OUT %s %s", logprefix, instanceAddress.data(), qPrintable(TnetString::variantToString(vpacket, -1)));
+			log_debug("%s server: OUT %s %s", logprefix, instanceAddress.data(), qPrintable(TnetString::variantToString(TnetString::toVariant(buf, instanceAddress.size() + 2), -1)));
 
 		server_out_sock->write(QList<QByteArray>() << buf);
 	}
 
+	void updateMultiPeer(const QByteArray &from, int seq, bool keepAlive, bool multi)
+	{
+		// the flag is only expected in first packets and keep-alives
+		if(from.isEmpty() || (seq != 0 && !keepAlive))
+			return;
+
+		if(multi)
+			multiPeers += from;
+		else
+			multiPeers.remove(from);
+	}
+
+	void writeKeepAliveBatches(SessionType type, bool server, const QHash<QByteArray, KeepAliveIds> &batches)
+	{
+		QHashIterator<QByteArray, KeepAliveIds> it(batches);
+		while(it.hasNext())
+		{
+			it.next();
+			const KeepAliveIds &ids = it.value();
+
+			for(int n = 0; n < ids.count(); n += KEEPALIVE_BATCH_MAX)
+			{
+				if(server)
+					writeServerOut(type, ZhttpPacketWriter::writeKeepAliveBatch(instanceId, ids.mid(n, KEEPALIVE_BATCH_MAX), it.key()), it.key());
+				else
+					writeClientStream(type, ZhttpPacketWriter::writeKeepAliveBatch(instanceId, ids.mid(n, KEEPALIVE_BATCH_MAX)), it.key());
+			}
+		}
+	}
+
+	static void addKeepAliveId(QHash<QByteArray, KeepAliveIds> *batches, const QByteArray &address, const QByteArray &id, int seq)
+	{
+		(*batches)[address] += ZhttpPacketWriter::KeepAliveId(id, seq);
+	}
+
+	void handleClientIn(const ZhttpResponsePacket &p)
+	{
+		// is this for a websocket?
+		ZWebSocket *sock = clientSocksByRid.value(ZWebSocket::Rid(instanceId, p.id));
+		if(sock)
+		{
+			sock->handle(p);
+			return;
+		}
+
+		// is this for an http request?
+		ZhttpRequest *req = clientReqsByRid.value(ZhttpRequest::Rid(instanceId, p.id));
+		if(req)
+		{
+			req->handle(p);
+			return;
+		}
+
+		log_debug("zhttp/zws client: received message for unknown request id, canceling");
+
+		// if this was not an error packet, send cancel
+		if(p.type != ZhttpResponsePacket::Error && p.type != ZhttpResponsePacket::Cancel && !p.from.isEmpty())
+		{
+			ZhttpRequestPacket out;
+			out.from = instanceId;
+			out.id = p.id;
+			out.type = ZhttpRequestPacket::Cancel;
+			write(UnknownSession, out, p.from);
+		}
+	}
+
+	void handleServerInStream(const ZhttpRequestPacket &p)
+	{
+		// is this for a websocket?
+		ZWebSocket *sock = serverSocksByRid.value(ZWebSocket::Rid(p.from, p.id));
+		if(sock)
+		{
+			sock->handle(p);
+			return;
+		}
+
+		// is this for an http request?
+		ZhttpRequest *req = serverReqsByRid.value(ZhttpRequest::Rid(p.from, p.id));
+		if(req)
+		{
+			req->handle(p);
+			return;
+		}
+
+		log_warning("zhttp/zws server: received message for unknown request id, canceling");
+
+		// if this was not an error packet, send cancel
+		if(p.type != ZhttpRequestPacket::Error && p.type != ZhttpRequestPacket::Cancel && !p.from.isEmpty())
+		{
+			ZhttpResponsePacket out;
+			out.from = instanceId;
+			out.id = p.id;
+			out.type = ZhttpResponsePacket::Cancel;
+			write(UnknownSession, out, p.from);
+		}
+	}
+
 	static const char *logPrefixForType(SessionType type)
 	{
 		switch(type)
@@ -415,64 +554,50 @@ public slots:
 				continue;
 			}
 
-			QByteArray receiver = msg[0].mid(0, at);
-			QByteArray dataRaw = msg[0].mid(at + 1);
-			if(dataRaw.length() < 1 || dataRaw[0] != 'T')
+			if(msg[0].length() < at + 2 || msg[0][at + 1] != 'T')
 			{
 				log_warning("zhttp/zws client: received message with invalid format (missing type), skipping");
 				continue;
 			}
 
-			QVariant data = TnetString::toVariant(dataRaw.mid(1));
-			if(data.isNull())
-			{
-				log_warning("zhttp/zws client: received message with invalid format (tnetstring parse failed), skipping");
-				continue;
-			}
-
 			if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-				log_debug("zhttp/zws client: IN %s %s", receiver.data(), qPrintable(TnetString::variantToString(data, -1)));
+				log_debug("zhttp/zws client: IN %s %s", msg[0].mid(0, at).data(), qPrintable(TnetString::variantToString(TnetString::toVariant(msg[0], at + 2), -1)));
 
+			// decode in place, skipping the address and type prefix
 			ZhttpResponsePacket p;
-			if(!p.fromVariant(data))
+			ZhttpPacketReader::Extensions ext;
+			if(!ZhttpPacketReader::readResponse(msg[0], at + 2, &p, &ext))
 			{
 				log_warning("zhttp/zws client: received message with invalid format (parse failed), skipping");
 				continue;
 			}
 
-			// is this for a websocket?
-			ZWebSocket *sock = clientSocksByRid.value(ZWebSocket::Rid(instanceId, p.id));
-			if(sock)
+			if(ext.batch)
 			{
-				sock->handle(p);
-				if(!self)
-					return;
+				// sending batches implies accepting them
+				multiPeers += p.from;
+
+				foreach(const ZhttpPacketReader::KeepAliveId &i, ext.ids)
+				{
+					ZhttpResponsePacket kp;
+					kp.from = p.from;
+					kp.id = i.first;
+					kp.type = ZhttpResponsePacket::KeepAlive;
+					kp.seq = i.second;
+
+					handleClientIn(kp);
+					if(!self)
+						return;
+				}
 
 				continue;
 			}
 
-			// is this for an http request?
-			ZhttpRequest *req = clientReqsByRid.value(ZhttpRequest::Rid(instanceId, p.id));
-			if(req)
-			{
-				req->handle(p);
-				if(!self)
-					return;
-
-				continue;
-			}
-
-			log_debug("zhttp/zws client: received message for unknown request id, canceling");
+			updateMultiPeer(p.from, p.seq, p.type == ZhttpResponsePacket::KeepAlive, ext.multi);
 
-			// if this was not an error packet, send cancel
-			if(p.type != ZhttpResponsePacket::Error && p.type != ZhttpResponsePacket::Cancel && !p.from.isEmpty())
-			{
-				ZhttpRequestPacket out;
-				out.from = instanceId;
-				out.id = p.id;
-				out.type = ZhttpRequestPacket::Cancel;
-				write(UnknownSession, out, p.from);
-			}
+			handleClientIn(p);
+			if(!self)
+				return;
 		}
 	}
 
@@ -490,18 +615,12 @@ public slots:
 			return;
 		}
 
-		QVariant data = TnetString::toVariant(msg[0].mid(1));
-		if(data.isNull())
-		{
-			log_warning("zhttp/zws server: received message with invalid format (tnetstring parse failed), skipping");
-			return;
-		}
-
 		if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-			log_debug("zhttp/zws server: IN %s", qPrintable(TnetString::variantToString(data, -1)));
+			log_debug("zhttp/zws server: IN %s", qPrintable(TnetString::variantToString(TnetString::toVariant(msg[0], 1), -1)));
 
 		ZhttpRequestPacket p;
-		if(!p.fromVariant(data))
+		ZhttpPacketReader::Extensions ext;
+		if(!ZhttpPacketReader::readRequest(msg[0], 1, &p, &ext) || ext.batch)
 		{
 			log_warning("zhttp/zws server: received message with invalid format (parse failed), skipping");
 			return;
@@ -513,6 +632,8 @@ public slots:
 			return;
 		}
 
+		updateMultiPeer(p.from, p.seq, p.type == ZhttpRequestPacket::KeepAlive, ext.multi);
+
 		if(p.uri.scheme() == "wss" || p.uri.scheme() == "ws")
 		{
 			ZWebSocket::Rid rid(p.from, p.id);
@@ -582,25 +703,17 @@ public slots:
 				continue;
 			}
 
-			QByteArray dataRaw = msg[1];
-			if(dataRaw.length() < 1 || dataRaw[0] != 'T')
+			if(msg[1].length() < 1 || msg[1][0] != 'T')
 			{
 				log_warning("zhttp/zws client req: received message with invalid format (missing type), skipping");
 				continue;
 			}
 
-			QVariant data = TnetString::toVariant(dataRaw.mid(1));
-			if(data.isNull())
-			{
-				log_warning("zhttp/zws client req: received message with invalid format (tnetstring parse failed), skipping");
-				continue;
-			}
-
 			if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-				log_debug("zhttp/zws client req: IN %s", qPrintable(TnetString::variantToString(data, -1)));
+				log_debug("zhttp/zws client req: IN %s", qPrintable(TnetString::variantToString(TnetString::toVariant(msg[1], 1), -1)));
 
 			ZhttpResponsePacket p;
-			if(!p.fromVariant(data))
+			if(!ZhttpPacketReader::readResponse(msg[1], 1, &p))
 			{
 				log_warning("zhttp/zws client req: received message with invalid format (parse failed), skipping");
 				continue;
@@ -641,56 +754,43 @@ public slots:
 				continue;
 			}
 
-			QVariant data = TnetString::toVariant(msg[2].mid(1));
-			if(data.isNull())
-			{
-				log_warning("zhttp/zws server: received message with invalid format (tnetstring parse failed), skipping");
-				continue;
-			}
-
 			if(log_outputLevel() >= LOG_LEVEL_DEBUG)
-				log_debug("zhttp/zws server: IN stream %s", qPrintable(TnetString::variantToString(data, -1)));
+				log_debug("zhttp/zws server: IN stream %s", qPrintable(TnetString::variantToString(TnetString::toVariant(msg[2], 1), -1)));
 
 			ZhttpRequestPacket p;
-			if(!p.fromVariant(data))
+			ZhttpPacketReader::Extensions ext;
+			if(!ZhttpPacketReader::readRequest(msg[2], 1, &p, &ext))
 			{
 				log_warning("zhttp/zws server: received message with invalid format (parse failed), skipping");
 				continue;
 			}
 
-			// is this for a websocket?
-			ZWebSocket *sock = serverSocksByRid.value(ZWebSocket::Rid(p.from, p.id));
-			if(sock)
+			if(ext.batch)
 			{
-				sock->handle(p);
-				if(!self)
-					return;
+				// sending batches implies accepting them
+				multiPeers += p.from;
+
+				foreach(const ZhttpPacketReader::KeepAliveId &i, ext.ids)
+				{
+					ZhttpRequestPacket kp;
+					kp.from = p.from;
+					kp.id = i.first;
+					kp.type = ZhttpRequestPacket::KeepAlive;
+					kp.seq = i.second;
+
+					handleServerInStream(kp);
+					if(!self)
+						return;
+				}
 
 				continue;
 			}
 
-			// is this for an http request?
-			ZhttpRequest *req = serverReqsByRid.value(ZhttpRequest::Rid(p.from, p.id));
-			if(req)
-			{
-				req->handle(p);
-				if(!self)
-					return;
-
-				continue;
-			}
+			updateMultiPeer(p.from, p.seq, p.type == ZhttpRequestPacket::KeepAlive, ext.multi);
 
-			log_warning("zhttp/zws server: received message for unknown request id, canceling");
-
-			// if this was not an error packet, send cancel
-			if(p.type != ZhttpRequestPacket::Error && p.type != ZhttpRequestPacket::Cancel && !p.from.isEmpty())
-			{
-				ZhttpResponsePacket out;
-				out.from = instanceId;
-				out.id = p.id;
-				out.type = ZhttpResponsePacket::Cancel;
-				write(UnknownSession, out, p.from);
-			}
+			handleServerInStream(p);
+			if(!self)
+				return;
 		}
 	}
 
@@ -698,6 +798,37 @@ public slots:
 	{
 		Q_UNUSED(count);
 	}
+
+	void keepAlive_timeout()
+	{
+		// sessions whose peers accept batches are collected per peer.
+		//   everyone else sends a keep-alive of their own from their wheel
+		//   timer, so that those writes stay spread over the interval
+		//   rather than all hitting the socket hwm at once
+		QHash<QByteArray, KeepAliveIds> httpServerBatches;
+		QHash<QByteArray, KeepAliveIds> httpClientBatches;
+		QHash<QByteArray, KeepAliveIds> wsServerBatches;
+		QHash<QByteArray, KeepAliveIds> wsClientBatches;
+
+		foreach(ZhttpRequest *req, keepAliveReqs)
+		{
+			QByteArray address = req->keepAliveAddress();
+			if(multiPeers.contains(address))
+				addKeepAliveId(req->isServer() ? &httpServerBatches : &httpClientBatches, address, req->rid().second, req->takeKeepAliveSeq());
+		}
+
+		foreach(ZWebSocket *sock, keepAliveSocks)
+		{
+			QByteArray address = sock->keepAliveAddress();
+			if(multiPeers.contains(address))
+				addKeepAliveId(sock->isServer() ? &wsServerBatches : &wsClientBatches, address, sock->rid().second, sock->takeKeepAliveSeq());
+		}
+
+		writeKeepAliveBatches(HttpSession, true, httpServerBatches);
+		writeKeepAliveBatches(HttpSession, false, httpClientBatches);
+		writeKeepAliveBatches(WebSocketSession, true, wsServerBatches);
+		writeKeepAliveBatches(WebSocketSession, false, wsClientBatches);
+	}
 };
 
 ZhttpManager::ZhttpManager(QObject *parent) :
@@ -851,6 +982,32 @@ ZWebSocket *ZhttpManager::takeNextSocket()
 	return sock;
 }
 
+int ZhttpManager::serverPendingCount() const
+{
+	return d->serverPendingReqs.count() + d->serverPendingSocks.count();
+}
+
+void ZhttpManager::setServerInPaused(bool paused)
+{
+	if(paused == d->serverInPaused)
+		return;
+
+	d->serverInPaused = paused;
+
+	if(d->server_in_valve)
+	{
+		if(paused)
+			d->server_in_valve->close();
+		else
+			d->server_in_valve->open();
+	}
+}
+
+bool ZhttpManager::isServerInPaused() const
+{
+	return d->serverInPaused;
+}
+
 ZhttpRequest *ZhttpManager::createRequestFromState(const ZhttpRequest::ServerState &state)
 {
 	ZhttpRequest *req = new ZhttpRequest;
@@ -858,6 +1015,11 @@ ZhttpRequest *ZhttpManager::createRequestFromState(const ZhttpRequest::ServerSta
 	return req;
 }
 
+TimerWheel *ZhttpManager::timerWheel() const
+{
+	return d->timerWheel;
+}
+
 void ZhttpManager::link(ZhttpRequest *req)
 {
 	if(req->isServer())
@@ -872,6 +1034,8 @@ void ZhttpManager::unlink(ZhttpRequest *req)
 		d->serverReqsByRid.remove(req->rid());
 	else
 		d->clientReqsByRid.remove(req->rid());
+
+	d->keepAliveReqs.remove(req);
 }
 
 void ZhttpManager::link(ZWebSocket *sock)
@@ -888,6 +1052,23 @@ void ZhttpManager::unlink(ZWebSocket *sock)
 		d->serverSocksByRid.remove(sock->rid());
 	else
 		d->clientSocksByRid.remove(sock->rid());
+
+	d->keepAliveSocks.remove(sock);
+}
+
+void ZhttpManager::registerKeepAlive(ZhttpRequest *req)
+{
+	d->keepAliveReqs += req;
+}
+
+void ZhttpManager::registerKeepAlive(ZWebSocket *sock)
+{
+	d->keepAliveSocks += sock;
+}
+
+bool ZhttpManager::batchesKeepAlives(const QByteArray &address) const
+{
+	return d->multiPeers.contains(address);
 }
 
 bool ZhttpManager::canWriteImmediately() const
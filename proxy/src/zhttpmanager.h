@@ -26,6 +26,7 @@
 
 class ZhttpRequestPacket;
 class ZhttpResponsePacket;
+class TimerWheel;
 
 class ZhttpManager : public QObject
 {
@@ -60,9 +61,20 @@ public:
 	ZWebSocket *createSocket();
 	ZWebSocket *takeNextSocket();
 
+	// server requests and sockets received but not yet taken
+	int serverPendingCount() const;
+
+	// while paused, nothing more is read from server_in, so new sessions
+	//   wait in the socket queue or go to other instances
+	void setServerInPaused(bool paused);
+	bool isServerInPaused() const;
+
 	// for server mode, jump directly to responding state
 	ZhttpRequest *createRequestFromState(const ZhttpRequest::ServerState &state);
 
+	// shared by the sessions of this manager for their timeouts
+	TimerWheel *timerWheel() const;
+
 signals:
 	void requestReady();
 	void socketReady();
@@ -78,6 +90,9 @@ private:
 	void unlink(ZhttpRequest *req);
 	void link(ZWebSocket *sock);
 	void unlink(ZWebSocket *sock);
+	void registerKeepAlive(ZhttpRequest *req);
+	void registerKeepAlive(ZWebSocket *sock);
+	bool batchesKeepAlives(const QByteArray &address) const;
 	bool canWriteImmediately() const;
 	void writeHttp(const ZhttpRequestPacket &packet);
 	void writeHttp(const ZhttpRequestPacket &packet, const QByteArray &instanceAddress);
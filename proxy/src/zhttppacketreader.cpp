@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zhttppacketreader.h"
+
+#include <string.h>
+#include <QUrl>
+#include <QHostAddress>
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+
+namespace ZhttpPacketReader {
+
+class Frame
+{
+public:
+	int offset; // start of the length prefix
+	int dataOffset;
+	int dataSize;
+	char type;
+	int next;
+};
+
+// size is the end of the enclosing container, not of the whole buffer
+static bool readFrame(const char *data, int size, int offset, Frame *f)
+{
+	int at = offset;
+	int len = 0;
+	int digits = 0;
+	while(at < size && data[at] >= '0' && data[at] <= '9')
+	{
+		if(++digits > 9)
+			return false;
+
+		len = (len * 10) + (data[at] - '0');
+		++at;
+	}
+
+	if(digits == 0 || at >= size || data[at] != ':')
+		return false;
+
+	++at;
+
+	// data must be followed by the type character
+	if(len > size - at - 1)
+		return false;
+
+	f->offset = offset;
+	f->dataOffset = at;
+	f->dataSize = len;
+	f->type = data[at + len];
+	f->next = at + len + 1;
+	return true;
+}
+
+static bool equals(const char *data, const Frame &f, const char *str)
+{
+	int len = strlen(str);
+	return (f.dataSize == len && memcmp(data + f.dataOffset, str, len) == 0);
+}
+
+static bool toBytes(const char *data, const Frame &f, QByteArray *out)
+{
+	if(f.type != ',')
+		return false;
+
+	*out = QByteArray(data + f.dataOffset, f.dataSize);
+	return true;
+}
+
+static bool toInt(const char *data, const Frame &f, int *out)
+{
+	if(f.type != '#' || f.dataSize < 1)
+		return false;
+
+	const char *p = data + f.dataOffset;
+	const char *end = p + f.dataSize;
+
+	bool neg = false;
+	if(*p == '-')
+	{
+		neg = true;
+		++p;
+		if(p == end)
+			return false;
+	}
+
+	qint64 x = 0;
+	for(; p < end; ++p)
+	{
+		if(*p < '0' || *p > '9')
+			return false;
+
+		x = (x * 10) + (*p - '0');
+		if(x > Q_INT64_C(2147483648))
+			return false;
+	}
+
+	if(neg)
+		x = -x;
+
+	if(x > Q_INT64_C(2147483647))
+		return false;
+
+	*out = (int)x;
+	return true;
+}
+
+static bool toBool(const char *data, const Frame &f, bool *out)
+{
+	if(f.type != '!')
+		return false;
+
+	if(equals(data, f, "true"))
+		*out = true;
+	else if(equals(data, f, "false"))
+		*out = false;
+	else
+		return false;
+
+	return true;
+}
+
+static bool readHeaders(const char *data, const Frame &f, HttpHeaders *out)
+{
+	if(f.type != ']')
+		return false;
+
+	int at = f.dataOffset;
+	int end = f.dataOffset + f.dataSize;
+	while(at < end)
+	{
+		Frame item;
+		if(!readFrame(data, end, at, &item) || item.type != ']')
+			return false;
+
+		int itemEnd = item.dataOffset + item.dataSize;
+
+		Frame name;
+		if(!readFrame(data, itemEnd, item.dataOffset, &name) || name.type != ',')
+			return false;
+
+		Frame value;
+		if(!readFrame(data, itemEnd, name.next, &value) || value.type != ',' || value.next != itemEnd)
+			return false;
+
+		*out += HttpHeader(QByteArray(data + name.dataOffset, name.dataSize), QByteArray(data + value.dataOffset, value.dataSize));
+
+		at = item.next;
+	}
+
+	return true;
+}
+
+static bool readKeepAliveIds(const char *data, const Frame &f, QList<KeepAliveId> *out)
+{
+	if(f.type != ']')
+		return false;
+
+	int at = f.dataOffset;
+	int end = f.dataOffset + f.dataSize;
+	while(at < end)
+	{
+		Frame item;
+		if(!readFrame(data, end, at, &item) || item.type != '}')
+			return false;
+
+		QByteArray id;
+		int seq = -1;
+		bool haveId = false;
+		bool haveSeq = false;
+
+		int fat = item.dataOffset;
+		int fend = item.dataOffset + item.dataSize;
+		while(fat < fend)
+		{
+			Frame key;
+			if(!readFrame(data, fend, fat, &key) || key.type != ',')
+				return false;
+
+			Frame value;
+			if(!readFrame(data, fend, key.next, &value))
+				return false;
+
+			if(equals(data, key, "id"))
+			{
+				if(!toBytes(data, value, &id))
+					return false;
+
+				haveId = true;
+			}
+			else if(equals(data, key, "seq"))
+			{
+				if(!toInt(data, value, &seq))
+					return false;
+
+				haveSeq = true;
+			}
+
+			fat = value.next;
+		}
+
+		if(!haveId || !haveSeq)
+			return false;
+
+		*out += KeepAliveId(id, seq);
+
+		at = item.next;
+	}
+
+	return true;
+}
+
+template <typename T>
+static bool readType(const char *data, const Frame &f, T *packet)
+{
+	if(f.type != ',')
+		return false;
+
+	if(equals(data, f, "error"))
+		packet->type = T::Error;
+	else if(equals(data, f, "credit"))
+		packet->type = T::Credit;
+	else if(equals(data, f, "keep-alive"))
+		packet->type = T::KeepAlive;
+	else if(equals(data, f, "cancel"))
+		packet->type = T::Cancel;
+	else if(equals(data, f, "handoff-start"))
+		packet->type = T::HandoffStart;
+	else if(equals(data, f, "handoff-proceed"))
+		packet->type = T::HandoffProceed;
+	else if(equals(data, f, "close"))
+		packet->type = T::Close;
+	else if(equals(data, f, "ping"))
+		packet->type = T::Ping;
+	else if(equals(data, f, "pong"))
+		packet->type = T::Pong;
+	else
+		return false;
+
+	return true;
+}
+
+// fields that requests and responses have in common. returns 1 if the
+//   field was read, 0 if it is not a common field, or -1 on error
+template <typename T>
+static int readCommonField(const QByteArray &buf, const Frame &key, const Frame &value, T *packet, Extensions *ext)
+{
+	const char *data = buf.constData();
+
+	bool ok = false;
+	if(equals(data, key, "from"))
+	{
+		ok = toBytes(data, value, &packet->from);
+	}
+	else if(equals(data, key, "id"))
+	{
+		ok = toBytes(data, value, &packet->id);
+	}
+	else if(equals(data, key, "type"))
+	{
+		ok = readType(data, value, packet);
+	}
+	else if(equals(data, key, "condition"))
+	{
+		ok = toBytes(data, value, &packet->condition);
+	}
+	else if(equals(data, key, "seq"))
+	{
+		ok = toInt(data, value, &packet->seq);
+	}
+	else if(equals(data, key, "credits"))
+	{
+		ok = toInt(data, value, &packet->credits);
+	}
+	else if(equals(data, key, "more"))
+	{
+		ok = toBool(data, value, &packet->more);
+	}
+	else if(equals(data, key, "headers"))
+	{
+		ok = readHeaders(data, value, &packet->headers);
+	}
+	else if(equals(data, key, "body"))
+	{
+		ok = toBytes(data, value, &packet->body);
+	}
+	else if(equals(data, key, "content-type"))
+	{
+		ok = toBytes(data, value, &packet->contentType);
+	}
+	else if(equals(data, key, "code"))
+	{
+		ok = toInt(data, value, &packet->code);
+	}
+	else if(equals(data, key, "user-data"))
+	{
+		// arbitrary structure. leave it to the generic parser
+		packet->userData = TnetString::toVariant(buf, value.offset, &ok);
+	}
+	else if(equals(data, key, "multi"))
+	{
+		ok = toBool(data, value, &ext->multi);
+	}
+	else if(equals(data, key, "ids"))
+	{
+		ok = readKeepAliveIds(data, value, &ext->ids);
+		ext->batch = true;
+	}
+	else
+	{
+		return 0;
+	}
+
+	return (ok ? 1 : -1);
+}
+
+static int readField(const QByteArray &buf, const Frame &key, const Frame &value, ZhttpRequestPacket *packet)
+{
+	const char *data = buf.constData();
+
+	bool ok = false;
+	if(equals(data, key, "stream"))
+	{
+		ok = toBool(data, value, &packet->stream);
+	}
+	else if(equals(data, key, "max-size"))
+	{
+		ok = toInt(data, value, &packet->maxSize);
+	}
+	else if(equals(data, key, "method"))
+	{
+		ok = (value.type == ',');
+		if(ok)
+			packet->method = QString::fromLatin1(data + value.dataOffset, value.dataSize);
+	}
+	else if(equals(data, key, "uri"))
+	{
+		ok = (value.type == ',');
+		if(ok)
+			packet->uri = QUrl::fromEncoded(QByteArray(data + value.dataOffset, value.dataSize), QUrl::StrictMode);
+	}
+	else if(equals(data, key, "peer-address"))
+	{
+		ok = (value.type == ',');
+		if(ok)
+			packet->peerAddress = QHostAddress(QString::fromUtf8(data + value.dataOffset, value.dataSize));
+	}
+	else if(equals(data, key, "connect-host"))
+	{
+		ok = (value.type == ',');
+		if(ok)
+			packet->connectHost = QString::fromUtf8(data + value.dataOffset, value.dataSize);
+	}
+	else if(equals(data, key, "connect-port"))
+	{
+		ok = toInt(data, value, &packet->connectPort);
+	}
+	else if(equals(data, key, "ignore-policies"))
+	{
+		ok = toBool(data, value, &packet->ignorePolicies);
+	}
+	else if(equals(data, key, "ignore-tls-errors"))
+	{
+		ok = toBool(data, value, &packet->ignoreTlsErrors);
+	}
+	else
+	{
+		return 0;
+	}
+
+	return (ok ? 1 : -1);
+}
+
+static int readField(const QByteArray &buf, const Frame &key, const Frame &value, ZhttpResponsePacket *packet)
+{
+	const char *data = buf.constData();
+
+	if(equals(data, key, "reason"))
+		return (toBytes(data, value, &packet->reason) ? 1 : -1);
+
+	return 0;
+}
+
+template <typename T>
+static bool readPacket(const QByteArray &buf, int offset, T *packet, Extensions *ext)
+{
+	const char *data = buf.constData();
+
+	Frame top;
+	if(!readFrame(data, buf.size(), offset, &top) || top.type != '}')
+		return false;
+
+	*packet = T();
+
+	Extensions tmp;
+	if(!ext)
+		ext = &tmp;
+
+	*ext = Extensions();
+
+	bool haveId = false;
+
+	int at = top.dataOffset;
+	int end = top.dataOffset + top.dataSize;
+	while(at < end)
+	{
+		Frame key;
+		if(!readFrame(data, end, at, &key) || key.type != ',')
+			return false;
+
+		Frame value;
+		if(!readFrame(data, end, key.next, &value))
+			return false;
+
+		int ret = readCommonField(buf, key, value, packet, ext);
+		if(ret == 0)
+			ret = readField(buf, key, value, packet);
+
+		if(ret == -1)
+			return false;
+
+		if(!haveId && equals(data, key, "id"))
+			haveId = true;
+
+		at = value.next;
+	}
+
+	// only keep-alive batches are allowed to omit the id
+	if(!haveId && !ext->batch)
+		return false;
+
+	return true;
+}
+
+bool readRequest(const QByteArray &buf, int offset, ZhttpRequestPacket *packet, Extensions *ext)
+{
+	return readPacket(buf, offset, packet, ext);
+}
+
+bool readResponse(const QByteArray &buf, int offset, ZhttpResponsePacket *packet, Extensions *ext)
+{
+	return readPacket(buf, offset, packet, ext);
+}
+
+}
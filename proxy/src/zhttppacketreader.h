@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZHTTPPACKETREADER_H
+#define ZHTTPPACKETREADER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+class ZhttpRequestPacket;
+class ZhttpResponsePacket;
+
+// decodes tnetstring-encoded zhttp packets directly from a received
+//   buffer, without building an intermediate QVariant tree. produces the
+//   same result as TnetString::toVariant followed by fromVariant
+
+namespace ZhttpPacketReader {
+
+typedef QPair<QByteArray, int> KeepAliveId;
+
+// protocol extension fields that the packet structs don't cover
+class Extensions
+{
+public:
+	bool multi;
+	bool batch; // if set, ids holds keep-alives and the packet has no id
+	QList<KeepAliveId> ids;
+
+	Extensions() :
+		multi(false),
+		batch(false)
+	{
+	}
+};
+
+// offset is where the tnetstring starts, e.g. past the "T" prefix
+bool readRequest(const QByteArray &buf, int offset, ZhttpRequestPacket *packet, Extensions *ext = 0);
+bool readResponse(const QByteArray &buf, int offset, ZhttpResponsePacket *packet, Extensions *ext = 0);
+
+}
+
+#endif
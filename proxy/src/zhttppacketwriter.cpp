@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zhttppacketwriter.h"
+
+#include <assert.h>
+#include <string.h>
+#include <QUrl>
+#include <QHostAddress>
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+
+namespace ZhttpPacketWriter {
+
+// buf must have room for 11 bytes
+static int formatInt(char *buf, int x)
+{
+	char tmp[10];
+	int n = 0;
+	quint32 ux = (x < 0 ? 0u - (quint32)x : (quint32)x);
+	do
+	{
+		tmp[n++] = '0' + (char)(ux % 10);
+		ux /= 10;
+	} while(ux > 0);
+
+	int len = 0;
+	if(x < 0)
+		buf[len++] = '-';
+
+	while(n > 0)
+		buf[len++] = tmp[--n];
+
+	return len;
+}
+
+static int digitCount(int x)
+{
+	int n = 1;
+	while(x >= 10)
+	{
+		x /= 10;
+		++n;
+	}
+
+	return n;
+}
+
+// total size of a frame containing size bytes of data
+static int frameSize(int size)
+{
+	return digitCount(size) + 1 + size + 1;
+}
+
+// writes frames into a preallocated buffer. if the buffer is null, only
+//   the size is tallied, so the same code can be run once to measure the
+//   output and once to fill it
+class Encoder
+{
+public:
+	char *out;
+	int size;
+
+	Encoder(char *_out = 0) :
+		out(_out),
+		size(0)
+	{
+	}
+
+	void writeRaw(const char *data, int len)
+	{
+		if(out)
+			memcpy(out + size, data, len);
+
+		size += len;
+	}
+
+	void writeLength(int len)
+	{
+		char buf[12];
+		int n = formatInt(buf, len);
+		buf[n++] = ':';
+		writeRaw(buf, n);
+	}
+
+	void writeFrame(const char *data, int len, char type)
+	{
+		writeLength(len);
+		writeRaw(data, len);
+		writeRaw(&type, 1);
+	}
+
+	void writeBytes(const QByteArray &s)
+	{
+		writeFrame(s.constData(), s.size(), ',');
+	}
+
+	void writeKey(const char *s)
+	{
+		writeFrame(s, strlen(s), ',');
+	}
+
+	void writeInt(int x)
+	{
+		char buf[12];
+		int n = formatInt(buf, x);
+		writeFrame(buf, n, '#');
+	}
+
+	void writeBool(bool b)
+	{
+		if(b)
+			writeFrame("true", 4, '!');
+		else
+			writeFrame("false", 5, '!');
+	}
+
+	void writeHeaders(const HttpHeaders &headers)
+	{
+		int total = 0;
+		foreach(const HttpHeader &h, headers)
+			total += frameSize(frameSize(h.first.size()) + frameSize(h.second.size()));
+
+		writeLength(total);
+		foreach(const HttpHeader &h, headers)
+		{
+			writeLength(frameSize(h.first.size()) + frameSize(h.second.size()));
+			writeBytes(h.first);
+			writeBytes(h.second);
+			writeRaw("]", 1);
+		}
+		writeRaw("]", 1);
+	}
+};
+
+// values that need conversion are converted once, before measuring
+class Converted
+{
+public:
+	QByteArray method;
+	QByteArray uri;
+	QByteArray peerAddress;
+	QByteArray connectHost;
+	QByteArray userData;
+};
+
+static void convert(const ZhttpRequestPacket &packet, Converted *c)
+{
+	if(!packet.method.isEmpty())
+		c->method = packet.method.toLatin1();
+
+	if(!packet.uri.isEmpty())
+		c->uri = packet.uri.toEncoded();
+
+	if(!packet.peerAddress.isNull())
+		c->peerAddress = packet.peerAddress.toString().toUtf8();
+
+	if(!packet.connectHost.isEmpty())
+		c->connectHost = packet.connectHost.toUtf8();
+
+	if(packet.userData.isValid())
+		c->userData = TnetString::fromVariant(packet.userData);
+}
+
+static void convert(const ZhttpResponsePacket &packet, Converted *c)
+{
+	if(packet.userData.isValid())
+		c->userData = TnetString::fromVariant(packet.userData);
+}
+
+template <typename T>
+static const char *typeName(const T &packet)
+{
+	switch(packet.type)
+	{
+		case T::Error: return "error";
+		case T::Credit: return "credit";
+		case T::KeepAlive: return "keep-alive";
+		case T::Cancel: return "cancel";
+		case T::HandoffStart: return "handoff-start";
+		case T::HandoffProceed: return "handoff-proceed";
+		case T::Close: return "close";
+		case T::Ping: return "ping";
+		case T::Pong: return "pong";
+		default: return 0; // data packets have no type field
+	}
+}
+
+static void writeFields(Encoder *e, const ZhttpRequestPacket &packet, const Converted &c)
+{
+	if(packet.stream)
+	{
+		e->writeKey("stream");
+		e->writeBool(true);
+	}
+
+	if(packet.maxSize != -1)
+	{
+		e->writeKey("max-size");
+		e->writeInt(packet.maxSize);
+	}
+
+	if(!c.method.isEmpty())
+	{
+		e->writeKey("method");
+		e->writeBytes(c.method);
+	}
+
+	if(!c.uri.isEmpty())
+	{
+		e->writeKey("uri");
+		e->writeBytes(c.uri);
+	}
+
+	if(!c.peerAddress.isEmpty())
+	{
+		e->writeKey("peer-address");
+		e->writeBytes(c.peerAddress);
+	}
+
+	if(!c.connectHost.isEmpty())
+	{
+		e->writeKey("connect-host");
+		e->writeBytes(c.connectHost);
+	}
+
+	if(packet.connectPort != -1)
+	{
+		e->writeKey("connect-port");
+		e->writeInt(packet.connectPort);
+	}
+
+	if(packet.ignorePolicies)
+	{
+		e->writeKey("ignore-policies");
+		e->writeBool(true);
+	}
+
+	if(packet.ignoreTlsErrors)
+	{
+		e->writeKey("ignore-tls-errors");
+		e->writeBool(true);
+	}
+}
+
+static void writeFields(Encoder *e, const ZhttpResponsePacket &packet, const Converted &c)
+{
+	Q_UNUSED(c);
+
+	if(!packet.reason.isEmpty())
+	{
+		e->writeKey("reason");
+		e->writeBytes(packet.reason);
+	}
+}
+
+// writes the contents of the packet dict. fields are omitted under the
+//   same conditions as in toVariant()
+template <typename T>
+static void writeDictContent(Encoder *e, const T &packet, const Converted &c, bool multi)
+{
+	if(!packet.from.isEmpty())
+	{
+		e->writeKey("from");
+		e->writeBytes(packet.from);
+	}
+
+	e->writeKey("id");
+	e->writeBytes(packet.id);
+
+	const char *type = typeName(packet);
+	if(type)
+	{
+		e->writeKey("type");
+		e->writeFrame(type, strlen(type), ',');
+	}
+
+	if(!packet.condition.isEmpty())
+	{
+		e->writeKey("condition");
+		e->writeBytes(packet.condition);
+	}
+
+	if(packet.seq != -1)
+	{
+		e->writeKey("seq");
+		e->writeInt(packet.seq);
+	}
+
+	if(packet.credits != -1)
+	{
+		e->writeKey("credits");
+		e->writeInt(packet.credits);
+	}
+
+	if(packet.more)
+	{
+		e->writeKey("more");
+		e->writeBool(true);
+	}
+
+	writeFields(e, packet, c);
+
+	if(!packet.headers.isEmpty())
+	{
+		e->writeKey("headers");
+		e->writeHeaders(packet.headers);
+	}
+
+	if(!packet.body.isNull())
+	{
+		e->writeKey("body");
+		e->writeBytes(packet.body);
+	}
+
+	if(!packet.contentType.isEmpty())
+	{
+		e->writeKey("content-type");
+		e->writeBytes(packet.contentType);
+	}
+
+	if(packet.code != -1)
+	{
+		e->writeKey("code");
+		e->writeInt(packet.code);
+	}
+
+	if(!c.userData.isEmpty())
+	{
+		// already a complete frame
+		e->writeKey("user-data");
+		e->writeRaw(c.userData.constData(), c.userData.size());
+	}
+
+	if(multi)
+	{
+		e->writeKey("multi");
+		e->writeBool(true);
+	}
+}
+
+// sizes the buffer for the output and writes everything up to the dict
+//   content, which the caller writes followed by the closing brace
+static void beginOutput(QByteArray *buf, Encoder *e, const QByteArray &address, int contentSize)
+{
+	int prefixSize = (!address.isEmpty() ? address.size() + 2 : 1);
+	buf->resize(prefixSize + frameSize(contentSize));
+
+	e->out = buf->data();
+	e->size = 0;
+	if(!address.isEmpty())
+	{
+		e->writeRaw(address.constData(), address.size());
+		e->writeRaw(" ", 1);
+	}
+	e->writeRaw("T", 1);
+	e->writeLength(contentSize);
+}
+
+template <typename T>
+static QByteArray writePacket(const T &packet, const QByteArray &address, bool multi)
+{
+	Converted c;
+	convert(packet, &c);
+
+	Encoder measure;
+	writeDictContent(&measure, packet, c, multi);
+	int contentSize = measure.size;
+
+	QByteArray buf;
+	Encoder e;
+	beginOutput(&buf, &e, address, contentSize);
+	writeDictContent(&e, packet, c, multi);
+	e.writeRaw("}", 1);
+
+	assert(e.size == buf.size());
+	return buf;
+}
+
+static int intSize(int x)
+{
+	char buf[12];
+	return formatInt(buf, x);
+}
+
+// size of the content of an {id, seq} dict
+static int keepAliveIdSize(const KeepAliveId &i)
+{
+	return frameSize(2) + frameSize(i.first.size()) + frameSize(3) + frameSize(intSize(i.second));
+}
+
+static void writeBatchContent(Encoder *e, const QByteArray &from, const QList<KeepAliveId> &ids)
+{
+	e->writeKey("from");
+	e->writeBytes(from);
+
+	e->writeKey("type");
+	e->writeFrame("keep-alive", 10, ',');
+
+	int total = 0;
+	foreach(const KeepAliveId &i, ids)
+		total += frameSize(keepAliveIdSize(i));
+
+	e->writeKey("ids");
+	e->writeLength(total);
+	foreach(const KeepAliveId &i, ids)
+	{
+		e->writeLength(keepAliveIdSize(i));
+		e->writeKey("id");
+		e->writeBytes(i.first);
+		e->writeKey("seq");
+		e->writeInt(i.second);
+		e->writeRaw("}", 1);
+	}
+	e->writeRaw("]", 1);
+}
+
+QByteArray writeRequest(const ZhttpRequestPacket &packet, const QByteArray &address, bool multi)
+{
+	return writePacket(packet, address, multi);
+}
+
+QByteArray writeResponse(const ZhttpResponsePacket &packet, const QByteArray &address, bool multi)
+{
+	return writePacket(packet, address, multi);
+}
+
+QByteArray writeKeepAliveBatch(const QByteArray &from, const QList<KeepAliveId> &ids, const QByteArray &address)
+{
+	Encoder measure;
+	writeBatchContent(&measure, from, ids);
+	int contentSize = measure.size;
+
+	QByteArray buf;
+	Encoder e;
+	beginOutput(&buf, &e, address, contentSize);
+	writeBatchContent(&e, from, ids);
+	e.writeRaw("}", 1);
+
+	assert(e.size == buf.size());
+	return buf;
+}
+
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This file is part of Pushpin.
+ *
+ * Pushpin is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Pushpin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZHTTPPACKETWRITER_H
+#define ZHTTPPACKETWRITER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+class ZhttpRequestPacket;
+class ZhttpResponsePacket;
+
+// encodes zhttp packets directly into a single buffer of the exact final
+//   size, without building an intermediate QVariant tree. the output
+//   carries the socket prefix: "T", or address + " T" if an address is
+//   given (for pub sockets). if multi is set, the keep-alive batching flag
+//   is included
+
+namespace ZhttpPacketWriter {
+
+QByteArray writeRequest(const ZhttpRequestPacket &packet, const QByteArray &address = QByteArray(), bool multi = false);
+QByteArray writeResponse(const ZhttpResponsePacket &packet, const QByteArray &address = QByteArray(), bool multi = false);
+
+// id and seq of each session in a keep-alive batch
+typedef QPair<QByteArray, int> KeepAliveId;
+
+QByteArray writeKeepAliveBatch(const QByteArray &from, const QList<KeepAliveId> &ids, const QByteArray &address = QByteArray());
+
+}
+
+#endif
@@ -20,19 +20,23 @@
 #include "zhttprequest.h"
 
 #include <assert.h>
-#include <QTimer>
 #include <QPointer>
 #include "zhttprequestpacket.h"
 #include "zhttpresponsepacket.h"
 #include "bufferlist.h"
 #include "log.h"
 #include "zhttpmanager.h"
+#include "timerwheel.h"
 #include "uuidutil.h"
+#include "tracer.h"
+#include "objectcounter.h"
 
 #define IDEAL_CREDITS 200000
 #define SESSION_EXPIRE 60000
 #define REQ_BUF_MAX 1000000
 
+static ObjectCounter g_counter("ZhttpRequest");
+
 class ZhttpRequest::Private : public QObject
 {
 	Q_OBJECT
@@ -87,8 +91,11 @@ public:
 	bool paused;
 	bool pendingUpdate;
 	ZhttpRequest::ErrorCondition errorCondition;
-	QTimer *expireTimer;
-	QTimer *keepAliveTimer;
+	TimerWheel *timerWheel;
+	int expireTimer;
+	int keepAliveTimer;
+	Trace *trace;
+	bool creditsWait;
 
 	Private(ZhttpRequest *_q) :
 		QObject(_q),
@@ -110,15 +117,12 @@ public:
 		pausing(false),
 		paused(false),
 		pendingUpdate(false),
-		expireTimer(0),
-		keepAliveTimer(0)
+		timerWheel(0),
+		expireTimer(-1),
+		keepAliveTimer(-1),
+		trace(0),
+		creditsWait(false)
 	{
-		expireTimer = new QTimer(this);
-		connect(expireTimer, SIGNAL(timeout()), this, SLOT(expire_timeout()));
-		expireTimer->setSingleShot(true);
-
-		keepAliveTimer = new QTimer(this);
-		connect(keepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAlive_timeout()));
 	}
 
 	~Private()
@@ -131,20 +135,13 @@ public:
 
 	void cleanup()
 	{
-		if(expireTimer)
-		{
-			expireTimer->disconnect(this);
-			expireTimer->setParent(0);
-			expireTimer->deleteLater();
-			expireTimer = 0;
-		}
-
-		if(keepAliveTimer)
+		if(timerWheel)
 		{
-			keepAliveTimer->disconnect(this);
-			keepAliveTimer->setParent(0);
-			keepAliveTimer->deleteLater();
-			keepAliveTimer = 0;
+			timerWheel->remove(expireTimer);
+			timerWheel->remove(keepAliveTimer);
+			expireTimer = -1;
+			keepAliveTimer = -1;
+			timerWheel = 0;
 		}
 
 		if(manager)
@@ -276,14 +273,35 @@ public:
 		update();
 	}
 
+	// timers come from the manager's wheel rather than being a qtimer each
+	void setupTimers()
+	{
+		timerWheel = manager->timerWheel();
+		expireTimer = timerWheel->add(expire_cb, this);
+		keepAliveTimer = timerWheel->add(keepAlive_cb, this);
+	}
+
+	static void expire_cb(void *data)
+	{
+		((Private *)data)->expire_timeout();
+	}
+
+	static void keepAlive_cb(void *data)
+	{
+		((Private *)data)->keepAlive_timeout();
+	}
+
+	// the manager batches keep-alives for peers that accept them. the
+	//   session timer covers everyone else
 	void startKeepAlive()
 	{
-		keepAliveTimer->start(SESSION_EXPIRE / 2);
+		manager->registerKeepAlive(q);
+		timerWheel->start(keepAliveTimer, SESSION_EXPIRE / 2);
 	}
 
 	void refreshTimeout()
 	{
-		expireTimer->start(SESSION_EXPIRE);
+		timerWheel->start(expireTimer, SESSION_EXPIRE);
 	}
 
 	void update()
@@ -331,6 +349,23 @@ public:
 		}
 	}
 
+	void mark(const char *stage)
+	{
+		if(trace)
+			trace->mark(stage);
+	}
+
+	// marks only the transitions, since a slow reader could otherwise
+	//   fill the trace
+	void markCreditsWait(bool on)
+	{
+		if(creditsWait != on)
+		{
+			creditsWait = on;
+			mark(on ? "credits-wait" : "credits-resume");
+		}
+	}
+
 	void tryWrite()
 	{
 		if(state == ClientRequesting)
@@ -390,6 +425,8 @@ public:
 		{
 			if((!responseBodyBuf.isEmpty() && outCredits > 0) || (responseBodyBuf.isEmpty() && bodyFinished))
 			{
+				markCreditsWait(false);
+
 				ZhttpResponsePacket packet;
 				packet.body = responseBodyBuf.take(outCredits);
 				outCredits -= packet.body.size();
@@ -399,12 +436,15 @@ public:
 
 				if(!packet.more)
 				{
+					mark("response-end");
 					state = Stopped;
 					cleanup();
 				}
 
 				emit q->bytesWritten(packet.body.size());
 			}
+			else if(!responseBodyBuf.isEmpty())
+				markCreditsWait(true);
 		}
 	}
 
@@ -915,11 +955,16 @@ public slots:
 
 			writePacket(packet);
 
+			mark("response-start");
+
 			if(!packet.more)
 			{
+				mark("response-end");
 				state = Stopped;
 				cleanup();
 			}
+			else if(!responseBodyBuf.isEmpty())
+				markCreditsWait(true);
 
 			if(!packet.body.isEmpty())
 				emit q->bytesWritten(packet.body.size());
@@ -944,6 +989,12 @@ public slots:
 
 	void keepAlive_timeout()
 	{
+		// wheel timers are single-shot
+		timerWheel->start(keepAliveTimer, SESSION_EXPIRE / 2);
+
+		if(manager->batchesKeepAlives(q->keepAliveAddress()))
+			return;
+
 		if(server)
 		{
 			ZhttpResponsePacket p;
@@ -963,11 +1014,13 @@ ZhttpRequest::ZhttpRequest(QObject *parent) :
 	QObject(parent)
 {
 	d = new Private(this);
+	g_counter.ref();
 }
 
 ZhttpRequest::~ZhttpRequest()
 {
 	delete d;
+	g_counter.deref();
 }
 
 ZhttpRequest::Rid ZhttpRequest::rid() const
@@ -1000,6 +1053,11 @@ void ZhttpRequest::setIgnoreTlsErrors(bool on)
 	d->ignoreTlsErrors = on;
 }
 
+void ZhttpRequest::setTrace(Trace *trace)
+{
+	d->trace = trace;
+}
+
 void ZhttpRequest::start(const QString &method, const QUrl &uri, const HttpHeaders &headers)
 {
 	assert(!d->server);
@@ -1129,6 +1187,7 @@ QByteArray ZhttpRequest::readBody(int size)
 void ZhttpRequest::setupClient(ZhttpManager *manager, bool req)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->rid = Rid(manager->instanceId(), UuidUtil::createUuid());
 	d->doReq = req;
 	d->manager->link(this);
@@ -1137,6 +1196,7 @@ void ZhttpRequest::setupClient(ZhttpManager *manager, bool req)
 bool ZhttpRequest::setupServer(ZhttpManager *manager, const ZhttpRequestPacket &packet)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->server = true;
 	d->rid = Rid(packet.from, packet.id);
 	return d->setupServer(packet);
@@ -1145,6 +1205,7 @@ bool ZhttpRequest::setupServer(ZhttpManager *manager, const ZhttpRequestPacket &
 void ZhttpRequest::setupServer(ZhttpManager *manager, const ZhttpRequest::ServerState &state)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->server = true;
 	d->rid = state.rid;
 	d->manager->link(this);
@@ -1175,4 +1236,15 @@ void ZhttpRequest::handle(const ZhttpResponsePacket &packet)
 	d->handle(packet);
 }
 
+QByteArray ZhttpRequest::keepAliveAddress() const
+{
+	return (d->server ? d->rid.first : d->toAddress);
+}
+
+int ZhttpRequest::takeKeepAliveSeq()
+{
+	// a batched keep-alive still counts as a packet in our sequence
+	return (d->outSeq)++;
+}
+
 #include "zhttprequest.moc"
@@ -29,6 +29,7 @@
 class ZhttpRequestPacket;
 class ZhttpResponsePacket;
 class ZhttpManager;
+class Trace;
 
 class ZhttpRequest : public QObject
 {
@@ -84,6 +85,10 @@ public:
 	void setIgnorePolicies(bool on);
 	void setIgnoreTlsErrors(bool on);
 
+	// for marking flow control stages of server requests. the trace must
+	//   outlive the request or be unset
+	void setTrace(Trace *trace);
+
 	void start(const QString &method, const QUrl &uri, const HttpHeaders &headers);
 	void beginResponse(int code, const QByteArray &reason, const HttpHeaders &headers);
 
@@ -135,6 +140,8 @@ private:
 	bool isServer() const;
 	void handle(const ZhttpRequestPacket &packet);
 	void handle(const ZhttpResponsePacket &packet);
+	QByteArray keepAliveAddress() const;
+	int takeKeepAliveSeq();
 };
 
 #endif
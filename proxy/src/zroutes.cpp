@@ -22,9 +22,20 @@
 #include <assert.h>
 #include <QHash>
 #include <QStringList>
+#include <QElapsedTimer>
 #include <QTimer>
 #include "log.h"
 
+// weight of each new latency sample in the moving average
+#define EWMA_WEIGHT 0.2
+
+// consecutive failures before a target is skipped
+#define FAILURE_THRESHOLD 5
+
+// cool-down bounds for a failing target, doubled for each failed trial
+#define MIN_COOLDOWN 1000
+#define MAX_COOLDOWN 60000
+
 static QStringList baseSpecToSpecs(const QString &baseSpec)
 {
 	int at = baseSpec.indexOf("://");
@@ -55,6 +66,14 @@ static QStringList baseSpecToSpecs(const QString &baseSpec)
 	}
 }
 
+static QString targetKey(const DomainMap::Target &target)
+{
+	if(target.type == DomainMap::Target::Custom)
+		return "zhttp/" + target.zhttpRoute.baseSpec;
+	else
+		return target.connectHost + ':' + QString::number(target.connectPort);
+}
+
 class ZRoutes::Private : public QObject
 {
 	Q_OBJECT
@@ -82,6 +101,34 @@ public:
 		}
 	};
 
+	// load and health of an upstream target, shared by all routes that
+	//   use it. an open circuit means the target is skipped until
+	//   openUntil, after which a single trial request may go through
+	class TargetState
+	{
+	public:
+		int inFlight;
+		double latency; // moving average, msecs
+		bool haveLatency;
+		int failures; // consecutive
+		bool open;
+		bool trying;
+		qint64 openUntil;
+		int cooldown;
+
+		TargetState() :
+			inFlight(0),
+			latency(0),
+			haveLatency(false),
+			failures(0),
+			open(false),
+			trying(false),
+			openUntil(0),
+			cooldown(MIN_COOLDOWN)
+		{
+		}
+	};
+
 	ZRoutes *q;
 	QByteArray instanceId;
 	QStringList defaultOutSpecs;
@@ -91,16 +138,22 @@ public:
 	QHash<QString, Item*> itemsBySpec;
 	QHash<ZhttpManager*, Item*> itemsByManager;
 	QTimer *cleanupTimer;
+	QHash<QString, TargetState> targetStates;
+	int rotation;
+	QElapsedTimer clock;
 
 	Private(ZRoutes *_q) :
 		QObject(_q),
 		q(_q),
-		defaultItem(0)
+		defaultItem(0),
+		rotation(0)
 	{
 		cleanupTimer = new QTimer(this);
 		connect(cleanupTimer, SIGNAL(timeout()), SLOT(removeUnused()));
 		cleanupTimer->setInterval(10000);
 		cleanupTimer->start();
+
+		clock.start();
 	}
 
 	~Private()
@@ -183,6 +236,45 @@ public:
 		delete i;
 	}
 
+	// lower is better. targets with no latency samples yet are favored so
+	//   that they get measured
+	double targetScore(DomainMap::LoadBalance lb, const DomainMap::Target &target) const
+	{
+		TargetState ts = targetStates.value(targetKey(target));
+
+		double load = (double)(ts.inFlight + 1) / target.weight;
+		if(lb == DomainMap::Ewma)
+			return load * (ts.latency + 1);
+		else
+			return load;
+	}
+
+	QList<DomainMap::Target> rankTargets(const DomainMap::Entry &route)
+	{
+		int count = route.targets.count();
+
+		// rotate the starting point so that ties are spread around
+		int start = (rotation++ & 0x7fffffff) % count;
+
+		QList<DomainMap::Target> out;
+		QList<double> scores;
+		for(int n = 0; n < count; ++n)
+		{
+			const DomainMap::Target &t = route.targets[(start + n) % count];
+			double score = targetScore(route.lb, t);
+
+			// insertion keeps equal scores in rotated order
+			int at = scores.count();
+			while(at > 0 && scores[at - 1] > score)
+				--at;
+
+			out.insert(at, t);
+			scores.insert(at, score);
+		}
+
+		return out;
+	}
+
 public slots:
 	void removeUnused()
 	{
@@ -304,4 +396,101 @@ void ZRoutes::removeRef(ZhttpManager *zhttpManager)
 	--(i->refs);
 }
 
+QList<DomainMap::Target> ZRoutes::targetsForRoute(const DomainMap::Entry &route)
+{
+	if(route.lb == DomainMap::Ordered || route.targets.count() < 2)
+		return route.targets;
+
+	return d->rankTargets(route);
+}
+
+bool ZRoutes::targetAvailable(const DomainMap::Target &target)
+{
+	QHash<QString, Private::TargetState>::const_iterator it = d->targetStates.find(targetKey(target));
+	if(it == d->targetStates.constEnd())
+		return true;
+
+	return (!it->open || d->clock.elapsed() >= it->openUntil);
+}
+
+void ZRoutes::targetStarted(const DomainMap::Target &target)
+{
+	Private::TargetState &ts = d->targetStates[targetKey(target)];
+
+	++(ts.inFlight);
+
+	if(ts.open)
+	{
+		// this is the trial. hold off others for another cool-down in
+		//   case it never reports back
+		ts.trying = true;
+		ts.openUntil = d->clock.elapsed() + ts.cooldown;
+	}
+}
+
+void ZRoutes::targetResponded(const DomainMap::Target &target, int latency)
+{
+	Private::TargetState &ts = d->targetStates[targetKey(target)];
+
+	if(ts.haveLatency)
+		ts.latency += (latency - ts.latency) * EWMA_WEIGHT;
+	else
+		ts.latency = latency;
+
+	ts.haveLatency = true;
+}
+
+void ZRoutes::targetSucceeded(const DomainMap::Target &target)
+{
+	Private::TargetState &ts = d->targetStates[targetKey(target)];
+
+	ts.failures = 0;
+
+	if(ts.open)
+	{
+		log_info("zroutes: target %s recovered", qPrintable(targetKey(target)));
+
+		ts.open = false;
+		ts.trying = false;
+		ts.cooldown = MIN_COOLDOWN;
+	}
+}
+
+void ZRoutes::targetFailed(const DomainMap::Target &target)
+{
+	Private::TargetState &ts = d->targetStates[targetKey(target)];
+
+	if(!ts.open)
+	{
+		++(ts.failures);
+		if(ts.failures < FAILURE_THRESHOLD)
+			return;
+
+		ts.open = true;
+	}
+	else if(ts.trying)
+	{
+		// failed trial
+		ts.trying = false;
+		ts.cooldown = qMin(ts.cooldown * 2, MAX_COOLDOWN);
+	}
+	else
+	{
+		// late result from before the circuit opened
+		return;
+	}
+
+	ts.openUntil = d->clock.elapsed() + ts.cooldown;
+
+	log_warning("zroutes: target %s failing, skipping for %dms", qPrintable(targetKey(target)), ts.cooldown);
+}
+
+void ZRoutes::targetFinished(const DomainMap::Target &target)
+{
+	Private::TargetState &ts = d->targetStates[targetKey(target)];
+
+	assert(ts.inFlight > 0);
+	--(ts.inFlight);
+}
+
 #include "zroutes.moc"
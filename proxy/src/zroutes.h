@@ -45,6 +45,22 @@ public:
 	void addRef(ZhttpManager *zhttpManager);
 	void removeRef(ZhttpManager *zhttpManager);
 
+	// targets of the route, best first according to its balancing mode
+	QList<DomainMap::Target> targetsForRoute(const DomainMap::Entry &route);
+
+	// track requests in flight to a target, and the time in msecs it
+	//   took the target to start responding
+	void targetStarted(const DomainMap::Target &target);
+	void targetResponded(const DomainMap::Target &target, int latency);
+	void targetFinished(const DomainMap::Target &target);
+
+	// passive health. after repeated failures (connect errors, timeouts
+	//   or 5xx responses) a target is unavailable for a cool-down, and
+	//   then a single trial request decides whether it comes back
+	bool targetAvailable(const DomainMap::Target &target);
+	void targetSucceeded(const DomainMap::Target &target);
+	void targetFailed(const DomainMap::Target &target);
+
 private:
 	class Private;
 	Private *d;
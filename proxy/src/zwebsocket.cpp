@@ -20,17 +20,20 @@
 #include "zwebsocket.h"
 
 #include <assert.h>
-#include <QTimer>
 #include <QPointer>
 #include "zhttprequestpacket.h"
 #include "zhttpresponsepacket.h"
 #include "log.h"
 #include "zhttpmanager.h"
+#include "timerwheel.h"
 #include "uuidutil.h"
+#include "objectcounter.h"
 
 #define IDEAL_CREDITS 200000
 #define SESSION_EXPIRE 60000
 
+static ObjectCounter g_counter("ZWebSocket");
+
 class ZWebSocket::Private : public QObject
 {
 	Q_OBJECT
@@ -74,8 +77,9 @@ public:
 	QVariant userData;
 	bool pendingUpdate;
 	WebSocket::ErrorCondition errorCondition;
-	QTimer *expireTimer;
-	QTimer *keepAliveTimer;
+	TimerWheel *timerWheel;
+	int expireTimer;
+	int keepAliveTimer;
 	QList<Frame> inFrames;
 	QList<Frame> outFrames;
 	int inSize;
@@ -101,18 +105,13 @@ public:
 		closeCode(-1),
 		peerCloseCode(-1),
 		pendingUpdate(false),
-		expireTimer(0),
-		keepAliveTimer(0),
+		timerWheel(0),
+		expireTimer(-1),
+		keepAliveTimer(-1),
 		inSize(0),
 		inContentType(-1),
 		outContentType((int)Frame::Text)
 	{
-		expireTimer = new QTimer(this);
-		connect(expireTimer, SIGNAL(timeout()), this, SLOT(expire_timeout()));
-		expireTimer->setSingleShot(true);
-
-		keepAliveTimer = new QTimer(this);
-		connect(keepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAlive_timeout()));
 	}
 
 	~Private()
@@ -125,20 +124,13 @@ public:
 
 	void cleanup()
 	{
-		if(expireTimer)
-		{
-			expireTimer->disconnect(this);
-			expireTimer->setParent(0);
-			expireTimer->deleteLater();
-			expireTimer = 0;
-		}
-
-		if(keepAliveTimer)
+		if(timerWheel)
 		{
-			keepAliveTimer->disconnect(this);
-			keepAliveTimer->setParent(0);
-			keepAliveTimer->deleteLater();
-			keepAliveTimer = 0;
+			timerWheel->remove(expireTimer);
+			timerWheel->remove(keepAliveTimer);
+			expireTimer = -1;
+			keepAliveTimer = -1;
+			timerWheel = 0;
 		}
 
 		if(manager)
@@ -196,14 +188,35 @@ public:
 		update();
 	}
 
+	// timers come from the manager's wheel rather than being a qtimer each
+	void setupTimers()
+	{
+		timerWheel = manager->timerWheel();
+		expireTimer = timerWheel->add(expire_cb, this);
+		keepAliveTimer = timerWheel->add(keepAlive_cb, this);
+	}
+
+	static void expire_cb(void *data)
+	{
+		((Private *)data)->expire_timeout();
+	}
+
+	static void keepAlive_cb(void *data)
+	{
+		((Private *)data)->keepAlive_timeout();
+	}
+
+	// the manager batches keep-alives for peers that accept them. the
+	//   session timer covers everyone else
 	void startKeepAlive()
 	{
-		keepAliveTimer->start(SESSION_EXPIRE / 2);
+		manager->registerKeepAlive(q);
+		timerWheel->start(keepAliveTimer, SESSION_EXPIRE / 2);
 	}
 
 	void refreshTimeout()
 	{
-		expireTimer->start(SESSION_EXPIRE);
+		timerWheel->start(expireTimer, SESSION_EXPIRE);
 	}
 
 	void update()
@@ -504,7 +517,7 @@ public:
 			return;
 		}
 
-		if(!toAddress.isEmpty() && !keepAliveTimer->isActive())
+		if(!toAddress.isEmpty() && !timerWheel->isActive(keepAliveTimer))
 			startKeepAlive();
 
 		++inSeq;
@@ -857,6 +870,12 @@ public slots:
 
 	void keepAlive_timeout()
 	{
+		// wheel timers are single-shot
+		timerWheel->start(keepAliveTimer, SESSION_EXPIRE / 2);
+
+		if(manager->batchesKeepAlives(q->keepAliveAddress()))
+			return;
+
 		if(server)
 		{
 			ZhttpResponsePacket p;
@@ -876,11 +895,13 @@ ZWebSocket::ZWebSocket(QObject *parent) :
 	WebSocket(parent)
 {
 	d = new Private(this);
+	g_counter.ref();
 }
 
 ZWebSocket::~ZWebSocket()
 {
 	delete d;
+	g_counter.deref();
 }
 
 ZWebSocket::Rid ZWebSocket::rid() const
@@ -1050,6 +1071,7 @@ void ZWebSocket::close(int code)
 void ZWebSocket::setupClient(ZhttpManager *manager)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->rid = Rid(manager->instanceId(), UuidUtil::createUuid());
 	d->manager->link(this);
 }
@@ -1057,6 +1079,7 @@ void ZWebSocket::setupClient(ZhttpManager *manager)
 bool ZWebSocket::setupServer(ZhttpManager *manager, const ZhttpRequestPacket &packet)
 {
 	d->manager = manager;
+	d->setupTimers();
 	d->server = true;
 	d->rid = Rid(packet.from, packet.id);
 	return d->setupServer(packet);
@@ -1086,4 +1109,15 @@ void ZWebSocket::handle(const ZhttpResponsePacket &packet)
 	d->handle(packet);
 }
 
+QByteArray ZWebSocket::keepAliveAddress() const
+{
+	return (d->server ? d->rid.first : d->toAddress);
+}
+
+int ZWebSocket::takeKeepAliveSeq()
+{
+	// a batched keep-alive still counts as a packet in our sequence
+	return (d->outSeq)++;
+}
+
 #include "zwebsocket.moc"
@@ -94,6 +94,8 @@ private:
 	bool isServer() const;
 	void handle(const ZhttpRequestPacket &packet);
 	void handle(const ZhttpResponsePacket &packet);
+	QByteArray keepAliveAddress() const;
+	int takeKeepAliveSeq();
 };
 
 #endif
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include <QTemporaryFile>
+#include <QElapsedTimer>
+#include "domainmap.h"
+
+static void writeRoutes(QTemporaryFile *file, const QByteArray &data)
+{
+	file->open();
+	file->resize(0);
+	file->seek(0);
+	file->write(data);
+	file->flush();
+}
+
+// rules per host: path_beg prefixes for tenants, some with proto
+//   conditions, plus a catch-all
+static QByteArray makeRoutes(int count, const QByteArray &idPrefix = "t")
+{
+	QByteArray out;
+	out += "api.example.com origin:80\n";
+	for(int n = 0; n < count - 1; ++n)
+	{
+		out += "api.example.com,path_beg=/tenant" + QByteArray::number(n) + "/";
+		if(n % 3 == 0)
+			out += ",proto=ws";
+		out += ",id=" + idPrefix + QByteArray::number(n) + " tenant" + QByteArray::number(n) + ":80\n";
+	}
+
+	return out;
+}
+
+// http tenant from the middle of the rules made by makeRoutes
+static int httpTenant(int count)
+{
+	int n = count / 2;
+	if(n % 3 == 0)
+		++n;
+
+	return n;
+}
+
+static QByteArray tenantPath(int n)
+{
+	return "/tenant" + QByteArray::number(n) + "/items/1234";
+}
+
+class LookupThread : public QThread
+{
+	Q_OBJECT
+
+public:
+	DomainMap *map;
+	QByteArray path;
+	QList<QByteArray> validIds;
+	QAtomicInt stop;
+	int lookups;
+	int bad;
+	int maxStall;
+
+	LookupThread(DomainMap *_map, const QByteArray &_path, const QList<QByteArray> &_validIds) :
+		map(_map),
+		path(_path),
+		validIds(_validIds),
+		lookups(0),
+		bad(0),
+		maxStall(0)
+	{
+	}
+
+	virtual void run()
+	{
+		QElapsedTimer t;
+		while(!(int)stop)
+		{
+			t.start();
+			DomainMap::Entry e = map->entry(DomainMap::Http, false, "api.example.com", path);
+			int elapsed = (int)t.elapsed();
+
+			if(elapsed > maxStall)
+				maxStall = elapsed;
+
+			if(!validIds.contains(e.id))
+				++bad;
+
+			++lookups;
+		}
+	}
+};
+
+class DomainMapTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void specificity()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file,
+			"* default:80\n"
+			"example.com,id=a a:80\n"
+			"example.com,id=b,path_beg=/foo b:80\n"
+			"example.com,id=c,path_beg=/foo/bar b:80\n"
+			"example.com,id=d,proto=ws d:80\n"
+			"example.com,id=e,ssl=yes,path_beg=/foo e:80\n"
+			"example.com,id=f,path_beg=/fo f:80\n"
+			"example.com,id=g,path_beg=/foo g:80\n");
+
+		DomainMap map(file.fileName());
+
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/").id, QByteArray("a"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/fox").id, QByteArray("f"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/foo").id, QByteArray("b"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/foo/ba").id, QByteArray("b"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/foo/bar/baz").id, QByteArray("c"));
+
+		// proto and ssl conditions outrank longer paths
+		QCOMPARE(map.entry(DomainMap::WebSocket, false, "example.com", "/foo/bar").id, QByteArray("d"));
+		QCOMPARE(map.entry(DomainMap::Http, true, "example.com", "/foo/bar").id, QByteArray("e"));
+
+		QCOMPARE(map.entry(DomainMap::Http, false, "other.com", "/foo").id, QByteArray());
+		QVERIFY(!map.entry(DomainMap::Http, false, "other.com", "/foo").isNull());
+	}
+
+	void noMatch()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file, "example.com,path_beg=/foo a:80\n");
+
+		DomainMap map(file.fileName());
+
+		QVERIFY(map.entry(DomainMap::Http, false, "example.com", "/bar").isNull());
+		QVERIFY(map.entry(DomainMap::Http, false, "other.com", "/foo").isNull());
+	}
+
+	void speculative()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file,
+			"example.com,path_beg=/feed,speculative a:80\n"
+			"example.com b:80\n");
+
+		DomainMap map(file.fileName());
+
+		QVERIFY(map.entry(DomainMap::Http, false, "example.com", "/feed/1").speculative);
+		QVERIFY(!map.entry(DomainMap::Http, false, "example.com", "/").speculative);
+	}
+
+	void balancing()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file,
+			"example.com,lb=ewma a:80 b:80,weight=3\n"
+			"other.com,lb=random a:80\n");
+
+		DomainMap map(file.fileName());
+
+		DomainMap::Entry e = map.entry(DomainMap::Http, false, "example.com", "/");
+		QCOMPARE(e.lb, DomainMap::Ewma);
+		QCOMPARE(e.targets.count(), 2);
+		QCOMPARE(e.targets[0].weight, 1);
+		QCOMPARE(e.targets[1].weight, 3);
+
+		QVERIFY(map.entry(DomainMap::Http, false, "other.com", "/").isNull());
+	}
+
+	void limits()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file,
+			"example.com,id=a,max_conns=10,max_pending=50 a:80\n"
+			"other.com,max_conns=10 a:80\n");
+
+		DomainMap map(file.fileName());
+
+		DomainMap::Entry e = map.entry(DomainMap::Http, false, "example.com", "/");
+		QCOMPARE(e.maxConns, 10);
+		QCOMPARE(e.maxPending, 50);
+
+		// limits are kept by route id
+		QVERIFY(map.entry(DomainMap::Http, false, "other.com", "/").isNull());
+	}
+
+	void wildcard()
+	{
+		QTemporaryFile file;
+		writeRoutes(&file,
+			"* default:80\n"
+			"*.example.com,id=s1 s1:80\n"
+			"*.api.example.com,id=s2 s2:80\n"
+			"*.api.example.com,id=s3,path_beg=/v2 s3:80\n"
+			"www.example.com,id=x x:80\n"
+			"*.bad*.com bad:80\n");
+
+		DomainMap map(file.fileName());
+
+		// exact wins over suffix
+		QCOMPARE(map.entry(DomainMap::Http, false, "www.example.com", "/").id, QByteArray("x"));
+
+		// longest suffix wins
+		QCOMPARE(map.entry(DomainMap::Http, false, "foo.example.com", "/").id, QByteArray("s1"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "a.b.example.com", "/").id, QByteArray("s1"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "foo.api.example.com", "/").id, QByteArray("s2"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "foo.api.example.com", "/v2/x").id, QByteArray("s3"));
+		QCOMPARE(map.entry(DomainMap::Http, false, "api.example.com", "/v2/x").id, QByteArray("s1"));
+
+		// the wildcard needs at least one label, otherwise the default
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.com", "/").id, QByteArray());
+		QVERIFY(!map.entry(DomainMap::Http, false, "example.com", "/").isNull());
+		QCOMPARE(map.entry(DomainMap::Http, false, "example.org", "/").id, QByteArray());
+		QCOMPARE(map.entry(DomainMap::Http, false, "*.example.com", "/").id, QByteArray("s1"));
+	}
+
+	void reloadUnderLoad()
+	{
+		const int count = 10000;
+		int tenant = httpTenant(count);
+		QByteArray path = tenantPath(tenant);
+
+		QTemporaryFile file;
+		writeRoutes(&file, makeRoutes(count, "a"));
+
+		DomainMap map(file.fileName());
+		QSignalSpy spy(&map, SIGNAL(changed()));
+
+		QList<QByteArray> validIds;
+		validIds += "a" + QByteArray::number(tenant);
+		validIds += "b" + QByteArray::number(tenant);
+
+		QList<LookupThread*> threads;
+		for(int n = 0; n < 4; ++n)
+		{
+			LookupThread *t = new LookupThread(&map, path, validIds);
+			t->start();
+			threads += t;
+		}
+
+		// publish alternating generations while lookups are running
+		for(int n = 0; n < 4; ++n)
+		{
+			int before = spy.count();
+			writeRoutes(&file, makeRoutes(count, (n % 2 == 0 ? "b" : "a")));
+			map.reload();
+
+			for(int i = 0; i < 100 && spy.count() == before; ++i)
+				QTest::qWait(50);
+
+			QVERIFY(spy.count() > before);
+		}
+
+		foreach(LookupThread *t, threads)
+			t->stop = 1;
+
+		foreach(LookupThread *t, threads)
+		{
+			t->wait();
+
+			QCOMPARE(t->bad, 0);
+			QVERIFY(t->lookups > 0);
+
+			// a blocked lookup would wait out a whole reload. the bound is
+			//   loose so that scheduling noise on a busy machine doesn't
+			//   trip it
+			QVERIFY(t->maxStall < 500);
+
+			delete t;
+		}
+	}
+
+	void benchEntry_data()
+	{
+		QTest::addColumn<int>("count");
+
+		QTest::newRow("10") << 10;
+		QTest::newRow("1k") << 1000;
+		QTest::newRow("100k") << 100000;
+	}
+
+	void benchEntry()
+	{
+		QFETCH(int, count);
+
+		QTemporaryFile file;
+		writeRoutes(&file, makeRoutes(count));
+
+		DomainMap map(file.fileName());
+
+		QByteArray path = tenantPath(httpTenant(count));
+		QVERIFY(!map.entry(DomainMap::Http, false, "api.example.com", path).id.isEmpty());
+
+		QBENCHMARK
+		{
+			map.entry(DomainMap::Http, false, "api.example.com", path);
+		}
+	}
+};
+
+QTEST_MAIN(DomainMapTest)
+#include "domainmaptest.moc"
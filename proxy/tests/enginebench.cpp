@@ -0,0 +1,698 @@
+/*
+ * Copyright (C) 2013 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// end-to-end throughput benchmark for the engine. it plays m2adapter on
+//   the client side, zurl on the origin side, and the handler for
+//   inspection, all over the usual zmq interfaces, like enginetest does.
+//   the engine runs in its own thread(s) so that its cpu time can be told
+//   apart from the fake peers, which all run in the main thread.
+//
+// usage: enginebench [--requests=N] [--concurrency=N] [--latency=msecs]
+//          [--body=bytes] [--chunks=N] [--workers=N] [--scenarios=a,b,...]
+//
+// scenarios: plain (no inspect), inspect, shared (inspect with a sharing
+//   key, so concurrent requests share one upstream request), and
+//   streaming (no inspect, response body sent in chunks)
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTemporaryFile>
+#include <QDir>
+#include <QtCrypto>
+#include "qzmqsocket.h"
+#include "qzmqvalve.h"
+#include "qzmqreqmessage.h"
+#include "log.h"
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "histogram.h"
+#include "engine.h"
+#include "benchutil.h"
+#include "benchorigin.h"
+
+#define CLIENT_ID "bench-client"
+#define ORIGIN_ID "bench-origin"
+#define PROXY_ID "bench-proxy"
+#define CLIENT_CREDITS 200000
+
+static QElapsedTimer g_clock;
+
+static qint64 nowUsecs()
+{
+	return g_clock.nsecsElapsed() / 1000;
+}
+
+static qint64 cpuUsecs(int who)
+{
+	struct rusage ru;
+	getrusage(who, &ru);
+	return ((qint64)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// where per-thread usage isn't available, the fake peers are counted too
+static qint64 mainThreadCpuUsecs()
+{
+#ifdef RUSAGE_THREAD
+	return cpuUsecs(RUSAGE_THREAD);
+#else
+	return 0;
+#endif
+}
+
+class Options
+{
+public:
+	int requests;
+	int concurrency;
+	int latency;
+	int bodySize;
+	int chunks;
+	int workers;
+	QStringList scenarios;
+
+	Options() :
+		requests(10000),
+		concurrency(100),
+		latency(0),
+		bodySize(1000),
+		chunks(10),
+		workers(1)
+	{
+		scenarios << "plain" << "inspect" << "shared" << "streaming";
+	}
+};
+
+class EngineThread : public QThread
+{
+public:
+	Engine::Configuration config;
+	QMutex m;
+	QWaitCondition w;
+	bool started;
+
+	EngineThread() :
+		started(false)
+	{
+	}
+
+	~EngineThread()
+	{
+		quit();
+		wait();
+	}
+
+	bool start()
+	{
+		QMutexLocker locker(&m);
+		QThread::start();
+		w.wait(&m);
+		return started;
+	}
+
+	virtual void run()
+	{
+		Engine *engine = new Engine;
+		bool ok = engine->start(config);
+
+		m.lock();
+		started = ok;
+		w.wakeOne();
+		m.unlock();
+
+		if(ok)
+			exec();
+
+		delete engine;
+	}
+};
+
+// fake zurl. responds after the configured latency, either in one packet
+//   or in chunks paced by the proxy's credits
+class Origin : public BenchOrigin
+{
+	Q_OBJECT
+
+public:
+	class Request : public Session
+	{
+	public:
+		int chunksLeft;
+		qint64 due;
+	};
+
+	int latency;
+	bool streaming;
+	int chunks;
+	QByteArray body;
+	QByteArray chunk;
+	int requests;
+
+	QTimer *timer;
+	QList<Request*> pending; // in arrival order, so also in due order
+
+	Origin(QObject *parent = 0) :
+		BenchOrigin(ORIGIN_ID, parent),
+		latency(0),
+		streaming(false),
+		chunks(1),
+		requests(0)
+	{
+		timer = new QTimer(this);
+		timer->setSingleShot(true);
+		connect(timer, SIGNAL(timeout()), SLOT(timer_timeout()));
+	}
+
+	~Origin()
+	{
+		qDeleteAll(pending);
+	}
+
+	void setup(const Options &opts, bool _streaming)
+	{
+		latency = opts.latency;
+		streaming = _streaming;
+		chunks = (streaming ? qMax(opts.chunks, 1) : 1);
+		body = QByteArray(opts.bodySize, 'a');
+		chunk = QByteArray(qMax(opts.bodySize / chunks, 1), 'a');
+		requests = 0;
+	}
+
+protected:
+	virtual void requestReady(const ZhttpRequestPacket &zreq)
+	{
+		++requests;
+
+		Request *r = new Request;
+		r->id = zreq.id;
+		r->proxyAddress = zreq.from;
+		r->credits = qMax(zreq.credits, 0);
+		r->chunksLeft = chunks;
+		r->due = nowUsecs() + (qint64)latency * 1000;
+		pending += r;
+
+		schedule();
+	}
+
+	virtual void creditsAdded(Session *s)
+	{
+		trySend((Request *)s);
+	}
+
+private:
+	void respond(Request *r)
+	{
+		ZhttpResponsePacket zresp;
+		zresp.code = 200;
+		zresp.reason = "OK";
+		zresp.headers += HttpHeader("Content-Type", "text/plain");
+
+		if(!streaming)
+		{
+			zresp.headers += HttpHeader("Content-Length", QByteArray::number(body.size()));
+			zresp.body = body;
+			write(r, zresp);
+			delete r;
+			return;
+		}
+
+		zresp.body = chunk;
+		zresp.more = (r->chunksLeft > 1);
+		write(r, zresp);
+
+		r->credits -= chunk.size();
+		--(r->chunksLeft);
+
+		if(r->chunksLeft > 0)
+		{
+			addSession(r);
+			trySend(r);
+		}
+		else
+			delete r;
+	}
+
+	void trySend(Request *r)
+	{
+		while(r->chunksLeft > 0 && r->credits >= chunk.size())
+		{
+			ZhttpResponsePacket zresp;
+			zresp.body = chunk;
+			zresp.more = (r->chunksLeft > 1);
+			write(r, zresp);
+
+			r->credits -= chunk.size();
+			--(r->chunksLeft);
+		}
+
+		if(r->chunksLeft == 0)
+			removeSession(r);
+	}
+
+	void schedule()
+	{
+		if(!pending.isEmpty() && !timer->isActive())
+			timer->start((int)qMax(pending.first()->due - nowUsecs(), (qint64)0) / 1000);
+	}
+
+private slots:
+	void timer_timeout()
+	{
+		qint64 now = nowUsecs();
+		while(!pending.isEmpty() && pending.first()->due <= now)
+			respond(pending.takeFirst());
+
+		schedule();
+	}
+};
+
+// fake handler. answers inspect requests, optionally with a sharing key
+class Handler : public QObject
+{
+	Q_OBJECT
+
+public:
+	QByteArray sharingKey;
+
+	QZmq::Socket *inspectSock;
+	QZmq::Valve *inspectValve;
+
+	Handler(QObject *parent = 0) :
+		QObject(parent)
+	{
+		inspectSock = new QZmq::Socket(QZmq::Socket::Router, this);
+		inspectValve = new QZmq::Valve(inspectSock, this);
+		connect(inspectValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(inspect_readyRead(const QList<QByteArray> &)));
+	}
+
+	void start()
+	{
+		inspectSock->connectToAddress(BenchUtil::makeSpec("inspect"));
+		inspectValve->open();
+	}
+
+private slots:
+	void inspect_readyRead(const QList<QByteArray> &_message)
+	{
+		QZmq::ReqMessage message(_message);
+		QVariantHash vreq = TnetString::toVariant(message.content()[0]).toHash();
+
+		QVariantHash value;
+		value["no-proxy"] = false;
+		if(!sharingKey.isEmpty())
+			value["sharing-key"] = sharingKey;
+
+		QVariantHash vresp;
+		vresp["id"] = vreq["id"];
+		vresp["success"] = true;
+		vresp["value"] = value;
+		inspectSock->write(message.createReply(QList<QByteArray>() << TnetString::fromVariant(vresp)).toRawMessage());
+	}
+};
+
+// fake m2adapter. keeps a number of requests in flight, starting a new
+//   one as each finishes, and acks response data with credits
+class Client : public QObject
+{
+	Q_OBJECT
+
+public:
+	class Request
+	{
+	public:
+		QByteArray id;
+		QByteArray proxyAddress;
+		int outSeq;
+		qint64 start;
+	};
+
+	int total;
+	int concurrency;
+	int started;
+	int finished;
+	int errors;
+	qint64 bytes;
+	Histogram latency;
+	int nextId;
+
+	QZmq::Socket *outSock;
+	QZmq::Socket *outStreamSock;
+	QZmq::Socket *inSock;
+	QZmq::Valve *inValve;
+	QHash<QByteArray, Request*> requests;
+
+	Client(QObject *parent = 0) :
+		QObject(parent),
+		total(0),
+		concurrency(0),
+		started(0),
+		finished(0),
+		errors(0),
+		bytes(0),
+		nextId(0)
+	{
+		outSock = new QZmq::Socket(QZmq::Socket::Push, this);
+
+		outStreamSock = new QZmq::Socket(QZmq::Socket::Router, this);
+
+		inSock = new QZmq::Socket(QZmq::Socket::Sub, this);
+		inValve = new QZmq::Valve(inSock, this);
+		connect(inValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(in_readyRead(const QList<QByteArray> &)));
+	}
+
+	~Client()
+	{
+		qDeleteAll(requests);
+	}
+
+	void start()
+	{
+		outSock->bind(BenchUtil::makeSpec("client-out"));
+		outStreamSock->bind(BenchUtil::makeSpec("client-out-stream"));
+		inSock->bind(BenchUtil::makeSpec("client-in"));
+
+		inSock->subscribe(QByteArray(CLIENT_ID) + ' ');
+		inValve->open();
+	}
+
+	void run(int _total, int _concurrency)
+	{
+		total = _total;
+		concurrency = _concurrency;
+		started = 0;
+		finished = 0;
+		errors = 0;
+		bytes = 0;
+		latency.clear();
+
+		while(started < total && requests.count() < concurrency)
+			sendRequest();
+	}
+
+signals:
+	void done();
+
+private:
+	void sendRequest()
+	{
+		Request *r = new Request;
+		r->id = "r" + QByteArray::number(nextId++);
+		r->outSeq = 0;
+		r->start = nowUsecs();
+		requests.insert(r->id, r);
+		++started;
+
+		ZhttpRequestPacket zreq;
+		zreq.from = CLIENT_ID;
+		zreq.id = r->id;
+		zreq.seq = (r->outSeq)++;
+		zreq.type = ZhttpRequestPacket::Data;
+		zreq.method = "GET";
+		zreq.uri = QUrl("http://bench/path");
+		zreq.stream = true;
+		zreq.credits = CLIENT_CREDITS;
+		outSock->write(QList<QByteArray>() << ('T' + TnetString::fromVariant(zreq.toVariant())));
+	}
+
+	void sendCredits(Request *r, int credits)
+	{
+		ZhttpRequestPacket zreq;
+		zreq.from = CLIENT_ID;
+		zreq.id = r->id;
+		zreq.seq = (r->outSeq)++;
+		zreq.type = ZhttpRequestPacket::Credit;
+		zreq.credits = credits;
+
+		QList<QByteArray> msg;
+		msg += r->proxyAddress;
+		msg += QByteArray();
+		msg += 'T' + TnetString::fromVariant(zreq.toVariant());
+		outStreamSock->write(msg);
+	}
+
+	void finish(Request *r, bool ok)
+	{
+		latency.record(nowUsecs() - r->start);
+		requests.remove(r->id);
+		delete r;
+
+		++finished;
+		if(!ok)
+			++errors;
+
+		if(started < total)
+			sendRequest();
+		else if(requests.isEmpty())
+			emit done();
+	}
+
+private slots:
+	void in_readyRead(const QList<QByteArray> &message)
+	{
+		int at = message[0].indexOf(' ');
+		if(at == -1)
+			return;
+
+		ZhttpResponsePacket zresp;
+		if(!zresp.fromVariant(TnetString::toVariant(message[0].mid(at + 2))))
+			return;
+
+		Request *r = requests.value(zresp.id);
+		if(!r)
+			return;
+
+		if(!zresp.from.isEmpty())
+			r->proxyAddress = zresp.from;
+
+		if(zresp.type == ZhttpResponsePacket::Data)
+		{
+			bytes += zresp.body.size();
+
+			if(!zresp.more)
+				finish(r, true);
+			else if(!zresp.body.isEmpty() && !r->proxyAddress.isEmpty())
+				sendCredits(r, zresp.body.size());
+		}
+		else if(zresp.type == ZhttpResponsePacket::Error || zresp.type == ZhttpResponsePacket::Cancel)
+		{
+			finish(r, false);
+		}
+	}
+};
+
+class Scenario
+{
+public:
+	QString name;
+	bool inspect;
+	bool shared;
+	bool streaming;
+
+	Scenario(const QString &_name = QString(), bool _inspect = false, bool _shared = false, bool _streaming = false) :
+		name(_name),
+		inspect(_inspect),
+		shared(_shared),
+		streaming(_streaming)
+	{
+	}
+};
+
+static QList<Scenario> allScenarios()
+{
+	QList<Scenario> out;
+	out += Scenario("plain");
+	out += Scenario("inspect", true);
+	out += Scenario("shared", true, true);
+	out += Scenario("streaming", false, false, true);
+	return out;
+}
+
+static bool runScenario(const Scenario &s, const Options &opts, const QString &routesFile, Client *client, Origin *origin, Handler *handler)
+{
+	EngineThread engine;
+	engine.config.clientId = PROXY_ID;
+	engine.config.serverInSpecs = QStringList() << BenchUtil::makeSpec("client-out");
+	engine.config.serverInStreamSpecs = QStringList() << BenchUtil::makeSpec("client-out-stream");
+	engine.config.serverOutSpecs = QStringList() << BenchUtil::makeSpec("client-in");
+	engine.config.clientOutSpecs = QStringList() << BenchUtil::makeSpec("zurl-out");
+	engine.config.clientOutStreamSpecs = QStringList() << BenchUtil::makeSpec("zurl-out-stream");
+	engine.config.clientInSpecs = QStringList() << BenchUtil::makeSpec("zurl-in");
+	if(s.inspect)
+		engine.config.inspectSpec = BenchUtil::makeSpec("inspect");
+	engine.config.routesFile = routesFile;
+	engine.config.workers = opts.workers;
+	engine.config.sigIss = "pushpin";
+	engine.config.sigKey = "changeme";
+
+	if(!engine.start())
+	{
+		fprintf(stderr, "%s: failed to start engine\n", qPrintable(s.name));
+		return false;
+	}
+
+	origin->setup(opts, s.streaming);
+	handler->sharingKey = (s.shared ? "bench" : QByteArray());
+
+	QEventLoop loop;
+	QObject::connect(client, SIGNAL(done()), &loop, SLOT(quit()));
+
+	// let the sockets connect, then warm up
+	QTimer::singleShot(500, &loop, SLOT(quit()));
+	loop.exec();
+
+	int warmup = qMin(qMax(opts.requests / 10, 1), 1000);
+	client->run(warmup, opts.concurrency);
+	loop.exec();
+
+	origin->requests = 0;
+	qint64 cpuStart = cpuUsecs(RUSAGE_SELF) - mainThreadCpuUsecs();
+	qint64 timeStart = nowUsecs();
+
+	client->run(opts.requests, opts.concurrency);
+	loop.exec();
+
+	qint64 elapsed = qMax(nowUsecs() - timeStart, (qint64)1);
+	qint64 cpu = cpuUsecs(RUSAGE_SELF) - mainThreadCpuUsecs() - cpuStart;
+
+	const Histogram &h = client->latency;
+	printf("%-10s %8d %10.0f %8lld %8lld %8lld %8lld %10.1f %9d %7d\n",
+		qPrintable(s.name),
+		client->finished,
+		(double)client->finished * 1000000 / elapsed,
+		h.percentile(50),
+		h.percentile(90),
+		h.percentile(99),
+		h.percentile(99.9),
+		(double)cpu / qMax(client->finished, 1),
+		origin->requests,
+		client->errors);
+	fflush(stdout);
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	QCA::Initializer qcaInit;
+	QCoreApplication app(argc, argv);
+
+	QStringList args = app.arguments();
+	args.removeFirst();
+
+	Options opts;
+	foreach(const QString &arg, args)
+	{
+		int at = arg.indexOf('=');
+		if(!arg.startsWith("--") || at == -1)
+		{
+			fprintf(stderr, "bad argument: %s\n", qPrintable(arg));
+			return 1;
+		}
+
+		QString name = arg.mid(2, at - 2);
+		QString value = arg.mid(at + 1);
+
+		if(name == "scenarios")
+		{
+			opts.scenarios = value.split(',', QString::SkipEmptyParts);
+			continue;
+		}
+
+		bool ok;
+		int x = value.toInt(&ok);
+		if(!ok || x < 0)
+		{
+			fprintf(stderr, "bad value for %s: %s\n", qPrintable(name), qPrintable(value));
+			return 1;
+		}
+
+		if(name == "requests")
+			opts.requests = qMax(x, 1);
+		else if(name == "concurrency")
+			opts.concurrency = qMax(x, 1);
+		else if(name == "latency")
+			opts.latency = x;
+		else if(name == "body")
+			opts.bodySize = x;
+		else if(name == "chunks")
+			opts.chunks = qMax(x, 1);
+		else if(name == "workers")
+			opts.workers = qMax(x, 1);
+		else
+		{
+			fprintf(stderr, "unknown option: %s\n", qPrintable(name));
+			return 1;
+		}
+	}
+
+	log_setOutputLevel(LOG_LEVEL_WARNING);
+
+	g_clock.start();
+
+	BenchUtil::setSpecPrefix(QDir::tempPath() + "/pushpin-bench-" + QString::number(QCoreApplication::applicationPid()) + '-');
+
+	QTemporaryFile routes;
+	routes.open();
+	routes.write("* origin:80\n");
+	routes.flush();
+
+	Client client;
+	client.start();
+	Origin origin;
+	origin.start();
+	Handler handler;
+	handler.start();
+
+	printf("requests=%d concurrency=%d latency=%dms body=%d chunks=%d workers=%d\n", opts.requests, opts.concurrency, opts.latency, opts.bodySize, opts.chunks, opts.workers);
+	printf("latency in usecs, cpu is engine time per request in usecs\n\n");
+	printf("%-10s %8s %10s %8s %8s %8s %8s %10s %9s %7s\n", "scenario", "reqs", "req/s", "p50", "p90", "p99", "p99.9", "cpu/req", "upstream", "errors");
+
+	QList<Scenario> scenarios = allScenarios();
+	foreach(const QString &name, opts.scenarios)
+	{
+		bool found = false;
+		foreach(const Scenario &s, scenarios)
+		{
+			if(s.name == name)
+			{
+				found = true;
+				if(!runScenario(s, opts, routes.fileName(), &client, &origin, &handler))
+					return 1;
+				break;
+			}
+		}
+
+		if(!found)
+		{
+			fprintf(stderr, "unknown scenario: %s\n", qPrintable(name));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+#include "enginebench.moc"
@@ -50,7 +50,13 @@ public:
 	QZmq::Socket *handlerRetryOutSock;
 
 	int serverReqs;
+	int serverCancels;
+	bool holdServer;
 	bool inspectEnabled;
+	bool holdInspect;
+	QList< QList<QByteArray> > heldInspects;
+	bool noProxy;
+	QByteArray sid;
 	QByteArray sharingKey;
 	QByteArray in;
 	QByteArray acceptIn;
@@ -61,7 +67,11 @@ public:
 	Wrapper(QObject *parent) :
 		QObject(parent),
 		serverReqs(0),
+		serverCancels(0),
+		holdServer(false),
 		inspectEnabled(true),
+		holdInspect(false),
+		noProxy(false),
 		retried(false),
 		finished(false),
 		clientReqsFinished(0)
@@ -81,6 +91,7 @@ public:
 		connect(zhttpServerInValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(zhttpServerIn_readyRead(const QList<QByteArray> &)));
 
 		zhttpServerInStreamSock = new QZmq::Socket(QZmq::Socket::Router, this);
+		zhttpServerInStreamSock->setIdentity("test-server");
 		zhttpServerInStreamValve = new QZmq::Valve(zhttpServerInStreamSock, this);
 		connect(zhttpServerInStreamValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(zhttpServerInStream_readyRead(const QList<QByteArray> &)));
 
@@ -129,7 +140,13 @@ public:
 	void reset()
 	{
 		serverReqs = 0;
+		serverCancels = 0;
+		holdServer = false;
 		inspectEnabled = true;
+		holdInspect = false;
+		heldInspects.clear();
+		noProxy = false;
+		sid.clear();
 		sharingKey.clear();
 		in.clear();
 		acceptIn.clear();
@@ -138,6 +155,39 @@ public:
 		clientReqsFinished = 0;
 	}
 
+	void releaseInspect()
+	{
+		QList< QList<QByteArray> > messages = heldInspects;
+		heldInspects.clear();
+		foreach(const QList<QByteArray> &message, messages)
+			respondInspect(message);
+	}
+
+private:
+	void respondInspect(const QList<QByteArray> &_message)
+	{
+		QZmq::ReqMessage message(_message);
+		QVariant v = TnetString::toVariant(message.content()[0]);
+		log_debug("inspect: %s", qPrintable(TnetString::variantToString(v, -1)));
+		if(inspectEnabled)
+		{
+			QVariantHash vreq = v.toHash();
+			QVariantHash args = vreq["args"].toHash();
+			QVariantHash respValue;
+			respValue["no-proxy"] = noProxy;
+			if(!sid.isEmpty())
+				respValue["sid"] = sid;
+			if(!sharingKey.isEmpty())
+				respValue["sharing-key"] = sharingKey;
+			QVariantHash vresp;
+			vresp["id"] = vreq["id"];
+			vresp["success"] = true;
+			vresp["value"] = respValue;
+			log_debug("inspect response: %s", qPrintable(TnetString::variantToString(vresp, -1)));
+			handlerInspectSock->write(message.createReply(QList<QByteArray>() << TnetString::fromVariant(vresp)).toRawMessage());
+		}
+	}
+
 private slots:
 	void zhttpClientIn_readyRead(const QList<QByteArray> &message)
 	{
@@ -186,6 +236,18 @@ private slots:
 		zresp.seq = 0;
 		zresp.code = 200;
 		zresp.reason = "OK";
+
+		if(holdServer)
+		{
+			// start the response but leave it open
+			zresp.headers += HttpHeader("Content-Type", "text/plain");
+			zresp.body = "held ";
+			zresp.more = true;
+			QByteArray buf = zreq.from + " T" + TnetString::fromVariant(zresp.toVariant());
+			zhttpServerOutSock->write(QList<QByteArray>() << buf);
+			return;
+		}
+
 		if(!retried && zreq.uri.encodedQuery().contains("wait=true"))
 		{
 			if(zreq.uri.encodedPath() == "/path2")
@@ -219,29 +281,25 @@ private slots:
 
 	void zhttpServerInStream_readyRead(const QList<QByteArray> &message)
 	{
-		Q_UNUSED(message);
+		if(message.count() != 3)
+			return;
+
+		QVariant v = TnetString::toVariant(message[2].mid(1));
+		ZhttpRequestPacket zreq;
+		zreq.fromVariant(v);
+		if(zreq.type == ZhttpRequestPacket::Cancel)
+			++serverCancels;
 	}
 
-	void handlerInspect_readyRead(const QList<QByteArray> &_message)
+	void handlerInspect_readyRead(const QList<QByteArray> &message)
 	{
-		QZmq::ReqMessage message(_message);
-		QVariant v = TnetString::toVariant(message.content()[0]);
-		log_debug("inspect: %s", qPrintable(TnetString::variantToString(v, -1)));
-		if(inspectEnabled)
+		if(holdInspect)
 		{
-			QVariantHash vreq = v.toHash();
-			QVariantHash args = vreq["args"].toHash();
-			QVariantHash respValue;
-			respValue["no-proxy"] = false;
-			if(!sharingKey.isEmpty())
-				respValue["sharing-key"] = sharingKey;
-			QVariantHash vresp;
-			vresp["id"] = vreq["id"];
-			vresp["success"] = true;
-			vresp["value"] = respValue;
-			log_debug("inspect response: %s", qPrintable(TnetString::variantToString(vresp, -1)));
-			handlerInspectSock->write(message.createReply(QList<QByteArray>() << TnetString::fromVariant(vresp)).toRawMessage());
+			heldInspects.append(message);
+			return;
 		}
+
+		respondInspect(message);
 	}
 
 	void handlerAccept_readyRead(const QList<QByteArray> &_message)
@@ -261,6 +319,14 @@ private slots:
 		handlerAcceptSock->write(message.createReply(QList<QByteArray>() << TnetString::fromVariant(vresp)).toRawMessage());
 
 		QVariantHash vaccept = vreq["args"].toHash();
+
+		// no response means the handler said not to proxy
+		if(!vaccept.contains("response"))
+		{
+			finished = true;
+			return;
+		}
+
 		acceptIn = vaccept["response"].toHash()["body"].toByteArray();
 
 		bool ok;
@@ -504,6 +570,145 @@ private slots:
 		// hackishly compare the merged inputs
 		QCOMPARE(wrapper->in, QByteArray("hello worldhello world"));
 	}
+
+	void speculativeAttach()
+	{
+		wrapper->reset();
+		wrapper->holdInspect = true;
+
+		ZhttpRequestPacket zreq;
+		zreq.from = "test-client";
+		zreq.id = "9";
+		zreq.uri = "http://example/spec/path";
+		zreq.method = "GET";
+		zreq.stream = true;
+		zreq.credits = 200000;
+		QByteArray buf = 'T' + TnetString::fromVariant(zreq.toVariant());
+		log_debug("writing: %s", buf.data());
+		wrapper->zhttpClientOutSock->write(QList<QByteArray>() << buf);
+
+		// the upstream request goes out while inspect is pending
+		while(wrapper->serverReqs < 1 || wrapper->heldInspects.isEmpty())
+			QTest::qWait(10);
+
+		wrapper->releaseInspect();
+		while(!wrapper->finished)
+			QTest::qWait(10);
+
+		// the held response was used rather than a second request
+		QCOMPARE(wrapper->in, QByteArray("hello world"));
+		QCOMPARE(wrapper->serverReqs, 1);
+	}
+
+	void speculativeDiscardWithSid()
+	{
+		wrapper->reset();
+		wrapper->holdInspect = true;
+		wrapper->holdServer = true;
+		wrapper->sid = "test-sid";
+
+		ZhttpRequestPacket zreq;
+		zreq.from = "test-client";
+		zreq.id = "10";
+		zreq.uri = "http://example/spec/path";
+		zreq.method = "GET";
+		zreq.stream = true;
+		zreq.credits = 200000;
+		QByteArray buf = 'T' + TnetString::fromVariant(zreq.toVariant());
+		log_debug("writing: %s", buf.data());
+		wrapper->zhttpClientOutSock->write(QList<QByteArray>() << buf);
+
+		while(wrapper->serverReqs < 1 || wrapper->heldInspects.isEmpty())
+			QTest::qWait(10);
+
+		// the speculative request lacked the session headers, so it is
+		//   cancelled and the request is sent again
+		wrapper->holdServer = false;
+		wrapper->releaseInspect();
+		while(!wrapper->finished || wrapper->serverCancels < 1)
+			QTest::qWait(10);
+
+		QCOMPARE(wrapper->in, QByteArray("hello world"));
+		QCOMPARE(wrapper->serverReqs, 2);
+		QCOMPARE(wrapper->serverCancels, 1);
+	}
+
+	void speculativeDiscardNoProxy()
+	{
+		wrapper->reset();
+		wrapper->holdInspect = true;
+		wrapper->holdServer = true;
+		wrapper->noProxy = true;
+
+		ZhttpRequestPacket zreq;
+		zreq.from = "test-client";
+		zreq.id = "11";
+		zreq.uri = "http://example/spec/path";
+		zreq.method = "GET";
+		zreq.stream = true;
+		zreq.credits = 200000;
+		QByteArray buf = 'T' + TnetString::fromVariant(zreq.toVariant());
+		log_debug("writing: %s", buf.data());
+		wrapper->zhttpClientOutSock->write(QList<QByteArray>() << buf);
+
+		while(wrapper->serverReqs < 1 || wrapper->heldInspects.isEmpty())
+			QTest::qWait(10);
+
+		// the request is handed to the accept handler instead
+		wrapper->releaseInspect();
+		while(!wrapper->finished || wrapper->serverCancels < 1)
+			QTest::qWait(10);
+
+		QCOMPARE(wrapper->serverReqs, 1);
+		QCOMPARE(wrapper->serverCancels, 1);
+		QVERIFY(wrapper->in.isEmpty());
+	}
+
+	void speculativeCancelOnClientGone()
+	{
+		wrapper->reset();
+		wrapper->holdInspect = true;
+		wrapper->holdServer = true;
+
+		ZhttpRequestPacket zreq;
+		zreq.from = "test-client";
+		zreq.id = "12";
+		zreq.uri = "http://example/spec/path";
+		zreq.method = "GET";
+		zreq.stream = true;
+		zreq.credits = 200000;
+		QByteArray buf = 'T' + TnetString::fromVariant(zreq.toVariant());
+		log_debug("writing: %s", buf.data());
+		wrapper->zhttpClientOutSock->write(QList<QByteArray>() << buf);
+
+		while(wrapper->serverReqs < 1 || wrapper->heldInspects.isEmpty())
+			QTest::qWait(10);
+
+		// client goes away while inspect is still pending
+		ZhttpRequestPacket zcancel;
+		zcancel.from = "test-client";
+		zcancel.id = "12";
+		zcancel.type = ZhttpRequestPacket::Cancel;
+		zcancel.seq = 1;
+		buf = 'T' + TnetString::fromVariant(zcancel.toVariant());
+		log_debug("writing: %s", buf.data());
+		QList<QByteArray> msg;
+		msg.append("proxy");
+		msg.append(QByteArray());
+		msg.append(buf);
+		wrapper->zhttpClientOutStreamSock->write(msg);
+
+		while(wrapper->serverCancels < 1)
+			QTest::qWait(10);
+
+		// a late inspect result for the finished request is ignored
+		wrapper->releaseInspect();
+		QTest::qWait(100);
+
+		QCOMPARE(wrapper->serverReqs, 1);
+		QCOMPARE(wrapper->serverCancels, 1);
+		QVERIFY(wrapper->in.isEmpty());
+	}
 };
 
 QTEST_MAIN(EngineTest)
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "headerrewrite.h"
+
+static HttpHeaders makeHeaders()
+{
+	HttpHeaders h;
+	h += HttpHeader("Host", "example.com:8080");
+	h += HttpHeader("Connection", "keep-alive");
+	h += HttpHeader("X-Forwarded-For", "1.2.3.4");
+	h += HttpHeader("Grip-Sig", "token");
+	h += HttpHeader("eb9bf0f5-Foo", "orig");
+	h += HttpHeader("Accept", "*/*");
+	h += HttpHeader("X-Forwarded-Protocol", "https");
+	h += HttpHeader("x-forwarded-for", "5.6.7.8");
+	return h;
+}
+
+static QList<QByteArray> names(const HttpHeaders &headers)
+{
+	QList<QByteArray> out;
+	foreach(const HttpHeader &h, headers)
+		out += h.first;
+	return out;
+}
+
+class HeaderRewriteTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void plain()
+	{
+		HeaderRewrite rewrite;
+
+		HttpHeaders out;
+		HttpHeaders xff;
+		rewrite.apply(makeHeaders(), false, false, &out, &xff);
+
+		QList<QByteArray> expected;
+		expected += "Accept";
+		expected += "X-Forwarded-Protocol";
+		QCOMPARE(names(out), expected);
+		QCOMPARE(xff.count(), 2);
+		QCOMPARE(xff[1].second, QByteArray("5.6.7.8"));
+	}
+
+	void trusted()
+	{
+		HeaderRewrite rewrite(QList<QByteArray>(), true);
+
+		HttpHeaders out;
+		HttpHeaders xff;
+		rewrite.apply(makeHeaders(), true, true, &out, &xff);
+
+		// marked headers stay in place, and Grip- headers are kept
+		QList<QByteArray> expected;
+		expected += "Grip-Sig";
+		expected += "eb9bf0f5-Foo";
+		expected += "Accept";
+		QCOMPARE(names(out), expected);
+	}
+
+	void mark()
+	{
+		QList<QByteArray> needMark;
+		needMark += "accept";
+		needMark += "Grip-Sig";
+		HeaderRewrite rewrite(needMark, false);
+
+		HttpHeaders out;
+		HttpHeaders xff;
+		rewrite.apply(makeHeaders(), true, false, &out, &xff);
+
+		// marked copies, including of dropped headers, go at the end
+		QList<QByteArray> expected;
+		expected += "Accept";
+		expected += "X-Forwarded-Protocol";
+		expected += "eb9bf0f5-Host";
+		expected += "eb9bf0f5-Connection";
+		expected += "eb9bf0f5-X-Forwarded-For";
+		expected += "eb9bf0f5-Foo";
+		expected += "eb9bf0f5-X-Forwarded-Protocol";
+		expected += "eb9bf0f5-x-forwarded-for";
+		QCOMPARE(names(out), expected);
+		QCOMPARE(out[5].second, QByteArray("orig"));
+	}
+
+	void benchApply()
+	{
+		QList<QByteArray> needMark;
+		needMark += "Authorization";
+		HeaderRewrite rewrite(needMark, true);
+
+		HttpHeaders in = makeHeaders();
+		for(int n = 0; n < 40; ++n)
+			in += HttpHeader("X-Custom-" + QByteArray::number(n), "value");
+
+		QBENCHMARK
+		{
+			HttpHeaders out;
+			HttpHeaders xff;
+			rewrite.apply(in, true, false, &out, &xff);
+		}
+	}
+};
+
+QTEST_MAIN(HeaderRewriteTest)
+#include "headerrewritetest.moc"
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "packet/httprequestdata.h"
+#include "inspectdata.h"
+#include "inspectcache.h"
+
+static HttpRequestData makeRequest(const QByteArray &path)
+{
+	HttpRequestData hdata;
+	hdata.method = "GET";
+	hdata.uri = QUrl::fromEncoded("http://example.com" + path, QUrl::StrictMode);
+	hdata.headers += HttpHeader("Authorization", "Bearer abc");
+	return hdata;
+}
+
+static InspectData makeResult(const QByteArray &sharingKey)
+{
+	InspectData idata;
+	idata.doProxy = true;
+	idata.sharingKey = sharingKey;
+	return idata;
+}
+
+class InspectCacheTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void lookup()
+	{
+		InspectCache cache;
+
+		QByteArray key = cache.key("r1", makeRequest("/a"));
+		InspectData idata;
+		QVERIFY(!cache.get(key, &idata));
+
+		// no ttl, not cached
+		cache.insert(key, makeResult("k"), 0);
+		QVERIFY(!cache.get(key, &idata));
+
+		cache.insert(key, makeResult("k"), 60);
+		QVERIFY(cache.get(key, &idata));
+		QVERIFY(idata.doProxy);
+		QCOMPARE(idata.sharingKey, QByteArray("k"));
+
+		// route, path and query are part of the key
+		QVERIFY(!cache.get(cache.key("r2", makeRequest("/a")), &idata));
+		QVERIFY(!cache.get(cache.key("r1", makeRequest("/b")), &idata));
+		QVERIFY(!cache.get(cache.key("r1", makeRequest("/a?x=1")), &idata));
+
+		int hits, misses;
+		cache.takeCounts(&hits, &misses);
+		QCOMPARE(hits, 1);
+		QCOMPARE(misses, 5);
+
+		cache.takeCounts(&hits, &misses);
+		QCOMPARE(hits, 0);
+		QCOMPARE(misses, 0);
+	}
+
+	void schemeAndPort()
+	{
+		InspectCache cache;
+
+		// routes without an id share an empty route id
+		HttpRequestData plain = makeRequest("/a");
+		HttpRequestData secure = plain;
+		secure.uri = QUrl::fromEncoded("https://example.com/a", QUrl::StrictMode);
+		HttpRequestData otherPort = plain;
+		otherPort.uri = QUrl::fromEncoded("http://example.com:8080/a", QUrl::StrictMode);
+
+		cache.insert(cache.key(QByteArray(), plain), makeResult("plain"), 60);
+		cache.insert(cache.key(QByteArray(), secure), makeResult("secure"), 60);
+
+		InspectData idata;
+		QVERIFY(cache.get(cache.key(QByteArray(), plain), &idata));
+		QCOMPARE(idata.sharingKey, QByteArray("plain"));
+		QVERIFY(cache.get(cache.key(QByteArray(), secure), &idata));
+		QCOMPARE(idata.sharingKey, QByteArray("secure"));
+		QVERIFY(!cache.get(cache.key(QByteArray(), otherPort), &idata));
+		QCOMPARE(cache.count(), 2);
+	}
+
+	void varyHeaders()
+	{
+		InspectCache cache;
+
+		HttpRequestData a = makeRequest("/a");
+		HttpRequestData b = a;
+		b.headers.clear();
+		b.headers += HttpHeader("Authorization", "Bearer xyz");
+
+		QCOMPARE(cache.key("r1", a), cache.key("r1", b));
+
+		cache.setVaryHeaders(QList<QByteArray>() << "authorization");
+		QVERIFY(cache.key("r1", a) != cache.key("r1", b));
+	}
+
+	void evict()
+	{
+		InspectCache cache;
+		cache.setMaxItems(2);
+
+		cache.insert("a", makeResult("a"), 60);
+		cache.insert("b", makeResult("b"), 60);
+
+		// touch a so that b is the least recently used
+		InspectData idata;
+		QVERIFY(cache.get("a", &idata));
+
+		cache.insert("c", makeResult("c"), 60);
+		QCOMPARE(cache.count(), 2);
+		QVERIFY(cache.get("a", &idata));
+		QVERIFY(!cache.get("b", &idata));
+		QVERIFY(cache.get("c", &idata));
+	}
+};
+
+QTEST_MAIN(InspectCacheTest)
+#include "inspectcachetest.moc"
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "histogram.h"
+#include "metrics.h"
+
+class MetricsTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void buckets()
+	{
+		// small values are exact, larger ones stay within a sub-bucket
+		for(qint64 v = 0; v < 100000; v += 7)
+		{
+			int index = Histogram::bucketIndex(v);
+			QVERIFY(Histogram::bucketLowerBound(index) <= v);
+			if(index + 1 < Histogram::BucketCount)
+				QVERIFY(Histogram::bucketLowerBound(index + 1) > v);
+		}
+
+		QCOMPARE(Histogram::bucketIndex(5), 5);
+		QCOMPARE(Histogram::bucketIndex(Q_INT64_C(1) << 50), (int)Histogram::BucketCount - 1);
+	}
+
+	void percentiles()
+	{
+		Histogram h;
+		for(int n = 1; n <= 1000; ++n)
+			h.record(n);
+
+		QCOMPARE(h.count(), (qint64)1000);
+		QCOMPARE(h.min(), (qint64)1);
+		QCOMPARE(h.max(), (qint64)1000);
+
+		qint64 p50 = h.percentile(50);
+		QVERIFY(p50 > 400 && p50 <= 500);
+		QVERIFY(h.percentile(100) <= 1000);
+	}
+
+	void merge()
+	{
+		Metrics a;
+		a.route("r1")->record(Metrics::ResponseTime, 100);
+		a.route("r1")->record(Metrics::BytesOut, 2048);
+
+		Metrics b;
+		b.route("r1")->record(Metrics::ResponseTime, 300);
+		b.route("r2")->record(Metrics::InspectTime, 50);
+
+		Metrics total;
+		QVERIFY(total.addVariant(a.toVariant()));
+		QVERIFY(total.addVariant(b.toVariant()));
+
+		const Histogram &rt = total.route("r1")->histograms[Metrics::ResponseTime];
+		QCOMPARE(rt.count(), (qint64)2);
+		QCOMPARE(rt.sum(), (qint64)400);
+		QCOMPARE(rt.min(), (qint64)100);
+		QCOMPARE(rt.max(), (qint64)300);
+		QCOMPARE(total.route("r2")->histograms[Metrics::InspectTime].count(), (qint64)1);
+
+		// clearing keeps route objects, so held pointers stay valid
+		Metrics::Route *r = total.route("r1");
+		total.clear();
+		QVERIFY(total.isEmpty());
+		QCOMPARE(total.route("r1"), r);
+		QCOMPARE(total.toVariant().toHash().count(), 0);
+	}
+
+	void mergeLargeCounts()
+	{
+		// lifetime totals can pass 2^32 in the busiest buckets
+		const qint64 big = Q_INT64_C(3000000000);
+
+		QVariantList b1;
+		b1 += (qint64)100;
+		b1 += big;
+		QVariantList b2;
+		b2 += (qint64)1000;
+		b2 += (qint64)1;
+		QVariantList vbuckets;
+		vbuckets += QVariant(b1);
+		vbuckets += QVariant(b2);
+
+		QVariantHash vh;
+		vh["count"] = big + 1;
+		vh["sum"] = big * 100 + 1000;
+		vh["min"] = (qint64)100;
+		vh["max"] = (qint64)1000;
+		vh["buckets"] = vbuckets;
+
+		QVariantHash vroute;
+		vroute["response-time"] = vh;
+		QVariantHash vmetrics;
+		vmetrics["r1"] = vroute;
+
+		Metrics total;
+		QVERIFY(total.addVariant(vmetrics));
+		QVERIFY(total.addVariant(vmetrics));
+
+		const Histogram &rt = total.route("r1")->histograms[Metrics::ResponseTime];
+		QCOMPARE(rt.count(), big * 2 + 2);
+		QCOMPARE(rt.percentile(50), (qint64)100);
+		QCOMPARE(rt.percentile(99.9), (qint64)100);
+		QVERIFY(rt.percentile(100) > 100);
+
+		// and survive a round trip
+		Histogram h;
+		QVERIFY(h.fromVariant(rt.toVariant()));
+		QCOMPARE(h.count(), big * 2 + 2);
+		QCOMPARE(h.percentile(50), (qint64)100);
+	}
+
+	void benchRecord()
+	{
+		Metrics metrics;
+		Metrics::Route *r = metrics.route("r1");
+
+		qint64 v = 0;
+		QBENCHMARK
+		{
+			r->record(Metrics::ResponseTime, v);
+			v = (v + 7919) & 0xfffff;
+		}
+	}
+};
+
+QTEST_MAIN(MetricsTest)
+#include "metricstest.moc"
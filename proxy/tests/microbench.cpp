@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2013 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// microbenchmarks for hot-path primitives. each benchmark is calibrated,
+//   then timed over several samples, and the fastest sample is reported
+//   since it is the least disturbed by the rest of the system. output is
+//   csv: name, iterations, ns/op, allocs/op. allocations are counted by
+//   interposing malloc, which is only done with glibc. elsewhere allocs/op
+//   is reported as -1.
+//
+// usage: microbench [--time=msecs] [--filter=substring]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <QHostAddress>
+#include "log.h"
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "packet/httprequestdata.h"
+#include "inspectdata.h"
+#include "xffrule.h"
+#include "headerrewrite.h"
+#include "domainmap.h"
+#include "proxyutil.h"
+#include "jwt.h"
+#include "httpextension.h"
+#include "wsevent.h"
+#include "m2requestpacket.h"
+
+#define SAMPLES 5
+
+static long g_allocs = 0;
+
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+// free isn't counted, so these are allocations rather than net usage
+void *malloc(size_t size)
+{
+	__sync_fetch_and_add(&g_allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	__sync_fetch_and_add(&g_allocs, 1);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&g_allocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+}
+#endif
+
+static long allocCount()
+{
+	return __sync_fetch_and_add(&g_allocs, 0);
+}
+
+// results are kept here so the compiler can't drop the work
+static int g_sink = 0;
+
+class Bench
+{
+public:
+	virtual ~Bench() {}
+
+	virtual const char *name() const = 0;
+
+	// performs one operation
+	virtual void run() = 0;
+};
+
+class TnetEncodeRequestBench : public Bench
+{
+public:
+	ZhttpRequestPacket zreq;
+
+	TnetEncodeRequestBench()
+	{
+		zreq.from = "pushpin-m2-7999";
+		zreq.id = "3c2e0e0a-6e1b-4f52-9bd4-1e35e6de6a11";
+		zreq.seq = 0;
+		zreq.type = ZhttpRequestPacket::Data;
+		zreq.method = "GET";
+		zreq.uri = QUrl("http://example.com/path/to/resource?a=1&b=2");
+		zreq.headers += HttpHeader("Host", "example.com");
+		zreq.headers += HttpHeader("User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)");
+		zreq.headers += HttpHeader("Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8");
+		zreq.headers += HttpHeader("Accept-Encoding", "gzip, deflate");
+		zreq.headers += HttpHeader("Accept-Language", "en-US,en;q=0.5");
+		zreq.headers += HttpHeader("Cookie", "session=0123456789abcdef0123456789abcdef");
+		zreq.headers += HttpHeader("Connection", "keep-alive");
+		zreq.stream = true;
+		zreq.credits = 200000;
+		zreq.peerAddress = QHostAddress("192.168.1.10");
+	}
+
+	virtual const char *name() const { return "tnetstring/encode-request"; }
+
+	virtual void run()
+	{
+		g_sink += TnetString::fromVariant(zreq.toVariant()).size();
+	}
+};
+
+class TnetDecodeRequestBench : public Bench
+{
+public:
+	QByteArray buf;
+
+	TnetDecodeRequestBench()
+	{
+		TnetEncodeRequestBench enc;
+		buf = TnetString::fromVariant(enc.zreq.toVariant());
+	}
+
+	virtual const char *name() const { return "tnetstring/decode-request"; }
+
+	virtual void run()
+	{
+		ZhttpRequestPacket zreq;
+		zreq.fromVariant(TnetString::toVariant(buf));
+		g_sink += zreq.headers.count();
+	}
+};
+
+class TnetEncodeResponseBench : public Bench
+{
+public:
+	ZhttpResponsePacket zresp;
+
+	TnetEncodeResponseBench()
+	{
+		zresp.from = "pushpin-proxy_1234";
+		zresp.id = "3c2e0e0a-6e1b-4f52-9bd4-1e35e6de6a11";
+		zresp.seq = 1;
+		zresp.code = 200;
+		zresp.reason = "OK";
+		zresp.headers += HttpHeader("Content-Type", "application/json");
+		zresp.headers += HttpHeader("Cache-Control", "no-cache");
+		zresp.headers += HttpHeader("Content-Length", "1000");
+		zresp.body = QByteArray(1000, 'a');
+		zresp.credits = 1000;
+	}
+
+	virtual const char *name() const { return "tnetstring/encode-response"; }
+
+	virtual void run()
+	{
+		g_sink += TnetString::fromVariant(zresp.toVariant()).size();
+	}
+};
+
+class TnetDecodeResponseBench : public Bench
+{
+public:
+	QByteArray buf;
+
+	TnetDecodeResponseBench()
+	{
+		TnetEncodeResponseBench enc;
+		buf = TnetString::fromVariant(enc.zresp.toVariant());
+	}
+
+	virtual const char *name() const { return "tnetstring/decode-response"; }
+
+	virtual void run()
+	{
+		ZhttpResponsePacket zresp;
+		zresp.fromVariant(TnetString::toVariant(buf));
+		g_sink += zresp.body.size();
+	}
+};
+
+class DomainMapEntryBench : public Bench
+{
+public:
+	QTemporaryFile file;
+	DomainMap *map;
+
+	DomainMapEntryBench()
+	{
+		QByteArray routes = "* default:80\n";
+		for(int n = 0; n < 1000; ++n)
+			routes += "api.example.com,path_beg=/tenant" + QByteArray::number(n) + "/,id=t" + QByteArray::number(n) + " tenant" + QByteArray::number(n) + ":80\n";
+
+		file.open();
+		file.write(routes);
+		file.flush();
+
+		map = new DomainMap(file.fileName());
+	}
+
+	~DomainMapEntryBench()
+	{
+		delete map;
+	}
+
+	virtual const char *name() const { return "domainmap/entry-1k"; }
+
+	virtual void run()
+	{
+		g_sink += map->entry(DomainMap::Http, false, "api.example.com", "/tenant500/items/1234").id.size();
+	}
+};
+
+class ManipulateRequestHeadersBench : public Bench
+{
+public:
+	HttpRequestData requestData;
+	DomainMap::Entry entry;
+	HeaderRewrite rewrite;
+	XffRule xffTrustedRule;
+	XffRule xffRule;
+	QHostAddress peerAddress;
+	InspectData idata;
+
+	ManipulateRequestHeadersBench() :
+		rewrite(QList<QByteArray>(), true),
+		peerAddress("192.168.1.10")
+	{
+		TnetEncodeRequestBench enc;
+		requestData.method = "GET";
+		requestData.uri = enc.zreq.uri;
+		requestData.headers = enc.zreq.headers;
+		requestData.headers += HttpHeader("X-Forwarded-For", "10.0.0.1");
+
+		xffRule.append = true;
+	}
+
+	virtual const char *name() const { return "proxyutil/manipulate-request-headers"; }
+
+	virtual void run()
+	{
+		// the call modifies its input, so the copy is part of the cost
+		HttpRequestData rd = requestData;
+		ProxyUtil::manipulateRequestHeaders("microbench", this, &rd, QByteArray(), entry, "pushpin", "changeme", rewrite, xffTrustedRule, xffRule, peerAddress, idata);
+		g_sink += rd.headers.count();
+	}
+};
+
+static QVariant makeClaim()
+{
+	QVariantMap claim;
+	claim["iss"] = "pushpin";
+	claim["exp"] = 1500000000;
+	return claim;
+}
+
+class JwtEncodeBench : public Bench
+{
+public:
+	QVariant claim;
+
+	JwtEncodeBench() :
+		claim(makeClaim())
+	{
+	}
+
+	virtual const char *name() const { return "jwt/encode"; }
+
+	virtual void run()
+	{
+		g_sink += Jwt::encode(claim, "changeme").size();
+	}
+};
+
+class JwtDecodeBench : public Bench
+{
+public:
+	QByteArray token;
+
+	JwtDecodeBench() :
+		token(Jwt::encode(makeClaim(), "changeme"))
+	{
+	}
+
+	virtual const char *name() const { return "jwt/decode"; }
+
+	virtual void run()
+	{
+		g_sink += (int)Jwt::decode(token, "changeme").isValid();
+	}
+};
+
+class ParseParamsBench : public Bench
+{
+public:
+	virtual const char *name() const { return "httpextension/parse-params"; }
+
+	virtual void run()
+	{
+		g_sink += parseParams(" message-prefix=\"m:\"; client_max_window_bits=15; server_no_context_takeover").count();
+	}
+};
+
+class GetExtensionBench : public Bench
+{
+public:
+	QList<QByteArray> extStrings;
+
+	GetExtensionBench()
+	{
+		extStrings += "permessage-deflate; client_max_window_bits";
+		extStrings += "grip; message-prefix=\"m:\"";
+	}
+
+	virtual const char *name() const { return "httpextension/get-extension"; }
+
+	virtual void run()
+	{
+		g_sink += getExtension(extStrings, "grip").params.count();
+	}
+};
+
+static QList<WsEvent> makeEvents()
+{
+	QList<WsEvent> events;
+	events += WsEvent("OPEN");
+	for(int n = 0; n < 4; ++n)
+		events += WsEvent("TEXT", QByteArray(100, 'a'));
+	events += WsEvent("PING", QByteArray(""));
+	return events;
+}
+
+class EncodeEventsBench : public Bench
+{
+public:
+	QList<WsEvent> events;
+
+	EncodeEventsBench() :
+		events(makeEvents())
+	{
+	}
+
+	virtual const char *name() const { return "wsevent/encode"; }
+
+	virtual void run()
+	{
+		g_sink += encodeEvents(events).size();
+	}
+};
+
+class DecodeEventsBench : public Bench
+{
+public:
+	QByteArray buf;
+
+	DecodeEventsBench() :
+		buf(encodeEvents(makeEvents()))
+	{
+	}
+
+	virtual const char *name() const { return "wsevent/decode"; }
+
+	virtual void run()
+	{
+		g_sink += decodeEvents(buf).count();
+	}
+};
+
+class M2RequestBench : public Bench
+{
+public:
+	QByteArray buf;
+
+	M2RequestBench()
+	{
+		QVariantHash headers;
+		headers["METHOD"] = QByteArray("GET");
+		headers["VERSION"] = QByteArray("HTTP/1.1");
+		headers["URI"] = QByteArray("/path/to/resource?a=1&b=2");
+		headers["PATH"] = QByteArray("/path/to/resource");
+		headers["QUERY"] = QByteArray("a=1&b=2");
+		headers["URL_SCHEME"] = QByteArray("http");
+		headers["REMOTE_ADDR"] = QByteArray("192.168.1.10");
+		headers["host"] = QByteArray("example.com");
+		headers["user-agent"] = QByteArray("Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)");
+		headers["accept"] = QByteArray("text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8");
+		headers["accept-encoding"] = QByteArray("gzip, deflate");
+		headers["cookie"] = QByteArray("session=0123456789abcdef0123456789abcdef");
+		headers["connection"] = QByteArray("keep-alive");
+
+		buf = "5e0b6c8c-2c4f-4c3b-9d6a-1c1f9e2d8a11 42 /path/to/resource ";
+		buf += TnetString::fromVariant(headers);
+		buf += TnetString::fromVariant(QByteArray(""));
+	}
+
+	virtual const char *name() const { return "m2requestpacket/from-byte-array"; }
+
+	virtual void run()
+	{
+		M2RequestPacket p;
+		p.fromByteArray(buf);
+		g_sink += p.headers.count();
+	}
+};
+
+static void runBatch(Bench *b, qint64 count)
+{
+	for(qint64 n = 0; n < count; ++n)
+		b->run();
+}
+
+static void measure(Bench *b, int msecs)
+{
+	// calibrate, which also warms up
+	qint64 count = 1;
+	QElapsedTimer t;
+	while(true)
+	{
+		t.start();
+		runBatch(b, count);
+		qint64 ns = t.nsecsElapsed();
+		if(ns >= 10000000 || count >= ((qint64)1 << 40))
+		{
+			count = qMax(count * ((qint64)msecs * 1000000 / SAMPLES) / qMax(ns, (qint64)1), (qint64)1);
+			break;
+		}
+
+		count *= 2;
+	}
+
+	double best = -1;
+	long allocsStart = allocCount();
+
+	for(int n = 0; n < SAMPLES; ++n)
+	{
+		t.start();
+		runBatch(b, count);
+		double nsPerOp = (double)t.nsecsElapsed() / count;
+		if(best < 0 || nsPerOp < best)
+			best = nsPerOp;
+	}
+
+#ifdef HAVE_ALLOC_COUNT
+	double allocsPerOp = (double)(allocCount() - allocsStart) / (count * SAMPLES);
+#else
+	Q_UNUSED(allocsStart);
+	double allocsPerOp = -1;
+#endif
+
+	printf("%s,%lld,%.1f,%.2f\n", b->name(), count * SAMPLES, best, allocsPerOp);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	QStringList args = app.arguments();
+	args.removeFirst();
+
+	int msecs = 500;
+	QString filter;
+	foreach(const QString &arg, args)
+	{
+		if(arg.startsWith("--time="))
+		{
+			bool ok;
+			msecs = arg.mid(7).toInt(&ok);
+			if(!ok || msecs < 1)
+			{
+				fprintf(stderr, "bad value for time: %s\n", qPrintable(arg.mid(7)));
+				return 1;
+			}
+		}
+		else if(arg.startsWith("--filter="))
+			filter = arg.mid(9);
+		else
+		{
+			fprintf(stderr, "bad argument: %s\n", qPrintable(arg));
+			return 1;
+		}
+	}
+
+	log_setOutputLevel(LOG_LEVEL_WARNING);
+
+	QList<Bench*> benches;
+	benches += new TnetEncodeRequestBench;
+	benches += new TnetDecodeRequestBench;
+	benches += new TnetEncodeResponseBench;
+	benches += new TnetDecodeResponseBench;
+	benches += new DomainMapEntryBench;
+	benches += new ManipulateRequestHeadersBench;
+	benches += new JwtEncodeBench;
+	benches += new JwtDecodeBench;
+	benches += new ParseParamsBench;
+	benches += new GetExtensionBench;
+	benches += new EncodeEventsBench;
+	benches += new DecodeEventsBench;
+	benches += new M2RequestBench;
+
+	printf("name,iterations,ns/op,allocs/op\n");
+
+	foreach(Bench *b, benches)
+	{
+		if(filter.isEmpty() || QString(b->name()).contains(filter))
+			measure(b, msecs);
+	}
+
+	qDeleteAll(benches);
+
+	// keeps the sink alive
+	return (g_sink == -1 ? 1 : 0);
+}
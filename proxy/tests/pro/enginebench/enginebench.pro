@@ -0,0 +1,17 @@
+include(../../tests.pri)
+
+# a standalone program rather than a test
+CONFIG -= testcase
+
+# fake peers shared with the tools
+BENCH_DIR = $$PWD/../../../../tools/common
+INCLUDEPATH += $$BENCH_DIR
+
+HEADERS += \
+	$$BENCH_DIR/benchutil.h \
+	$$BENCH_DIR/benchorigin.h
+
+SOURCES += \
+	$$BENCH_DIR/benchutil.cpp \
+	$$BENCH_DIR/benchorigin.cpp \
+	$$TESTS_DIR/enginebench.cpp
@@ -0,0 +1,2 @@
+include(../../tests.pri)
+SOURCES += $$TESTS_DIR/headerrewritetest.cpp
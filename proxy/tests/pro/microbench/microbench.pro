@@ -0,0 +1,11 @@
+include(../../tests.pri)
+
+# a standalone program rather than a test
+CONFIG -= testcase
+
+M2ADAPTER_SRC_DIR = $$TESTS_DIR/../../m2adapter/src
+INCLUDEPATH += $$M2ADAPTER_SRC_DIR
+HEADERS += $$M2ADAPTER_SRC_DIR/m2requestpacket.h
+SOURCES += $$M2ADAPTER_SRC_DIR/m2requestpacket.cpp
+
+SOURCES += $$TESTS_DIR/microbench.cpp
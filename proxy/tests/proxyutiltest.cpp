@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "jwt.h"
+#include "proxyutil.h"
+
+// an arbitrary fixed time, so expiry can be checked without waiting
+#define NOW 1500000000
+
+static QByteArray makeToken(const QByteArray &key, int exp)
+{
+	QVariantMap claim;
+	claim["iss"] = "pushpin";
+	claim["exp"] = exp;
+	return Jwt::encode(claim, key);
+}
+
+static int tokenExp(const QByteArray &token, const QByteArray &key)
+{
+	return Jwt::decode(token, key).toMap().value("exp").toInt();
+}
+
+class ProxyUtilTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void validatedTokenExpires()
+	{
+		QByteArray token = makeToken("key-expire", NOW + 10);
+
+		QVERIFY(ProxyUtil::validateSignatureToken(token, "key-expire", NOW));
+
+		// now answered from the cache
+		QVERIFY(ProxyUtil::validateSignatureToken(token, "key-expire", NOW + 9));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-expire", NOW + 10));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-expire", NOW + 5000));
+	}
+
+	void validatedTokenOtherKey()
+	{
+		QByteArray token = makeToken("key-a", NOW + 100);
+
+		QVERIFY(ProxyUtil::validateSignatureToken(token, "key-a", NOW));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-b", NOW));
+
+		// the entry for the right key is unaffected
+		QVERIFY(ProxyUtil::validateSignatureToken(token, "key-a", NOW));
+	}
+
+	void failedTokenNotCached()
+	{
+		// bad signature, then the right key. a cached failure would
+		//   reject the second check, and a cached success the third
+		QByteArray token = makeToken("key-fail", NOW + 100);
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-wrong", NOW));
+		QVERIFY(ProxyUtil::validateSignatureToken(token, "key-fail", NOW));
+
+		token = makeToken("key-fail", NOW + 200);
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-wrong", NOW));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-wrong", NOW));
+
+		token = makeToken("key-fail", NOW - 1);
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-fail", NOW));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-fail", NOW));
+
+		// no exp at all
+		QVariantMap claim;
+		claim["iss"] = "pushpin";
+		token = Jwt::encode(claim, "key-fail");
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-fail", NOW));
+		QVERIFY(!ProxyUtil::validateSignatureToken(token, "key-fail", NOW));
+
+		QVERIFY(!ProxyUtil::validateSignatureToken("not-a-token", "key-fail", NOW));
+		QVERIFY(!ProxyUtil::validateSignatureToken("not-a-token", "key-fail", NOW));
+	}
+
+	void signedTokenRefresh()
+	{
+		// tokens last an hour and are replaced once 3000 seconds or
+		//   fewer remain
+		QByteArray first = ProxyUtil::getSignatureToken("pushpin", "key-sign", NOW);
+		QVERIFY(!first.isEmpty());
+		QCOMPARE(tokenExp(first, "key-sign"), NOW + 3600);
+
+		QCOMPARE(ProxyUtil::getSignatureToken("pushpin", "key-sign", NOW + 1), first);
+		QCOMPARE(ProxyUtil::getSignatureToken("pushpin", "key-sign", NOW + 599), first);
+
+		QByteArray second = ProxyUtil::getSignatureToken("pushpin", "key-sign", NOW + 600);
+		QVERIFY(second != first);
+		QCOMPARE(tokenExp(second, "key-sign"), NOW + 600 + 3600);
+
+		QCOMPARE(ProxyUtil::getSignatureToken("pushpin", "key-sign", NOW + 601), second);
+
+		// separate entries per key
+		QByteArray other = ProxyUtil::getSignatureToken("pushpin", "key-sign-other", NOW + 601);
+		QVERIFY(other != second);
+		QVERIFY(Jwt::decode(other, "key-sign-other").isValid());
+	}
+};
+
+QTEST_MAIN(ProxyUtilTest)
+#include "proxyutiltest.moc"
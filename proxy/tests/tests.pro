@@ -2,4 +2,15 @@ TEMPLATE = subdirs
 
 SUBDIRS += \
 	pro/jwttest \
-	pro/enginetest
+	pro/enginetest \
+	pro/zhttppacketreadertest \
+	pro/zhttppacketwritertest \
+	pro/domainmaptest \
+	pro/inspectcachetest \
+	pro/zroutestest \
+	pro/headerrewritetest \
+	pro/metricstest \
+	pro/tracertest \
+	pro/proxyutiltest \
+	pro/enginebench \
+	pro/microbench
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "tracer.h"
+
+// with a sample rate of 2, whether an id is sampled depends on its hash
+static QByteArray makeId(const QByteArray &prefix, bool sampled, int *counter, const QByteArray &suffix = QByteArray())
+{
+	while(true)
+	{
+		QByteArray id = prefix + QByteArray::number((*counter)++) + suffix;
+		if((qHash(id) % 2 == 0) == sampled)
+			return id;
+	}
+}
+
+// route mirrors the id and the number of marks is encoded in the id, so
+//   that a torn copy would show up as a mismatch
+static void writeTrace(const QByteArray &id, int marks)
+{
+	Trace t;
+	t.start(id);
+	t.setRoute(id);
+	for(int n = 0; n < marks; ++n)
+		t.mark("stage");
+	t.finish();
+}
+
+static bool traceConsistent(const QVariantHash &t)
+{
+	QByteArray id = t["id"].toByteArray();
+	if(t["route"].toByteArray() != id)
+		return false;
+
+	int marks = id.mid(id.indexOf(':') + 1).toInt();
+	return (t["stages"].toList().count() == marks);
+}
+
+class WriterThread : public QThread
+{
+	Q_OBJECT
+
+public:
+	QList<QByteArray> ids;
+
+	virtual void run()
+	{
+		for(int n = 0; n < 20; ++n)
+		{
+			foreach(const QByteArray &id, ids)
+				writeTrace(id, id.mid(id.indexOf(':') + 1).toInt());
+		}
+	}
+};
+
+class TracerTest : public QObject
+{
+	Q_OBJECT
+
+private:
+	int counter;
+
+private slots:
+	void initTestCase()
+	{
+		counter = 0;
+		Tracer::setup(2, 50, 64);
+		QVERIFY(Tracer::isEnabled());
+	}
+
+	void sampled()
+	{
+		QByteArray id = makeId("a", true, &counter);
+
+		Trace t;
+		t.start(id);
+		QVERIFY(t.isActive());
+		t.setRoute("r");
+		t.mark("first");
+		t.mark("second");
+		t.finish();
+		QVERIFY(!t.isActive());
+
+		QVariantList traces = Tracer::recent(1);
+		QCOMPARE(traces.count(), 1);
+
+		QVariantHash out = traces[0].toHash();
+		QCOMPARE(out["id"].toByteArray(), id);
+		QCOMPARE(out["route"].toByteArray(), QByteArray("r"));
+		QVERIFY(out["sampled"].toBool());
+
+		QVariantList stages = out["stages"].toList();
+		QCOMPARE(stages.count(), 2);
+		QCOMPARE(stages[0].toList()[0].toByteArray(), QByteArray("first"));
+		QCOMPARE(stages[1].toList()[0].toByteArray(), QByteArray("second"));
+		QVERIFY(stages[0].toList()[1].toLongLong() <= stages[1].toList()[1].toLongLong());
+		QVERIFY(stages[1].toList()[1].toLongLong() <= out["total"].toLongLong());
+	}
+
+	void slow()
+	{
+		QByteArray fast = makeId("b", false, &counter);
+		writeTrace(fast, 1);
+		QVERIFY(Tracer::recent(1)[0].toHash()["id"].toByteArray() != fast);
+
+		QByteArray slow = makeId("b", false, &counter);
+
+		Trace t;
+		t.start(slow);
+		QTest::qSleep(60);
+		t.finish();
+
+		QVariantHash out = Tracer::recent(1)[0].toHash();
+		QCOMPARE(out["id"].toByteArray(), slow);
+		QVERIFY(!out["sampled"].toBool());
+		QVERIFY(out["total"].toLongLong() >= 50000);
+	}
+
+	void wrap()
+	{
+		QByteArray last;
+		for(int n = 0; n < 100; ++n)
+		{
+			last = makeId("c", true, &counter);
+			writeTrace(last, 0);
+		}
+
+		QVariantList traces = Tracer::recent();
+		QCOMPARE(traces.count(), 64);
+		QCOMPARE(traces[0].toHash()["id"].toByteArray(), last);
+		QCOMPARE(Tracer::recent(10).count(), 10);
+	}
+
+	void concurrent()
+	{
+		QList<WriterThread*> threads;
+		for(int n = 0; n < 4; ++n)
+		{
+			WriterThread *t = new WriterThread;
+			for(int i = 0; i < 200; ++i)
+				t->ids += makeId("d", true, &counter, ':' + QByteArray::number(i % (Trace::MaxMarks + 1)));
+			threads += t;
+		}
+
+		foreach(WriterThread *t, threads)
+			t->start();
+
+		int seen = 0;
+		bool running = true;
+		while(running)
+		{
+			running = false;
+			foreach(WriterThread *t, threads)
+			{
+				if(t->isRunning())
+					running = true;
+			}
+
+			foreach(const QVariant &vt, Tracer::recent())
+			{
+				QVariantHash t = vt.toHash();
+				if(!t["id"].toByteArray().startsWith('d'))
+					continue;
+
+				QVERIFY(traceConsistent(t));
+				++seen;
+			}
+		}
+
+		foreach(WriterThread *t, threads)
+		{
+			t->wait();
+			delete t;
+		}
+
+		QVERIFY(seen > 0);
+	}
+};
+
+QTEST_MAIN(TracerTest)
+#include "tracertest.moc"
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "zhttppacketreader.h"
+
+static QByteArray makeRequest()
+{
+	ZhttpRequestPacket p;
+	p.from = "m2adapter_http_1";
+	p.id = "3f1c8b2e-5a4d-4c1e-9d6b-7e0a2f9c4b11";
+	p.seq = 0;
+	p.credits = 200000;
+	p.stream = true;
+	p.more = true;
+	p.method = "POST";
+	p.uri = QUrl::fromEncoded("http://api.example.com/v1/items?limit=20&offset=40", QUrl::StrictMode);
+	p.headers += HttpHeader("Host", "api.example.com");
+	p.headers += HttpHeader("User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/45.0.2454.85 Safari/537.36");
+	p.headers += HttpHeader("Accept", "application/json, text/plain, */*");
+	p.headers += HttpHeader("Accept-Encoding", "gzip, deflate");
+	p.headers += HttpHeader("Accept-Language", "en-US,en;q=0.8");
+	p.headers += HttpHeader("Content-Type", "application/json");
+	p.headers += HttpHeader("Cookie", "session=8a3f0c9d2b7e4f61a5c3d9e8b7a6f5e4; theme=dark");
+	p.body = QByteArray("{\"name\": \"widget\", \"tags\": [\"a\", \"b\", \"c\"], \"count\": 42}");
+	p.peerAddress = QHostAddress("192.168.1.20");
+
+	QVariantHash userData;
+	userData["route"] = QByteArray("api");
+	userData["attempt"] = 1;
+	p.userData = userData;
+
+	return QByteArray("T") + TnetString::fromVariant(p.toVariant());
+}
+
+static QByteArray makeResponse()
+{
+	ZhttpResponsePacket p;
+	p.from = "pushpin-proxy_1";
+	p.id = "3f1c8b2e-5a4d-4c1e-9d6b-7e0a2f9c4b11";
+	p.seq = 1;
+	p.credits = 1000;
+	p.code = 200;
+	p.reason = "OK";
+	p.headers += HttpHeader("Content-Type", "application/json");
+	p.headers += HttpHeader("Cache-Control", "no-cache");
+	p.headers += HttpHeader("Date", "Tue, 15 Sep 2015 18:00:00 GMT");
+	p.headers += HttpHeader("Server", "nginx/1.6.2");
+	p.body = QByteArray(4000, 'x');
+
+	return QByteArray("T") + TnetString::fromVariant(p.toVariant());
+}
+
+class ZhttpPacketReaderTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void request()
+	{
+		QByteArray buf = makeRequest();
+
+		ZhttpRequestPacket expected;
+		QVERIFY(expected.fromVariant(TnetString::toVariant(buf.mid(1))));
+
+		ZhttpRequestPacket p;
+		ZhttpPacketReader::Extensions ext;
+		QVERIFY(ZhttpPacketReader::readRequest(buf, 1, &p, &ext));
+		QVERIFY(!ext.batch);
+
+		QCOMPARE(p.from, expected.from);
+		QCOMPARE(p.id, expected.id);
+		QCOMPARE((int)p.type, (int)expected.type);
+		QCOMPARE(p.seq, expected.seq);
+		QCOMPARE(p.credits, expected.credits);
+		QCOMPARE(p.more, expected.more);
+		QCOMPARE(p.stream, expected.stream);
+		QCOMPARE(p.method, expected.method);
+		QCOMPARE(p.uri, expected.uri);
+		QCOMPARE(p.headers, expected.headers);
+		QCOMPARE(p.body, expected.body);
+		QCOMPARE(p.peerAddress, expected.peerAddress);
+		QCOMPARE(p.userData, expected.userData);
+	}
+
+	void response()
+	{
+		QByteArray buf = makeResponse();
+
+		ZhttpResponsePacket expected;
+		QVERIFY(expected.fromVariant(TnetString::toVariant(buf.mid(1))));
+
+		ZhttpResponsePacket p;
+		QVERIFY(ZhttpPacketReader::readResponse(buf, 1, &p));
+
+		QCOMPARE(p.from, expected.from);
+		QCOMPARE(p.id, expected.id);
+		QCOMPARE((int)p.type, (int)expected.type);
+		QCOMPARE(p.seq, expected.seq);
+		QCOMPARE(p.credits, expected.credits);
+		QCOMPARE(p.more, expected.more);
+		QCOMPARE(p.code, expected.code);
+		QCOMPARE(p.reason, expected.reason);
+		QCOMPARE(p.headers, expected.headers);
+		QCOMPARE(p.body, expected.body);
+	}
+
+	void keepAliveBatch()
+	{
+		QVariantList ids;
+		for(int n = 0; n < 3; ++n)
+		{
+			QVariantHash i;
+			i["id"] = QByteArray("id-") + QByteArray::number(n);
+			i["seq"] = n + 5;
+			ids += i;
+		}
+
+		QVariantHash vpacket;
+		vpacket["from"] = QByteArray("m2adapter_http_1");
+		vpacket["type"] = QByteArray("keep-alive");
+		vpacket["ids"] = ids;
+		QByteArray buf = TnetString::fromVariant(vpacket);
+
+		ZhttpRequestPacket p;
+		ZhttpPacketReader::Extensions ext;
+		QVERIFY(ZhttpPacketReader::readRequest(buf, 0, &p, &ext));
+		QVERIFY(ext.batch);
+		QCOMPARE(p.from, QByteArray("m2adapter_http_1"));
+		QCOMPARE((int)p.type, (int)ZhttpRequestPacket::KeepAlive);
+		QCOMPARE(ext.ids.count(), 3);
+		QCOMPARE(ext.ids[2].first, QByteArray("id-2"));
+		QCOMPARE(ext.ids[2].second, 7);
+	}
+
+	void invalid()
+	{
+		QByteArray buf = makeRequest();
+
+		ZhttpRequestPacket p;
+
+		// truncated
+		QVERIFY(!ZhttpPacketReader::readRequest(buf.mid(0, buf.size() - 10), 1, &p));
+
+		// not a dict
+		QVERIFY(!ZhttpPacketReader::readRequest(TnetString::fromVariant(QVariantList()), 0, &p));
+
+		// missing id
+		QVariantHash vpacket;
+		vpacket["from"] = QByteArray("a");
+		QVERIFY(!ZhttpPacketReader::readRequest(TnetString::fromVariant(vpacket), 0, &p));
+	}
+
+	void benchRequestVariant()
+	{
+		QByteArray buf = makeRequest();
+
+		QBENCHMARK
+		{
+			ZhttpRequestPacket p;
+			p.fromVariant(TnetString::toVariant(buf.mid(1)));
+		}
+	}
+
+	void benchRequestReader()
+	{
+		QByteArray buf = makeRequest();
+
+		QBENCHMARK
+		{
+			ZhttpRequestPacket p;
+			ZhttpPacketReader::readRequest(buf, 1, &p);
+		}
+	}
+
+	void benchResponseVariant()
+	{
+		QByteArray buf = makeResponse();
+
+		QBENCHMARK
+		{
+			ZhttpResponsePacket p;
+			p.fromVariant(TnetString::toVariant(buf.mid(1)));
+		}
+	}
+
+	void benchResponseReader()
+	{
+		QByteArray buf = makeResponse();
+
+		QBENCHMARK
+		{
+			ZhttpResponsePacket p;
+			ZhttpPacketReader::readResponse(buf, 1, &p);
+		}
+	}
+};
+
+QTEST_MAIN(ZhttpPacketReaderTest)
+#include "zhttppacketreadertest.moc"
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "zhttppacketwriter.h"
+
+static ZhttpRequestPacket makeRequest()
+{
+	ZhttpRequestPacket p;
+	p.from = "m2adapter_http_1";
+	p.id = "3f1c8b2e-5a4d-4c1e-9d6b-7e0a2f9c4b11";
+	p.seq = 0;
+	p.credits = 200000;
+	p.stream = true;
+	p.more = true;
+	p.method = "POST";
+	p.uri = QUrl::fromEncoded("http://api.example.com/v1/items?limit=20&offset=40", QUrl::StrictMode);
+	p.headers += HttpHeader("Host", "api.example.com");
+	p.headers += HttpHeader("Accept", "application/json, text/plain, */*");
+	p.headers += HttpHeader("Content-Type", "application/json");
+	p.body = QByteArray("{\"name\": \"widget\", \"count\": 42}");
+	p.peerAddress = QHostAddress("192.168.1.20");
+	p.connectHost = "backend.local";
+	p.connectPort = 8080;
+
+	QVariantHash userData;
+	userData["route"] = QByteArray("api");
+	userData["attempt"] = -1;
+	p.userData = userData;
+
+	return p;
+}
+
+static ZhttpResponsePacket makeBodyPacket()
+{
+	ZhttpResponsePacket p;
+	p.from = "pushpin-proxy_1";
+	p.id = "3f1c8b2e-5a4d-4c1e-9d6b-7e0a2f9c4b11";
+	p.seq = 1234;
+	p.more = true;
+	p.body = QByteArray("data: {\"price\": 101.25}\n\n");
+	return p;
+}
+
+class ZhttpPacketWriterTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void request()
+	{
+		ZhttpRequestPacket in = makeRequest();
+
+		QByteArray buf = ZhttpPacketWriter::writeRequest(in);
+		QCOMPARE(buf[0], 'T');
+
+		// must match the generic encoding, field order aside
+		QCOMPARE(TnetString::toVariant(buf, 1), in.toVariant());
+
+		ZhttpRequestPacket p;
+		QVERIFY(p.fromVariant(TnetString::toVariant(buf, 1)));
+		QCOMPARE(p.id, in.id);
+		QCOMPARE(p.method, in.method);
+		QCOMPARE(p.uri, in.uri);
+		QCOMPARE(p.headers, in.headers);
+		QCOMPARE(p.body, in.body);
+		QCOMPARE(p.peerAddress, in.peerAddress);
+		QCOMPARE(p.connectPort, in.connectPort);
+		QCOMPARE(p.userData, in.userData);
+	}
+
+	void response()
+	{
+		ZhttpResponsePacket in;
+		in.from = "pushpin-proxy_1";
+		in.id = "a";
+		in.seq = 0;
+		in.code = 200;
+		in.reason = "OK";
+		in.headers += HttpHeader("Content-Type", "text/plain");
+		in.body = QByteArray("hello\n");
+
+		QByteArray buf = ZhttpPacketWriter::writeResponse(in, "m2adapter_http_1", true);
+		QVERIFY(buf.startsWith("m2adapter_http_1 T"));
+
+		QVariantHash expected = in.toVariant().toHash();
+		expected["multi"] = true;
+		QCOMPARE(TnetString::toVariant(buf, 18), QVariant(expected));
+	}
+
+	void types()
+	{
+		ZhttpResponsePacket in;
+		in.id = "a";
+		in.seq = 5;
+		in.type = ZhttpResponsePacket::Error;
+		in.condition = "bad-request";
+
+		QByteArray buf = ZhttpPacketWriter::writeResponse(in);
+		QCOMPARE(TnetString::toVariant(buf, 1), in.toVariant());
+
+		in = ZhttpResponsePacket();
+		in.id = "a";
+		in.type = ZhttpResponsePacket::Credit;
+		in.credits = 1000;
+		buf = ZhttpPacketWriter::writeResponse(in);
+		QCOMPARE(TnetString::toVariant(buf, 1), in.toVariant());
+	}
+
+	void keepAliveBatch()
+	{
+		QList<ZhttpPacketWriter::KeepAliveId> ids;
+		ids += ZhttpPacketWriter::KeepAliveId("a", 0);
+		ids += ZhttpPacketWriter::KeepAliveId("3f1c8b2e-5a4d-4c1e-9d6b-7e0a2f9c4b11", 12345);
+
+		QVariantList vids;
+		foreach(const ZhttpPacketWriter::KeepAliveId &i, ids)
+		{
+			QVariantHash vi;
+			vi["id"] = i.first;
+			vi["seq"] = i.second;
+			vids += vi;
+		}
+
+		QVariantHash expected;
+		expected["from"] = QByteArray("pushpin-proxy_1");
+		expected["type"] = QByteArray("keep-alive");
+		expected["ids"] = vids;
+
+		QByteArray buf = ZhttpPacketWriter::writeKeepAliveBatch("pushpin-proxy_1", ids);
+		QCOMPARE(buf[0], 'T');
+		QCOMPARE(TnetString::toVariant(buf, 1), QVariant(expected));
+
+		buf = ZhttpPacketWriter::writeKeepAliveBatch("pushpin-proxy_1", ids, "zurl_1");
+		QVERIFY(buf.startsWith("zurl_1 T"));
+		QCOMPARE(TnetString::toVariant(buf, 8), QVariant(expected));
+	}
+
+	void benchBodyVariant()
+	{
+		ZhttpResponsePacket p = makeBodyPacket();
+		QByteArray addr = "m2adapter_http_1";
+
+		QBENCHMARK
+		{
+			QByteArray buf = addr + " T" + TnetString::fromVariant(p.toVariant());
+		}
+	}
+
+	void benchBodyWriter()
+	{
+		ZhttpResponsePacket p = makeBodyPacket();
+		QByteArray addr = "m2adapter_http_1";
+
+		QBENCHMARK
+		{
+			QByteArray buf = ZhttpPacketWriter::writeResponse(p, addr);
+		}
+	}
+
+	void benchRequestVariant()
+	{
+		ZhttpRequestPacket p = makeRequest();
+
+		QBENCHMARK
+		{
+			QByteArray buf = QByteArray("T") + TnetString::fromVariant(p.toVariant());
+		}
+	}
+
+	void benchRequestWriter()
+	{
+		ZhttpRequestPacket p = makeRequest();
+
+		QBENCHMARK
+		{
+			QByteArray buf = ZhttpPacketWriter::writeRequest(p);
+		}
+	}
+};
+
+QTEST_MAIN(ZhttpPacketWriterTest)
+#include "zhttppacketwritertest.moc"
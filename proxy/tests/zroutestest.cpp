@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2015 Fanout, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest/QtTest>
+#include "domainmap.h"
+#include "zroutes.h"
+
+static DomainMap::Target makeTarget(const QString &host, int weight = 1)
+{
+	DomainMap::Target t;
+	t.connectHost = host;
+	t.connectPort = 80;
+	t.weight = weight;
+	return t;
+}
+
+static DomainMap::Entry makeRoute(DomainMap::LoadBalance lb, const DomainMap::Target &a, const DomainMap::Target &b)
+{
+	DomainMap::Entry e;
+	e.lb = lb;
+	e.targets += a;
+	e.targets += b;
+	return e;
+}
+
+class ZRoutesTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void ordered()
+	{
+		ZRoutes zroutes;
+		DomainMap::Entry route = makeRoute(DomainMap::Ordered, makeTarget("a"), makeTarget("b"));
+
+		zroutes.targetStarted(route.targets[0]);
+		QCOMPARE(zroutes.targetsForRoute(route)[0].connectHost, QString("a"));
+		zroutes.targetFinished(route.targets[0]);
+	}
+
+	void leastConn()
+	{
+		ZRoutes zroutes;
+		DomainMap::Entry route = makeRoute(DomainMap::LeastConn, makeTarget("a"), makeTarget("b"));
+
+		zroutes.targetStarted(route.targets[0]);
+		zroutes.targetStarted(route.targets[0]);
+
+		QList<DomainMap::Target> targets = zroutes.targetsForRoute(route);
+		QCOMPARE(targets.count(), 2);
+		QCOMPARE(targets[0].connectHost, QString("b"));
+		QCOMPARE(targets[1].connectHost, QString("a"));
+
+		// weight outranks a lower count
+		route = makeRoute(DomainMap::LeastConn, makeTarget("a", 4), makeTarget("b"));
+		QCOMPARE(zroutes.targetsForRoute(route)[0].connectHost, QString("a"));
+	}
+
+	void ewma()
+	{
+		ZRoutes zroutes;
+		DomainMap::Entry route = makeRoute(DomainMap::Ewma, makeTarget("a"), makeTarget("b"));
+
+		zroutes.targetStarted(route.targets[0]);
+		zroutes.targetResponded(route.targets[0], 100);
+		zroutes.targetFinished(route.targets[0]);
+
+		zroutes.targetStarted(route.targets[1]);
+		zroutes.targetResponded(route.targets[1], 10);
+		zroutes.targetFinished(route.targets[1]);
+
+		for(int n = 0; n < 4; ++n)
+			QCOMPARE(zroutes.targetsForRoute(route)[0].connectHost, QString("b"));
+	}
+
+	void circuit()
+	{
+		ZRoutes zroutes;
+		DomainMap::Target t = makeTarget("a");
+
+		for(int n = 0; n < 4; ++n)
+			zroutes.targetFailed(t);
+		QVERIFY(zroutes.targetAvailable(t));
+
+		zroutes.targetFailed(t);
+		QVERIFY(!zroutes.targetAvailable(t));
+
+		// after the cool-down, only one trial gets through
+		QTest::qWait(1100);
+		QVERIFY(zroutes.targetAvailable(t));
+		zroutes.targetStarted(t);
+		QVERIFY(!zroutes.targetAvailable(t));
+
+		zroutes.targetSucceeded(t);
+		zroutes.targetFinished(t);
+		QVERIFY(zroutes.targetAvailable(t));
+	}
+};
+
+QTEST_MAIN(ZRoutesTest)
+#include "zroutestest.moc"
@@ -65,7 +65,14 @@ def run(exedir, config_file, verbose):
 		ports = list()
 		ports.append(http_port)
 		ports.extend(https_ports)
-		services.write_m2adapter_config(os.path.join(configdir, "m2adapter.conf.template"), rundir, ports)
+		# trace the same requests as the proxy
+		trace_sample_rate = 0
+		if config.has_option("proxy", "trace_sample_rate"):
+			trace_sample_rate = int(config.get("proxy", "trace_sample_rate"))
+		trace_slow_time = 0
+		if config.has_option("proxy", "trace_slow_time"):
+			trace_slow_time = int(config.get("proxy", "trace_slow_time"))
+		services.write_m2adapter_config(os.path.join(configdir, "m2adapter.conf.template"), rundir, ports, trace_sample_rate, trace_slow_time)
 		service_objs.append(services.M2AdapterService(m2abin, os.path.join(rundir, "m2adapter.conf"), verbose, rundir, logdir))
 
 	if "zurl" in service_names:
@@ -41,7 +41,7 @@ def write_mongrel2_config(rootdir, configpath, rundir, logdir, http_port, https_
 
 	return sqlconfigpath
 
-def write_m2adapter_config(configpath, rundir, ports):
+def write_m2adapter_config(configpath, rundir, ports, trace_sample_rate=0, trace_slow_time=0):
 	assert(configpath.endswith(".template"))
 	fname = os.path.basename(configpath)
 	path, ext = os.path.splitext(fname)
@@ -58,6 +58,8 @@ def write_m2adapter_config(configpath, rundir, ports):
 
 	vars = dict()
 	vars["instances"] = instances
+	vars["trace_sample_rate"] = trace_sample_rate
+	vars["trace_slow_time"] = trace_slow_time
 	compile_template(configpath, genconfigpath, vars)
 
 class Service(object):
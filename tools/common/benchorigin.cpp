@@ -0,0 +1,135 @@
+#include "benchorigin.h"
+
+#include <QTimer>
+#include "qzmqsocket.h"
+#include "qzmqvalve.h"
+#include "tnetstring.h"
+#include "zhttppacketreader.h"
+#include "benchutil.h"
+
+#define KEEPALIVE_INTERVAL 20000
+#define HWM 100000
+
+BenchOrigin::BenchOrigin(const QByteArray &_instanceId, QObject *parent) :
+	QObject(parent),
+	instanceId(_instanceId)
+{
+	inSock = new QZmq::Socket(QZmq::Socket::Pull, this);
+	inSock->setHwm(HWM);
+	inValve = new QZmq::Valve(inSock, this);
+	connect(inValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(in_readyRead(const QList<QByteArray> &)));
+
+	inStreamSock = new QZmq::Socket(QZmq::Socket::Router, this);
+	inStreamSock->setIdentity(instanceId);
+	inStreamSock->setHwm(HWM);
+	inStreamValve = new QZmq::Valve(inStreamSock, this);
+	connect(inStreamValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(inStream_readyRead(const QList<QByteArray> &)));
+
+	outSock = new QZmq::Socket(QZmq::Socket::Pub, this);
+	outSock->setHwm(HWM);
+
+	keepAliveTimer = new QTimer(this);
+	connect(keepAliveTimer, SIGNAL(timeout()), SLOT(keepAlive_timeout()));
+}
+
+BenchOrigin::~BenchOrigin()
+{
+	qDeleteAll(sessions);
+}
+
+void BenchOrigin::start()
+{
+	inSock->bind(BenchUtil::makeSpec("zurl-out"));
+	inStreamSock->bind(BenchUtil::makeSpec("zurl-out-stream"));
+	outSock->bind(BenchUtil::makeSpec("zurl-in"));
+
+	inValve->open();
+	inStreamValve->open();
+
+	keepAliveTimer->start(KEEPALIVE_INTERVAL);
+}
+
+void BenchOrigin::reset()
+{
+	qDeleteAll(sessions);
+	sessions.clear();
+}
+
+void BenchOrigin::creditsAdded(Session *s)
+{
+	Q_UNUSED(s);
+}
+
+void BenchOrigin::addSession(Session *s)
+{
+	sessions.insert(s->id, s);
+}
+
+void BenchOrigin::removeSession(Session *s)
+{
+	sessions.remove(s->id);
+	delete s;
+}
+
+void BenchOrigin::write(const QByteArray &to, const ZhttpResponsePacket &zresp)
+{
+	outSock->write(QList<QByteArray>() << (to + " T" + TnetString::fromVariant(zresp.toVariant())));
+}
+
+void BenchOrigin::write(Session *s, const ZhttpResponsePacket &zresp)
+{
+	ZhttpResponsePacket out = zresp;
+	out.from = instanceId;
+	out.id = s->id;
+	out.seq = (s->outSeq)++;
+	write(s->proxyAddress, out);
+}
+
+void BenchOrigin::in_readyRead(const QList<QByteArray> &message)
+{
+	ZhttpRequestPacket zreq;
+	if(!ZhttpPacketReader::readRequest(message[0], 1, &zreq) || zreq.type != ZhttpRequestPacket::Data)
+		return;
+
+	requestReady(zreq);
+}
+
+void BenchOrigin::inStream_readyRead(const QList<QByteArray> &message)
+{
+	if(message.count() != 3)
+		return;
+
+	ZhttpRequestPacket zreq;
+	ZhttpPacketReader::Extensions ext;
+	if(!ZhttpPacketReader::readRequest(message[2], 1, &zreq, &ext) || ext.batch)
+		return;
+
+	Session *s = sessions.value(zreq.id);
+	if(!s)
+		return;
+
+	if(zreq.type == ZhttpRequestPacket::Close || zreq.type == ZhttpRequestPacket::Error || zreq.type == ZhttpRequestPacket::Cancel)
+	{
+		removeSession(s);
+	}
+	else if(zreq.credits > 0)
+	{
+		s->credits += zreq.credits;
+		creditsAdded(s);
+	}
+}
+
+void BenchOrigin::keepAlive_timeout()
+{
+	QHash<QByteArray, QVariantList> batches;
+	foreach(Session *s, sessions)
+		BenchUtil::addKeepAliveId(&batches, s->proxyAddress, s->id, (s->outSeq)++);
+
+	QHashIterator<QByteArray, QVariantList> it(batches);
+	while(it.hasNext())
+	{
+		it.next();
+		foreach(const QByteArray &buf, BenchUtil::makeKeepAlives(instanceId, it.value()))
+			outSock->write(QList<QByteArray>() << (it.key() + " T" + buf));
+	}
+}
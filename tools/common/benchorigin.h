@@ -0,0 +1,87 @@
+// fake zurl and origin shared by the benchmark and soak tools. it binds
+//   the zhttp interfaces the proxy sends requests to, keeps track of open
+//   sessions along with the credits the proxy has granted them, and sends
+//   batched keep-alives for them. subclasses decide how requests are
+//   answered
+
+#ifndef BENCHORIGIN_H
+#define BENCHORIGIN_H
+
+#include <QObject>
+#include <QHash>
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+
+class QTimer;
+
+namespace QZmq {
+class Socket;
+class Valve;
+}
+
+class BenchOrigin : public QObject
+{
+	Q_OBJECT
+
+public:
+	class Session
+	{
+	public:
+		QByteArray id;
+		QByteArray proxyAddress;
+		int outSeq;
+		int credits;
+
+		Session() :
+			outSeq(0),
+			credits(0)
+		{
+		}
+
+		virtual ~Session() {}
+	};
+
+	QByteArray instanceId;
+	QHash<QByteArray, Session*> sessions;
+
+	BenchOrigin(const QByteArray &instanceId, QObject *parent = 0);
+	~BenchOrigin();
+
+	// binds zurl-out, zurl-out-stream and zurl-in
+	void start();
+
+	// drops all sessions
+	void reset();
+
+protected:
+	virtual void requestReady(const ZhttpRequestPacket &zreq) = 0;
+
+	// called after credits are added to the session
+	virtual void creditsAdded(Session *s);
+
+	// takes ownership
+	void addSession(Session *s);
+
+	// deletes the session
+	void removeSession(Session *s);
+
+	void write(const QByteArray &to, const ZhttpResponsePacket &zresp);
+
+	// fills in from, id and seq
+	void write(Session *s, const ZhttpResponsePacket &zresp);
+
+private:
+	QZmq::Socket *inSock;
+	QZmq::Valve *inValve;
+	QZmq::Socket *inStreamSock;
+	QZmq::Valve *inStreamValve;
+	QZmq::Socket *outSock;
+	QTimer *keepAliveTimer;
+
+private slots:
+	void in_readyRead(const QList<QByteArray> &message);
+	void inStream_readyRead(const QList<QByteArray> &message);
+	void keepAlive_timeout();
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "benchutil.h"
+
+#include <stdio.h>
+#include <QFile>
+#include <QTimer>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QProcess>
+#include "tnetstring.h"
+
+#define KEEPALIVE_BATCH_MAX 1000
+
+namespace BenchUtil {
+
+static QString g_specPrefix;
+
+void setSpecPrefix(const QString &prefix)
+{
+	g_specPrefix = prefix;
+}
+
+QString makeSpec(const char *name)
+{
+	return QString("ipc://") + g_specPrefix + name;
+}
+
+void runLoop(QEventLoop *loop, int msecs)
+{
+	QTimer t;
+	t.setSingleShot(true);
+	QObject::connect(&t, SIGNAL(timeout()), loop, SLOT(quit()));
+	t.start(msecs);
+	loop->exec();
+}
+
+void waitFor(QEventLoop *loop, const qint64 *value, qint64 target, int idleMsecs)
+{
+	QElapsedTimer idle;
+	idle.start();
+	qint64 last = *value;
+	while(*value < target && idle.elapsed() < idleMsecs)
+	{
+		runLoop(loop, 20);
+		if(*value != last)
+		{
+			last = *value;
+			idle.restart();
+		}
+	}
+}
+
+qint64 processRss(qint64 pid)
+{
+	QFile file(QString("/proc/%1/status").arg(pid));
+	if(!file.open(QFile::ReadOnly))
+		return -1;
+
+	foreach(const QByteArray &line, file.readAll().split('\n'))
+	{
+		if(line.startsWith("VmRSS:"))
+			return line.mid(6).simplified().split(' ')[0].toLongLong();
+	}
+
+	return -1;
+}
+
+bool writeFile(const QString &fileName, const QByteArray &data)
+{
+	QFile file(fileName);
+	if(!file.open(QFile::WriteOnly | QFile::Truncate))
+		return false;
+
+	return (file.write(data) == data.size());
+}
+
+bool startProcess(QProcess *proc, const QString &program, const QStringList &args, const QString &logFile)
+{
+	proc->setProcessChannelMode(QProcess::MergedChannels);
+	proc->setStandardOutputFile(logFile);
+	proc->start(program, args);
+	if(!proc->waitForStarted())
+	{
+		fprintf(stderr, "unable to run %s\n", qPrintable(program));
+		return false;
+	}
+
+	return true;
+}
+
+void stopProcess(QProcess *proc)
+{
+	proc->terminate();
+	if(!proc->waitForFinished(5000))
+	{
+		proc->kill();
+		proc->waitForFinished();
+	}
+}
+
+void addKeepAliveId(QHash<QByteArray, QVariantList> *batches, const QByteArray &address, const QByteArray &id, int seq)
+{
+	QVariantHash i;
+	i["id"] = id;
+	i["seq"] = seq;
+	(*batches)[address] += i;
+}
+
+QList<QByteArray> makeKeepAlives(const QByteArray &from, const QVariantList &ids)
+{
+	QList<QByteArray> out;
+	for(int n = 0; n < ids.count(); n += KEEPALIVE_BATCH_MAX)
+	{
+		QVariantHash vpacket;
+		vpacket["from"] = from;
+		vpacket["type"] = QByteArray("keep-alive");
+		vpacket["ids"] = ids.mid(n, KEEPALIVE_BATCH_MAX);
+		out += TnetString::fromVariant(vpacket);
+	}
+
+	return out;
+}
+
+}
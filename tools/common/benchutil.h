@@ -0,0 +1,46 @@
+// helpers shared by the benchmark and soak tools
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QVariant>
+
+class QEventLoop;
+class QProcess;
+
+namespace BenchUtil {
+
+// ipc specs are made of the prefix followed by a name
+void setSpecPrefix(const QString &prefix);
+QString makeSpec(const char *name);
+
+// runs the loop until something quits it or the time is up
+void runLoop(QEventLoop *loop, int msecs);
+
+// runs the loop until the value reaches the target, or stops changing
+//   for the idle time
+void waitFor(QEventLoop *loop, const qint64 *value, qint64 target, int idleMsecs);
+
+// resident set size in kB, or -1 if unknown
+qint64 processRss(qint64 pid);
+
+bool writeFile(const QString &fileName, const QByteArray &data);
+
+// output of the process goes to the log file
+bool startProcess(QProcess *proc, const QString &program, const QStringList &args, const QString &logFile);
+
+// terminates the process, killing it if it doesn't exit in time
+void stopProcess(QProcess *proc);
+
+void addKeepAliveId(QHash<QByteArray, QVariantList> *batches, const QByteArray &address, const QByteArray &id, int seq);
+
+// tnetstring-encoded keep-alive packets for the ids, split into batches
+QList<QByteArray> makeKeepAlives(const QByteArray &from, const QVariantList &ids);
+
+}
+
+#endif
@@ -0,0 +1,538 @@
+// memory footprint soak test for idle connections. it runs pushpin-proxy
+//   and m2adapter as child processes, plays mongrel2 on one side and
+//   zurl/origin on the other, and opens idle connections in steps. after
+//   each step it samples the RSS of both processes, and, from their
+//   "objects" command, the bytes in use by the allocator and the live
+//   object counts.
+//
+// modes:
+//   http - requests whose responses are streamed by the origin, but
+//          with no body after the headers
+//   ws   - websockets accepted by the origin and then left alone
+//
+// usage: memsoak [--proxy=path] [--m2adapter=path] [--steps=N,N,...]
+//          [--settle=msecs] [--modes=a,b]
+
+#include <stdio.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QHash>
+#include <QDir>
+#include <QEventLoop>
+#include <QProcess>
+#include "qzmqsocket.h"
+#include "qzmqvalve.h"
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "benchutil.h"
+#include "benchorigin.h"
+
+#define M2_IDENT "memsoak-m2"
+#define ORIGIN_ID "memsoak-origin"
+#define CREDITS 200000
+#define MAX_PENDING_CONNECTS 1000
+#define HWM 100000
+
+static QString g_dir;
+
+// calls a method on a zrpc command socket, returning a null value on error
+static QVariant callCommand(const QString &spec, const QByteArray &method)
+{
+	QZmq::Socket sock(QZmq::Socket::Req);
+	sock.setShutdownWaitTime(0);
+	sock.connectToAddress(spec);
+
+	QVariantHash vreq;
+	vreq["id"] = QByteArray("memsoak");
+	vreq["method"] = method;
+	vreq["args"] = QVariantHash();
+	sock.write(QList<QByteArray>() << TnetString::fromVariant(vreq));
+
+	QEventLoop loop;
+	QObject::connect(&sock, SIGNAL(readyRead()), &loop, SLOT(quit()));
+	if(!sock.canRead())
+		BenchUtil::runLoop(&loop, 5000);
+
+	if(!sock.canRead())
+		return QVariant();
+
+	QVariantHash vresp = TnetString::toVariant(sock.read()[0]).toHash();
+	if(!vresp.value("success").toBool())
+		return QVariant();
+
+	return vresp["value"];
+}
+
+static QByteArray hashToString(const QVariantHash &h)
+{
+	QStringList keys = h.keys();
+	keys.sort();
+
+	QByteArray out;
+	foreach(const QString &key, keys)
+	{
+		if(!out.isEmpty())
+			out += ' ';
+		out += key.toUtf8() + '=' + QByteArray::number(h[key].toLongLong());
+	}
+
+	return out;
+}
+
+class Sample
+{
+public:
+	qint64 rss; // kB, or -1
+	qint64 heap; // bytes in use, or -1
+	QVariantHash types;
+	QVariantHash heapStats;
+
+	Sample() :
+		rss(-1),
+		heap(-1)
+	{
+	}
+};
+
+static Sample takeSample(qint64 pid, const char *commandName)
+{
+	Sample s;
+	s.rss = BenchUtil::processRss(pid);
+
+	QVariantHash report = callCommand(BenchUtil::makeSpec(commandName), "objects").toHash();
+	s.types = report.value("types").toHash();
+	s.heapStats = report.value("heap").toHash();
+	if(s.heapStats.contains("in-use"))
+		s.heap = s.heapStats["in-use"].toLongLong();
+
+	return s;
+}
+
+class Options
+{
+public:
+	QString proxy;
+	QString m2adapter;
+	QList<int> steps;
+	int settle;
+	QStringList modes;
+
+	Options() :
+		proxy("pushpin-proxy"),
+		m2adapter("m2adapter"),
+		settle(2000)
+	{
+		steps << 10000 << 50000 << 100000 << 200000 << 500000;
+		modes << "http" << "ws";
+	}
+};
+
+// fake mongrel2. sends new requests, a bounded number at a time, and
+//   considers a connection established once m2adapter writes to it
+class Mongrel2 : public QObject
+{
+	Q_OBJECT
+
+public:
+	bool websocket;
+	qint64 started;
+	qint64 settled;
+	int pending;
+	int nextId;
+	QHash<QByteArray, bool> established;
+
+	QZmq::Socket *sendSock;
+	QZmq::Socket *recvSock;
+	QZmq::Valve *recvValve;
+	QZmq::Socket *controlSock;
+	QZmq::Valve *controlValve;
+
+	Mongrel2(QObject *parent = 0) :
+		QObject(parent),
+		websocket(false)
+	{
+		sendSock = new QZmq::Socket(QZmq::Socket::Push, this);
+		sendSock->setHwm(HWM);
+
+		recvSock = new QZmq::Socket(QZmq::Socket::Sub, this);
+		recvSock->setHwm(HWM);
+		recvValve = new QZmq::Valve(recvSock, this);
+		connect(recvValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(recv_readyRead(const QList<QByteArray> &)));
+
+		// status requests are left unanswered, so m2adapter doesn't
+		//   reap connections it can't see
+		controlSock = new QZmq::Socket(QZmq::Socket::Router, this);
+		controlValve = new QZmq::Valve(controlSock, this);
+		connect(controlValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(control_readyRead(const QList<QByteArray> &)));
+
+		reset();
+	}
+
+	void start()
+	{
+		sendSock->bind(BenchUtil::makeSpec("m2-send"));
+		recvSock->bind(BenchUtil::makeSpec("m2-recv"));
+		controlSock->bind(BenchUtil::makeSpec("m2-control"));
+
+		recvSock->subscribe(QByteArray(M2_IDENT) + ' ');
+		recvValve->open();
+		controlValve->open();
+	}
+
+	void reset()
+	{
+		started = 0;
+		settled = 0;
+		pending = 0;
+		nextId = 0;
+		established.clear();
+	}
+
+	void openTo(qint64 total)
+	{
+		while(started < total && pending < MAX_PENDING_CONNECTS)
+		{
+			QByteArray id = QByteArray::number(nextId++);
+			established.insert(id, false);
+			++started;
+			++pending;
+
+			sendSock->write(QList<QByteArray>() << makeRequest(id));
+		}
+	}
+
+private:
+	QByteArray makeRequest(const QByteArray &id)
+	{
+		QVariantHash headers;
+		headers["VERSION"] = QByteArray("HTTP/1.1");
+		headers["URI"] = QByteArray("/soak");
+		headers["PATH"] = QByteArray("/soak");
+		headers["URL_SCHEME"] = QByteArray("http");
+		headers["REMOTE_ADDR"] = QByteArray("127.0.0.1");
+		headers["host"] = QByteArray("soak");
+
+		QByteArray body;
+		if(websocket)
+		{
+			headers["METHOD"] = QByteArray("WEBSOCKET_HANDSHAKE");
+			headers["upgrade"] = QByteArray("websocket");
+			headers["connection"] = QByteArray("Upgrade");
+			headers["sec-websocket-key"] = QByteArray("dGhlIHNhbXBsZSBub25jZQ==");
+			headers["sec-websocket-version"] = QByteArray("13");
+			body = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+		}
+		else
+			headers["METHOD"] = QByteArray("GET");
+
+		return QByteArray(M2_IDENT) + ' ' + id + " /soak " + TnetString::fromVariant(headers) + TnetString::fromVariant(body);
+	}
+
+private slots:
+	void recv_readyRead(const QList<QByteArray> &message)
+	{
+		// format is "sender size:ids, data"
+		const QByteArray &buf = message[0];
+		int start = buf.indexOf(' ');
+		if(start == -1)
+			return;
+		int at = buf.indexOf(':', start + 1);
+		int end = buf.indexOf(',', at + 1);
+		if(at == -1 || end == -1)
+			return;
+
+		foreach(const QByteArray &id, buf.mid(at + 1, end - at - 1).split(' '))
+		{
+			QHash<QByteArray, bool>::iterator it = established.find(id);
+			if(it == established.end() || it.value())
+				continue;
+
+			// the first write is the response header. an empty write
+			//   would be a close
+			it.value() = true;
+			--pending;
+			++settled;
+		}
+
+		openTo(started + (MAX_PENDING_CONNECTS - pending));
+	}
+
+	void control_readyRead(const QList<QByteArray> &message)
+	{
+		Q_UNUSED(message);
+	}
+};
+
+// fake zurl and origin. answers http requests with a streamed response
+//   that never ends, and accepts websockets
+class Origin : public BenchOrigin
+{
+	Q_OBJECT
+
+public:
+	Origin(QObject *parent = 0) :
+		BenchOrigin(ORIGIN_ID, parent)
+	{
+	}
+
+protected:
+	virtual void requestReady(const ZhttpRequestPacket &zreq)
+	{
+		Session *s = new Session;
+		s->id = zreq.id;
+		s->proxyAddress = zreq.from;
+		s->credits = qMax(zreq.credits, 0);
+		addSession(s);
+
+		ZhttpResponsePacket zresp;
+		zresp.credits = CREDITS;
+
+		QString scheme = zreq.uri.scheme();
+		if(scheme == "ws" || scheme == "wss")
+		{
+			zresp.code = 101;
+			zresp.reason = "Switching Protocols";
+		}
+		else
+		{
+			zresp.code = 200;
+			zresp.reason = "OK";
+			zresp.headers += HttpHeader("Content-Type", "text/plain");
+			zresp.more = true;
+		}
+
+		write(s, zresp);
+	}
+};
+
+static bool writeConfigs()
+{
+	QByteArray proxy;
+	proxy += "[proxy]\n";
+	proxy += "m2a_in_specs=" + BenchUtil::makeSpec("m2zhttp-out").toUtf8() + ',' + BenchUtil::makeSpec("m2zws-out").toUtf8() + '\n';
+	proxy += "m2a_in_stream_specs=" + BenchUtil::makeSpec("m2zhttp-out-stream").toUtf8() + ',' + BenchUtil::makeSpec("m2zws-out-stream").toUtf8() + '\n';
+	proxy += "m2a_out_specs=" + BenchUtil::makeSpec("m2zhttp-in").toUtf8() + ',' + BenchUtil::makeSpec("m2zws-in").toUtf8() + '\n';
+	proxy += "zurl_out_specs=" + BenchUtil::makeSpec("zurl-out").toUtf8() + '\n';
+	proxy += "zurl_out_stream_specs=" + BenchUtil::makeSpec("zurl-out-stream").toUtf8() + '\n';
+	proxy += "zurl_in_specs=" + BenchUtil::makeSpec("zurl-in").toUtf8() + '\n';
+	proxy += "command_spec=" + BenchUtil::makeSpec("proxy-command").toUtf8() + '\n';
+	proxy += "routesfile=routes\n";
+	proxy += "sig_key=changeme\n";
+
+	QByteArray m2a;
+	m2a += "[General]\n";
+	m2a += "m2_in_specs=" + BenchUtil::makeSpec("m2-send").toUtf8() + '\n';
+	m2a += "m2_out_specs=" + BenchUtil::makeSpec("m2-recv").toUtf8() + '\n';
+	m2a += "m2_send_idents=" M2_IDENT "\n";
+	m2a += "m2_control_specs=" + BenchUtil::makeSpec("m2-control").toUtf8() + '\n';
+	m2a += "zhttp_in_specs=" + BenchUtil::makeSpec("m2zhttp-in").toUtf8() + '\n';
+	m2a += "zhttp_out_specs=" + BenchUtil::makeSpec("m2zhttp-out").toUtf8() + '\n';
+	m2a += "zhttp_out_stream_specs=" + BenchUtil::makeSpec("m2zhttp-out-stream").toUtf8() + '\n';
+	m2a += "zws_in_specs=" + BenchUtil::makeSpec("m2zws-in").toUtf8() + '\n';
+	m2a += "zws_out_specs=" + BenchUtil::makeSpec("m2zws-out").toUtf8() + '\n';
+	m2a += "zws_out_stream_specs=" + BenchUtil::makeSpec("m2zws-out-stream").toUtf8() + '\n';
+	m2a += "m2_client_buffer=200000\n";
+	m2a += "command_spec=" + BenchUtil::makeSpec("m2adapter-command").toUtf8() + '\n';
+
+	return (BenchUtil::writeFile(g_dir + "/routes", "* origin:80\n") && BenchUtil::writeFile(g_dir + "/pushpin.conf", proxy) && BenchUtil::writeFile(g_dir + "/m2adapter.conf", m2a));
+}
+
+static bool startWithConfig(QProcess *proc, const QString &program, const QString &config, const QString &logName)
+{
+	return BenchUtil::startProcess(proc, program, QStringList() << ("--config=" + config), g_dir + '/' + logName);
+}
+
+static double perConn(qint64 value, qint64 base, qint64 conns)
+{
+	if(conns <= 0 || value < 0 || base < 0)
+		return 0;
+
+	return (double)(value - base) / conns;
+}
+
+static void printSample(const QString &mode, qint64 conns, const Sample &proxy, const Sample &proxyBase, const Sample &m2a, const Sample &m2aBase)
+{
+	printf("%-5s %8lld %10lld %10.0f %12lld %10.0f %10lld %10.0f %12lld %10.0f\n",
+		qPrintable(mode),
+		conns,
+		proxy.rss,
+		perConn(proxy.rss * 1024, proxyBase.rss * 1024, conns),
+		proxy.heap,
+		perConn(proxy.heap, proxyBase.heap, conns),
+		m2a.rss,
+		perConn(m2a.rss * 1024, m2aBase.rss * 1024, conns),
+		m2a.heap,
+		perConn(m2a.heap, m2aBase.heap, conns));
+	printf("      proxy objects: %s\n", hashToString(proxy.types).data());
+	printf("      proxy heap: %s\n", hashToString(proxy.heapStats).data());
+	printf("      m2adapter objects: %s\n", hashToString(m2a.types).data());
+	printf("      m2adapter heap: %s\n", hashToString(m2a.heapStats).data());
+	fflush(stdout);
+}
+
+static bool runMode(const QString &mode, const Options &opts, Mongrel2 *m2, Origin *origin)
+{
+	m2->reset();
+	m2->websocket = (mode == "ws");
+	origin->reset();
+
+	QProcess m2adapter;
+	if(!startWithConfig(&m2adapter, opts.m2adapter, g_dir + "/m2adapter.conf", "m2adapter-" + mode + ".log"))
+		return false;
+
+	QProcess proxy;
+	if(!startWithConfig(&proxy, opts.proxy, g_dir + "/pushpin.conf", "proxy-" + mode + ".log"))
+	{
+		BenchUtil::stopProcess(&m2adapter);
+		return false;
+	}
+
+	// give them time to bind and for the sockets to connect
+	QEventLoop loop;
+	BenchUtil::runLoop(&loop, 1000);
+
+	if(proxy.state() != QProcess::Running || m2adapter.state() != QProcess::Running)
+	{
+		fprintf(stderr, "a process exited early, see the logs in %s\n", qPrintable(g_dir));
+		BenchUtil::stopProcess(&proxy);
+		BenchUtil::stopProcess(&m2adapter);
+		return false;
+	}
+
+	Sample proxyBase = takeSample(proxy.pid(), "proxy-command");
+	Sample m2aBase = takeSample(m2adapter.pid(), "m2adapter-command");
+	printSample(mode, 0, proxyBase, proxyBase, m2aBase, m2aBase);
+
+	foreach(int step, opts.steps)
+	{
+		m2->openTo(step);
+		BenchUtil::waitFor(&loop, &m2->settled, step, 10000);
+
+		// let deferred cleanups and keep-alive registration finish
+		BenchUtil::runLoop(&loop, opts.settle);
+
+		Sample proxySample = takeSample(proxy.pid(), "proxy-command");
+		Sample m2aSample = takeSample(m2adapter.pid(), "m2adapter-command");
+		printSample(mode, m2->settled, proxySample, proxyBase, m2aSample, m2aBase);
+
+		if(m2->settled < step)
+		{
+			fprintf(stderr, "%s: only %lld of %d connections established, stopping\n", qPrintable(mode), m2->settled, step);
+			break;
+		}
+	}
+
+	BenchUtil::stopProcess(&proxy);
+	BenchUtil::stopProcess(&m2adapter);
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	QStringList args = app.arguments();
+	args.removeFirst();
+
+	Options opts;
+	foreach(const QString &arg, args)
+	{
+		int at = arg.indexOf('=');
+		if(!arg.startsWith("--") || at == -1)
+		{
+			fprintf(stderr, "bad argument: %s\n", qPrintable(arg));
+			return 1;
+		}
+
+		QString name = arg.mid(2, at - 2);
+		QString value = arg.mid(at + 1);
+
+		if(name == "proxy")
+			opts.proxy = value;
+		else if(name == "m2adapter")
+			opts.m2adapter = value;
+		else if(name == "modes")
+			opts.modes = value.split(',', QString::SkipEmptyParts);
+		else if(name == "steps" || name == "settle")
+		{
+			QList<int> values;
+			foreach(const QString &s, value.split(',', QString::SkipEmptyParts))
+			{
+				bool ok;
+				int x = s.toInt(&ok);
+				if(!ok || x < 0)
+				{
+					fprintf(stderr, "bad value for %s: %s\n", qPrintable(name), qPrintable(value));
+					return 1;
+				}
+
+				values += x;
+			}
+
+			if(values.isEmpty() || (name == "settle" && values.count() != 1))
+			{
+				fprintf(stderr, "bad value for %s: %s\n", qPrintable(name), qPrintable(value));
+				return 1;
+			}
+
+			if(name == "steps")
+			{
+				qSort(values);
+				opts.steps = values;
+			}
+			else
+				opts.settle = values[0];
+		}
+		else
+		{
+			fprintf(stderr, "unknown option: %s\n", qPrintable(name));
+			return 1;
+		}
+	}
+
+	foreach(const QString &mode, opts.modes)
+	{
+		if(mode != "http" && mode != "ws")
+		{
+			fprintf(stderr, "unknown mode: %s\n", qPrintable(mode));
+			return 1;
+		}
+	}
+
+	g_dir = QDir::tempPath() + "/pushpin-memsoak-" + QString::number(QCoreApplication::applicationPid());
+	QDir().mkpath(g_dir);
+	BenchUtil::setSpecPrefix(g_dir + '/');
+
+	if(!writeConfigs())
+	{
+		fprintf(stderr, "unable to write configs in %s\n", qPrintable(g_dir));
+		return 1;
+	}
+
+	Mongrel2 m2;
+	m2.start();
+	Origin origin;
+	origin.start();
+
+	printf("rss in kB, heap is allocator bytes in use, per-conn values are growth\n");
+	printf("over the idle process in bytes\n\n");
+	printf("%-5s %8s %10s %10s %12s %10s %10s %10s %12s %10s\n", "mode", "conns", "proxy-rss", "rss/conn", "proxy-heap", "heap/conn", "m2a-rss", "rss/conn", "m2a-heap", "heap/conn");
+
+	int ret = 0;
+	foreach(const QString &mode, opts.modes)
+	{
+		if(!runMode(mode, opts, &m2, &origin))
+		{
+			ret = 1;
+			break;
+		}
+	}
+
+	printf("\nlogs are in %s\n", qPrintable(g_dir));
+
+	return ret;
+}
+
+#include "memsoak.moc"
@@ -0,0 +1,28 @@
+CONFIG += console
+CONFIG -= app_bundle
+QT -= gui
+QT += network
+
+SRC_DIR = $$PWD/../../proxy/src
+BENCH_DIR = $$PWD/../common
+QZMQ_DIR = $$PWD/../../qzmq
+COMMON_DIR = $$PWD/../../common
+
+LIBS += -L$$SRC_DIR -lpushpin-proxy
+PRE_TARGETDEPS += $$SRC_DIR/libpushpin-proxy.a
+include($$PWD/../../proxy/conf.pri)
+
+INCLUDEPATH += $$SRC_DIR
+INCLUDEPATH += $$BENCH_DIR
+INCLUDEPATH += $$QZMQ_DIR/src
+INCLUDEPATH += $$COMMON_DIR
+DEFINES += NO_IRISNET
+
+HEADERS += \
+	$$BENCH_DIR/benchutil.h \
+	$$BENCH_DIR/benchorigin.h
+
+SOURCES += \
+	$$BENCH_DIR/benchutil.cpp \
+	$$BENCH_DIR/benchorigin.cpp \
+	memsoak.cpp
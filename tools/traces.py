@@ -0,0 +1,55 @@
+# usage: traces.py [max] spec [spec ...]
+#   e.g. traces.py ipc:///tmp/pushpin-proxy-command ipc:///tmp/pushpin-m2adapter-command
+# fetches recent request traces from each process and prints them as JSON,
+#   joined up by request id
+
+import sys
+import uuid
+import json
+import tnetstring
+import zmq
+
+def call(ctx, spec, method, args):
+	sock = ctx.socket(zmq.REQ)
+	sock.linger = 0
+	sock.connect(spec)
+	req = dict()
+	req['id'] = str(uuid.uuid4())
+	req['method'] = method
+	req['args'] = args
+	sock.send(tnetstring.dumps(req))
+	if not sock.poll(5000):
+		raise ValueError('%s: timed out' % spec)
+	resp = tnetstring.loads(sock.recv())
+	sock.close()
+	if not resp['success']:
+		raise ValueError('%s: %s' % (spec, resp['condition']))
+	return resp['value']
+
+specs = sys.argv[1:]
+args = dict()
+if len(specs) > 0 and specs[0].isdigit():
+	args['max'] = int(specs[0])
+	specs = specs[1:]
+
+ctx = zmq.Context()
+
+by_id = dict()
+order = list()
+for spec in specs:
+	for t in call(ctx, spec, 'traces', args):
+		id = t['id']
+		if id not in by_id:
+			by_id[id] = list()
+			order.append(id)
+		t['source'] = spec
+		t['stages'] = [{'name': s[0], 'time': s[1]} for s in t['stages']]
+		by_id[id].append(t)
+
+out = list()
+for id in order:
+	# earliest start first. start times are on the shared monotonic clock
+	parts = sorted(by_id[id], key=lambda t: t['start'])
+	out.append({'id': id, 'parts': parts})
+
+print json.dumps(out, indent=2)
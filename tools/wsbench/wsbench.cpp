@@ -0,0 +1,716 @@
+// websocket fan-out benchmark for pushpin-proxy. it runs the proxy as a
+//   child process, opens many zws sessions against it as a fake
+//   m2adapter, accepts them as a fake zurl/origin, and plays the handler
+//   side of the ws-control interface. a number of rounds are then sent,
+//   each round being one message to every connection, and the time from
+//   send to receipt is recorded for every message.
+//
+// modes:
+//   passthrough - origin accepts plain websockets and sends the messages
+//   grip        - origin accepts with the grip extension, and the handler
+//                 sends the messages as ws-control "send" items
+//   over_http   - like grip, but the origin is reached with
+//                 websocket-over-http
+//
+// usage: wsbench [--proxy=path] [--connections=N] [--rounds=N]
+//          [--interval=msecs] [--size=bytes] [--workers=N]
+//          [--modes=a,b,...]
+
+#include <stdio.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QDir>
+#include <QTimer>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QProcess>
+#include "qzmqsocket.h"
+#include "qzmqvalve.h"
+#include "tnetstring.h"
+#include "zhttprequestpacket.h"
+#include "zhttpresponsepacket.h"
+#include "zhttppacketreader.h"
+#include "packet/wscontrolpacket.h"
+#include "histogram.h"
+#include "benchutil.h"
+#include "benchorigin.h"
+
+#define CLIENT_ID "wsbench-client"
+#define ORIGIN_ID "wsbench-origin"
+#define CREDITS 200000
+#define MAX_PENDING_CONNECTS 1000
+#define KEEPALIVE_INTERVAL 20000
+#define SEND_BATCH_MAX 100
+#define HWM 100000
+
+static QElapsedTimer g_clock;
+static QString g_dir;
+
+static qint64 nowUsecs()
+{
+	return g_clock.nsecsElapsed() / 1000;
+}
+
+class Options
+{
+public:
+	QString proxy;
+	int connections;
+	int rounds;
+	int interval;
+	int size;
+	int workers;
+	QStringList modes;
+
+	Options() :
+		proxy("pushpin-proxy"),
+		connections(10000),
+		rounds(10),
+		interval(100),
+		size(100),
+		workers(1)
+	{
+		modes << "passthrough" << "grip" << "over_http";
+	}
+};
+
+// fake m2adapter. opens sessions, a bounded number at a time, and records
+//   the latency of each message received
+class Client : public QObject
+{
+	Q_OBJECT
+
+public:
+	class Session
+	{
+	public:
+		QByteArray id;
+		QByteArray proxyAddress;
+		int outSeq;
+		int consumed;
+		bool connected;
+	};
+
+	int total;
+	int started;
+	int pending;
+	int connected;
+	int failed;
+	int closed;
+	qint64 settled;
+	qint64 delivered;
+	qint64 lastDelivery;
+	Histogram latency;
+	int nextId;
+
+	QZmq::Socket *outSock;
+	QZmq::Socket *outStreamSock;
+	QZmq::Socket *inSock;
+	QZmq::Valve *inValve;
+	QTimer *keepAliveTimer;
+	QHash<QByteArray, Session*> sessions;
+
+	Client(QObject *parent = 0) :
+		QObject(parent),
+		nextId(0)
+	{
+		outSock = new QZmq::Socket(QZmq::Socket::Push, this);
+		outSock->setHwm(HWM);
+
+		outStreamSock = new QZmq::Socket(QZmq::Socket::Router, this);
+		outStreamSock->setHwm(HWM);
+
+		inSock = new QZmq::Socket(QZmq::Socket::Sub, this);
+		inSock->setHwm(HWM);
+		inValve = new QZmq::Valve(inSock, this);
+		connect(inValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(in_readyRead(const QList<QByteArray> &)));
+
+		keepAliveTimer = new QTimer(this);
+		connect(keepAliveTimer, SIGNAL(timeout()), SLOT(keepAlive_timeout()));
+
+		reset();
+	}
+
+	~Client()
+	{
+		qDeleteAll(sessions);
+	}
+
+	void start()
+	{
+		outSock->bind(BenchUtil::makeSpec("m2a-in"));
+		outStreamSock->bind(BenchUtil::makeSpec("m2a-in-stream"));
+		inSock->bind(BenchUtil::makeSpec("m2a-out"));
+
+		inSock->subscribe(QByteArray(CLIENT_ID) + ' ');
+		inValve->open();
+
+		keepAliveTimer->start(KEEPALIVE_INTERVAL);
+	}
+
+	void reset()
+	{
+		qDeleteAll(sessions);
+		sessions.clear();
+
+		total = 0;
+		started = 0;
+		pending = 0;
+		connected = 0;
+		failed = 0;
+		closed = 0;
+		settled = 0;
+		resetStats();
+	}
+
+	void resetStats()
+	{
+		delivered = 0;
+		lastDelivery = 0;
+		latency.clear();
+	}
+
+	void connectAll(int count)
+	{
+		total = count;
+		startMore();
+	}
+
+private:
+	void startMore()
+	{
+		while(started < total && pending < MAX_PENDING_CONNECTS)
+		{
+			Session *s = new Session;
+			s->id = "c" + QByteArray::number(nextId++);
+			s->outSeq = 0;
+			s->consumed = 0;
+			s->connected = false;
+			sessions.insert(s->id, s);
+			++started;
+			++pending;
+
+			ZhttpRequestPacket zreq;
+			zreq.from = CLIENT_ID;
+			zreq.id = s->id;
+			zreq.seq = (s->outSeq)++;
+			zreq.type = ZhttpRequestPacket::Data;
+			zreq.uri = QUrl("ws://bench/path");
+			zreq.credits = CREDITS;
+			outSock->write(QList<QByteArray>() << ('T' + TnetString::fromVariant(zreq.toVariant())));
+		}
+	}
+
+	void writeStream(Session *s, const QByteArray &buf)
+	{
+		QList<QByteArray> msg;
+		msg += s->proxyAddress;
+		msg += QByteArray();
+		msg += 'T' + buf;
+		outStreamSock->write(msg);
+	}
+
+	void sendCredits(Session *s)
+	{
+		ZhttpRequestPacket zreq;
+		zreq.from = CLIENT_ID;
+		zreq.id = s->id;
+		zreq.seq = (s->outSeq)++;
+		zreq.type = ZhttpRequestPacket::Credit;
+		zreq.credits = s->consumed;
+		writeStream(s, TnetString::fromVariant(zreq.toVariant()));
+
+		s->consumed = 0;
+	}
+
+	void removeSession(Session *s)
+	{
+		sessions.remove(s->id);
+		delete s;
+	}
+
+private slots:
+	void in_readyRead(const QList<QByteArray> &message)
+	{
+		int at = message[0].indexOf(' ');
+		if(at == -1)
+			return;
+
+		ZhttpResponsePacket zresp;
+		ZhttpPacketReader::Extensions ext;
+		if(!ZhttpPacketReader::readResponse(message[0], at + 2, &zresp, &ext) || ext.batch)
+			return;
+
+		Session *s = sessions.value(zresp.id);
+		if(!s)
+			return;
+
+		if(!s->connected)
+		{
+			--pending;
+			++settled;
+
+			if(zresp.type == ZhttpResponsePacket::Data && zresp.code == 101 && !zresp.from.isEmpty())
+			{
+				s->connected = true;
+				s->proxyAddress = zresp.from;
+				++connected;
+			}
+			else
+			{
+				++failed;
+				removeSession(s);
+			}
+
+			startMore();
+			return;
+		}
+
+		if(zresp.type == ZhttpResponsePacket::Data)
+		{
+			qint64 now = nowUsecs();
+			int end = zresp.body.indexOf(' ');
+			if(end != -1)
+				latency.record(now - zresp.body.left(end).toLongLong());
+
+			++delivered;
+			lastDelivery = now;
+
+			s->consumed += zresp.body.size();
+			if(s->consumed >= CREDITS / 2)
+				sendCredits(s);
+		}
+		else if(zresp.type == ZhttpResponsePacket::Close || zresp.type == ZhttpResponsePacket::Error || zresp.type == ZhttpResponsePacket::Cancel)
+		{
+			++closed;
+			removeSession(s);
+		}
+	}
+
+	void keepAlive_timeout()
+	{
+		QHash<QByteArray, QVariantList> batches;
+		foreach(Session *s, sessions)
+		{
+			if(s->connected)
+				BenchUtil::addKeepAliveId(&batches, s->proxyAddress, s->id, (s->outSeq)++);
+		}
+
+		QHashIterator<QByteArray, QVariantList> it(batches);
+		while(it.hasNext())
+		{
+			it.next();
+			foreach(const QByteArray &buf, BenchUtil::makeKeepAlives(CLIENT_ID, it.value()))
+			{
+				QList<QByteArray> msg;
+				msg += it.key();
+				msg += QByteArray();
+				msg += 'T' + buf;
+				outStreamSock->write(msg);
+			}
+		}
+	}
+};
+
+// fake zurl and origin. accepts websockets directly, or answers the
+//   OPEN event of websocket-over-http requests
+class Origin : public BenchOrigin
+{
+	Q_OBJECT
+
+public:
+	bool grip;
+	int blocked;
+
+	Origin(QObject *parent = 0) :
+		BenchOrigin(ORIGIN_ID, parent),
+		grip(false),
+		blocked(0)
+	{
+	}
+
+	void reset()
+	{
+		BenchOrigin::reset();
+		blocked = 0;
+	}
+
+	// sends to every websocket that has the credits for it
+	int send(const QByteArray &message)
+	{
+		int count = 0;
+		foreach(Session *s, sessions)
+		{
+			if(s->credits < message.size())
+			{
+				++blocked;
+				continue;
+			}
+
+			ZhttpResponsePacket zresp;
+			zresp.contentType = "text";
+			zresp.body = message;
+			write(s, zresp);
+
+			s->credits -= message.size();
+			++count;
+		}
+
+		return count;
+	}
+
+protected:
+	virtual void requestReady(const ZhttpRequestPacket &zreq)
+	{
+		QString scheme = zreq.uri.scheme();
+		if(scheme == "ws" || scheme == "wss")
+			acceptWebSocket(zreq);
+		else
+			respondEvents(zreq);
+	}
+
+private:
+	void acceptWebSocket(const ZhttpRequestPacket &zreq)
+	{
+		Session *s = new Session;
+		s->id = zreq.id;
+		s->proxyAddress = zreq.from;
+		s->credits = qMax(zreq.credits, 0);
+		addSession(s);
+
+		ZhttpResponsePacket zresp;
+		zresp.code = 101;
+		zresp.reason = "Switching Protocols";
+		if(grip)
+			zresp.headers += HttpHeader("Sec-WebSocket-Extensions", "grip");
+		zresp.credits = CREDITS;
+		write(s, zresp);
+	}
+
+	void respondEvents(const ZhttpRequestPacket &zreq)
+	{
+		// only the opening request is expected during a run
+		QByteArray body;
+		if(zreq.body.startsWith("OPEN\r\n"))
+			body = "OPEN\r\n";
+
+		ZhttpResponsePacket zresp;
+		zresp.from = ORIGIN_ID;
+		zresp.id = zreq.id;
+		zresp.seq = 0;
+		zresp.code = 200;
+		zresp.reason = "OK";
+		zresp.headers += HttpHeader("Content-Type", "application/websocket-events");
+		if(grip)
+			zresp.headers += HttpHeader("Sec-WebSocket-Extensions", "grip");
+		zresp.headers += HttpHeader("Content-Length", QByteArray::number(body.size()));
+		zresp.body = body;
+		write(zreq.from, zresp);
+	}
+};
+
+// fake handler. tracks connection ids from "here" items and fans out
+//   "send" items to all of them
+class Handler : public QObject
+{
+	Q_OBJECT
+
+public:
+	QSet<QByteArray> cids;
+	qint64 count;
+
+	QZmq::Socket *controlOutSock;
+	QZmq::Socket *controlInSock;
+	QZmq::Valve *controlInValve;
+
+	Handler(QObject *parent = 0) :
+		QObject(parent),
+		count(0)
+	{
+		controlOutSock = new QZmq::Socket(QZmq::Socket::Push, this);
+		controlOutSock->setHwm(HWM);
+
+		controlInSock = new QZmq::Socket(QZmq::Socket::Pull, this);
+		controlInSock->setHwm(HWM);
+		controlInValve = new QZmq::Valve(controlInSock, this);
+		connect(controlInValve, SIGNAL(readyRead(const QList<QByteArray> &)), SLOT(controlIn_readyRead(const QList<QByteArray> &)));
+	}
+
+	void start()
+	{
+		controlOutSock->connectToAddress(BenchUtil::makeSpec("ws-control-in"));
+		controlInSock->connectToAddress(BenchUtil::makeSpec("ws-control-out"));
+		controlInValve->open();
+	}
+
+	void reset()
+	{
+		cids.clear();
+		count = 0;
+	}
+
+	int send(const QByteArray &message)
+	{
+		WsControlPacket p;
+		foreach(const QByteArray &cid, cids)
+		{
+			WsControlPacket::Item i;
+			i.cid = cid;
+			i.type = WsControlPacket::Item::Send;
+			i.contentType = "text";
+			i.message = message;
+			p.items += i;
+
+			if(p.items.count() >= SEND_BATCH_MAX)
+			{
+				controlOutSock->write(QList<QByteArray>() << TnetString::fromVariant(p.toVariant()));
+				p.items.clear();
+			}
+		}
+
+		if(!p.items.isEmpty())
+			controlOutSock->write(QList<QByteArray>() << TnetString::fromVariant(p.toVariant()));
+
+		return cids.count();
+	}
+
+private slots:
+	void controlIn_readyRead(const QList<QByteArray> &message)
+	{
+		WsControlPacket p;
+		if(message.count() != 1 || !p.fromVariant(TnetString::toVariant(message[0])))
+			return;
+
+		foreach(const WsControlPacket::Item &i, p.items)
+		{
+			if(i.type == WsControlPacket::Item::Here)
+				cids += i.cid;
+			else if(i.type == WsControlPacket::Item::Gone || i.type == WsControlPacket::Item::Cancel)
+				cids.remove(i.cid);
+		}
+
+		count = cids.count();
+	}
+};
+
+static bool startProxy(QProcess *proc, const QString &mode, const Options &opts)
+{
+	QByteArray routes = "* origin:80";
+	if(mode == "over_http")
+		routes += ",over_http";
+	routes += '\n';
+
+	QByteArray config;
+	config += "[proxy]\n";
+	config += "m2a_in_specs=" + BenchUtil::makeSpec("m2a-in").toUtf8() + '\n';
+	config += "m2a_in_stream_specs=" + BenchUtil::makeSpec("m2a-in-stream").toUtf8() + '\n';
+	config += "m2a_out_specs=" + BenchUtil::makeSpec("m2a-out").toUtf8() + '\n';
+	config += "zurl_out_specs=" + BenchUtil::makeSpec("zurl-out").toUtf8() + '\n';
+	config += "zurl_out_stream_specs=" + BenchUtil::makeSpec("zurl-out-stream").toUtf8() + '\n';
+	config += "zurl_in_specs=" + BenchUtil::makeSpec("zurl-in").toUtf8() + '\n';
+	config += "handler_ws_control_in_spec=" + BenchUtil::makeSpec("ws-control-in").toUtf8() + '\n';
+	config += "handler_ws_control_out_spec=" + BenchUtil::makeSpec("ws-control-out").toUtf8() + '\n';
+	config += "routesfile=routes\n";
+	config += "sig_key=changeme\n";
+	config += "workers=" + QByteArray::number(opts.workers) + '\n';
+
+	if(!BenchUtil::writeFile(g_dir + "/routes", routes) || !BenchUtil::writeFile(g_dir + "/pushpin.conf", config))
+	{
+		fprintf(stderr, "unable to write config in %s\n", qPrintable(g_dir));
+		return false;
+	}
+
+	if(!BenchUtil::startProcess(proc, opts.proxy, QStringList() << ("--config=" + g_dir + "/pushpin.conf"), g_dir + "/proxy-" + mode + ".log"))
+		return false;
+
+	// give it time to bind and for the sockets to connect
+	QEventLoop loop;
+	BenchUtil::runLoop(&loop, 1000);
+
+	if(proc->state() != QProcess::Running)
+	{
+		fprintf(stderr, "%s exited, see %s/proxy-%s.log\n", qPrintable(opts.proxy), qPrintable(g_dir), qPrintable(mode));
+		return false;
+	}
+
+	return true;
+}
+
+static bool runMode(const QString &mode, const Options &opts, Client *client, Origin *origin, Handler *handler)
+{
+	bool viaHandler = (mode != "passthrough");
+
+	client->reset();
+	origin->reset();
+	handler->reset();
+	origin->grip = viaHandler;
+
+	QProcess proc;
+	if(!startProxy(&proc, mode, opts))
+		return false;
+
+	qint64 pid = proc.pid();
+	qint64 rssBase = BenchUtil::processRss(pid);
+
+	QEventLoop loop;
+
+	// connect
+	QElapsedTimer t;
+	t.start();
+	client->connectAll(opts.connections);
+	BenchUtil::waitFor(&loop, &client->settled, opts.connections, 5000);
+	double connectTime = (double)t.elapsed() / 1000;
+
+	// wait for the control sessions to check in
+	if(viaHandler)
+		BenchUtil::waitFor(&loop, &handler->count, client->connected, 5000);
+
+	qint64 rssConnected = BenchUtil::processRss(pid);
+
+	// send the rounds, each one after the previous has been delivered
+	client->resetStats();
+	qint64 expected = 0;
+	qint64 busyTime = 0;
+	for(int n = 0; n < opts.rounds; ++n)
+	{
+		QByteArray message = QByteArray::number(nowUsecs()) + ' ';
+		if(message.size() < opts.size)
+			message += QByteArray(opts.size - message.size(), 'a');
+
+		qint64 roundStart = nowUsecs();
+		expected += (viaHandler ? handler->send(message) : origin->send(message));
+
+		BenchUtil::waitFor(&loop, &client->delivered, expected, 1000);
+
+		if(client->lastDelivery > roundStart)
+			busyTime += client->lastDelivery - roundStart;
+
+		BenchUtil::runLoop(&loop, opts.interval);
+	}
+
+	const Histogram &h = client->latency;
+	double rssPerConn = 0;
+	if(rssBase >= 0 && rssConnected >= 0 && client->connected > 0)
+		rssPerConn = (double)(rssConnected - rssBase) * 1024 / client->connected;
+
+	printf("%-12s %7d/%-7d %8.1f %10lld %8lld %10.0f %8lld %8lld %8lld %8lld %8lld %9.0f\n",
+		qPrintable(mode),
+		client->connected,
+		opts.connections,
+		connectTime,
+		client->delivered,
+		expected - client->delivered,
+		(double)client->delivered * 1000000 / qMax(busyTime, (qint64)1),
+		h.percentile(50),
+		h.percentile(90),
+		h.percentile(99),
+		h.percentile(99.9),
+		h.max(),
+		rssPerConn);
+	fflush(stdout);
+
+	BenchUtil::stopProcess(&proc);
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	QStringList args = app.arguments();
+	args.removeFirst();
+
+	Options opts;
+	foreach(const QString &arg, args)
+	{
+		int at = arg.indexOf('=');
+		if(!arg.startsWith("--") || at == -1)
+		{
+			fprintf(stderr, "bad argument: %s\n", qPrintable(arg));
+			return 1;
+		}
+
+		QString name = arg.mid(2, at - 2);
+		QString value = arg.mid(at + 1);
+
+		if(name == "proxy")
+		{
+			opts.proxy = value;
+			continue;
+		}
+		else if(name == "modes")
+		{
+			opts.modes = value.split(',', QString::SkipEmptyParts);
+			continue;
+		}
+
+		bool ok;
+		int x = value.toInt(&ok);
+		if(!ok || x < 0)
+		{
+			fprintf(stderr, "bad value for %s: %s\n", qPrintable(name), qPrintable(value));
+			return 1;
+		}
+
+		if(name == "connections")
+			opts.connections = qMax(x, 1);
+		else if(name == "rounds")
+			opts.rounds = qMax(x, 1);
+		else if(name == "interval")
+			opts.interval = x;
+		else if(name == "size")
+			opts.size = x;
+		else if(name == "workers")
+			opts.workers = qMax(x, 1);
+		else
+		{
+			fprintf(stderr, "unknown option: %s\n", qPrintable(name));
+			return 1;
+		}
+	}
+
+	foreach(const QString &mode, opts.modes)
+	{
+		if(mode != "passthrough" && mode != "grip" && mode != "over_http")
+		{
+			fprintf(stderr, "unknown mode: %s\n", qPrintable(mode));
+			return 1;
+		}
+	}
+
+	g_clock.start();
+
+	g_dir = QDir::tempPath() + "/pushpin-wsbench-" + QString::number(QCoreApplication::applicationPid());
+	QDir().mkpath(g_dir);
+	BenchUtil::setSpecPrefix(g_dir + '/');
+
+	Client client;
+	client.start();
+	Origin origin;
+	origin.start();
+	Handler handler;
+	handler.start();
+
+	printf("connections=%d rounds=%d size=%d workers=%d\n", opts.connections, opts.rounds, opts.size, opts.workers);
+	printf("latency in usecs from send to receipt, rss is proxy growth per connection in bytes\n\n");
+	printf("%-12s %15s %8s %10s %8s %10s %8s %8s %8s %8s %8s %9s\n", "mode", "connected", "conn-s", "delivered", "lost", "msg/s", "p50", "p90", "p99", "p99.9", "max", "rss/conn");
+
+	int ret = 0;
+	foreach(const QString &mode, opts.modes)
+	{
+		if(!runMode(mode, opts, &client, &origin, &handler))
+		{
+			ret = 1;
+			break;
+		}
+	}
+
+	printf("\nproxy logs are in %s\n", qPrintable(g_dir));
+
+	return ret;
+}
+
+#include "wsbench.moc"